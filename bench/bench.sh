@@ -0,0 +1,297 @@
+#!/bin/sh
+
+# bench.sh
+# Usage:
+#   bench/bench.sh bench     # cold start, failure detection, teardown, CPU/RSS for 1..256 instances
+#   bench/bench.sh soak      # long run with crashing children; checks RSS/fd growth and recovery
+# Normally run through `make bench` / `make soak`. Needs no Wi-Fi hardware: every instance is a
+# bench/bin/wfb_{rx,tx,tun} stand-in (see fake_wfb.c) that stamps its start/ready/crash/term
+# events into a shared log, so latencies are measured from the children's side.
+# Results are written as JSON to $BENCH_OUT (default bench-results.json / soak-results.json);
+# the exit status is non-zero when an assertion fails.
+
+set -u
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+MODE=${1:-bench}
+SUP=${SUPERVISOR:-$HERE/../wfb_supervisor}
+BIN=${BENCH_BIN:-$HERE/bin}
+FAKE=$BIN/fake_wfb
+
+SIZES=${BENCH_SIZES:-"1 16 64 256"}
+STATS_MS=${BENCH_STATS_MS:-100}
+DELAY_MS=${BENCH_DELAY_MS:-0}
+STEADY_S=${BENCH_STEADY:-3}
+STOP_TIMEOUT_MS=${BENCH_STOP_TIMEOUT_MS:-300}
+TIMEOUT_S=${BENCH_TIMEOUT:-30}
+CGROUP=${BENCH_CGROUP:-auto}
+MAX_COLD_MS=${BENCH_MAX_COLD_MS:-2000}
+MAX_DETECT_MS=${BENCH_MAX_DETECT_MS:-50}
+MAX_TEARDOWN_MS=${BENCH_MAX_TEARDOWN_MS:-1000}
+
+SOAK_SECONDS=${SOAK_SECONDS:-600}
+SOAK_INSTANCES=${SOAK_INSTANCES:-16}
+SOAK_SAMPLE=${SOAK_SAMPLE:-10}
+SOAK_STATS_MS=${SOAK_STATS_MS:-50}
+SOAK_MAX_RSS_GROWTH_KB=${SOAK_MAX_RSS_GROWTH_KB:-256}
+SOAK_MAX_FD_GROWTH=${SOAK_MAX_FD_GROWTH:-0}
+
+case $MODE in
+    bench) OUT=${BENCH_OUT:-bench-results.json} ;;
+    soak)  OUT=${BENCH_OUT:-soak-results.json} ;;
+    *) echo "usage: $0 bench|soak" >&2; exit 2 ;;
+esac
+
+[ -x "$SUP" ] || { echo "bench: supervisor binary '$SUP' not found (run make)" >&2; exit 2; }
+[ -x "$FAKE" ] || { echo "bench: '$FAKE' not found (run make bench-bin)" >&2; exit 2; }
+
+if [ "$CGROUP" = auto ]; then
+    CGROUP=no
+    [ "$(id -u)" = 0 ] && [ -f /sys/fs/cgroup/cgroup.controllers ] && CGROUP=yes
+fi
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/wfb_bench.XXXXXX")
+EV=$WORK/events
+SPID=
+CLK_TCK=$(getconf CLK_TCK)
+FAILURES=
+
+cleanup() {
+    [ -n "$SPID" ] && kill -KILL "$SPID" 2>/dev/null
+    pkill -KILL -f "^$BIN/wfb_" 2>/dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+trap 'exit 130' INT TERM
+
+now_us() { "$FAKE" --now; }
+ms() { awk -v a="$1" -v b="$2" 'BEGIN { printf "%.3f", (b - a) / 1000 }'; }
+fail() {
+    echo "bench: FAIL: $*" >&2
+    FAILURES="$FAILURES${FAILURES:+,}\"$*\""
+}
+# assert_le <name> <value> <limit>; null values (not measurable here) pass
+assert_le() {
+    [ "$2" = null ] && return 0
+    awk -v v="$2" -v l="$3" 'BEGIN { exit !(v <= l) }' || fail "$1 $2 > $3"
+}
+
+cpu_ticks() { sed 's/.*) //' "/proc/$1/stat" | awk '{ print $12 + $13 }'; }
+status_kb() { awk -v k="$2:" '$1 == k { print $2 }' "/proc/$1/status"; }
+fd_count() { ls "/proc/$1/fd" | wc -l; }
+count_events() { grep -c " $1 " "$EV"; }
+event_pid() { awk -v e="$1" -v t="$2" '$2 == e && $3 == t { p = $4 } END { print p }' "$EV"; }
+leaked() { pgrep -c -f "^$BIN/wfb_" 2>/dev/null || true; }
+
+# Mean of a Prometheus histogram from the final metrics file, in microseconds.
+histo_mean_us() {
+    awk -v n="wfb_supervisor_$1_seconds" '
+        $1 == n "_sum" { s = $2 } $1 == n "_count" { c = $2 }
+        END { if (c > 0) printf "%.1f", s / c * 1e6; else printf "null" }' "$WORK/metrics.prom" 2>/dev/null || printf null
+}
+
+# write_config <instances> <scenario> <extra fake args> <extra instance lines>
+write_config() {
+    CFG=$WORK/$2-$1.conf
+    {
+        echo "[general]"
+        echo "control_socket=no"
+        echo "flight_recorder=$WORK/flight"
+        echo "metrics_file=$WORK/metrics.prom"
+        echo "metrics_interval=1s"
+        echo "[parameters]"
+        echo "cgroup=$CGROUP"
+        i=0
+        while [ "$i" -lt "$1" ]; do
+            case $((i % 3)) in
+                0) role=wfb_rx ;;
+                1) role=wfb_tx ;;
+                *) role=wfb_tun ;;
+            esac
+            echo "[instance $role$i]"
+            echo "cmd=$BIN/$role --tag=$role$i --events=$EV --delay=$DELAY_MS $3"
+            [ "$role" != wfb_tun ] && echo "stats=wfb"
+            [ -n "$4" ] && printf '%b\n' "$4"
+            i=$((i + 1))
+        done
+    } > "$CFG"
+}
+
+start_supervisor() {
+    : > "$EV"
+    rm -f "$WORK/metrics.prom"
+    T0=$(now_us)
+    "$SUP" "$CFG" > "$WORK/supervisor.log" 2>&1 &
+    SPID=$!
+}
+
+# wait_events <event> <count>; fails if the supervisor dies or TIMEOUT_S passes
+wait_events() {
+    deadline=$(( $(date +%s) + TIMEOUT_S ))
+    while [ "$(count_events "$1")" -lt "$2" ]; do
+        kill -0 "$SPID" 2>/dev/null || return 1
+        [ "$(date +%s)" -ge "$deadline" ] && return 1
+        sleep 0.01
+    done
+}
+
+stop_supervisor() {
+    T_STOP=$(now_us)
+    kill -TERM "$SPID" 2>/dev/null
+    wait "$SPID"
+    T_END=$(now_us)
+    SPID=
+}
+
+startup_error() {
+    kill -KILL "$SPID" 2>/dev/null
+    wait "$SPID" 2>/dev/null
+    SPID=
+    ERR=$(grep -m1 -e 'config' -e 'error' -e 'failed' "$WORK/supervisor.log" | sed 's/"/'"'"'/g')
+    [ -n "$ERR" ] || ERR="instances not ready within ${TIMEOUT_S}s"
+}
+
+# One size: three supervisor runs (clean, one child crashing, children ignoring SIGTERM).
+bench_size() {
+    n=$1
+    write_config "$n" clean "--stats=$STATS_MS" ""
+    start_supervisor
+    if ! wait_events ready "$n"; then
+        startup_error
+        fail "$n instances: $ERR"
+        RESULT="{\"instances\":$n,\"error\":\"$ERR\"}"
+        return
+    fi
+    cold=$(awk -v t0="$T0" '$2 == "ready" && $1 > m { m = $1 } END { printf "%.3f", (m - t0) / 1000 }' "$EV")
+
+    c0=$(cpu_ticks "$SPID"); t0=$(now_us)
+    sleep "$STEADY_S"
+    c1=$(cpu_ticks "$SPID"); t1=$(now_us)
+    cpu=$(awk -v c="$((c1 - c0))" -v hz="$CLK_TCK" -v us="$((t1 - t0))" 'BEGIN { printf "%.2f", c / hz / (us / 1e6) * 100 }')
+    rss=$(status_kb "$SPID" VmRSS); hwm=$(status_kb "$SPID" VmHWM); fds=$(fd_count "$SPID")
+    stop_supervisor
+    teardown=$(ms "$T_STOP" "$T_END")
+    spawn=$(histo_mean_us spawn)
+    detect_mean=$(histo_mean_us exit_detect)
+
+    # failure: wfb_rx0 crashes; detection is the crash-to-first-SIGTERM of its peers
+    write_config "$n" failure "--stats=$STATS_MS" ""
+    start_supervisor
+    detect=null; fail_teardown=null
+    if wait_events ready "$n"; then
+        sleep 0.2
+        kill -USR1 "$(event_pid ready wfb_rx0)"
+        wait "$SPID"
+        T_END=$(now_us); SPID=
+        crash=$(awk '$2 == "crash" { print $1; exit }' "$EV")
+        fail_teardown=$(ms "$crash" "$T_END")
+        [ "$n" -gt 1 ] && detect=$(awk -v c="$crash" '$2 == "term" && (m == "" || $1 < m) { m = $1 } END { if (m == "") print "null"; else printf "%.3f", (m - c) / 1000 }' "$EV")
+    else
+        startup_error; fail "$n instances (failure run): $ERR"
+    fi
+
+    # stubborn: children ignore SIGTERM and fork; teardown must escalate and leave nothing behind
+    write_config "$n" stubborn "--stats=0 --ignore-term --fork=2" "stop_timeout=${STOP_TIMEOUT_MS}ms"
+    start_supervisor
+    kill_teardown=null; left=null
+    if wait_events ready "$n"; then
+        stop_supervisor
+        kill_teardown=$(ms "$T_STOP" "$T_END")
+        sleep 0.1
+        left=$(leaked)
+        pkill -KILL -f "^$BIN/wfb_" 2>/dev/null
+    else
+        startup_error; fail "$n instances (stubborn run): $ERR"
+    fi
+
+    assert_le "$n instances: cold_start_ms" "$cold" "$MAX_COLD_MS"
+    assert_le "$n instances: teardown_ms" "$teardown" "$MAX_TEARDOWN_MS"
+    assert_le "$n instances: failure_detect_ms" "$detect" "$MAX_DETECT_MS"
+    assert_le "$n instances: failure_teardown_ms" "$fail_teardown" "$MAX_TEARDOWN_MS"
+    assert_le "$n instances: kill_teardown_ms" "$kill_teardown" "$((STOP_TIMEOUT_MS + MAX_TEARDOWN_MS))"
+    # without cgroups the grandchildren of a SIGKILLed child are expected to survive
+    [ "$CGROUP" = yes ] && assert_le "$n instances: leaked processes" "$left" 0
+
+    RESULT="{\"instances\":$n,\"cold_start_ms\":$cold,\"spawn_mean_us\":$spawn,\"exit_detect_mean_us\":$detect_mean"
+    RESULT="$RESULT,\"cpu_pct\":$cpu,\"rss_kb\":$rss,\"rss_hwm_kb\":$hwm,\"fds\":$fds,\"teardown_ms\":$teardown"
+    RESULT="$RESULT,\"failure_detect_ms\":$detect,\"failure_teardown_ms\":$fail_teardown"
+    RESULT="$RESULT,\"kill_teardown_ms\":$kill_teardown,\"leaked_processes\":$left}"
+    echo "bench: $n instances: cold ${cold}ms, teardown ${teardown}ms, detect ${detect}ms, cpu ${cpu}%, rss ${rss}kB" >&2
+}
+
+run_bench() {
+    results=
+    for n in $SIZES; do
+        bench_size "$n"
+        results="$results${results:+,}$RESULT"
+    done
+    printf '{"mode":"bench","supervisor":"%s","kernel":"%s","cpus":%s,"cgroup":"%s","stats_ms":%s,"results":[%s],"failures":[%s],"pass":%s}\n' \
+        "$SUP" "$(uname -r)" "$(nproc)" "$CGROUP" "$STATS_MS" "$results" "$FAILURES" \
+        "$([ -z "$FAILURES" ] && echo true || echo false)" > "$OUT"
+}
+
+# Every fourth instance crash-loops; all restart in place with a short backoff.
+run_soak() {
+    n=$SOAK_INSTANCES
+    write_config "$n" soak "--stats=$SOAK_STATS_MS" "restart=always\nrestart_backoff=100ms\nrestart_burst=0"
+    i=0
+    while [ "$i" -lt "$n" ]; do
+        sed -i "s|--tag=\([a-z_]*\)$i --|--tag=\1$i --crash-after=$((2000 + i * 537 % 6000)) --|" "$CFG"
+        i=$((i + 4))
+    done
+    start_supervisor
+    wait_events ready "$n" || { startup_error; fail "soak: $ERR"; run_soak_report; return; }
+
+    samples=
+    : > "$WORK/samples"
+    elapsed=0
+    c0=$(cpu_ticks "$SPID"); t0=$(now_us)
+    while [ "$elapsed" -lt "$SOAK_SECONDS" ]; do
+        sleep "$SOAK_SAMPLE"
+        elapsed=$((elapsed + SOAK_SAMPLE))
+        if ! kill -0 "$SPID" 2>/dev/null; then
+            fail "soak: supervisor exited after ${elapsed}s"
+            SPID=
+            break
+        fi
+        c1=$(cpu_ticks "$SPID"); t1=$(now_us)
+        cpu=$(awk -v c="$((c1 - c0))" -v hz="$CLK_TCK" -v us="$((t1 - t0))" 'BEGIN { printf "%.2f", c / hz / (us / 1e6) * 100 }')
+        c0=$c1; t0=$t1
+        rss=$(status_kb "$SPID" VmRSS); fds=$(fd_count "$SPID")
+        echo "$elapsed $rss $fds $cpu" >> "$WORK/samples"
+        samples="$samples${samples:+,}{\"t\":$elapsed,\"rss_kb\":$rss,\"fds\":$fds,\"cpu_pct\":$cpu}"
+    done
+
+    teardown=null
+    if [ -n "$SPID" ]; then
+        stop_supervisor
+        teardown=$(ms "$T_STOP" "$T_END")
+    fi
+    # leaks show up as growth from the first half of the run to the second
+    set -- $(awk '{ s[NR] = $0 } END {
+        h = int(NR / 2); r1 = f1 = r2 = f2 = 0
+        for (i = 1; i <= NR; i++) { split(s[i], v, " ")
+            if (i <= h) { if (v[2] > r1) r1 = v[2]; if (v[3] > f1) f1 = v[3] }
+            else { if (v[2] > r2) r2 = v[2]; if (v[3] > f2) f2 = v[3] } }
+        if (h == 0) print "null null"; else print r2 - r1, f2 - f1 }' "$WORK/samples")
+    rss_growth=$1; fd_growth=$2
+    crashes=$(count_events crash); starts=$(count_events start)
+    assert_le "soak: rss_growth_kb" "$rss_growth" "$SOAK_MAX_RSS_GROWTH_KB"
+    assert_le "soak: fd_growth" "$fd_growth" "$SOAK_MAX_FD_GROWTH"
+    assert_le "soak: teardown_ms" "$teardown" "$MAX_TEARDOWN_MS"
+    # each crash is followed by a start, except possibly one backoff still pending per crasher
+    [ "$((starts - n))" -ge "$((crashes - (n + 3) / 4))" ] || fail "soak: $crashes crashes but only $((starts - n)) restarts"
+    echo "bench: soak: ${SOAK_SECONDS}s, $crashes crashes, $((starts - n)) restarts, rss growth ${rss_growth}kB, fd growth $fd_growth" >&2
+    printf '{"mode":"soak","supervisor":"%s","kernel":"%s","cpus":%s,"instances":%s,"duration_s":%s,"crashes":%s,"restarts":%s,"rss_growth_kb":%s,"fd_growth":%s,"teardown_ms":%s,"samples":[%s],"failures":[%s],"pass":%s}\n' \
+        "$SUP" "$(uname -r)" "$(nproc)" "$n" "$SOAK_SECONDS" "$crashes" "$((starts - n))" "$rss_growth" "$fd_growth" \
+        "$teardown" "$samples" "$FAILURES" "$([ -z "$FAILURES" ] && echo true || echo false)" > "$OUT"
+}
+
+run_soak_report() {
+    printf '{"mode":"soak","supervisor":"%s","instances":%s,"failures":[%s],"pass":false}\n' \
+        "$SUP" "$SOAK_INSTANCES" "$FAILURES" > "$OUT"
+}
+
+if [ "$MODE" = bench ]; then run_bench; else run_soak; fi
+echo "bench: results in $OUT" >&2
+[ -z "$FAILURES" ]
@@ -0,0 +1,173 @@
+// autod – Autod Personal Use License
+// Copyright (c) 2025 Joakim Snökvist
+// Licensed for personal, non-commercial use only.
+// Redistribution or commercial use requires prior written approval from Joakim Snökvist.
+// See LICENSE.md for full terms.
+
+// Stand-in for wfb_rx/wfb_tx/wfb_tun used by the bench and soak harness.
+// The role comes from the name it is invoked as; unknown arguments are ignored so
+// real wfb command lines can be reused. Behaviour knobs:
+//   --tag=NAME          identity written to the event log (default: role)
+//   --events=PATH       append "<realtime_us> <event> <tag> <pid>" lines (start, ready, crash, term)
+//   --delay=MS          startup delay before "ready"
+//   --stats=MS          wfb log_interval; rx/tx print PKT/RX_ANT/TX_ANT reports (0 = quiet)
+//   --crash-after=MS    exit(1) that long after start; SIGUSR1 crashes immediately
+//   --ignore-term       ignore SIGTERM (only SIGKILL or cgroup.kill stops it)
+//   --fork=N            leave N grandchildren behind that sleep (and ignore SIGTERM with --ignore-term)
+// "fake_wfb --now" prints the realtime clock in microseconds, for the harness scripts.
+
+//gcc -O2 -std=c11 -Wall -Wextra -o fake_wfb fake_wfb.c
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdint.h>
+
+enum { ROLE_RX, ROLE_TX, ROLE_TUN };
+
+static const char *g_tag;
+static const char *g_events;
+
+static uint64_t now_us(int clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ull + (uint64_t)ts.tv_nsec / 1000ull;
+}
+
+/* One write() per line so concurrent instances can share the file (O_APPEND). */
+static void event(const char *what) {
+    if (!g_events) return;
+    char line[256];
+    int n = snprintf(line, sizeof(line), "%llu %s %s %d\n",
+                     (unsigned long long)now_us(CLOCK_REALTIME), what, g_tag, (int)getpid());
+    int fd = open(g_events, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+    if (write(fd, line, (size_t)n) < 0) { /* best effort */ }
+    close(fd);
+}
+
+static long opt_long(const char *arg, const char *name, long *out) {
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) != 0 || arg[len] != '=') return 0;
+    char *end;
+    *out = strtol(arg + len + 1, &end, 10);
+    if (*end || *out < 0) {
+        fprintf(stderr, "fake_wfb: invalid %s\n", arg);
+        exit(2);
+    }
+    return 1;
+}
+
+/* Sleeps up to ms; returns the blocked signal that cut it short, or 0. */
+static int wait_signal(const sigset_t *set, long ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    int sig = sigtimedwait(set, NULL, &ts);
+    return sig > 0 ? sig : 0;
+}
+
+static void print_stats(int role, unsigned seq) {
+    unsigned long long ts = (unsigned long long)(now_us(CLOCK_REALTIME) / 1000);
+    if (role == ROLE_RX) {
+        unsigned lost = seq % 7 == 0 ? 3 : 0;
+        printf("%llu\tSESSION\t%u:1:8:12\n", ts, 1700000000u);
+        printf("%llu\tRX_ANT\t5825:1:20\t0\t100:-70:-55:-40\n", ts);
+        printf("%llu\tRX_ANT\t5825:1:20\t1\t100:-71:-58:-42\n", ts);
+        printf("%llu\tPKT\t1000:1200000:0:0:1000:990:%u:%u:0:980:1100000\n", ts, seq % 13, lost);
+    } else if (role == ROLE_TX) {
+        printf("%llu\tTX_ANT\t0\t1000:800:1200:3000\n", ts);
+        printf("%llu\tPKT\t0:1000:1200000:1000:1200000:%u:0\n", ts, seq % 11 == 0 ? 2u : 0u);
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    const char *base = strrchr(argv[0], '/');
+    base = base ? base + 1 : argv[0];
+    int role = strstr(base, "tx") ? ROLE_TX : strstr(base, "tun") ? ROLE_TUN : ROLE_RX;
+    g_tag = role == ROLE_TX ? "wfb_tx" : role == ROLE_TUN ? "wfb_tun" : "wfb_rx";
+
+    long delay = 0, stats = 1000, crash_after = -1, forks = 0, v;
+    int ignore_term = 0;
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        if (strcmp(a, "--now") == 0) {
+            printf("%llu\n", (unsigned long long)now_us(CLOCK_REALTIME));
+            return 0;
+        } else if (strncmp(a, "--tag=", 6) == 0) {
+            g_tag = a + 6;
+        } else if (strncmp(a, "--events=", 9) == 0) {
+            g_events = a + 9;
+        } else if (strcmp(a, "--ignore-term") == 0) {
+            ignore_term = 1;
+        } else if (opt_long(a, "--delay", &v)) {
+            delay = v;
+        } else if (opt_long(a, "--stats", &v)) {
+            stats = v;
+        } else if (opt_long(a, "--crash-after", &v)) {
+            crash_after = v;
+        } else if (opt_long(a, "--fork", &v)) {
+            forks = v;
+        }
+    }
+
+    // signals are taken synchronously so "term"/"crash" are stamped the moment they arrive
+    sigset_t set, old;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGUSR1);
+    if (ignore_term) signal(SIGTERM, SIG_IGN);
+    else sigaddset(&set, SIGTERM);
+    sigprocmask(SIG_BLOCK, &set, &old);
+
+    uint64_t start = now_us(CLOCK_MONOTONIC);
+    event("start");
+
+    for (long i = 0; i < forks; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            // grandchildren keep SIGTERM ignored with --ignore-term, otherwise die on it
+            sigprocmask(SIG_SETMASK, &old, NULL);
+            for (;;) pause();
+        }
+        if (pid < 0) fprintf(stderr, "fake_wfb: fork failed: %s\n", strerror(errno));
+    }
+
+    int sig = delay > 0 ? wait_signal(&set, delay) : 0;
+    event("ready");
+    fprintf(stderr, "%s: ready\n", g_tag);
+
+    unsigned seq = 0;
+    uint64_t next_stats = now_us(CLOCK_MONOTONIC) + (uint64_t)stats * 1000u;
+    for (;;) {
+        if (sig == SIGTERM || sig == SIGINT) {
+            event("term");
+            return 0;
+        }
+        uint64_t now = now_us(CLOCK_MONOTONIC);
+        if (sig == SIGUSR1 || (crash_after >= 0 && now >= start + (uint64_t)crash_after * 1000u)) {
+            event("crash");
+            fprintf(stderr, "%s: simulated crash\n", g_tag);
+            _exit(1);
+        }
+        long wait_ms = 1000;
+        if (stats > 0 && role != ROLE_TUN) {
+            if (now >= next_stats) {
+                print_stats(role, seq++);
+                next_stats += (uint64_t)stats * 1000u;
+                if (next_stats < now) next_stats = now + (uint64_t)stats * 1000u;
+            }
+            wait_ms = (long)((next_stats - now + 999) / 1000);
+        }
+        if (crash_after >= 0) {
+            uint64_t crash_at = start + (uint64_t)crash_after * 1000u;
+            long until = crash_at > now ? (long)((crash_at - now + 999) / 1000) : 0;
+            if (until < wait_ms) wait_ms = until;
+        }
+        sig = wait_signal(&set, wait_ms);
+    }
+}
@@ -12,6 +12,7 @@
 #include <strings.h>
 #include <ctype.h>
 #include <stdarg.h>
+#include <setjmp.h>
 #include <errno.h>
 #include <unistd.h>
 #include <signal.h>
@@ -20,58 +21,447 @@
 #include <sys/wait.h>
 #include <time.h>
 #include <sched.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/vfs.h>
+#include <sys/resource.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <regex.h>
+#include <poll.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/genetlink.h>
+#include <linux/taskstats.h>
+#include <linux/acct.h>
+#include <linux/nl80211.h>
+#include <linux/pkt_sched.h>
+#include <linux/pkt_cls.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <netdb.h>
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#ifndef SYS_pidfd_send_signal
+#define SYS_pidfd_send_signal 424
+#endif
+#ifndef SYS_clone3
+#define SYS_clone3 435
+#endif
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP 0x200000000ULL
+#endif
 
-#define MAX_INSTANCES 16
 #define MAX_NAME_LEN  64
-#define MAX_KEY_LEN   64
-#define MAX_VALUE_LEN 256
-#define MAX_CMD_LEN   1024
-#define MAX_ARGS      64
-#define MAX_CMDS      8
-#define MAX_PARAM_ENTRIES 64
+#define ARENA_BLOCK_SIZE 16384
 #define DEFAULT_RESTART_ENABLED 0
 #define DEFAULT_RESTART_DELAY   3
+#define DEFAULT_STOP_SIGNAL     SIGTERM
+#define DEFAULT_STOP_TIMEOUT_MS 5000
+#define DEFAULT_RESTART_MAX     0
+#define DEFAULT_BACKOFF_MS      1000
+#define DEFAULT_BACKOFF_MAX_MS  30000
+#define DEFAULT_RESTART_BURST   5
+#define DEFAULT_RESTART_INTERVAL_MS 60000
+#define MAX_EVENTS    16
+#define DEFAULT_LOG_RATE 50
+#define DEFAULT_FLIGHT_RECORDER "/run/wfb_supervisor.flight"
+#define DEFAULT_FLIGHT_WINDOW_MS 10000
+#define CGROUP2_MAGIC 0x63677270
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+#define STATS_RING      64   // samples kept per instance (~1 min at log_interval=1000)
+#define LOG_LINE_MAX    256
+#define LOG_RING_SIZE   16384 // bytes of timestamped output kept per instance
+#define MAX_ADAPT_STEPS 16
+#define HEALTH_TICK_MS  100   // liveness probe sampling period
+#define DEFAULT_HEALTH_TIMEOUT_MS 500
+#define DEFAULT_HEALTH_GRACE_MS   3000
+#define DEFAULT_FANOUT_REPORT_MS  10000
+#define DEFAULT_PROBE_RATE        10     // type=link_probe packets per second
+#define DEFAULT_PROBE_SIZE        64
+#define READY_POLL_MS   20    // how often a ready= port/interface/file condition is checked
+#define DEFAULT_READY_TIMEOUT_MS  10000
+
+/* Bump allocator owning everything one loaded config points to; released as a whole. */
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t used;
+    size_t size;
+    max_align_t data[];
+} arena_block_t;
+
+typedef struct {
+    arena_block_t *head;
+} arena_t;
+
+/* Growable string for rendered commands; reused by its owner and never shrunk. */
+typedef struct {
+    char  *buf;
+    size_t len;
+    size_t cap;
+} strbuf_t;
+
+typedef struct {
+    char    *key;
+    char    *val;
+    size_t   val_cap;        // val is rewritten in place while the new value fits
+    uint32_t hash;
+} param_t;
+
+/* Literal text, or a reference to a parameter whose current value is substituted. */
+typedef struct {
+    const char *text;        // NULL for a parameter reference
+    size_t      len;
+    int         param;       // g_cfg.params index
+} tmpl_seg_t;
+
+/* A command compiled against the parameter table at load; rendering is one pass. */
+typedef struct {
+    tmpl_seg_t *seg;
+    int         count;
+} tmpl_t;
+
+typedef struct {
+    const char *cmd;
+    tmpl_t tmpl;
+    int  persist;        // idempotent init hook whose effect survives a warm restart
+    int  timeout_ms;     // killed after this long (0 = DEFAULT_HOOK_TIMEOUT_MS, -1 = never; init only)
+    int  on_fail_ignore; // on_fail=ignore: a failure is logged and the rest carries on
+    const char *group;   // parallel_group= ("" = none: waits for every hook before it, and they for it)
+    const char *after;   // groups of earlier hooks a grouped hook waits for
+} hook_t;
+
+enum {
+    TUNE_SYSCTL,           // key is the sysctl name, e.g. net.core.rmem_max
+    TUNE_GOVERNOR,         // scaling_governor of every CPU
+    TUNE_MIN_FREQ,         // scaling_min_freq of every CPU, kHz or "max"
+    TUNE_WIFI_PS,          // nl80211 power save on rx_nics/tx_nics
+    TUNE_THP,              // transparent_hugepage/enabled
+    TUNE_THP_DEFRAG,       // transparent_hugepage/defrag
+};
+
+/* One [tuning] setting. */
+typedef struct {
+    int kind;
+    const char *key;
+    const char *val;
+} tuning_t;
+
+/* One rung of the adaptive ladder, ordered from most robust to fastest. */
+typedef struct {
+    int mcs;
+    int fec_k;
+    int fec_n;
+    int rssi_min;            // best-antenna RSSI required to step up into this rung (0 = none)
+} adapt_step_t;
 
 typedef struct {
-    char init_cmds[MAX_CMDS][MAX_VALUE_LEN];
+    arena_t arena;           // owns every pointer below and the instance table
+    hook_t *init_cmds;
     int  init_cmd_count;
-    char cleanup_cmds[MAX_CMDS][MAX_VALUE_LEN];
+    int  init_cmd_cap;
+    hook_t *cleanup_cmds;
     int  cleanup_cmd_count;
+    int  cleanup_cmd_cap;
 
     int  restart_enabled;
     int  restart_delay;
+    int  restart_delay_max;  // cap for the doubling full-restart delay
+    int  restart_max;        // consecutive full restarts before giving up (0 = unlimited)
+    int  warm_restart_delay_ms; // first relaunch delay when the hooks can be kept
+
+    int  monitor_setup;      // configure rx_nics/tx_nics natively instead of monitor.sh
+    char wifi_region[3];
+    int  wifi_channel;
+    int  wifi_bandwidth;     // MHz
+    int  wifi_txpower;       // mBm
+
+    int  shaper_setup;       // program the HTB tree on tx_nics natively instead of shaper.sh
+    int  shaper_mcs;
+    int  shaper_nss;         // 0: mcs is an HT index (0-31); else per-stream VHT MCS (0-9)
+    int  shaper_sgi;
+    int  shaper_efficiency;  // percent of the PHY rate used as the root rate
+    int  shaper_share[3];    // video/telemetry/tunnel percent of the root rate
+
+    int  adapt;              // closed-loop MCS/FEC control from the adapt_source stats
+    char adapt_source[MAX_NAME_LEN];
+    adapt_step_t adapt_steps[MAX_ADAPT_STEPS];
+    int  adapt_step_count;
+    double adapt_loss_target; // percent of packets lost after FEC
+    double adapt_fec_max;    // percent FEC-recovered above which the link has no headroom
+    int  adapt_down_ms;      // sustained loss before stepping down
+    int  adapt_up_ms;        // sustained headroom before stepping up
+    int  adapt_hold_ms;      // settle time after a change, while the targets restart
+
+    int  cgroup;             // one cgroup v2 leaf per instance under cgroup_root
+    const char *cgroup_root; // "" = <cgroup2 mount>/wfb_supervisor
+
+    int  log_rate;           // instance output lines printed per second, each (0 = unlimited)
+    const char *log_file;    // "" = stderr
+    const char *flight_recorder; // "" = off
+    int  flight_window_ms;   // output kept in a flight record
 
-    char param_keys[MAX_PARAM_ENTRIES][MAX_KEY_LEN];
-    char param_placeholders[MAX_PARAM_ENTRIES][MAX_KEY_LEN + 2];
-    char param_vals[MAX_PARAM_ENTRIES][MAX_VALUE_LEN];
+    tuning_t *tuning;        // [tuning], applied in file order after NIC setup
+    int  tuning_count;
+    int  tuning_cap;
+    int  socket_buffers;     // -R/-s above rmem_max/wmem_max: 0 = ignore, 1 = warn, 2 = refuse to start
+
+    struct instance *templates; // [instance name@pattern]: one instance per matching NIC
+    int  template_count;
+    int  template_cap;
+
+    param_t *params;         // in the order they were first set
     int  param_count;
+    int  param_cap;
+    int *param_slots;        // open-addressed hash of params indexes, -1 = empty
+    unsigned param_slot_count; // power of two, kept over twice param_count
 } general_config_t;
 
+/* One fd registered with the supervisor's epoll set; ctx points back at the owner. */
+typedef struct ev_watch {
+    int   fd;
+    void (*cb)(struct ev_watch *w, uint32_t events);
+    void *ctx;
+} ev_watch_t;
+
+enum {
+    RESTART_TEARDOWN = 0,  // legacy: any exit tears the whole supervisor down
+    RESTART_ALWAYS,
+    RESTART_ON_FAILURE,
+    RESTART_NEVER,
+};
+
+enum {
+    READY_NONE = 0,        // ready once exec'd
+    READY_UDP,             // a UDP socket bound to the port
+    READY_TCP,             // a TCP socket listening on the port
+    READY_IFACE,           // the network interface exists
+    READY_FILE,            // the path exists
+    READY_LOG,             // an output line matches the regex
+};
+
+enum {
+    STATS_NONE = 0,
+    STATS_WFB_AUTO,        // resolved to rx/tx from cmd at load time
+    STATS_WFB_RX,
+    STATS_WFB_TX,
+    STATS_PROBE,           // type=link_probe PROBE reports
+};
+
+/* One wfb log_interval report: counters are per interval, as wfb resets them after each dump. */
+typedef struct {
+    uint64_t ts_ms;         // supervisor monotonic time the PKT line arrived
+    uint32_t interval_ms;   // wfb clock since the previous report, 0 = unknown
+    uint32_t packets;       // rx: all received; tx: incoming from UDP
+    uint32_t delivered;     // rx: packets out to UDP; tx: packets injected
+    uint32_t bytes;         // rx: bytes out to UDP; tx: bytes injected
+    uint32_t fec_recovered; // rx
+    uint32_t lost;          // rx: unrecoverable after FEC
+    uint32_t bad;           // rx: bad + decrypt errors
+    uint32_t dropped;       // tx: dropped + truncated
+    uint32_t latency_us;    // tx: worst per-antenna average injection latency
+    int16_t  rssi;          // rx: best per-antenna average, dBm
+    uint8_t  antennas;      // RX_ANT/TX_ANT lines folded into this sample
+} stats_sample_t;
+
+/* What the PROBE reports of a type=link_probe run add up to. */
 typedef struct {
+    uint64_t sent, received, lost, reordered, duplicate;  // totals, kept across restarts
+    uint32_t p50_us, p90_us, p99_us, max_us, jitter_us;   // last report window
+} probe_stats_t;
+
+typedef struct {
+    stats_sample_t ring[STATS_RING];
+    unsigned head;           // next slot to write
+    unsigned count;
+    stats_sample_t pending;  // antenna lines waiting for their PKT line
+    uint64_t last_wfb_ts;
+    int      fec_k, fec_n;   // from the last SESSION line
+    probe_stats_t probe;
+} stats_t;
+
+/* Captured stdout/stderr: the line being assembled, the ring it lands in and the output rate limit. */
+typedef struct {
+    int      ring;           // slot in g_log_pool, -1 until the first spawn
+    uint64_t head;           // bytes ever written to the ring
+    uint64_t tail;           // start of the oldest record still in it
+    double   tokens;         // lines that may still be printed right now
+    uint64_t refill_ms;
+    unsigned suppressed;     // lines kept out of the output since the last one printed
+    char     line[LOG_LINE_MAX];
+    size_t   line_len;
+    int      line_overflow;  // rest of an overlong line is cut
+} log_t;
+
+/* Liveness probe state of one run; the UDP tap is a packet socket that is never read. */
+typedef struct {
+    int      udp_fd;         // -1 = no UDP probe this run
+    uint64_t window_start_ms; // UDP packets are counted per health_timeout window
+    uint64_t window_packets;
+    uint32_t last_pps;       // rate of the last complete window
+    int      failed;         // stopped by a probe; the exit counts as a failure
+    char     reason[64];
+} health_t;
+
+typedef struct instance {
     char name[MAX_NAME_LEN];
-    char cmd[MAX_VALUE_LEN];
-    int  quiet;          // suppress stdout/stderr
-    int  cpu_core;       // pin to a specific CPU core (-1 for no pin)
+    const char *cmd;
+    tmpl_t cmd_tmpl;     // the whole cmd, for shell=yes and NIC matching
+    int  quiet;          // keep stdout/stderr in the ring only
+    char cpu_list[64];   // CPUs to pin to, e.g. "2" or "0-1,3" ("" for no pin, "auto" for cpu_auto)
+    cpu_set_t cpus;
+    int  cpu_auto;       // cpu=auto: placed from the topology and rebalanced from measured load
+    int  latency_critical; // latency=critical: a core of its own under cpu=auto
+    int  sched_policy;   // SCHED_* set at spawn (-1 = inherit)
+    int  sched_priority;
+    int  nice;
+    int  nice_set;
+    int  ioprio;         // ioprio_set() value (-1 = inherit)
+    int  irq_affinity;   // steer the consumed NICs' IRQs and RPS/XPS to cpu
+    const char *irq_nics; // explicit NIC list ("" = rx_nics/tx_nics named in cmd)
+    int  stop_signal;    // signal sent first on shutdown
+    int  stop_timeout_ms; // grace period before SIGKILL escalation
+    int  restart_policy;  // RESTART_*
+    int  backoff_ms;      // first respawn delay, doubled per consecutive restart
+    int  backoff_max_ms;
+    int  restart_burst;   // crash-loop budget: restarts allowed per restart_interval
+    int  restart_interval_ms;
+    char group[MAX_NAME_LEN]; // failure domain recycled as a unit ("" = none)
+    int  shell;          // run cmd via /bin/sh -c (pipes, $(...)) instead of direct exec
+    tmpl_t *argv_tmpl;   // cmd words, quotes removed, compiled at load
+    unsigned char *argv_split; // fully unquoted word: field-split after expansion
+    int  argv_count;
+    int  stats_kind;     // STATS_*: capture and parse wfb log_interval output
+    int  cpu_weight;     // cgroup cpu.weight (0 = unset)
+    char cpu_max[32];    // cgroup cpu.max ("" = unset)
+    char memory_max[32]; // cgroup memory.max in bytes or "max" ("" = unset)
+    char memory_high[32];
+    char cpuset[64];     // cgroup cpuset.cpus ("" = unset)
+    int  adapt_source;   // its reports drive the adaptive controller
+    int  adapt_target;   // re-rendered and recycled when the adaptive controller moves
+    int  health_udp;     // UDP liveness probe: 0 = off, 1 = port below, 2 = -c/-u of the rendered cmd
+    uint32_t health_addr; // IPv4 destination in network order (0 = any)
+    int  health_port;
+    int  health_min_pps; // UDP rate below which a window counts as stalled
+    int  health_timeout_ms;
+    int  health_stats_ms; // longest allowed gap between wfb reports (0 = off)
+    int  health_grace_ms; // no verdict this soon after a spawn
+    const char *nic;     // interface a templated instance is bound to ("" = none)
+    const char *nics;    // template: candidate NICs, parameters expanded at load (NULL = every wireless NIC)
+    int  fanout;         // type=udp_fanout: cmd is the supervisor itself relaying listen= to dest=
+    const char *fanout_listen;
+    const char *fanout_dest;
+    int  fanout_gso;
+    int  fanout_report_ms; // also the report period of type=link_probe
+    int  probe;          // type=link_probe: inject at dest= and measure what comes back at listen=
+    int  probe_echo;     // mode=echo: reflect what arrives at listen= instead (the far end of a round trip)
+    int  probe_rate;     // packets per second
+    int  probe_size;     // datagram bytes
+    const char *after;   // instances (globs) that must be ready before this one starts ("" = none)
+    const char *requires; // like after=, but this one also goes down and waits whenever they do
+    int  ready_kind;     // READY_*: when dependents may start
+    const char *ready_arg; // interface, path or regex
+    int  ready_port;
+    int  ready_timeout_ms; // a run not ready by then counts as failed
 
+    // Runtime state from here on; a hot reload carries it over for unchanged instances.
     pid_t pid;
     int   exit_status;
     int   running;
+    int   stopping;      // stop signal sent, waiting for exit
+    int   killed;        // escalated to SIGKILL
+    int   pidfd;         // -1 when the kernel lacks pidfd_open
+    uint64_t stop_us;    // monotonic time the stop signal was sent
+    uint64_t start_ms;
+    uint64_t spawn_us;   // fork-to-exec latency of the last spawn
+    uint64_t spawn_at_us; // monotonic time of that spawn
+    uint64_t exit_us;    // monotonic exit time reported by taskstats (0 = not seen)
+    int   mx_slot;       // g_metrics index + 1 (0 = not looked up yet)
+    int   restart_count;
+    int   backoff_step;
+    int   restart_pending; // respawn once the rest of the group is down
+    int   pending_delay_ms;
+    uint64_t budget_start_ms;
+    int   budget_used;
+    int   recycle;       // stopped to be respawned alone with fresh parameters
+    int   absent;        // its NIC is unplugged; started again when it returns
+    int   waiting;       // held back until its after=/requires= instances are ready
+    int   ready;         // its ready= condition held during this run
+    int   ready_re_set;
+    regex_t ready_re;    // ready=log:, compiled per run
+    cpu_set_t auto_cpus; // cpu=auto: where it runs now
+    int   auto_core;     // g_auto_cores index + 1 of its dedicated core (0 = shared CPUs)
+    pid_t auto_pid;      // run the schedstat totals below belong to
+    uint64_t auto_run_ns;
+    uint64_t auto_wait_ns;
+    uint64_t auto_sample_us;
+    int   auto_measured; // auto_load/auto_wait hold a full interval
+    int   auto_load;     // CPU use over the last interval, permille of one CPU
+    int   auto_wait;     // run-queue wait over the last interval, us per second
+    int   auto_moved;    // moved while running; the next interval is compared with auto_wait_moved
+    int   auto_wait_moved;
+    ev_watch_t ready_timer;
+    ev_watch_t pid_watch;
+    ev_watch_t kill_timer;
+    ev_watch_t restart_timer;
+    ev_watch_t out_watch; // read end of the stdout/stderr pipe
+    ev_watch_t health_timer;
+    health_t health;
+    int   cg_dir;        // cgroup leaf directory, -1 when cgroups are off
+    stats_t stats;
+    log_t log;
 } instance_t;
 
 static general_config_t g_cfg;
-static instance_t g_instances[MAX_INSTANCES];
+static instance_t *g_instances;     // in g_cfg.arena
 static int g_instance_count = 0;
-static volatile sig_atomic_t g_stop_requested = 0;
+static int g_instance_cap = 0;
+static int g_stop_requested = 0;
+static int g_restart_requested = 0;
+static int g_reload_requested = 0;
+static int g_session_active = 0;   // children are up and may be started/stopped one by one
+static const char *g_config_path = "/etc/wfb.conf";
+static uint64_t g_fingerprint = 0; // hook_fingerprint() of the hooks in effect
+static int g_failed_idx = -1;
+static int g_failed_status = 0;
+static int g_epfd = -1;
+static sigset_t g_orig_sigmask;
+static ev_watch_t g_signal_watch = { .fd = -1 };
+
+/* Parameters set over the control socket; they win over the file on every load until exit. */
+static param_t *g_overrides;
+static int  g_override_count = 0;
+static int  g_override_cap = 0;
 
 /* Utils */
 
+static jmp_buf *g_die_jmp;      // set by config_try(): a config error unwinds instead of exiting
+static char g_die_msg[512];
+
 static void die(const char *fmt, ...) {
     va_list ap;
-    fprintf(stderr, "wfb_supervisor: ");
     va_start(ap, fmt);
-    vfprintf(stderr, fmt, ap);
+    vsnprintf(g_die_msg, sizeof(g_die_msg), fmt, ap);
     va_end(ap);
-    fputc('\n', stderr);
+    fprintf(stderr, "wfb_supervisor: %s\n", g_die_msg);
+    if (g_die_jmp) longjmp(*g_die_jmp, 1);
     exit(1);
 }
 
@@ -103,12 +493,329 @@ static int parse_int(const char *v, int *out) {
     return 0;
 }
 
-static void run_commands(char cmds[][MAX_VALUE_LEN], int count, const char *phase);
-static void store_param_kv(int line_no, const char *key, const char *val);
+/* Durations: bare numbers are seconds (like restart_delay); "ms"/"s" suffixes are accepted. */
+static int parse_duration_ms(const char *v, int *out) {
+    char *end = NULL;
+    errno = 0;
+    double val = strtod(v, &end);
+    if (errno != 0 || end == v || val < 0) return -1;
+    if (*end == '\0' || strcmp(end, "s") == 0) {
+        val *= 1000.0;
+    } else if (strcmp(end, "ms") != 0) {
+        return -1;
+    }
+    if (val > 86400000.0) return -1;
+    *out = (int)val;
+    return 0;
+}
+
+/* Sizes for cgroup memory limits: bytes with an optional K/M/G suffix, or "max". */
+static int parse_size(const char *v, char *out, size_t out_len) {
+    if (strcasecmp(v, "max") == 0) {
+        snprintf(out, out_len, "max");
+        return 0;
+    }
+    char *end = NULL;
+    errno = 0;
+    unsigned long long val = strtoull(v, &end, 10);
+    if (errno != 0 || end == v || *v == '-') return -1;
+    int shift = 0;
+    if (*end == 'k' || *end == 'K') shift = 10;
+    else if (*end == 'm' || *end == 'M') shift = 20;
+    else if (*end == 'g' || *end == 'G') shift = 30;
+    if (shift) end++;
+    if (*end != '\0' || val > (~0ULL >> shift)) return -1;
+    snprintf(out, out_len, "%llu", val << shift);
+    return 0;
+}
+
+/* "2" or "0-1,3"; returns -1 on syntax errors and CPUs beyond CPU_SETSIZE. */
+static int parse_cpu_list(const char *v, cpu_set_t *set) {
+    CPU_ZERO(set);
+    const char *p = v;
+    while (*p) {
+        char *end;
+        long lo = strtol(p, &end, 10);
+        if (end == p || lo < 0) return -1;
+        long hi = lo;
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+            if (end == p || hi < lo) return -1;
+        }
+        if (hi >= CPU_SETSIZE) return -1;
+        for (long c = lo; c <= hi; c++) CPU_SET((int)c, set);
+        if (*end == ',') end++;
+        else if (*end) return -1;
+        p = end;
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+static const struct { const char *name; int sig; } k_signals[] = {
+    { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "KILL", SIGKILL },
+    { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 }, { "TERM", SIGTERM },
+};
+
+static int parse_signal(const char *v, int *out) {
+    if (isdigit((unsigned char)*v)) {
+        if (parse_int(v, out) || *out <= 0 || *out >= NSIG) return -1;
+        return 0;
+    }
+    if (strncasecmp(v, "SIG", 3) == 0) v += 3;
+    for (size_t i = 0; i < sizeof(k_signals) / sizeof(k_signals[0]); i++) {
+        if (strcasecmp(v, k_signals[i].name) == 0) {
+            *out = k_signals[i].sig;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+/* Tracing (--trace) */
+
+#define TRACE_MAX_EVENTS 32768
+
+typedef struct {
+    uint64_t ts_us;          // CLOCK_MONOTONIC
+    uint64_t dur_us;
+    int      tid;            // 0 = the supervisor, else the child pid whose track this is on
+    char     ph;             // 'X' span, 'i' instant, 'M' track name
+    char     name[31];
+    char     detail[80];
+} trace_event_t;
+
+static const char    *g_trace_path;
+static trace_event_t *g_trace;      // preallocated by trace_setup(); NULL when tracing is off
+static int            g_trace_count = 0;
+static int            g_trace_dropped = 0;
+static pid_t          g_trace_owner;  // forked children must not write the file on exit
+
+/* Start of a span: the clock is only read while tracing. */
+static uint64_t trace_now(void) {
+    return g_trace ? now_us() : 0;
+}
+
+static void trace_add(char ph, int tid, uint64_t start_us, const char *name, const char *fmt, ...) {
+    if (!g_trace) return;
+    if (g_trace_count >= TRACE_MAX_EVENTS) {
+        g_trace_dropped++;
+        return;
+    }
+    trace_event_t *e = &g_trace[g_trace_count++];
+    uint64_t now = now_us();
+    e->ts_us = ph == 'X' ? start_us : now;
+    e->dur_us = ph == 'X' && now > start_us ? now - start_us : 0;
+    e->tid = tid;
+    e->ph = ph;
+    snprintf(e->name, sizeof(e->name), "%s", name);
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(e->detail, sizeof(e->detail), fmt, ap);
+    va_end(ap);
+}
+
+#define trace_span(start, name, ...)        trace_add('X', 0, (start), (name), __VA_ARGS__)
+#define trace_instant(name, ...)            trace_add('i', 0, 0, (name), __VA_ARGS__)
+
+static void trace_json_str(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+        else if (c < 0x20) fprintf(f, "\\u%04x", c);
+        else fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+/* Write everything recorded so far as Chrome/Perfetto trace-event JSON; replaces the file atomically. */
+static void trace_flush(void) {
+    if (!g_trace || getpid() != g_trace_owner) return;
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", g_trace_path);
+    FILE *f = fopen(tmp, "we");
+    if (!f) {
+        fprintf(stderr, "wfb_supervisor: trace: %s: %s\n", tmp, strerror(errno));
+        return;
+    }
+    int self = (int)getpid();
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped\":%d},\"traceEvents\":[\n", g_trace_dropped);
+    fprintf(f, "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"wfb_supervisor\"}}", self, self);
+    fprintf(f, ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"supervisor\"}}", self, self);
+    for (int i = 0; i < g_trace_count; i++) {
+        const trace_event_t *e = &g_trace[i];
+        int tid = e->tid ? e->tid : self;
+        if (e->ph == 'M') {
+            fprintf(f, ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":", self, tid);
+            trace_json_str(f, e->name);
+            fputs("}}", f);
+            continue;
+        }
+        fprintf(f, ",\n{\"ph\":\"%c\",\"cat\":\"wfb\",\"pid\":%d,\"tid\":%d,\"ts\":%llu,", e->ph, self, tid,
+                (unsigned long long)e->ts_us);
+        if (e->ph == 'X') fprintf(f, "\"dur\":%llu,", (unsigned long long)e->dur_us);
+        else fputs("\"s\":\"t\",", f);
+        fputs("\"name\":", f);
+        trace_json_str(f, e->name);
+        if (e->detail[0]) {
+            fputs(",\"args\":{\"detail\":", f);
+            trace_json_str(f, e->detail);
+            fputc('}', f);
+        }
+        fputc('}', f);
+    }
+    fputs("\n]}\n", f);
+    int err = ferror(f);
+    if (fclose(f) != 0 || err || rename(tmp, g_trace_path) != 0) {
+        fprintf(stderr, "wfb_supervisor: trace: writing %s failed: %s\n", g_trace_path, strerror(errno));
+        unlink(tmp);
+        return;
+    }
+    fprintf(stderr, "wfb_supervisor: trace: %d event%s written to %s%s\n", g_trace_count, g_trace_count == 1 ? "" : "s",
+            g_trace_path, g_trace_dropped ? " (buffer full, later events dropped)" : "");
+}
+
+static void trace_setup(const char *path) {
+    g_trace_path = path;
+    g_trace_owner = getpid();
+    g_trace = calloc(TRACE_MAX_EVENTS, sizeof(*g_trace));
+    if (!g_trace) die("out of memory");
+    // Touch the buffer now so recording never takes a page fault on the hot path.
+    memset(g_trace, 0, TRACE_MAX_EVENTS * sizeof(*g_trace));
+    atexit(trace_flush);
+}
+
+/* Arena and scratch strings */
+
+static void *arena_alloc(arena_t *a, size_t len) {
+    len = (len + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+    arena_block_t *b = a->head;
+    if (!b || b->size - b->used < len) {
+        size_t size = len > ARENA_BLOCK_SIZE ? len : ARENA_BLOCK_SIZE;
+        b = malloc(sizeof(*b) + size);
+        if (!b) die("out of memory");
+        b->next = a->head;
+        b->used = 0;
+        b->size = size;
+        a->head = b;
+    }
+    void *p = (char *)b->data + b->used;
+    b->used += len;
+    memset(p, 0, len);
+    return p;
+}
+
+static char *arena_strdup(arena_t *a, const char *s) {
+    size_t len = strlen(s);
+    char *p = arena_alloc(a, len + 1);
+    memcpy(p, s, len);
+    return p;
+}
+
+/* Room for one more element, doubling; the outgrown copy stays in the arena until release. */
+static void *arena_grow(arena_t *a, void *arr, int count, int *cap, size_t elem) {
+    if (count < *cap) return arr;
+    int ncap = *cap ? *cap * 2 : 8;
+    void *grown = arena_alloc(a, (size_t)ncap * elem);
+    if (count) memcpy(grown, arr, (size_t)count * elem);
+    *cap = ncap;
+    return grown;
+}
+
+static void arena_release(arena_t *a) {
+    while (a->head) {
+        arena_block_t *next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+}
+
+static void sb_reserve(strbuf_t *sb, size_t extra) {
+    if (sb->len + extra < sb->cap) return;
+    size_t cap = sb->cap ? sb->cap : 256;
+    while (cap <= sb->len + extra) cap *= 2;
+    char *grown = realloc(sb->buf, cap);
+    if (!grown) die("out of memory");
+    sb->buf = grown;
+    sb->cap = cap;
+}
+
+static void sb_reset(strbuf_t *sb) {
+    sb->len = 0;
+    sb_reserve(sb, 0);
+    sb->buf[0] = '\0';
+}
+
+static void sb_append(strbuf_t *sb, const char *s, size_t len) {
+    sb_reserve(sb, len);
+    memcpy(sb->buf + sb->len, s, len);
+    sb->len += len;
+    sb->buf[sb->len] = '\0';
+}
+
+static void sb_puts(strbuf_t *sb, const char *s) {
+    sb_append(sb, s, strlen(s));
+}
+
+static void sb_printf(strbuf_t *sb, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void sb_printf(strbuf_t *sb, const char *fmt, ...) {
+    sb_reserve(sb, 0);
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(sb->buf + sb->len, sb->cap - sb->len, fmt, ap);
+    va_end(ap);
+    if (n <= 0) return;
+    if ((size_t)n >= sb->cap - sb->len) {  // did not fit, retry once with room
+        sb_reserve(sb, (size_t)n);
+        va_start(ap, fmt);
+        vsnprintf(sb->buf + sb->len, (size_t)n + 1, fmt, ap);
+        va_end(ap);
+    }
+    sb->len += (size_t)n;
+}
+
+static void sb_free(strbuf_t *sb) {
+    free(sb->buf);
+    memset(sb, 0, sizeof(*sb));
+}
+
+static int run_commands(const hook_t *hooks, int count, const char *phase, int skip_persistent);
+static void store_param_kv(const char *key, const char *val);
 static const char *get_param_value(const char *key);
+static void ev_add(ev_watch_t *w, uint32_t events);
+static void ev_close(ev_watch_t *w);
+static void ev_run_once(int timeout_ms);
+static void timer_arm_ms(int fd, int ms);
+static void timer_drain(int fd);
+static const char *describe_status(int status, char *buf, size_t len);
 static int get_param_bool(const char *key, int default_val);
 static int get_param_int(const char *key, int default_val);
 static void apply_runtime_settings(void);
+static void compile_commands(void);
+static void tmpl_compile(tmpl_t *t, const char *s);
+static void compile_instance(instance_t *inst);
+static const char *tmpl_expand(const tmpl_t *t, strbuf_t *sb);
+static instance_t *find_instance(const char *name);
+static int channel_to_freq(int ch);
+static int channel_center_freq(int ch, int freq, int bw);
+static int bandwidth_to_width(int bw);
+static long phy_rate_kbit(int mcs, int nss, int bw, int sgi);
+static void load_adapt_settings(void);
+static void adapt_pick_targets(void);
+static void metrics_hook(const char *phase, uint64_t us);
 
 /* Config */
 
@@ -116,84 +823,369 @@ static void init_defaults(void) {
     memset(&g_cfg, 0, sizeof(g_cfg));
     g_cfg.restart_enabled = DEFAULT_RESTART_ENABLED;
     g_cfg.restart_delay = DEFAULT_RESTART_DELAY;
+    g_cfg.socket_buffers = 1;
 }
 
-static void store_param_kv(int line_no, const char *key, const char *val) {
-    int idx = -1;
-    for (int i = 0; i < g_cfg.param_count; i++) {
-        if (strcasecmp(g_cfg.param_keys[i], key) == 0) {
-            idx = i;
-            break;
-        }
+static uint32_t param_hash(const char *key, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)tolower((unsigned char)key[i]);
+        h *= 16777619u;
     }
+    return h;
+}
 
-    if (idx < 0) {
-        if (g_cfg.param_count >= MAX_PARAM_ENTRIES) {
-            die("config:%d: too many general/parameter entries (max %d)", line_no, MAX_PARAM_ENTRIES);
-        }
-
-        idx = g_cfg.param_count++;
-
-        strncpy(g_cfg.param_keys[idx], key, sizeof(g_cfg.param_keys[0]) - 1);
-        g_cfg.param_keys[idx][sizeof(g_cfg.param_keys[0]) - 1] = '\0';
+/* Index of the parameter named by the first len bytes of key (any case), or -1. */
+static int param_find(const char *key, size_t len) {
+    if (g_cfg.param_slot_count == 0) return -1;
+    unsigned mask = g_cfg.param_slot_count - 1;
+    uint32_t h = param_hash(key, len);
+    for (unsigned i = h & mask; g_cfg.param_slots[i] >= 0; i = (i + 1) & mask) {
+        const param_t *p = &g_cfg.params[g_cfg.param_slots[i]];
+        if (p->hash == h && strncasecmp(p->key, key, len) == 0 && p->key[len] == '\0') return g_cfg.param_slots[i];
+    }
+    return -1;
+}
 
-        char placeholder[MAX_KEY_LEN + 2];
-        int n = snprintf(placeholder, sizeof(placeholder), "$%s",
-                         g_cfg.param_keys[idx]);
-        if (n < 0 || (size_t)n >= sizeof(placeholder)) {
-            die("config:%d: general key '%s' too long to substitute", line_no, key);
-        }
+static void param_rehash(void) {
+    unsigned n = g_cfg.param_slot_count ? g_cfg.param_slot_count * 2 : 64;
+    g_cfg.param_slots = arena_alloc(&g_cfg.arena, n * sizeof(int));
+    memset(g_cfg.param_slots, 0xff, n * sizeof(int));
+    g_cfg.param_slot_count = n;
+    for (int p = 0; p < g_cfg.param_count; p++) {
+        unsigned i = g_cfg.params[p].hash & (n - 1);
+        while (g_cfg.param_slots[i] >= 0) i = (i + 1) & (n - 1);
+        g_cfg.param_slots[i] = p;
+    }
+}
 
-        size_t placeholder_len = strlen(placeholder);
-        if (placeholder_len >= sizeof(g_cfg.param_placeholders[0])) {
-            die("config:%d: general key '%s' too long to substitute", line_no, key);
+static void store_param_kv(const char *key, const char *val) {
+    int idx = param_find(key, strlen(key));
+    if (idx < 0) {
+        g_cfg.params = arena_grow(&g_cfg.arena, g_cfg.params, g_cfg.param_count, &g_cfg.param_cap, sizeof(param_t));
+        idx = g_cfg.param_count++;
+        param_t *p = &g_cfg.params[idx];
+        p->key = arena_strdup(&g_cfg.arena, key);
+        p->hash = param_hash(key, strlen(key));
+        if ((unsigned)g_cfg.param_count * 2 > g_cfg.param_slot_count) {
+            param_rehash();
+        } else {
+            unsigned mask = g_cfg.param_slot_count - 1, i = p->hash & mask;
+            while (g_cfg.param_slots[i] >= 0) i = (i + 1) & mask;
+            g_cfg.param_slots[i] = idx;
         }
-        memcpy(g_cfg.param_placeholders[idx], placeholder, placeholder_len + 1);
     }
 
-    strncpy(g_cfg.param_vals[idx], val, sizeof(g_cfg.param_vals[0]) - 1);
-    g_cfg.param_vals[idx][sizeof(g_cfg.param_vals[0]) - 1] = '\0';
+    // Compiled commands refer to the slot, so a new value is seen on the next render.
+    param_t *p = &g_cfg.params[idx];
+    size_t len = strlen(val);
+    if (len + 1 > p->val_cap) {
+        p->val_cap = len + 1 < 16 ? 16 : (len + 1) * 2;
+        p->val = arena_alloc(&g_cfg.arena, p->val_cap);
+    }
+    memcpy(p->val, val, len + 1);
 }
 
 static int parse_parameter_kv(int line_no, const char *key, const char *val) {
-    if (strcasecmp(key, "init_cmd") == 0 || strcasecmp(key, "cleanup_cmd") == 0) {
+    if (strncasecmp(key, "init_cmd", 8) == 0 || strncasecmp(key, "cleanup_cmd", 11) == 0) {
         die("config:%d: %s must be placed in [general]", line_no, key);
     }
 
-    store_param_kv(line_no, key, val);
+    store_param_kv(key, val);
 
     return 1;
 }
 
+static void instance_defaults(instance_t *inst) {
+    inst->cmd = "";
+    inst->irq_nics = "";
+    inst->nic = "";
+    inst->fanout_listen = "";
+    inst->fanout_dest = "";
+    inst->fanout_report_ms = DEFAULT_FANOUT_REPORT_MS;
+    inst->probe_rate = DEFAULT_PROBE_RATE;
+    inst->probe_size = DEFAULT_PROBE_SIZE;
+    inst->after = "";
+    inst->requires = "";
+    inst->ready_arg = "";
+    inst->ready_timeout_ms = DEFAULT_READY_TIMEOUT_MS;
+    inst->ready_timer.fd = -1;
+    inst->sched_policy = -1;
+    inst->ioprio = -1;
+    inst->stop_signal = DEFAULT_STOP_SIGNAL;
+    inst->stop_timeout_ms = DEFAULT_STOP_TIMEOUT_MS;
+    inst->pidfd = -1;
+    inst->restart_policy = RESTART_TEARDOWN;
+    inst->backoff_ms = DEFAULT_BACKOFF_MS;
+    inst->backoff_max_ms = DEFAULT_BACKOFF_MAX_MS;
+    inst->restart_burst = DEFAULT_RESTART_BURST;
+    inst->restart_interval_ms = DEFAULT_RESTART_INTERVAL_MS;
+    inst->pid_watch.fd = -1;
+    inst->kill_timer.fd = -1;
+    inst->restart_timer.fd = -1;
+    inst->out_watch.fd = -1;
+    inst->health_timer.fd = -1;
+    inst->health.udp_fd = -1;
+    inst->health_min_pps = 1;
+    inst->health_timeout_ms = DEFAULT_HEALTH_TIMEOUT_MS;
+    inst->health_grace_ms = DEFAULT_HEALTH_GRACE_MS;
+    inst->cg_dir = -1;
+    inst->log.ring = -1;
+}
+
+/* "name@pattern" declares a template, expanded per NIC by template_instantiate(). */
 static instance_t *add_instance(const char *name, int line_no) {
-    if (g_instance_count >= MAX_INSTANCES) {
-        die("config:%d: too many instances (max %d)", line_no, MAX_INSTANCES);
+    if (strlen(name) >= MAX_NAME_LEN) die("config:%d: instance name '%s' too long (max %d)", line_no, name, MAX_NAME_LEN - 1);
+    const char *at = strchr(name, '@');
+    if (at && (at == name || !at[1])) die("config:%d: template '%s' needs a name and a NIC pattern (e.g. rx@*)", line_no, name);
+    // What a template expands to is "<name>@<interface>".
+    if (at && (size_t)(at - name) + IFNAMSIZ >= MAX_NAME_LEN) die("config:%d: template name '%.*s' too long", line_no, (int)(at - name), name);
+    instance_t *list = at ? g_cfg.templates : g_instances;
+    int count = at ? g_cfg.template_count : g_instance_count;
+    for (int i = 0; i < count; i++) {
+        if (strcasecmp(list[i].name, name) == 0) {
+            die("config:%d: duplicate instance name '%s'", line_no, name);
+        }
     }
 
-    for (int i = 0; i < g_instance_count; i++) {
-        if (strcasecmp(g_instances[i].name, name) == 0) {
-            die("config:%d: duplicate instance name '%s'", line_no, name);
+    instance_t *inst;
+    if (at) {
+        g_cfg.templates = arena_grow(&g_cfg.arena, g_cfg.templates, g_cfg.template_count, &g_cfg.template_cap, sizeof(instance_t));
+        inst = &g_cfg.templates[g_cfg.template_count++];
+    } else {
+        g_instances = arena_grow(&g_cfg.arena, g_instances, g_instance_count, &g_instance_cap, sizeof(instance_t));
+        inst = &g_instances[g_instance_count++];
+    }
+    snprintf(inst->name, sizeof(inst->name), "%s", name);
+    instance_defaults(inst);
+    return inst;
+}
+
+static int nic_is_wireless(const char *nic) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/class/net/%s/phy80211", nic);
+    return access(path, F_OK) == 0;
+}
+
+/* Is word a token of a space/comma separated list? */
+static int list_has(const char *list, const char *word) {
+    size_t len = strlen(word);
+    for (const char *p = list; *p; ) {
+        p += strspn(p, " \t,");
+        size_t n = strcspn(p, " \t,");
+        if (n == len && strncmp(p, word, len) == 0) return 1;
+        p += n;
+    }
+    return 0;
+}
+
+/* Does template tpl want an instance on nic: matching its pattern, among nics= or wireless? */
+static int template_wants(const instance_t *tpl, const char *nic) {
+    if (fnmatch(strchr(tpl->name, '@') + 1, nic, 0) != 0) return 0;
+    return tpl->nics ? list_has(tpl->nics, nic) : nic_is_wireless(nic);
+}
+
+/* $nic and ${nic} in a template's cmd become the interface name. */
+static const char *nic_subst(const char *cmd, const char *nic) {
+    static strbuf_t sb;
+    sb_reset(&sb);
+    for (const char *p = cmd; *p; ) {
+        size_t n = 0;
+        if (strncmp(p, "${nic}", 6) == 0) n = 6;
+        else if (strncmp(p, "$nic", 4) == 0 && !isalnum((unsigned char)p[4]) && p[4] != '_') n = 4;
+        if (n) {
+            sb_puts(&sb, nic);
+            p += n;
+        } else {
+            sb_append(&sb, p++, 1);
         }
     }
+    return arena_strdup(&g_cfg.arena, sb.buf);
+}
 
+/*
+ * A new instance named "<name>@<nic>" from tpl, appended to the table and compiled. The table
+ * may move, so callers outside load_config() rebind the watches.
+ */
+static instance_t *template_instantiate(const instance_t *tpl, const char *nic) {
+    g_instances = arena_grow(&g_cfg.arena, g_instances, g_instance_count, &g_instance_cap, sizeof(instance_t));
     instance_t *inst = &g_instances[g_instance_count++];
     memset(inst, 0, sizeof(*inst));
-    strncpy(inst->name, name, sizeof(inst->name)-1);
-    inst->cpu_core = -1;
+    instance_defaults(inst);                      // runtime fields start like any instance's
+    memcpy(inst, tpl, offsetof(instance_t, pid)); // configuration comes from the template
+    snprintf(inst->name, sizeof(inst->name), "%.*s@%s", (int)(strchr(tpl->name, '@') - tpl->name), tpl->name, nic);
+    inst->nic = arena_strdup(&g_cfg.arena, nic);
+    inst->cmd = nic_subst(tpl->cmd, nic);
+    inst->nics = NULL;
+    inst->argv_tmpl = NULL;
+    inst->argv_split = NULL;
+    compile_instance(inst);
     return inst;
 }
 
+/*
+ * Instantiate every template for the NICs present that it has no instance for yet; returns
+ * how many were added.
+ */
+static int templates_expand(void) {
+    if (g_cfg.template_count == 0) return 0;
+    struct if_nameindex *ifs = if_nameindex();
+    if (!ifs) return 0;
+    int added = 0;
+    char name[MAX_NAME_LEN + IFNAMSIZ];
+    for (struct if_nameindex *it = ifs; it->if_index; it++) {
+        for (int t = 0; t < g_cfg.template_count; t++) {
+            const instance_t *tpl = &g_cfg.templates[t];
+            if (!template_wants(tpl, it->if_name)) continue;
+            snprintf(name, sizeof(name), "%.*s@%s", (int)(strchr(tpl->name, '@') - tpl->name), tpl->name, it->if_name);
+            if (find_instance(name)) continue;
+            template_instantiate(tpl, it->if_name);
+            added++;
+        }
+    }
+    if_freenameindex(ifs);
+    return added;
+}
+
+/* Next word of a space/comma separated list, copied into buf; NULL at the end. */
+static const char *list_word(const char **p, char *buf, size_t len) {
+    *p += strspn(*p, " \t,");
+    size_t n = strcspn(*p, " \t,");
+    if (n == 0) return NULL;
+    snprintf(buf, len, "%.*s", (int)n, *p);
+    *p += n;
+    return buf;
+}
+
+/* Does an after=/requires= list name m? Words are globs, so rx@* covers a template's instances. */
+static int deps_name(const char *list, const instance_t *m) {
+    char word[MAX_NAME_LEN];
+    for (const char *p = list; list_word(&p, word, sizeof(word)); ) {
+        if (fnmatch(word, m->name, FNM_CASEFOLD) == 0) return 1;
+    }
+    return 0;
+}
+
+static int deps_visit(int i, unsigned char *state) {
+    if (state[i] == 2) return 0;
+    if (state[i] == 1) return -1;
+    state[i] = 1;
+    const instance_t *inst = &g_instances[i];
+    for (int j = 0; j < g_instance_count; j++) {
+        const instance_t *m = &g_instances[j];
+        if (j == i || !(deps_name(inst->after, m) || deps_name(inst->requires, m))) continue;
+        if (deps_visit(j, state) != 0) return -1;
+    }
+    state[i] = 2;
+    return 0;
+}
+
+/* after=/requires= must name an instance or a template's instances, and must not loop. */
+static void check_dependencies(void) {
+    char word[MAX_NAME_LEN];
+    for (int i = 0; i < g_instance_count + g_cfg.template_count; i++) {
+        const instance_t *inst = i < g_instance_count ? &g_instances[i] : &g_cfg.templates[i - g_instance_count];
+        for (int l = 0; l < 2; l++) {
+            for (const char *p = l ? inst->requires : inst->after; list_word(&p, word, sizeof(word)); ) {
+                int found = 0;
+                for (int j = 0; j < g_instance_count && !found; j++) found = fnmatch(word, g_instances[j].name, FNM_CASEFOLD) == 0;
+                for (int t = 0; t < g_cfg.template_count && !found; t++) {
+                    const char *tpl = g_cfg.templates[t].name;
+                    found = strncasecmp(word, tpl, (size_t)(strchr(tpl, '@') - tpl) + 1) == 0;
+                }
+                if (!found) die("instance '%s': %s=%s names no instance", inst->name, l ? "requires" : "after", word);
+            }
+        }
+    }
+    unsigned char *state = calloc((size_t)g_instance_count + 1, 1);
+    if (!state) die("out of memory");
+    for (int i = 0; i < g_instance_count; i++) {
+        if (deps_visit(i, state) != 0) die("instance '%s': after=/requires= form a cycle", g_instances[i].name);
+    }
+    free(state);
+}
+
+/* "<init_cmd|cleanup_cmd>.<attr>=" applies to the most recent hook of that kind. */
+static void parse_hook_attr(int line_no, const char *kind, hook_t *hooks, int count, const char *attr, const char *val) {
+    if (count == 0) die("config:%d: %s.%s must follow a %s entry", line_no, kind, attr, kind);
+    hook_t *hook = &hooks[count - 1];
+    if (strcasecmp(attr, "persist") == 0) {
+        if (parse_bool(val, &hook->persist)) die("config:%d: invalid %s.persist value '%s'", line_no, kind, val);
+    } else if (strcasecmp(attr, "timeout") == 0) {
+        if (parse_duration_ms(val, &hook->timeout_ms)) die("config:%d: invalid %s.timeout value '%s'", line_no, kind, val);
+        if (hook->timeout_ms == 0 && strcmp(kind, "cleanup_cmd") == 0) die("config:%d: cleanup_cmd.timeout must be positive so a shutdown cannot hang", line_no);
+        if (hook->timeout_ms == 0) hook->timeout_ms = -1;
+    } else if (strcasecmp(attr, "on_fail") == 0) {
+        if (strcasecmp(val, "ignore") == 0) hook->on_fail_ignore = 1;
+        else if (strcasecmp(val, "abort") == 0) hook->on_fail_ignore = 0;
+        else die("config:%d: invalid %s.on_fail value '%s' (expected abort or ignore)", line_no, kind, val);
+    } else if (strcasecmp(attr, "parallel_group") == 0) {
+        if (!*val || val[strspn(val, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-")]) {
+            die("config:%d: invalid %s.parallel_group '%s' (letters, digits, '_' and '-')", line_no, kind, val);
+        }
+        hook->group = arena_strdup(&g_cfg.arena, val);
+    } else if (strcasecmp(attr, "after") == 0) {
+        // Only groups of earlier hooks, so the order stays a DAG by construction.
+        char word[MAX_NAME_LEN];
+        for (const char *p = val; list_word(&p, word, sizeof(word)); ) {
+            int k = 0;
+            while (k < count - 1 && strcmp(hooks[k].group, word) != 0) k++;
+            if (k == count - 1) die("config:%d: %s.after: no earlier %s has parallel_group=%s", line_no, kind, kind, word);
+        }
+        hook->after = arena_strdup(&g_cfg.arena, val);
+    } else {
+        die("config:%d: unknown hook attribute '%s.%s'", line_no, kind, attr);
+    }
+}
+
+/* after= only orders a grouped hook; an ungrouped one already waits for everything before it. */
+static void check_hooks(const char *kind, const hook_t *hooks, int count) {
+    for (int i = 0; i < count; i++) {
+        if (hooks[i].after[0] && !hooks[i].group[0]) die("%s '%s': after= needs parallel_group=", kind, hooks[i].cmd);
+    }
+}
+
+static void parse_tuning_kv(int line_no, const char *key, const char *val) {
+    static const struct { const char *name; int kind; } k_keys[] = {
+        { "cpu_governor", TUNE_GOVERNOR }, { "cpu_min_freq", TUNE_MIN_FREQ }, { "wifi_powersave", TUNE_WIFI_PS },
+        { "thp", TUNE_THP }, { "thp_defrag", TUNE_THP_DEFRAG },
+    };
+    if (strcasecmp(key, "socket_buffers") == 0) {
+        if (strcasecmp(val, "off") == 0) g_cfg.socket_buffers = 0;
+        else if (strcasecmp(val, "warn") == 0) g_cfg.socket_buffers = 1;
+        else if (strcasecmp(val, "fail") == 0) g_cfg.socket_buffers = 2;
+        else die("config:%d: invalid socket_buffers '%s' (expected warn, fail or off)", line_no, val);
+        return;
+    }
+    int kind = -1;
+    for (size_t i = 0; i < sizeof(k_keys) / sizeof(k_keys[0]); i++) {
+        if (strcasecmp(key, k_keys[i].name) == 0) kind = k_keys[i].kind;
+    }
+    if (kind < 0 && strchr(key, '.') && !strstr(key, "..") && key[strspn(key, "abcdefghijklmnopqrstuvwxyz0123456789_.-")] == '\0') {
+        kind = TUNE_SYSCTL;
+    }
+    if (kind < 0) die("config:%d: unknown [tuning] key '%s' (a sysctl such as net.core.rmem_max, cpu_governor, cpu_min_freq, wifi_powersave, thp, thp_defrag or socket_buffers)", line_no, key);
+    int on;
+    if (kind == TUNE_WIFI_PS && parse_bool(val, &on)) die("config:%d: invalid wifi_powersave '%s'", line_no, val);
+    if (!*val) die("config:%d: %s needs a value", line_no, key);
+    g_cfg.tuning = arena_grow(&g_cfg.arena, g_cfg.tuning, g_cfg.tuning_count, &g_cfg.tuning_cap, sizeof(tuning_t));
+    tuning_t *t = &g_cfg.tuning[g_cfg.tuning_count++];
+    t->kind = kind;
+    t->key = arena_strdup(&g_cfg.arena, key);
+    t->val = arena_strdup(&g_cfg.arena, val);
+}
+
 static int parse_general_kv(int line_no, const char *key, const char *val) {
     if (strcasecmp(key, "init_cmd") == 0) {
-        if (g_cfg.init_cmd_count >= MAX_CMDS) die("config:%d: too many init_cmd entries (max %d)", line_no, MAX_CMDS);
-        strncpy(g_cfg.init_cmds[g_cfg.init_cmd_count], val, sizeof(g_cfg.init_cmds[g_cfg.init_cmd_count])-1);
-        g_cfg.init_cmds[g_cfg.init_cmd_count][sizeof(g_cfg.init_cmds[g_cfg.init_cmd_count])-1] = '\0';
-        g_cfg.init_cmd_count++;
+        g_cfg.init_cmds = arena_grow(&g_cfg.arena, g_cfg.init_cmds, g_cfg.init_cmd_count, &g_cfg.init_cmd_cap, sizeof(hook_t));
+        g_cfg.init_cmds[g_cfg.init_cmd_count++] = (hook_t){ .cmd = arena_strdup(&g_cfg.arena, val), .group = "", .after = "" };
     } else if (strcasecmp(key, "cleanup_cmd") == 0) {
-        if (g_cfg.cleanup_cmd_count >= MAX_CMDS) die("config:%d: too many cleanup_cmd entries (max %d)", line_no, MAX_CMDS);
-        strncpy(g_cfg.cleanup_cmds[g_cfg.cleanup_cmd_count], val, sizeof(g_cfg.cleanup_cmds[g_cfg.cleanup_cmd_count])-1);
-        g_cfg.cleanup_cmds[g_cfg.cleanup_cmd_count][sizeof(g_cfg.cleanup_cmds[g_cfg.cleanup_cmd_count])-1] = '\0';
-        g_cfg.cleanup_cmd_count++;
+        g_cfg.cleanup_cmds = arena_grow(&g_cfg.arena, g_cfg.cleanup_cmds, g_cfg.cleanup_cmd_count, &g_cfg.cleanup_cmd_cap, sizeof(hook_t));
+        g_cfg.cleanup_cmds[g_cfg.cleanup_cmd_count++] = (hook_t){ .cmd = arena_strdup(&g_cfg.arena, val), .group = "", .after = "" };
+    } else if (strncasecmp(key, "init_cmd.", 9) == 0) {
+        parse_hook_attr(line_no, "init_cmd", g_cfg.init_cmds, g_cfg.init_cmd_count, key + 9, val);
+    } else if (strncasecmp(key, "cleanup_cmd.", 12) == 0) {
+        parse_hook_attr(line_no, "cleanup_cmd", g_cfg.cleanup_cmds, g_cfg.cleanup_cmd_count, key + 12, val);
     } else {
         return 0;
     }
@@ -201,34 +1193,275 @@ static int parse_general_kv(int line_no, const char *key, const char *val) {
     return 1;
 }
 
+/*
+ * type=udp_fanout runs the supervisor binary itself (fanout_main()), so restart=, cpu=,
+ * sched=, cgroups and health_udp=auto apply to it like to any other instance.
+ */
+static void fanout_command(instance_t *inst) {
+    static strbuf_t sb;
+    if (inst->cmd[0]) die("instance '%s': type=udp_fanout takes listen= and dest=, not cmd=", inst->name);
+    if (!inst->fanout_listen[0] || !inst->fanout_dest[0]) die("instance '%s': type=udp_fanout needs listen= and dest=", inst->name);
+    const char *colon = strrchr(inst->fanout_listen, ':');
+    sb_reset(&sb);
+    sb_puts(&sb, "/proc/self/exe --udp-fanout");
+    if (colon) sb_printf(&sb, " -c %.*s", (int)(colon - inst->fanout_listen), inst->fanout_listen);
+    sb_printf(&sb, " -u %s --report=%d%s %s", colon ? colon + 1 : inst->fanout_listen, inst->fanout_report_ms,
+              inst->fanout_gso ? " --gso" : "", inst->fanout_dest);
+    inst->cmd = arena_strdup(&g_cfg.arena, sb.buf);
+}
+
+/* type=link_probe runs probe_main() the same way; its PROBE reports feed stats=probe. */
+static void probe_command(instance_t *inst) {
+    static strbuf_t sb;
+    if (inst->cmd[0]) die("instance '%s': type=link_probe takes listen= and dest=, not cmd=", inst->name);
+    if (!inst->fanout_listen[0]) die("instance '%s': type=link_probe needs listen=", inst->name);
+    if (!inst->probe_echo && !inst->fanout_dest[0]) die("instance '%s': type=link_probe needs dest= (or mode=echo)", inst->name);
+    if (strchr(inst->fanout_dest, ',')) die("instance '%s': type=link_probe takes a single dest=", inst->name);
+    const char *colon = strrchr(inst->fanout_listen, ':');
+    sb_reset(&sb);
+    sb_puts(&sb, "/proc/self/exe --link-probe");
+    if (colon) sb_printf(&sb, " -c %.*s", (int)(colon - inst->fanout_listen), inst->fanout_listen);
+    sb_printf(&sb, " -u %s --report=%d --rate=%d --size=%d%s %s", colon ? colon + 1 : inst->fanout_listen,
+              inst->fanout_report_ms, inst->probe_rate, inst->probe_size, inst->probe_echo ? " --echo" : "", inst->fanout_dest);
+    inst->cmd = arena_strdup(&g_cfg.arena, sb.buf);
+    if (!inst->probe_echo && !inst->stats_kind) inst->stats_kind = STATS_PROBE;
+}
+
 static void parse_instance_kv(instance_t *inst, int line_no, const char *key, const char *val) {
     if (strcasecmp(key, "cmd") == 0) {
-        strncpy(inst->cmd, val, sizeof(inst->cmd)-1);
+        inst->cmd = arena_strdup(&g_cfg.arena, val);
     } else if (strcasecmp(key, "quiet") == 0) {
         if (parse_bool(val, &inst->quiet)) die("config:%d: invalid quiet value '%s'", line_no, val);
     } else if (strcasecmp(key, "cpu") == 0) {
-        if (parse_int(val, &inst->cpu_core)) die("config:%d: invalid cpu value '%s'", line_no, val);
-        if (inst->cpu_core < 0) die("config:%d: cpu core must be non-negative", line_no);
-        if (inst->cpu_core >= CPU_SETSIZE) die("config:%d: cpu core %d exceeds maximum %d", line_no, inst->cpu_core, CPU_SETSIZE - 1);
+        inst->cpu_auto = strcasecmp(val, "auto") == 0;
+        if (inst->cpu_auto) CPU_ZERO(&inst->cpus);
+        else if (parse_cpu_list(val, &inst->cpus)) die("config:%d: invalid cpu value '%s' (expected e.g. 2 or 0-1,3)", line_no, val);
+        strncpy(inst->cpu_list, val, sizeof(inst->cpu_list)-1);
+    } else if (strcasecmp(key, "latency") == 0) {
+        if (strcasecmp(val, "critical") == 0) inst->latency_critical = 1;
+        else if (strcasecmp(val, "normal") == 0) inst->latency_critical = 0;
+        else die("config:%d: invalid latency '%s' (expected critical or normal)", line_no, val);
+    } else if (strcasecmp(key, "sched") == 0) {
+        // policy[:priority]; fifo and rr need a priority
+        static const struct { const char *name; int policy; } k_policies[] = {
+            { "other", SCHED_OTHER }, { "batch", SCHED_BATCH }, { "idle", SCHED_IDLE },
+            { "fifo", SCHED_FIFO }, { "rr", SCHED_RR },
+        };
+        char policy[16];
+        const char *colon = strchr(val, ':');
+        snprintf(policy, sizeof(policy), "%.*s", colon ? (int)(colon - val) : (int)strlen(val), val);
+        inst->sched_policy = -1;
+        for (size_t i = 0; i < sizeof(k_policies) / sizeof(k_policies[0]); i++) {
+            if (strcasecmp(policy, k_policies[i].name) == 0) inst->sched_policy = k_policies[i].policy;
+        }
+        if (inst->sched_policy < 0) die("config:%d: invalid sched policy '%s' (expected other, batch, idle, fifo or rr)", line_no, policy);
+        int rt = inst->sched_policy == SCHED_FIFO || inst->sched_policy == SCHED_RR;
+        inst->sched_priority = 0;
+        if (rt && (!colon || parse_int(colon + 1, &inst->sched_priority) || inst->sched_priority < 1 || inst->sched_priority > 99)) {
+            die("config:%d: sched=%s needs a priority 1..99, e.g. %s:50", line_no, policy, policy);
+        }
+        if (!rt && colon) die("config:%d: sched=%s takes no priority (use nice=)", line_no, policy);
+    } else if (strcasecmp(key, "nice") == 0) {
+        if (parse_int(val, &inst->nice) || inst->nice < -20 || inst->nice > 19) die("config:%d: nice must be -20..19 (got '%s')", line_no, val);
+        inst->nice_set = 1;
+    } else if (strcasecmp(key, "ioprio") == 0) {
+        // rt[:0-7], be[:0-7] or idle
+        int cls = 0, level = 4;
+        if (strncasecmp(val, "rt", 2) == 0) cls = 1;
+        else if (strncasecmp(val, "be", 2) == 0) cls = 2;
+        else if (strcasecmp(val, "idle") == 0) cls = 3;
+        const char *lvl = cls == 3 ? "" : val + 2;
+        if (cls == 0 || (*lvl && (*lvl != ':' || parse_int(lvl + 1, &level) || level < 0 || level > 7))) {
+            die("config:%d: invalid ioprio '%s' (expected rt[:0-7], be[:0-7] or idle)", line_no, val);
+        }
+        inst->ioprio = (cls << IOPRIO_CLASS_SHIFT) | (cls == 3 ? 0 : level);
+    } else if (strcasecmp(key, "irq_affinity") == 0) {
+        int on = 0;
+        inst->irq_nics = "";
+        if (parse_bool(val, &on) != 0) {
+            on = 1;
+            inst->irq_nics = arena_strdup(&g_cfg.arena, val);
+        }
+        inst->irq_affinity = on;
+    } else if (strcasecmp(key, "cpu_weight") == 0) {
+        if (parse_int(val, &inst->cpu_weight) || inst->cpu_weight < 1 || inst->cpu_weight > 10000) {
+            die("config:%d: cpu_weight must be 1..10000 (got '%s')", line_no, val);
+        }
+    } else if (strcasecmp(key, "cpu_max") == 0) {
+        // "max", "<percent>%" of one CPU, or a raw "<quota> <period>" in microseconds
+        int pct;
+        size_t len = strlen(val);
+        if (len > 1 && val[len - 1] == '%') {
+            char num[16];
+            snprintf(num, sizeof(num), "%.*s", (int)(len - 1), val);
+            if (parse_int(num, &pct) || pct < 1) die("config:%d: invalid cpu_max '%s'", line_no, val);
+            snprintf(inst->cpu_max, sizeof(inst->cpu_max), "%ld 100000", (long)pct * 1000);
+        } else {
+            char quota[16];
+            unsigned long period = 1;
+            char tail;
+            int n = sscanf(val, "%15s %lu %c", quota, &period, &tail);
+            if ((n != 1 && n != 2) || period == 0 ||
+                (strcasecmp(quota, "max") != 0 && (parse_int(quota, &pct) || pct < 1))) {
+                die("config:%d: invalid cpu_max '%s' (expected max, <n>%% or '<quota> [<period>]')", line_no, val);
+            }
+            snprintf(inst->cpu_max, sizeof(inst->cpu_max), "%s", val);
+        }
+    } else if (strcasecmp(key, "memory_max") == 0) {
+        if (parse_size(val, inst->memory_max, sizeof(inst->memory_max))) die("config:%d: invalid memory_max '%s'", line_no, val);
+    } else if (strcasecmp(key, "memory_high") == 0) {
+        if (parse_size(val, inst->memory_high, sizeof(inst->memory_high))) die("config:%d: invalid memory_high '%s'", line_no, val);
+    } else if (strcasecmp(key, "cpuset") == 0) {
+        if (strspn(val, "0123456789,-") != strlen(val) || !*val) die("config:%d: invalid cpuset '%s'", line_no, val);
+        strncpy(inst->cpuset, val, sizeof(inst->cpuset)-1);
+    } else if (strcasecmp(key, "stop_signal") == 0) {
+        if (parse_signal(val, &inst->stop_signal)) die("config:%d: invalid stop_signal '%s'", line_no, val);
+    } else if (strcasecmp(key, "stop_timeout") == 0) {
+        if (parse_duration_ms(val, &inst->stop_timeout_ms)) die("config:%d: invalid stop_timeout '%s'", line_no, val);
+    } else if (strcasecmp(key, "restart") == 0) {
+        if (strcasecmp(val, "always") == 0) inst->restart_policy = RESTART_ALWAYS;
+        else if (strcasecmp(val, "on-failure") == 0) inst->restart_policy = RESTART_ON_FAILURE;
+        else if (strcasecmp(val, "never") == 0) inst->restart_policy = RESTART_NEVER;
+        else die("config:%d: invalid restart policy '%s' (always|on-failure|never)", line_no, val);
+    } else if (strcasecmp(key, "restart_backoff") == 0) {
+        if (parse_duration_ms(val, &inst->backoff_ms)) die("config:%d: invalid restart_backoff '%s'", line_no, val);
+    } else if (strcasecmp(key, "restart_backoff_max") == 0) {
+        if (parse_duration_ms(val, &inst->backoff_max_ms)) die("config:%d: invalid restart_backoff_max '%s'", line_no, val);
+    } else if (strcasecmp(key, "restart_burst") == 0) {
+        if (parse_int(val, &inst->restart_burst) || inst->restart_burst < 0) die("config:%d: invalid restart_burst '%s'", line_no, val);
+    } else if (strcasecmp(key, "restart_interval") == 0) {
+        if (parse_duration_ms(val, &inst->restart_interval_ms)) die("config:%d: invalid restart_interval '%s'", line_no, val);
+    } else if (strcasecmp(key, "shell") == 0) {
+        if (parse_bool(val, &inst->shell)) die("config:%d: invalid shell value '%s'", line_no, val);
+    } else if (strcasecmp(key, "group") == 0) {
+        strncpy(inst->group, val, sizeof(inst->group)-1);
+    } else if (strcasecmp(key, "stats") == 0) {
+        int on = 1;
+        if (strcasecmp(val, "wfb") == 0) inst->stats_kind = STATS_WFB_AUTO;
+        else if (strcasecmp(val, "wfb_rx") == 0) inst->stats_kind = STATS_WFB_RX;
+        else if (strcasecmp(val, "wfb_tx") == 0) inst->stats_kind = STATS_WFB_TX;
+        else if (parse_bool(val, &on) == 0 && !on) inst->stats_kind = STATS_NONE;
+        else die("config:%d: invalid stats value '%s' (expected wfb, wfb_rx, wfb_tx or no)", line_no, val);
+    } else if (strcasecmp(key, "health_udp") == 0) {
+        // auto (-c/-u of the cmd), [host:]port or no
+        int on = 1;
+        const char *colon = strrchr(val, ':');
+        inst->health_addr = 0;
+        if (strcasecmp(val, "auto") == 0) {
+            inst->health_udp = 2;
+        } else if (parse_bool(val, &on) == 0 && !on) {
+            inst->health_udp = 0;
+        } else {
+            char host[64];
+            snprintf(host, sizeof(host), "%.*s", colon ? (int)(colon - val) : 0, val);
+            if (parse_int(colon ? colon + 1 : val, &inst->health_port) || inst->health_port < 1 || inst->health_port > 65535 ||
+                (colon && inet_pton(AF_INET, host, &inst->health_addr) != 1)) {
+                die("config:%d: invalid health_udp '%s' (expected auto, <port> or <ipv4>:<port>)", line_no, val);
+            }
+            inst->health_udp = 1;
+        }
+    } else if (strcasecmp(key, "health_min_pps") == 0) {
+        if (parse_int(val, &inst->health_min_pps) || inst->health_min_pps < 1) die("config:%d: invalid health_min_pps '%s'", line_no, val);
+    } else if (strcasecmp(key, "health_timeout") == 0) {
+        if (parse_duration_ms(val, &inst->health_timeout_ms) || inst->health_timeout_ms < HEALTH_TICK_MS) {
+            die("config:%d: health_timeout must be at least %d ms (got '%s')", line_no, HEALTH_TICK_MS, val);
+        }
+    } else if (strcasecmp(key, "health_stats") == 0) {
+        if (parse_duration_ms(val, &inst->health_stats_ms)) die("config:%d: invalid health_stats '%s'", line_no, val);
+    } else if (strcasecmp(key, "health_grace") == 0) {
+        if (parse_duration_ms(val, &inst->health_grace_ms)) die("config:%d: invalid health_grace '%s'", line_no, val);
+    } else if (strcasecmp(key, "type") == 0) {
+        inst->fanout = strcasecmp(val, "udp_fanout") == 0;
+        inst->probe = strcasecmp(val, "link_probe") == 0;
+        if (!inst->fanout && !inst->probe && strcasecmp(val, "exec") != 0) {
+            die("config:%d: invalid type '%s' (expected exec, udp_fanout or link_probe)", line_no, val);
+        }
+    } else if (strcasecmp(key, "listen") == 0) {
+        // [ipv4:]port, taken apart again by the child and by health_udp=auto
+        const char *colon = strrchr(val, ':');
+        char host[64];
+        int port;
+        snprintf(host, sizeof(host), "%.*s", colon ? (int)(colon - val) : 0, val);
+        struct in_addr addr;
+        if (parse_int(colon ? colon + 1 : val, &port) || port < 1 || port > 65535 || (colon && inet_pton(AF_INET, host, &addr) != 1)) {
+            die("config:%d: invalid listen '%s' (expected <port> or <ipv4>:<port>)", line_no, val);
+        }
+        inst->fanout_listen = arena_strdup(&g_cfg.arena, val);
+    } else if (strcasecmp(key, "dest") == 0) {
+        inst->fanout_dest = arena_strdup(&g_cfg.arena, val);
+    } else if (strcasecmp(key, "gso") == 0) {
+        if (parse_bool(val, &inst->fanout_gso)) die("config:%d: invalid gso value '%s'", line_no, val);
+    } else if (strcasecmp(key, "report") == 0) {
+        if (parse_duration_ms(val, &inst->fanout_report_ms)) die("config:%d: invalid report '%s'", line_no, val);
+    } else if (strcasecmp(key, "mode") == 0) {
+        if (strcasecmp(val, "echo") == 0) inst->probe_echo = 1;
+        else if (strcasecmp(val, "measure") == 0) inst->probe_echo = 0;
+        else die("config:%d: invalid mode '%s' (expected measure or echo)", line_no, val);
+    } else if (strcasecmp(key, "rate") == 0) {
+        if (parse_int(val, &inst->probe_rate) || inst->probe_rate < 1 || inst->probe_rate > 1000) {
+            die("config:%d: invalid rate '%s' (1-1000 packets per second)", line_no, val);
+        }
+    } else if (strcasecmp(key, "size") == 0) {
+        if (parse_int(val, &inst->probe_size) || inst->probe_size < 32 || inst->probe_size > 1472) {
+            die("config:%d: invalid size '%s' (32-1472 bytes)", line_no, val);
+        }
+    } else if (strcasecmp(key, "after") == 0) {
+        inst->after = arena_strdup(&g_cfg.arena, val);
+    } else if (strcasecmp(key, "requires") == 0) {
+        inst->requires = arena_strdup(&g_cfg.arena, val);
+    } else if (strcasecmp(key, "ready") == 0) {
+        // udp:<port>, tcp:<port>, iface:<name>, file:<path> or log:<regex>
+        static const char *const k_kinds[] = { "", "udp", "tcp", "iface", "file", "log" };
+        const char *colon = strchr(val, ':');
+        inst->ready_kind = READY_NONE;
+        for (int k = 1; colon && k < (int)(sizeof(k_kinds) / sizeof(k_kinds[0])); k++) {
+            if (strlen(k_kinds[k]) == (size_t)(colon - val) && strncasecmp(val, k_kinds[k], (size_t)(colon - val)) == 0) inst->ready_kind = k;
+        }
+        if (inst->ready_kind == READY_NONE || !colon[1]) {
+            die("config:%d: invalid ready '%s' (expected udp:<port>, tcp:<port>, iface:<name>, file:<path> or log:<regex>)", line_no, val);
+        }
+        inst->ready_arg = arena_strdup(&g_cfg.arena, colon + 1);
+        if (inst->ready_kind == READY_UDP || inst->ready_kind == READY_TCP) {
+            if (parse_int(colon + 1, &inst->ready_port) || inst->ready_port < 1 || inst->ready_port > 65535) {
+                die("config:%d: invalid ready port '%s'", line_no, colon + 1);
+            }
+        } else if (inst->ready_kind == READY_LOG) {
+            regex_t re;
+            if (regcomp(&re, colon + 1, REG_EXTENDED | REG_NOSUB) != 0) die("config:%d: invalid ready regex '%s'", line_no, colon + 1);
+            regfree(&re);
+        }
+    } else if (strcasecmp(key, "ready_timeout") == 0) {
+        if (parse_duration_ms(val, &inst->ready_timeout_ms) || inst->ready_timeout_ms < 1) die("config:%d: invalid ready_timeout '%s'", line_no, val);
+    } else if (strcasecmp(key, "nics") == 0) {
+        if (!strchr(inst->name, '@')) die("config:%d: nics= is only valid in a template section such as [instance %s@*]", line_no, inst->name);
+        inst->nics = arena_strdup(&g_cfg.arena, val);
     } else {
         die("config:%d: unknown key '%s' in instance '%s'", line_no, key, inst->name);
     }
 }
 
 static void load_config(const char *path) {
+    uint64_t trace_start = trace_now();
+    // Drops the config this one replaces: the previous generation, or a stale shadow on hot reload.
+    arena_release(&g_cfg.arena);
     init_defaults();
+    g_instances = NULL;
     g_instance_count = 0;
-    memset(g_instances, 0, sizeof(g_instances));
+    g_instance_cap = 0;
 
-    FILE *f = fopen(path, "r");
+    // File and line buffer outlive the call so that a load cut short by config_try() leaks neither.
+    static FILE *f;
+    static char *linebuf;
+    static size_t linecap;
+    if (f) fclose(f);
+    f = fopen(path, "r");
     if (!f) die("cannot open config '%s': %s", path, strerror(errno));
 
-    char linebuf[512];
     int line_no = 0;
-    enum { SEC_NONE, SEC_GENERAL, SEC_PARAMETERS, SEC_INSTANCE } section = SEC_NONE;
+    enum { SEC_NONE, SEC_GENERAL, SEC_PARAMETERS, SEC_TUNING, SEC_INSTANCE } section = SEC_NONE;
     instance_t *current_inst = NULL;
 
-    while (fgets(linebuf, sizeof(linebuf), f)) {
+    while (getline(&linebuf, &linecap, f) >= 0) {
         line_no++;
         char *line = linebuf;
         char *nl = strchr(line, '\n');
@@ -248,6 +1481,9 @@ static void load_config(const char *path) {
             } else if (strcasecmp(secname, "parameters") == 0) {
                 section = SEC_PARAMETERS;
                 current_inst = NULL;
+            } else if (strcasecmp(secname, "tuning") == 0) {
+                section = SEC_TUNING;
+                current_inst = NULL;
             } else if (strncasecmp(secname, "instance", 8) == 0) {
                 char *p = secname + 8;
                 while (*p && isspace((unsigned char)*p)) p++;
@@ -273,6 +1509,8 @@ static void load_config(const char *path) {
             }
         } else if (section == SEC_PARAMETERS) {
             parse_parameter_kv(line_no, key, val);
+        } else if (section == SEC_TUNING) {
+            parse_tuning_kv(line_no, key, val);
         } else if (section == SEC_INSTANCE) {
             if (!current_inst) die("config:%d: internal error: no current instance", line_no);
             parse_instance_kv(current_inst, line_no, key, val);
@@ -282,347 +1520,6588 @@ static void load_config(const char *path) {
     }
 
     fclose(f);
+    f = NULL;
+    check_hooks("init_cmd", g_cfg.init_cmds, g_cfg.init_cmd_count);
+    check_hooks("cleanup_cmd", g_cfg.cleanup_cmds, g_cfg.cleanup_cmd_count);
 
+    for (int i = 0; i < g_override_count; i++) store_param_kv(g_overrides[i].key, g_overrides[i].val);
     apply_runtime_settings();
 
-    if (g_instance_count == 0) die("no instances defined in config");
+    if (g_instance_count == 0 && g_cfg.template_count == 0) die("no instances defined in config");
 
-    for (int i = 0; i < g_instance_count; i++) {
-        if (!g_instances[i].cmd[0]) {
-            die("instance '%s': cmd is required", g_instances[i].name);
+    for (int i = 0; i < g_instance_count + g_cfg.template_count; i++) {
+        instance_t *inst = i < g_instance_count ? &g_instances[i] : &g_cfg.templates[i - g_instance_count];
+        if (inst->fanout) fanout_command(inst);
+        else if (inst->probe) probe_command(inst);
+        else if (inst->fanout_listen[0] || inst->fanout_dest[0]) die("instance '%s': listen= and dest= need type=udp_fanout or type=link_probe", inst->name);
+        if (!inst->probe && (inst->probe_echo || inst->probe_rate != DEFAULT_PROBE_RATE || inst->probe_size != DEFAULT_PROBE_SIZE)) {
+            die("instance '%s': mode=, rate= and size= need type=link_probe", inst->name);
+        }
+        if (!inst->cmd[0]) die("instance '%s': cmd is required", inst->name);
+        if (inst->stats_kind == STATS_WFB_AUTO) {
+            if (strstr(inst->cmd, "wfb_tx")) inst->stats_kind = STATS_WFB_TX;
+            else if (strstr(inst->cmd, "wfb_rx")) inst->stats_kind = STATS_WFB_RX;
+            else die("instance '%s': stats=wfb needs wfb_rx or wfb_tx in cmd (or use stats=wfb_rx|wfb_tx)", inst->name);
+        }
+        if (inst->irq_affinity && (!inst->cpu_list[0] || inst->cpu_auto)) die("instance '%s': irq_affinity needs a fixed cpu=", inst->name);
+        if (inst->latency_critical && !inst->cpu_auto) die("instance '%s': latency=critical needs cpu=auto", inst->name);
+        if (inst->health_stats_ms && !inst->stats_kind) die("instance '%s': health_stats needs stats=", inst->name);
+        if (inst->nics) {
+            static strbuf_t sb;
+            tmpl_t t;
+            tmpl_compile(&t, inst->nics);
+            inst->nics = arena_strdup(&g_cfg.arena, tmpl_expand(&t, &sb));
+        }
+        // Any resource key implies cgroup=yes.
+        if (inst->cpu_weight || inst->cpu_max[0] || inst->memory_max[0] || inst->memory_high[0] || inst->cpuset[0]) {
+            g_cfg.cgroup = 1;
         }
     }
-}
-
-static void reload_config_and_init(const char *config_path) {
-    load_config(config_path);
-    run_commands(g_cfg.init_cmds, g_cfg.init_cmd_count, "init");
+    // The controller adds mcs/fec_k/fec_n, so commands are compiled once every parameter exists.
+    load_adapt_settings();
+    compile_commands();
+    adapt_pick_targets();
+    // Templates expand for the NICs present now; hotplug adds the others as they appear.
+    templates_expand();
+    check_dependencies();
+    trace_span(trace_start, "load_config", "%s: %d instances, %d parameters", path, g_instance_count, g_cfg.param_count);
 }
 
 /* Hooks */
 
-static void expand_placeholders(const char *in, char *out, size_t out_len) {
-    size_t pos = 0;
-    size_t out_pos = 0;
-    size_t in_len = strlen(in);
-    while (pos < in_len) {
-        int matched = 0;
-        if (in[pos] == '$') {
-            for (int i = 0; i < g_cfg.param_count; i++) {
-                size_t klen = strlen(g_cfg.param_placeholders[i]);
-                if (klen == 0) continue;
-
-                if (strncasecmp(in + pos, g_cfg.param_placeholders[i], klen) == 0) {
-                    size_t vlen = strlen(g_cfg.param_vals[i]);
-                    if (out_pos + vlen >= out_len) die("expanded command too long");
-                    memcpy(out + out_pos, g_cfg.param_vals[i], vlen);
-                    out_pos += vlen;
-                    pos += klen;
-                    matched = 1;
-                    break;
-                }
+static int is_param_char(char c) {
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+/*
+ * Compile s against the parameter table. "${name}" names a parameter exactly; "$name" takes
+ * the longest parameter that prefixes the word characters after the '$', so $mcs_tunnel is
+ * not $mcs followed by "_tunnel". Unknown names stay literal for the shell or program.
+ * The template points into s, which must live in the same arena.
+ */
+static void tmpl_compile(tmpl_t *t, const char *s) {
+    int max = 1;
+    for (const char *p = s; *p; p++) max += (*p == '$') * 2;
+    t->seg = arena_alloc(&g_cfg.arena, (size_t)max * sizeof(tmpl_seg_t));
+    t->count = 0;
+    const char *lit = s, *p = s;
+    while (*p) {
+        if (*p != '$') {
+            p++;
+            continue;
+        }
+        int idx = -1;
+        const char *end = NULL;
+        if (p[1] == '{') {
+            const char *close = strchr(p + 2, '}');
+            if (close) {
+                idx = param_find(p + 2, (size_t)(close - p - 2));
+                end = close + 1;
+            }
+        } else {
+            size_t run = 0;
+            while (is_param_char(p[1 + run])) run++;
+            for (size_t len = run; len > 0 && idx < 0; len--) {
+                idx = param_find(p + 1, len);
+                end = p + 1 + len;
             }
         }
-        if (!matched) {
-            if (out_pos + 1 >= out_len) die("expanded command too long");
-            out[out_pos++] = in[pos++];
+        if (idx < 0) {
+            p++;
+            continue;
         }
+        if (p > lit) t->seg[t->count++] = (tmpl_seg_t){ lit, (size_t)(p - lit), -1 };
+        t->seg[t->count++] = (tmpl_seg_t){ NULL, 0, idx };
+        p = lit = end;
     }
-    if (out_pos >= out_len) die("expanded command too long");
-    out[out_pos] = '\0';
+    if (p > lit) t->seg[t->count++] = (tmpl_seg_t){ lit, (size_t)(p - lit), -1 };
 }
 
-static const char *get_param_value(const char *key) {
-    for (int i = 0; i < g_cfg.param_count; i++) {
-        if (strcasecmp(g_cfg.param_keys[i], key) == 0) {
-            return g_cfg.param_vals[i];
-        }
+static void tmpl_render(const tmpl_t *t, strbuf_t *out) {
+    for (int i = 0; i < t->count; i++) {
+        const tmpl_seg_t *seg = &t->seg[i];
+        if (seg->text) sb_append(out, seg->text, seg->len);
+        else sb_puts(out, g_cfg.params[seg->param].val);
     }
-    return NULL;
 }
 
-static int get_param_bool(const char *key, int default_val) {
-    const char *val = get_param_value(key);
-    if (!val) return default_val;
+/* Renders into sb, replacing what it held; the result stays valid until sb is reused. */
+static const char *tmpl_expand(const tmpl_t *t, strbuf_t *sb) {
+    sb_reset(sb);
+    tmpl_render(t, sb);
+    return sb->buf;
+}
 
-    int parsed = 0;
-    if (parse_bool(val, &parsed)) {
+static int tmpl_uses(const tmpl_t *t, int param) {
+    for (int i = 0; i < t->count; i++) {
+        if (!t->seg[i].text && t->seg[i].param == param) return 1;
+    }
+    return 0;
+}
+
+static const char *get_param_value(const char *key) {
+    int idx = param_find(key, strlen(key));
+    return idx < 0 ? NULL : g_cfg.params[idx].val;
+}
+
+static int get_param_bool(const char *key, int default_val) {
+    const char *val = get_param_value(key);
+    if (!val) return default_val;
+
+    int parsed = 0;
+    if (parse_bool(val, &parsed)) {
         die("config: invalid boolean value '%s' for %s", val, key);
     }
-    return parsed;
+    return parsed;
+}
+
+static int get_param_int(const char *key, int default_val) {
+    const char *val = get_param_value(key);
+    if (!val) return default_val;
+
+    int parsed = 0;
+    if (parse_int(val, &parsed)) {
+        die("config: invalid integer value '%s' for %s", val, key);
+    }
+    return parsed;
+}
+
+static void apply_runtime_settings(void) {
+    g_cfg.restart_enabled = get_param_bool("restart", DEFAULT_RESTART_ENABLED);
+    g_cfg.restart_delay = get_param_int("restart_delay", DEFAULT_RESTART_DELAY);
+    if (g_cfg.restart_delay < 0) {
+        die("config: restart_delay must be non-negative (got %d)", g_cfg.restart_delay);
+    }
+    g_cfg.restart_delay_max = get_param_int("restart_delay_max", g_cfg.restart_delay);
+    if (g_cfg.restart_delay_max < g_cfg.restart_delay) {
+        die("config: restart_delay_max (%d) must be at least restart_delay (%d)",
+            g_cfg.restart_delay_max, g_cfg.restart_delay);
+    }
+    g_cfg.restart_max = get_param_int("restart_max", DEFAULT_RESTART_MAX);
+    if (g_cfg.restart_max < 0) {
+        die("config: restart_max must be non-negative (got %d)", g_cfg.restart_max);
+    }
+    const char *warm_delay = get_param_value("warm_restart_delay");
+    g_cfg.warm_restart_delay_ms = 0;
+    if (warm_delay && parse_duration_ms(warm_delay, &g_cfg.warm_restart_delay_ms)) {
+        die("config: invalid warm_restart_delay '%s'", warm_delay);
+    }
+
+    // Same defaults as monitor.sh/shaper.sh; only validated when a native stage is in use.
+    g_cfg.monitor_setup = get_param_bool("monitor_setup", 0);
+    g_cfg.shaper_setup = get_param_bool("shaper_setup", 0);
+    g_cfg.cgroup = get_param_bool("cgroup", 0);
+    const char *cg_root = get_param_value("cgroup_root");
+    g_cfg.cgroup_root = arena_strdup(&g_cfg.arena, cg_root ? cg_root : "");
+    if (cg_root && cg_root[0] != '/') die("config: cgroup_root must be an absolute path (got '%s')", cg_root);
+
+    g_cfg.log_rate = get_param_int("log_rate", DEFAULT_LOG_RATE);
+    if (g_cfg.log_rate < 0) die("config: log_rate must be non-negative (got %d)", g_cfg.log_rate);
+    const char *log_file = get_param_value("log_file");
+    g_cfg.log_file = arena_strdup(&g_cfg.arena, log_file ? log_file : "");
+    const char *flight = get_param_value("flight_recorder");
+    int flight_on = 1;
+    if (flight && parse_bool(flight, &flight_on) == 0) flight = NULL;  // yes/no rather than a path
+    g_cfg.flight_recorder = arena_strdup(&g_cfg.arena, !flight_on ? "" : flight ? flight : DEFAULT_FLIGHT_RECORDER);
+    const char *window = get_param_value("flight_window");
+    g_cfg.flight_window_ms = DEFAULT_FLIGHT_WINDOW_MS;
+    if (window && (parse_duration_ms(window, &g_cfg.flight_window_ms) || g_cfg.flight_window_ms <= 0)) {
+        die("config: invalid flight_window '%s'", window);
+    }
+    if (g_cfg.monitor_setup || g_cfg.shaper_setup) {
+        const char *bw = get_param_value("BANDWIDTH");
+        if (bw && strncasecmp(bw, "HT", 2) == 0) bw += 2;
+        if (!bw) g_cfg.wifi_bandwidth = 20;
+        else if (parse_int(bw, &g_cfg.wifi_bandwidth)) die("config: invalid BANDWIDTH '%s'", bw);
+        if (bandwidth_to_width(g_cfg.wifi_bandwidth) < 0) die("config: unsupported BANDWIDTH %d", g_cfg.wifi_bandwidth);
+    }
+    if (g_cfg.monitor_setup) {
+        const char *region = get_param_value("REGION");
+        if (!region) region = "US";
+        if (strlen(region) != 2) die("config: REGION must be a two-letter country code (got '%s')", region);
+        snprintf(g_cfg.wifi_region, sizeof(g_cfg.wifi_region), "%c%c",
+                 toupper((unsigned char)region[0]), toupper((unsigned char)region[1]));
+        g_cfg.wifi_channel = get_param_int("CHANNEL", 161);
+        g_cfg.wifi_txpower = get_param_int("TXPOWER", 500);
+        int freq = channel_to_freq(g_cfg.wifi_channel);
+        if (freq < 0) die("config: unsupported CHANNEL %d", g_cfg.wifi_channel);
+        if (channel_center_freq(g_cfg.wifi_channel, freq, g_cfg.wifi_bandwidth) < 0) {
+            die("config: CHANNEL %d cannot be used with BANDWIDTH %d", g_cfg.wifi_channel, g_cfg.wifi_bandwidth);
+        }
+    }
+    if (g_cfg.shaper_setup) {
+        g_cfg.shaper_mcs = get_param_int("mcs", 2);
+        g_cfg.shaper_nss = get_param_int("nss", 0);
+        g_cfg.shaper_sgi = get_param_bool("short_gi", 0);
+        g_cfg.shaper_efficiency = get_param_int("shaper_efficiency", 65);
+        g_cfg.shaper_share[0] = get_param_int("shaper_share_video", 80);
+        g_cfg.shaper_share[1] = get_param_int("shaper_share_telemetry", 10);
+        g_cfg.shaper_share[2] = get_param_int("shaper_share_tunnel", 10);
+        if (phy_rate_kbit(g_cfg.shaper_mcs, g_cfg.shaper_nss, g_cfg.wifi_bandwidth, g_cfg.shaper_sgi) < 0) {
+            die("config: unsupported mcs %d / nss %d for the shaper", g_cfg.shaper_mcs, g_cfg.shaper_nss);
+        }
+        if (g_cfg.shaper_efficiency <= 0 || g_cfg.shaper_efficiency > 100) {
+            die("config: shaper_efficiency must be 1..100 (got %d)", g_cfg.shaper_efficiency);
+        }
+        int total = 0;
+        for (int c = 0; c < 3; c++) {
+            if (g_cfg.shaper_share[c] < 0) die("config: shaper shares must be non-negative");
+            total += g_cfg.shaper_share[c];
+        }
+        if (total > 100) die("config: shaper shares add up to %d%% (max 100)", total);
+    }
+}
+
+static const char *wrap_exec(const char *cmd, strbuf_t *out) {
+    sb_reset(out);
+    if (strncmp(cmd, "exec ", 5) != 0) sb_puts(out, "exec ");
+    sb_puts(out, cmd);
+    return out->buf;
+}
+
+#define DEFAULT_HOOK_TIMEOUT_MS 60000
+#define HOOK_POLL_MS 50         // exit polling on kernels without pidfd_open
+
+enum { HOOK_WAITING, HOOK_RUNNING, HOOK_DONE };
+
+/* One hook of a run_hooks() pass. */
+typedef struct {
+    int      state;
+    pid_t    pid;
+    ev_watch_t pid_watch;    // only wakes the loop; the exit is reaped there
+    uint64_t start_us;
+    uint64_t deadline_us;    // 0 = no timeout
+    int      killed;         // SIGKILLed by us: timeout, abort or shutdown
+    int      timed_out;
+} hook_run_t;
+
+/* Has every hook that hooks[i] is ordered after finished? */
+static int hook_ready(const hook_t *hooks, const hook_run_t *runs, int i) {
+    for (int j = 0; j < i; j++) {
+        if (runs[j].state == HOOK_DONE) continue;
+        if (!hooks[i].group[0] || !hooks[j].group[0] || list_has(hooks[i].after, hooks[j].group)) return 0;
+    }
+    return 1;
+}
+
+static void on_hook_exit(ev_watch_t *w, uint32_t events) {
+    (void)w;
+    (void)events;
+}
+
+static int hook_start(const hook_t *hook, hook_run_t *run, const char *expanded, const char *phase) {
+    static strbuf_t exec_wrapped;
+    const char *cmd = wrap_exec(expanded, &exec_wrapped);
+    fprintf(stderr, "wfb_supervisor: running %s command: %s\n", phase, cmd);
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "wfb_supervisor: %s command fork failed: %s\n", phase, strerror(errno));
+        return -1;
+    }
+    if (pid == 0) {
+        setpgid(0, 0);  // a timeout kills what the hook started along with it
+        sigprocmask(SIG_SETMASK, &g_orig_sigmask, NULL);
+        execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+        fprintf(stderr, "wfb_supervisor: exec failed for %s command '%s': %s\n", phase, cmd, strerror(errno));
+        _exit(127);
+    }
+    setpgid(pid, pid);
+    int timeout_ms = hook->timeout_ms ? hook->timeout_ms : DEFAULT_HOOK_TIMEOUT_MS;
+    run->state = HOOK_RUNNING;
+    run->pid = pid;
+    run->start_us = now_us();
+    run->deadline_us = timeout_ms > 0 ? run->start_us + (uint64_t)timeout_ms * 1000u : 0;
+    run->pid_watch.fd = (int)syscall(SYS_pidfd_open, pid, 0);
+    run->pid_watch.cb = on_hook_exit;
+    run->pid_watch.ctx = run;
+    if (run->pid_watch.fd >= 0) ev_add(&run->pid_watch, EPOLLIN);
+    return 0;
+}
+
+/*
+ * Hooks run in file order, except that one with parallel_group= waits only for the ungrouped
+ * hooks before it and the groups named in its after=, and runs alongside everything else.
+ * Exits and timeouts are picked up by the event loop, so signals and the control socket are
+ * served meanwhile. A shutdown cuts init short; cleanup runs on, bounded by its timeouts.
+ * A failed init hook is fatal. A failed cleanup hook is logged and the others still run, so
+ * whatever they undo is not left behind; the count of such failures is returned.
+ * cmds[i] is the expanded command, NULL to skip that hook.
+ */
+static int run_hooks(const hook_t *hooks, const char *const *cmds, int count, const char *phase) {
+    hook_run_t *runs = calloc((size_t)count, sizeof(*runs));
+    if (!runs && count) die("out of memory");
+    int is_init = strcmp(phase, "init") == 0;
+    int left = 0, skipped = 0, failed = -1, cleanup_failed = 0;
+    for (int i = 0; i < count; i++) {
+        runs[i].pid_watch.fd = -1;
+        if (cmds[i]) left++;
+        else runs[i].state = HOOK_DONE;
+    }
+    while (left > 0) {
+        int stopping = failed >= 0 || (is_init && g_stop_requested);
+        int running = 0;
+        int wait_ms = -1;
+        uint64_t now = now_us();
+        for (int i = 0; i < count; i++) {
+            hook_run_t *run = &runs[i];
+            if (run->state == HOOK_WAITING && stopping) {
+                run->state = HOOK_DONE;
+                left--;
+                skipped++;
+            } else if (run->state == HOOK_WAITING && hook_ready(hooks, runs, i)) {
+                if (hook_start(&hooks[i], run, cmds[i], phase) != 0) {
+                    run->state = HOOK_DONE;
+                    left--;
+                    if (is_init && !hooks[i].on_fail_ignore && failed < 0) failed = i;
+                    else cleanup_failed += !is_init && !hooks[i].on_fail_ignore;
+                    stopping = failed >= 0;
+                }
+                now = now_us();
+            }
+            if (run->state != HOOK_RUNNING) continue;
+            if (!run->killed && (stopping || (run->deadline_us && now >= run->deadline_us))) {
+                run->timed_out = !stopping;  // logged with its duration once reaped
+                kill(-run->pid, SIGKILL);
+                run->killed = 1;
+            }
+            running++;
+            int ms = run->pid_watch.fd < 0 || run->killed ? HOOK_POLL_MS : -1;
+            if (!run->killed && run->deadline_us) {
+                uint64_t until = (run->deadline_us - now + 999) / 1000;
+                if (ms < 0 || (int)until < ms) ms = (int)until;
+            }
+            if (ms >= 0 && (wait_ms < 0 || ms < wait_ms)) wait_ms = ms;
+        }
+        if (!running) break;
+        ev_run_once(wait_ms);
+
+        now = now_us();
+        for (int i = 0; i < count; i++) {
+            hook_run_t *run = &runs[i];
+            int status;
+            if (run->state != HOOK_RUNNING) continue;
+            pid_t r = waitpid(run->pid, &status, WNOHANG);
+            if (r == 0) continue;
+            if (r < 0) {
+                if (is_init) die("%s command waitpid failed: %s", phase, strerror(errno));
+                fprintf(stderr, "wfb_supervisor: %s command waitpid failed: %s\n", phase, strerror(errno));
+                status = 127 << 8;
+            }
+            ev_close(&run->pid_watch);
+            run->state = HOOK_DONE;
+            left--;
+            uint64_t us = now - run->start_us;
+            metrics_hook(phase, us);
+            trace_span(run->start_us, is_init ? "init hook" : "cleanup hook", "%s", cmds[i]);
+            int ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+            char desc[48];
+            if (run->timed_out) snprintf(desc, sizeof(desc), "timed out");
+            else if (run->killed) snprintf(desc, sizeof(desc), "cut short");
+            else describe_status(status, desc, sizeof(desc));
+            fprintf(stderr, "wfb_supervisor: %s command %s after %llu.%03llu ms: %s\n", phase, desc,
+                    (unsigned long long)(us / 1000), (unsigned long long)(us % 1000), cmds[i]);
+            if (ok || (run->killed && !run->timed_out)) continue;
+            if (hooks[i].on_fail_ignore) {
+                fprintf(stderr, "wfb_supervisor: ignoring the failure of that %s command (on_fail=ignore)\n", phase);
+            } else if (!is_init) {
+                cleanup_failed++;
+            } else if (failed < 0) {
+                failed = i;
+                for (int k = 0; k < count; k++) {
+                    if (runs[k].state == HOOK_RUNNING) fprintf(stderr, "wfb_supervisor: stopping %s command: %s\n", phase, cmds[k]);
+                }
+            }
+        }
+    }
+    if (skipped && failed < 0) {
+        fprintf(stderr, "wfb_supervisor: shutdown requested, %d %s command%s not run\n", skipped, phase, skipped == 1 ? "" : "s");
+    }
+    free(runs);
+    if (failed >= 0) die("%s command '%s' failed", phase, cmds[failed]);
+    if (cleanup_failed) fprintf(stderr, "wfb_supervisor: %d %s command%s failed\n", cleanup_failed, phase, cleanup_failed == 1 ? "" : "s");
+    return cleanup_failed;
+}
+
+static int run_commands(const hook_t *hooks, int count, const char *phase, int skip_persistent) {
+    static strbuf_t sb;
+    char **cmds = calloc((size_t)count + 1, sizeof(*cmds));
+    if (!cmds) die("out of memory");
+    for (int i = 0; i < count; i++) {
+        const char *expanded = tmpl_expand(&hooks[i].tmpl, &sb);
+        if (skip_persistent && hooks[i].persist) {
+            fprintf(stderr, "wfb_supervisor: keeping persistent %s command: %s\n", phase, expanded);
+            continue;
+        }
+        if (!(cmds[i] = strdup(expanded))) die("out of memory");
+    }
+    int failed = run_hooks(hooks, (const char *const *)cmds, count, phase);
+    for (int i = 0; i < count; i++) free(cmds[i]);
+    free(cmds);
+    return failed;
+}
+
+/* Warm restart */
+
+/* Cleanup hooks of the config whose init hooks are in effect, expanded before a reload replaces it. */
+static char **g_prev_cleanup;
+static hook_t *g_prev_cleanup_hooks;   // their attributes; group/after copied to the heap too
+static int  g_prev_cleanup_count = 0;
+
+static void prev_cleanup_free(void) {
+    for (int i = 0; i < g_prev_cleanup_count; i++) {
+        free(g_prev_cleanup[i]);
+        free((char *)g_prev_cleanup_hooks[i].group);
+        free((char *)g_prev_cleanup_hooks[i].after);
+    }
+    free(g_prev_cleanup);
+    free(g_prev_cleanup_hooks);
+    g_prev_cleanup = NULL;
+    g_prev_cleanup_hooks = NULL;
+    g_prev_cleanup_count = 0;
+}
+
+static uint64_t fnv1a(uint64_t h, const char *s) {
+    for (; *s; s++) {
+        h ^= (unsigned char)tolower((unsigned char)*s);
+        h *= 1099511628211ull;
+    }
+    h ^= 0xff;  // field separator so "ab"+"c" differs from "a"+"bc"
+    return h * 1099511628211ull;
+}
+
+/* Fingerprint of everything the hooks can observe: expanded hook lines and all parameters. */
+static uint64_t hook_fingerprint(void) {
+    uint64_t h = 1469598103934665603ull;
+    static strbuf_t sb;
+    for (int i = 0; i < g_cfg.init_cmd_count; i++) {
+        h = fnv1a(h, tmpl_expand(&g_cfg.init_cmds[i].tmpl, &sb));
+        h = fnv1a(h, g_cfg.init_cmds[i].persist ? "persist" : "");
+    }
+    for (int i = 0; i < g_cfg.cleanup_cmd_count; i++) {
+        h = fnv1a(h, tmpl_expand(&g_cfg.cleanup_cmds[i].tmpl, &sb));
+    }
+    for (int i = 0; i < g_cfg.param_count; i++) {
+        h = fnv1a(h, g_cfg.params[i].key);
+        h = fnv1a(h, g_cfg.params[i].val);
+    }
+    for (int i = 0; i < g_cfg.tuning_count; i++) {
+        h = fnv1a(h, g_cfg.tuning[i].key);
+        h = fnv1a(h, g_cfg.tuning[i].val);
+    }
+    return h;
+}
+
+/*
+ * A warm restart skips every cleanup hook but reruns the init hooks that are not persist=yes,
+ * which would then run on top of the state they set up last time (ip link add without its
+ * ip link del). So with cleanup hooks present, every init hook has to be persistent.
+ */
+static int warm_restart_allowed(void) {
+    int persistent = g_cfg.monitor_setup || g_cfg.shaper_setup || g_cfg.tuning_count > 0;
+    int rerun = -1;
+    for (int i = 0; i < g_cfg.init_cmd_count; i++) {
+        if (g_cfg.init_cmds[i].persist) persistent = 1;
+        else if (rerun < 0) rerun = i;
+    }
+    if (!persistent) return 0;
+    if (rerun >= 0 && g_cfg.cleanup_cmd_count > 0) {
+        static strbuf_t sb;
+        fprintf(stderr, "wfb_supervisor: init command not persistent and cleanup hooks present, cold restart: %s\n",
+                tmpl_expand(&g_cfg.init_cmds[rerun].tmpl, &sb));
+        return 0;
+    }
+    return 1;
+}
+
+static void swap_shadow(void);
+static int config_try(const char *path);
+
+/*
+ * Reload the config for a relaunch. Returns 1 when the hooks are unchanged and allow a warm
+ * restart, i.e. the link state set up by the previous init can be reused as is.
+ */
+
+static int reload_config(const char *config_path, uint64_t *fingerprint) {
+    // Expanded into memory of their own: load_config() releases the arena they live in.
+    static strbuf_t sb;
+    prev_cleanup_free();
+    g_prev_cleanup = calloc((size_t)g_cfg.cleanup_cmd_count + 1, sizeof(char *));
+    g_prev_cleanup_hooks = calloc((size_t)g_cfg.cleanup_cmd_count + 1, sizeof(hook_t));
+    if (!g_prev_cleanup || !g_prev_cleanup_hooks) die("out of memory");
+    g_prev_cleanup_count = g_cfg.cleanup_cmd_count;
+    for (int i = 0; i < g_cfg.cleanup_cmd_count; i++) {
+        hook_t *h = &g_prev_cleanup_hooks[i];
+        *h = g_cfg.cleanup_cmds[i];
+        h->cmd = NULL;
+        h->tmpl = (tmpl_t){ NULL, 0 };
+        g_prev_cleanup[i] = strdup(tmpl_expand(&g_cfg.cleanup_cmds[i].tmpl, &sb));
+        h->group = strdup(h->group);
+        h->after = strdup(h->after);
+        if (!g_prev_cleanup[i] || !h->group || !h->after) die("out of memory");
+    }
+
+    uint64_t prev = *fingerprint;
+    // A config broken since the last load must not take the supervisor down: relaunch the one that ran.
+    swap_shadow();
+    g_reload_requested = 0;  // this load covers it; one that arrives later is handled by the session
+    if (config_try(config_path) != 0) {
+        swap_shadow();
+        fprintf(stderr, "wfb_supervisor: config rejected, relaunching with the previous one\n");
+    }
+    *fingerprint = hook_fingerprint();
+    return *fingerprint == prev && warm_restart_allowed();
+}
+
+static void run_prev_cleanup(void) {
+    run_hooks(g_prev_cleanup_hooks, (const char *const *)g_prev_cleanup, g_prev_cleanup_count, "cleanup");
+    prev_cleanup_free();
+}
+
+/* Netlink */
+
+#define NL_BATCH_SIZE  8192
+#define NL_BATCH_MAX   32
+#define NL_TIMEOUT_MS  2000
+
+/* Requests laid out back to back so a whole step goes to the kernel in one send(). */
+typedef struct {
+    char     buf[NL_BATCH_SIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+    size_t   len;
+    int      count;
+    uint32_t first_seq;
+} nl_batch_t;
+
+typedef void (*nl_reply_cb)(const struct nlmsghdr *nlh, void *ctx);
+
+static uint32_t g_nl_seq = 1;
+
+/* --dry-run-netlink: requests are printed to stdout and answered by nl_mock_exchange() instead of the kernel. */
+#define NL_MOCK_FDS 64
+static int g_nl_mock = 0;
+static int g_nl_mock_proto[NL_MOCK_FDS];
+
+static int nl_open(int protocol, uint32_t groups) {
+    if (g_nl_mock) {
+        int fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (fd >= NL_MOCK_FDS) die("netlink mock: out of descriptors");
+        if (fd >= 0) g_nl_mock_proto[fd] = protocol;
+        return fd;
+    }
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, protocol);
+    if (fd < 0) return -1;
+    struct sockaddr_nl sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.nl_family = AF_NETLINK;
+    sa.nl_groups = groups;
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* if_nametoindex(), or under the mock a stable made-up index so setup runs without the hardware. */
+static int nl_ifindex(const char *name) {
+    int idx = (int)if_nametoindex(name);
+    if (idx == 0 && g_nl_mock) idx = 100 + (int)(param_hash(name, strlen(name)) % 900);
+    return idx;
+}
+
+static void nl_batch_init(nl_batch_t *b) {
+    b->len = 0;
+    b->count = 0;
+    b->first_seq = g_nl_seq;
+}
+
+static struct nlmsghdr *nl_batch_add(nl_batch_t *b, uint16_t type, uint16_t flags, const void *hdr, size_t hdr_len) {
+    if (b->count >= NL_BATCH_MAX || b->len + NLMSG_SPACE(hdr_len) > sizeof(b->buf)) die("netlink batch overflow");
+    struct nlmsghdr *nlh = (struct nlmsghdr *)(b->buf + b->len);
+    memset(nlh, 0, NLMSG_SPACE(hdr_len));
+    nlh->nlmsg_len = NLMSG_LENGTH(hdr_len);
+    nlh->nlmsg_type = type;
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+    nlh->nlmsg_seq = g_nl_seq++;
+    memcpy(NLMSG_DATA(nlh), hdr, hdr_len);
+    b->len += NLMSG_ALIGN(nlh->nlmsg_len);
+    b->count++;
+    return nlh;
+}
+
+/* Append an attribute to nlh, which must be the last message in the batch. */
+static struct nlattr *nla_put(nl_batch_t *b, struct nlmsghdr *nlh, uint16_t type, const void *data, size_t len) {
+    size_t off = NLMSG_ALIGN(nlh->nlmsg_len);
+    size_t base = (size_t)((char *)nlh - b->buf);
+    if (base + off + NLA_ALIGN(NLA_HDRLEN + len) > sizeof(b->buf)) die("netlink batch overflow");
+    struct nlattr *nla = (struct nlattr *)((char *)nlh + off);
+    nla->nla_type = type;
+    nla->nla_len = (uint16_t)(NLA_HDRLEN + len);
+    memset((char *)nla + NLA_HDRLEN, 0, NLA_ALIGN(NLA_HDRLEN + len) - NLA_HDRLEN);
+    if (len) memcpy((char *)nla + NLA_HDRLEN, data, len);
+    nlh->nlmsg_len = (uint32_t)(off + NLA_ALIGN(NLA_HDRLEN + len));
+    b->len = base + nlh->nlmsg_len;
+    return nla;
+}
+
+static void nla_put_u32(nl_batch_t *b, struct nlmsghdr *nlh, uint16_t type, uint32_t v) {
+    nla_put(b, nlh, type, &v, sizeof(v));
+}
+
+static void nla_nest_end(struct nlmsghdr *nlh, struct nlattr *nest) {
+    nest->nla_len = (uint16_t)((char *)nlh + nlh->nlmsg_len - (char *)nest);
+}
+
+static void nla_parse(const void *data, size_t len, const struct nlattr **tb, int max) {
+    memset(tb, 0, sizeof(*tb) * (size_t)(max + 1));
+    const struct nlattr *a = data;
+    while (len >= NLA_HDRLEN && a->nla_len >= NLA_HDRLEN && a->nla_len <= len) {
+        int type = a->nla_type & NLA_TYPE_MASK;
+        if (type <= max) tb[type] = a;
+        size_t step = NLA_ALIGN(a->nla_len);
+        if (step >= len) break;
+        len -= step;
+        a = (const struct nlattr *)((const char *)a + step);
+    }
+}
+
+#define NLA_DATA(a) ((const void *)((const char *)(a) + NLA_HDRLEN))
+
+static uint32_t nla_get_u32(const struct nlattr *a) {
+    uint32_t v;
+    memcpy(&v, NLA_DATA(a), sizeof(v));
+    return v;
+}
+
+/* Next attribute nested in parent after a (the first one when a is NULL), or NULL at the end. */
+static const struct nlattr *nla_nested_next(const struct nlattr *parent, const struct nlattr *a) {
+    const char *end = (const char *)parent + parent->nla_len;
+    const char *p = a ? (const char *)a + NLA_ALIGN(a->nla_len) : (const char *)NLA_DATA(parent);
+    if (end - p < NLA_HDRLEN) return NULL;
+    a = (const struct nlattr *)p;
+    return a->nla_len >= NLA_HDRLEN && (const char *)a + a->nla_len <= end ? a : NULL;
+}
+
+static void nl_mock_print(int proto, const struct nlmsghdr *nlh) {
+    size_t hdr = 0;
+    printf("netlink %s type=%u flags=0x%x", proto == NETLINK_GENERIC ? "generic" : "route", nlh->nlmsg_type, nlh->nlmsg_flags);
+    if (proto == NETLINK_GENERIC) {
+        printf(" cmd=%u", ((const struct genlmsghdr *)NLMSG_DATA(nlh))->cmd);
+        hdr = GENL_HDRLEN;
+    } else if (nlh->nlmsg_type >= RTM_NEWLINK && nlh->nlmsg_type <= RTM_SETLINK) {
+        const struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+        printf(" ifindex=%d ifflags=0x%x/0x%x", ifi->ifi_index, ifi->ifi_flags, ifi->ifi_change);
+        hdr = sizeof(*ifi);
+    } else if (nlh->nlmsg_type >= RTM_NEWQDISC && nlh->nlmsg_type <= RTM_GETTFILTER) {
+        const struct tcmsg *tcm = NLMSG_DATA(nlh);
+        printf(" ifindex=%d handle=%x parent=%x info=%x", tcm->tcm_ifindex, tcm->tcm_handle, tcm->tcm_parent, tcm->tcm_info);
+        hdr = sizeof(*tcm);
+    }
+    const struct nlattr *a = (const struct nlattr *)((const char *)NLMSG_DATA(nlh) + NLMSG_ALIGN(hdr));
+    for (size_t left = nlh->nlmsg_len - NLMSG_LENGTH(hdr); left >= NLA_HDRLEN && a->nla_len >= NLA_HDRLEN && a->nla_len <= left;) {
+        size_t len = a->nla_len - NLA_HDRLEN;
+        printf(" %u=", a->nla_type & NLA_TYPE_MASK);
+        if (len == 4) printf("%u", nla_get_u32(a));
+        for (size_t k = 0; len != 4 && k < len && k < 32; k++) printf("%02x", ((const unsigned char *)NLA_DATA(a))[k]);
+        if (len > 32 && len != 4) printf("...");
+        size_t step = NLA_ALIGN(a->nla_len);
+        if (step >= left) break;
+        left -= step;
+        a = (const struct nlattr *)((const char *)a + step);
+    }
+    putchar('\n');
+}
+
+/* Print the batch and ACK every request; queries get a minimal reply: NIC down, station mode, 20 dBm, world domain. */
+static int nl_mock_exchange(int fd, nl_batch_t *b, int *errs, nl_reply_cb cb, void *ctx) {
+    size_t off = 0;
+    for (int i = 0; i < b->count; i++) {
+        const struct nlmsghdr *nlh = (const struct nlmsghdr *)(b->buf + off);
+        off += NLMSG_ALIGN(nlh->nlmsg_len);
+        int proto = fd >= 0 && fd < NL_MOCK_FDS ? g_nl_mock_proto[fd] : NETLINK_ROUTE;
+        nl_mock_print(proto, nlh);
+        errs[i] = 0;
+        if (!cb) continue;
+        nl_batch_t r;
+        struct nlmsghdr *reply = NULL;
+        nl_batch_init(&r);
+        uint8_t cmd = proto == NETLINK_GENERIC ? ((const struct genlmsghdr *)NLMSG_DATA(nlh))->cmd : 0;
+        if (proto == NETLINK_GENERIC && nlh->nlmsg_type == GENL_ID_CTRL) {
+            struct genlmsghdr g = { .cmd = CTRL_CMD_NEWFAMILY };
+            uint16_t id = GENL_MIN_ID + 16;  // any id clear of GENL_ID_CTRL
+            reply = nl_batch_add(&r, GENL_ID_CTRL, 0, &g, sizeof(g));
+            nla_put(&r, reply, CTRL_ATTR_FAMILY_ID, &id, sizeof(id));
+        } else if (proto == NETLINK_GENERIC && cmd == NL80211_CMD_GET_INTERFACE) {
+            const struct nlattr *tb[NL80211_ATTR_MAX + 1];
+            nla_parse((const char *)NLMSG_DATA(nlh) + GENL_HDRLEN, nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN), tb, NL80211_ATTR_MAX);
+            struct genlmsghdr g = { .cmd = NL80211_CMD_NEW_INTERFACE };
+            reply = nl_batch_add(&r, nlh->nlmsg_type, 0, &g, sizeof(g));
+            if (tb[NL80211_ATTR_IFINDEX]) nla_put_u32(&r, reply, NL80211_ATTR_IFINDEX, nla_get_u32(tb[NL80211_ATTR_IFINDEX]));
+            nla_put_u32(&r, reply, NL80211_ATTR_IFTYPE, NL80211_IFTYPE_STATION);
+            nla_put_u32(&r, reply, NL80211_ATTR_WIPHY, 0);
+            nla_put_u32(&r, reply, NL80211_ATTR_WIPHY_TX_POWER_LEVEL, 2000);
+        } else if (proto == NETLINK_GENERIC && cmd == NL80211_CMD_GET_REG) {
+            struct genlmsghdr g = { .cmd = NL80211_CMD_GET_REG };
+            reply = nl_batch_add(&r, nlh->nlmsg_type, 0, &g, sizeof(g));
+            nla_put(&r, reply, NL80211_ATTR_REG_ALPHA2, "00", 3);
+        } else if (proto == NETLINK_ROUTE && nlh->nlmsg_type == RTM_GETLINK) {
+            struct ifinfomsg ifi = *(const struct ifinfomsg *)NLMSG_DATA(nlh);
+            ifi.ifi_flags = 0;
+            reply = nl_batch_add(&r, RTM_NEWLINK, 0, &ifi, sizeof(ifi));
+        }
+        if (!reply) continue;
+        reply->nlmsg_seq = nlh->nlmsg_seq;
+        cb(reply, ctx);
+    }
+    return 0;
+}
+
+/* Send the batch in one write and collect one ACK per request; errs[i] is 0 or -errno. */
+static int nl_exchange(int fd, nl_batch_t *b, int *errs, nl_reply_cb cb, void *ctx) {
+    if (g_nl_mock) return nl_mock_exchange(fd, b, errs, cb, ctx);
+    for (int i = 0; i < b->count; i++) errs[i] = -ETIMEDOUT;
+    if (send(fd, b->buf, b->len, 0) < 0) return -errno;
+
+    char rbuf[16384] __attribute__((aligned(NLMSG_ALIGNTO)));
+    int pending = b->count;
+    while (pending > 0) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int pr = poll(&pfd, 1, NL_TIMEOUT_MS);
+        if (pr < 0 && errno == EINTR) continue;
+        if (pr <= 0) return -ETIMEDOUT;
+        ssize_t n = recv(fd, rbuf, sizeof(rbuf), 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        size_t left = (size_t)n;
+        for (struct nlmsghdr *nlh = (struct nlmsghdr *)rbuf; NLMSG_OK(nlh, left); nlh = NLMSG_NEXT(nlh, left)) {
+            uint32_t idx = nlh->nlmsg_seq - b->first_seq;
+            if (idx >= (uint32_t)b->count) continue;
+            if (nlh->nlmsg_type == NLMSG_ERROR || nlh->nlmsg_type == NLMSG_DONE) {
+                // Dumps finish with NLMSG_DONE instead of an ACK; both lead with an error code.
+                errs[idx] = *(const int *)NLMSG_DATA(nlh);
+                pending--;
+            } else if (cb) {
+                cb(nlh, ctx);
+            }
+        }
+    }
+    return 0;
+}
+
+static void on_genl_family(const struct nlmsghdr *nlh, void *ctx) {
+    const struct nlattr *tb[CTRL_ATTR_MAX + 1];
+    nla_parse((const char *)NLMSG_DATA(nlh) + GENL_HDRLEN, nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN), tb, CTRL_ATTR_MAX);
+    if (tb[CTRL_ATTR_FAMILY_ID]) *(int *)ctx = *(const uint16_t *)NLA_DATA(tb[CTRL_ATTR_FAMILY_ID]);
+}
+
+static int genl_family_id(int fd, const char *name) {
+    nl_batch_t b;
+    nl_batch_init(&b);
+    struct genlmsghdr g = { .cmd = CTRL_CMD_GETFAMILY, .version = 1 };
+    struct nlmsghdr *nlh = nl_batch_add(&b, GENL_ID_CTRL, 0, &g, sizeof(g));
+    nla_put(&b, nlh, CTRL_ATTR_FAMILY_NAME, name, strlen(name) + 1);
+    int id = -1;
+    int err;
+    if (nl_exchange(fd, &b, &err, on_genl_family, &id) != 0 || err != 0) return -1;
+    return id;
+}
+
+/* Interface setup (native replacement for monitor.sh) */
+
+#define MAX_NICS      8
+#define LINK_WAIT_MS  3000
+
+typedef struct {
+    char     name[IFNAMSIZ];
+    int      ifindex;
+    int      failed;         // a setup step failed; leave the NIC alone from here on
+    int      fresh;          // not configured yet; the next iface_configure() takes it
+    int      saved;          // original state below was captured
+    uint32_t saved_iftype;
+    int      saved_up;
+    int      saved_txpower_set;  // the driver reported a level; without one restore goes back to automatic
+    uint32_t saved_txpower;      // mBm
+    int      has_wiphy;
+    uint32_t wiphy;
+} nic_t;
+
+static nic_t g_nics[MAX_NICS];
+static int   g_nic_count = 0;
+static int   g_iface_active = 0;
+static char  g_saved_alpha2[3];
+
+typedef struct {
+    int fam;
+    const void *arg;
+} nic_op_ctx_t;
+
+typedef void (*nic_op_fn)(nl_batch_t *b, const nic_t *nic, const nic_op_ctx_t *op);
+
+/* Issue one request per usable NIC in a single batch; NICs whose request fails are marked failed. */
+static void nic_step(int fd, const char *step, nic_op_fn add, const nic_op_ctx_t *op, nl_reply_cb cb, int only_saved) {
+    nl_batch_t b;
+    int map[MAX_NICS];
+    int errs[MAX_NICS];
+    nl_batch_init(&b);
+    for (int i = 0; i < g_nic_count; i++) {
+        if (only_saved ? !g_nics[i].saved : g_nics[i].failed || !g_nics[i].fresh) continue;
+        add(&b, &g_nics[i], op);
+        map[b.count - 1] = i;
+    }
+    if (b.count == 0) return;
+
+    int rc = nl_exchange(fd, &b, errs, cb, NULL);
+    for (int k = 0; k < b.count; k++) {
+        int err = rc ? rc : errs[k];
+        if (err == 0) continue;
+        nic_t *nic = &g_nics[map[k]];
+        fprintf(stderr, "wfb_supervisor: interface %s: %s failed: %s\n", nic->name, step, strerror(-err));
+        if (!only_saved) nic->failed = 1;
+    }
+}
+
+static nic_t *nic_by_index(int ifindex) {
+    for (int i = 0; i < g_nic_count; i++) {
+        if (g_nics[i].ifindex == ifindex) return &g_nics[i];
+    }
+    return NULL;
+}
+
+static void add_link_flags(nl_batch_t *b, const nic_t *nic, const nic_op_ctx_t *op) {
+    struct ifinfomsg ifi;
+    memset(&ifi, 0, sizeof(ifi));
+    ifi.ifi_family = AF_UNSPEC;
+    ifi.ifi_index = nic->ifindex;
+    ifi.ifi_change = IFF_UP;
+    ifi.ifi_flags = *(const int *)op->arg ? IFF_UP : 0;
+    nl_batch_add(b, RTM_NEWLINK, 0, &ifi, sizeof(ifi));
+}
+
+static void add_link_restore(nl_batch_t *b, const nic_t *nic, const nic_op_ctx_t *op) {
+    int up = nic->saved_up;
+    nic_op_ctx_t sub = { op->fam, &up };
+    add_link_flags(b, nic, &sub);
+}
+
+static void add_get_link(nl_batch_t *b, const nic_t *nic, const nic_op_ctx_t *op) {
+    (void)op;
+    struct ifinfomsg ifi;
+    memset(&ifi, 0, sizeof(ifi));
+    ifi.ifi_family = AF_UNSPEC;
+    ifi.ifi_index = nic->ifindex;
+    nl_batch_add(b, RTM_GETLINK, 0, &ifi, sizeof(ifi));
+}
+
+static void on_link(const struct nlmsghdr *nlh, void *ctx) {
+    (void)ctx;
+    if (nlh->nlmsg_type != RTM_NEWLINK) return;
+    const struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+    nic_t *nic = nic_by_index(ifi->ifi_index);
+    if (nic) nic->saved_up = (ifi->ifi_flags & IFF_UP) != 0;
+}
+
+static struct nlmsghdr *add_nl80211(nl_batch_t *b, int fam, uint8_t cmd, const nic_t *nic) {
+    struct genlmsghdr g = { .cmd = cmd, .version = 0 };
+    struct nlmsghdr *nlh = nl_batch_add(b, (uint16_t)fam, 0, &g, sizeof(g));
+    if (nic) nla_put_u32(b, nlh, NL80211_ATTR_IFINDEX, (uint32_t)nic->ifindex);
+    return nlh;
+}
+
+static void add_get_iftype(nl_batch_t *b, const nic_t *nic, const nic_op_ctx_t *op) {
+    add_nl80211(b, op->fam, NL80211_CMD_GET_INTERFACE, nic);
+}
+
+static void on_iftype(const struct nlmsghdr *nlh, void *ctx) {
+    (void)ctx;
+    const struct nlattr *tb[NL80211_ATTR_MAX + 1];
+    nla_parse((const char *)NLMSG_DATA(nlh) + GENL_HDRLEN, nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN), tb, NL80211_ATTR_MAX);
+    if (!tb[NL80211_ATTR_IFINDEX] || !tb[NL80211_ATTR_IFTYPE]) return;
+    nic_t *nic = nic_by_index((int)nla_get_u32(tb[NL80211_ATTR_IFINDEX]));
+    if (!nic) return;
+    nic->saved_iftype = nla_get_u32(tb[NL80211_ATTR_IFTYPE]);
+    nic->saved = 1;
+    nic->saved_txpower_set = tb[NL80211_ATTR_WIPHY_TX_POWER_LEVEL] != NULL;
+    if (nic->saved_txpower_set) nic->saved_txpower = nla_get_u32(tb[NL80211_ATTR_WIPHY_TX_POWER_LEVEL]);
+    nic->has_wiphy = tb[NL80211_ATTR_WIPHY] != NULL;
+    if (nic->has_wiphy) nic->wiphy = nla_get_u32(tb[NL80211_ATTR_WIPHY]);
+}
+
+static void add_set_iftype(nl_batch_t *b, const nic_t *nic, const nic_op_ctx_t *op) {
+    struct nlmsghdr *nlh = add_nl80211(b, op->fam, NL80211_CMD_SET_INTERFACE, nic);
+    uint32_t type = op->arg ? *(const uint32_t *)op->arg : nic->saved_iftype;
+    nla_put_u32(b, nlh, NL80211_ATTR_IFTYPE, type);
+    if (type == NL80211_IFTYPE_MONITOR) {
+        struct nlattr *flags = nla_put(b, nlh, NL80211_ATTR_MNTR_FLAGS | NLA_F_NESTED, NULL, 0);
+        nla_put(b, nlh, NL80211_MNTR_FLAG_OTHER_BSS, NULL, 0);
+        nla_nest_end(nlh, flags);
+    }
+}
+
+static void add_set_channel(nl_batch_t *b, const nic_t *nic, const nic_op_ctx_t *op) {
+    const uint32_t *ch = op->arg;  // freq, width, center_freq1
+    struct nlmsghdr *nlh = add_nl80211(b, op->fam, NL80211_CMD_SET_CHANNEL, nic);
+    nla_put_u32(b, nlh, NL80211_ATTR_WIPHY_FREQ, ch[0]);
+    nla_put_u32(b, nlh, NL80211_ATTR_CHANNEL_WIDTH, ch[1]);
+    nla_put_u32(b, nlh, NL80211_ATTR_CENTER_FREQ1, ch[2]);
+}
+
+/* Without op->arg the level saved by iface_configure() comes back. */
+static void add_set_txpower(nl_batch_t *b, const nic_t *nic, const nic_op_ctx_t *op) {
+    struct nlmsghdr *nlh = add_nl80211(b, op->fam, NL80211_CMD_SET_WIPHY, nic);
+    const uint32_t *mbm = op->arg ? op->arg : nic->saved_txpower_set ? &nic->saved_txpower : NULL;
+    if (mbm) {
+        nla_put_u32(b, nlh, NL80211_ATTR_WIPHY_TX_POWER_SETTING, NL80211_TX_POWER_FIXED);
+        nla_put_u32(b, nlh, NL80211_ATTR_WIPHY_TX_POWER_LEVEL, *mbm);
+    } else {
+        nla_put_u32(b, nlh, NL80211_ATTR_WIPHY_TX_POWER_SETTING, NL80211_TX_POWER_AUTOMATIC);
+    }
+}
+
+static void on_reg(const struct nlmsghdr *nlh, void *ctx) {
+    (void)ctx;
+    const struct nlattr *tb[NL80211_ATTR_MAX + 1];
+    nla_parse((const char *)NLMSG_DATA(nlh) + GENL_HDRLEN, nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN), tb, NL80211_ATTR_MAX);
+    if (tb[NL80211_ATTR_REG_ALPHA2]) {
+        memcpy(g_saved_alpha2, NLA_DATA(tb[NL80211_ATTR_REG_ALPHA2]), 2);
+        g_saved_alpha2[2] = '\0';
+    }
+}
+
+static int set_regdomain(int fd, int fam, const char *alpha2) {
+    nl_batch_t b;
+    int err;
+    nl_batch_init(&b);
+    struct nlmsghdr *nlh = add_nl80211(&b, fam, NL80211_CMD_REQ_SET_REG, NULL);
+    nla_put(&b, nlh, NL80211_ATTR_REG_ALPHA2, alpha2, 3);
+    int rc = nl_exchange(fd, &b, &err, NULL, NULL);
+    return rc ? rc : err;
+}
+
+/* Primary frequency of a 20 MHz channel on the 2.4/5 GHz raster, or -1. */
+static int channel_to_freq(int ch) {
+    if (ch >= 1 && ch <= 13) return 2407 + 5 * ch;
+    if (ch == 14) return 2484;
+    if (ch >= 32 && ch <= 144 && ch % 4 == 0) return 5000 + 5 * ch;
+    if (ch >= 149 && ch <= 177 && (ch - 149) % 4 == 0) return 5000 + 5 * ch;
+    return -1;
+}
+
+/* Center of the bonded channel containing the primary channel, as iw derives for HT40+/-, 80 and 160 MHz. */
+static int channel_center_freq(int ch, int freq, int bw) {
+    static const int c80[] = { 42, 58, 106, 122, 138, 155, 171 };
+    static const int c160[] = { 50, 114, 163 };
+    if (bw <= 20) return freq;
+    if (freq < 5000) {
+        if (bw != 40 || ch == 14) return -1;
+        return ch <= 7 ? freq + 10 : freq - 10;
+    }
+    if (bw == 40) {
+        // The secondary channel must exist too: 32 has no pair at all, 36..144 pair up from 36, 149..177 from 149.
+        if (ch < 36) return -1;
+        int idx = ch >= 149 ? (ch - 149) / 4 : (ch - 36) / 4;
+        int second = idx % 2 == 0 ? ch + 4 : ch - 4;
+        if (channel_to_freq(second) < 0 || (ch < 149) != (second < 149)) return -1;
+        return (idx % 2 == 0) ? freq + 10 : freq - 10;
+    }
+    const int *tbl = bw == 80 ? c80 : c160;
+    int n = bw == 80 ? (int)(sizeof(c80) / sizeof(c80[0])) : (int)(sizeof(c160) / sizeof(c160[0]));
+    for (int i = 0; i < n; i++) {
+        if (abs(ch - tbl[i]) <= bw / 10 - 2) return 5000 + 5 * tbl[i];
+    }
+    return -1;
+}
+
+static int bandwidth_to_width(int bw) {
+    switch (bw) {
+    case 5:   return NL80211_CHAN_WIDTH_5;
+    case 10:  return NL80211_CHAN_WIDTH_10;
+    case 20:  return NL80211_CHAN_WIDTH_20;
+    case 40:  return NL80211_CHAN_WIDTH_40;
+    case 80:  return NL80211_CHAN_WIDTH_80;
+    case 160: return NL80211_CHAN_WIDTH_160;
+    default:  return -1;
+    }
+}
+
+static void collect_nics(void) {
+    const char *lists[2] = { get_param_value("rx_nics"), get_param_value("tx_nics") };
+    g_nic_count = 0;
+    for (int l = 0; l < 2; l++) {
+        if (!lists[l]) continue;
+        char *copy = strdup(lists[l]);
+        if (!copy) die("out of memory");
+        char *save = NULL;
+        for (char *tok = strtok_r(copy, " \t,", &save); tok; tok = strtok_r(NULL, " \t,", &save)) {
+            int dup = 0;
+            for (int i = 0; i < g_nic_count; i++) {
+                if (strcmp(g_nics[i].name, tok) == 0) dup = 1;
+            }
+            if (dup) continue;
+            if (g_nic_count >= MAX_NICS) die("interface setup: too many NICs (max %d)", MAX_NICS);
+            int idx = nl_ifindex(tok);
+            if (idx == 0) {
+                fprintf(stderr, "wfb_supervisor: interface %s not found, skipping\n", tok);
+                continue;
+            }
+            nic_t *nic = &g_nics[g_nic_count++];
+            memset(nic, 0, sizeof(*nic));
+            snprintf(nic->name, sizeof(nic->name), "%s", tok);
+            nic->ifindex = idx;
+            nic->fresh = 1;
+        }
+        free(copy);
+    }
+}
+
+/* The 20 MHz channels a chandef covers, and what the radio reports about them. */
+typedef struct {
+    int      primary;
+    int      lo, hi;         // first and last 20 MHz center covered
+    uint32_t deny;           // NL80211_FREQUENCY_ATTR_* flag that rules out the width on the primary, or 0
+    unsigned enabled;        // bit per covered channel the radio lists as enabled
+    int      denied;
+    int      listed;         // any frequency seen at all
+} chan_check_t;
+
+static void on_wiphy_freqs(const struct nlmsghdr *nlh, void *ctx) {
+    chan_check_t *cc = ctx;
+    const struct nlattr *tb[NL80211_ATTR_MAX + 1];
+    nla_parse((const char *)NLMSG_DATA(nlh) + GENL_HDRLEN, nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN), tb, NL80211_ATTR_MAX);
+    if (!tb[NL80211_ATTR_WIPHY_BANDS]) return;
+    for (const struct nlattr *band = NULL; (band = nla_nested_next(tb[NL80211_ATTR_WIPHY_BANDS], band));) {
+        const struct nlattr *bt[NL80211_BAND_ATTR_MAX + 1];
+        nla_parse(NLA_DATA(band), band->nla_len - NLA_HDRLEN, bt, NL80211_BAND_ATTR_MAX);
+        if (!bt[NL80211_BAND_ATTR_FREQS]) continue;
+        for (const struct nlattr *f = NULL; (f = nla_nested_next(bt[NL80211_BAND_ATTR_FREQS], f));) {
+            const struct nlattr *ft[NL80211_FREQUENCY_ATTR_MAX + 1];
+            nla_parse(NLA_DATA(f), f->nla_len - NLA_HDRLEN, ft, NL80211_FREQUENCY_ATTR_MAX);
+            if (!ft[NL80211_FREQUENCY_ATTR_FREQ]) continue;
+            int mhz = (int)nla_get_u32(ft[NL80211_FREQUENCY_ATTR_FREQ]);
+            cc->listed = 1;
+            if (mhz == cc->primary && cc->deny && ft[cc->deny]) cc->denied = 1;
+            if (mhz < cc->lo || mhz > cc->hi || (mhz - cc->lo) % 20 || ft[NL80211_FREQUENCY_ATTR_DISABLED]) continue;
+            cc->enabled |= 1u << ((mhz - cc->lo) / 20);
+        }
+    }
+}
+
+/*
+ * Can the radio behind nic use CHANNEL at BANDWIDTH in the current regulatory domain? Asked
+ * before anything is programmed; a radio that lists no frequencies is given the benefit of the
+ * doubt and left to the kernel's own check.
+ */
+static int channel_usable(int fd, int fam, const nic_t *nic, int freq, int center, const char **why) {
+    chan_check_t cc = { .primary = freq, .lo = freq, .hi = freq };
+    int bw = g_cfg.wifi_bandwidth;
+    if (bw >= 40) {
+        cc.lo = center - bw / 2 + 10;
+        cc.hi = center + bw / 2 - 10;
+    }
+    cc.deny = bw == 40 ? (center > freq ? NL80211_FREQUENCY_ATTR_NO_HT40_PLUS : NL80211_FREQUENCY_ATTR_NO_HT40_MINUS)
+            : bw == 80 ? NL80211_FREQUENCY_ATTR_NO_80MHZ : bw == 160 ? NL80211_FREQUENCY_ATTR_NO_160MHZ : 0;
+    if (!nic->has_wiphy) return 1;
+
+    // One dump per request: the kernel refuses a second one while the first is still running.
+    nl_batch_t b;
+    int err;
+    nl_batch_init(&b);
+    struct genlmsghdr g = { .cmd = NL80211_CMD_GET_WIPHY };
+    struct nlmsghdr *nlh = nl_batch_add(&b, (uint16_t)fam, NLM_F_DUMP, &g, sizeof(g));
+    nla_put_u32(&b, nlh, NL80211_ATTR_WIPHY, nic->wiphy);
+    nla_put(&b, nlh, NL80211_ATTR_SPLIT_WIPHY_DUMP, NULL, 0);
+    if (nl_exchange(fd, &b, &err, on_wiphy_freqs, &cc) != 0 || err != 0 || !cc.listed) return 1;
+
+    unsigned all = (1u << ((cc.hi - cc.lo) / 20 + 1)) - 1;
+    if (cc.denied) *why = "width not allowed there";
+    else if (cc.enabled != all) *why = "channel disabled";
+    return !cc.denied && cc.enabled == all;
+}
+
+/* Wait for the RTM_NEWLINK notifications that confirm every usable NIC is up. */
+static void wait_links_up(int ev) {
+    int pending[MAX_NICS];
+    int left = 0;
+    for (int i = 0; i < g_nic_count; i++) {
+        pending[i] = g_nics[i].fresh && !g_nics[i].failed;
+        left += pending[i];
+    }
+    if (g_nl_mock) return;
+
+    uint64_t deadline = now_ms() + LINK_WAIT_MS;
+    char rbuf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+    while (left > 0) {
+        uint64_t now = now_ms();
+        if (now >= deadline) break;
+        struct pollfd pfd = { .fd = ev, .events = POLLIN };
+        int pr = poll(&pfd, 1, (int)(deadline - now));
+        if (pr < 0 && errno != EINTR) {
+            fprintf(stderr, "wfb_supervisor: interface setup: waiting for link-up events failed: %s\n", strerror(errno));
+            break;
+        }
+        if (pr <= 0) continue;
+        ssize_t n = recv(ev, rbuf, sizeof(rbuf), MSG_DONTWAIT);
+        // ENOBUFS only means notifications were dropped; the ones still to come count.
+        if (n < 0 && errno != EINTR && errno != EAGAIN && errno != ENOBUFS) {
+            fprintf(stderr, "wfb_supervisor: interface setup: waiting for link-up events failed: %s\n", strerror(errno));
+            break;
+        }
+        if (n <= 0) continue;
+        size_t len = (size_t)n;
+        for (struct nlmsghdr *nlh = (struct nlmsghdr *)rbuf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+            if (nlh->nlmsg_type != RTM_NEWLINK) continue;
+            const struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+            nic_t *nic = nic_by_index(ifi->ifi_index);
+            if (!nic || !(ifi->ifi_flags & IFF_UP)) continue;
+            int i = (int)(nic - g_nics);
+            if (pending[i]) {
+                pending[i] = 0;
+                left--;
+            }
+        }
+    }
+    for (int i = 0; i < g_nic_count; i++) {
+        if (pending[i]) fprintf(stderr, "wfb_supervisor: interface %s: no link-up event within %d ms\n", g_nics[i].name, LINK_WAIT_MS);
+    }
+}
+
+/*
+ * Put the fresh NICs into monitor mode on CHANNEL/BANDWIDTH at TXPOWER, all NICs per step
+ * in one netlink batch. Per-NIC failures are reported and skipped like monitor.sh did.
+ */
+static void iface_configure(void) {
+    uint64_t start = now_ms();
+    uint64_t trace_start = trace_now();
+    int freq = channel_to_freq(g_cfg.wifi_channel);
+    int center = channel_center_freq(g_cfg.wifi_channel, freq, g_cfg.wifi_bandwidth);
+    int width = bandwidth_to_width(g_cfg.wifi_bandwidth);
+
+    int rt = nl_open(NETLINK_ROUTE, 0);
+    int gn = nl_open(NETLINK_GENERIC, 0);
+    if (rt < 0 || gn < 0) die("interface setup: netlink socket failed: %s", strerror(errno));
+    int fam = genl_family_id(gn, "nl80211");
+    if (fam < 0) die("interface setup: nl80211 unavailable (is the wireless driver loaded?)");
+
+    nic_op_ctx_t op = { fam, NULL };
+    nic_step(rt, "query link", add_get_link, &op, on_link, 0);
+    nic_step(gn, "query type", add_get_iftype, &op, on_iftype, 0);
+
+    if (!g_iface_active) {
+        nl_batch_t b;
+        int err;
+        nl_batch_init(&b);
+        add_nl80211(&b, fam, NL80211_CMD_GET_REG, NULL);
+        g_saved_alpha2[0] = '\0';
+        nl_exchange(gn, &b, &err, on_reg, NULL);
+        if (strcasecmp(g_saved_alpha2, g_cfg.wifi_region) != 0) {
+            int rc = set_regdomain(gn, fam, g_cfg.wifi_region);
+            if (rc) fprintf(stderr, "wfb_supervisor: failed to set regulatory region to %s: %s\n", g_cfg.wifi_region, strerror(-rc));
+        }
+    }
+
+    int up = 0;
+    op.arg = &up;
+    nic_step(rt, "link down", add_link_flags, &op, NULL, 0);
+    uint32_t monitor = NL80211_IFTYPE_MONITOR;
+    op.arg = &monitor;
+    nic_step(gn, "set monitor", add_set_iftype, &op, NULL, 0);
+
+    // Subscribe before raising the links so no RTM_NEWLINK notification can be missed.
+    int ev = nl_open(NETLINK_ROUTE, RTMGRP_LINK);
+    if (ev < 0) die("interface setup: netlink socket failed: %s", strerror(errno));
+    up = 1;
+    op.arg = &up;
+    nic_step(rt, "link up", add_link_flags, &op, NULL, 0);
+    wait_links_up(ev);
+    close(ev);
+
+    for (int i = 0; i < g_nic_count; i++) {
+        nic_t *nic = &g_nics[i];
+        const char *why = NULL;
+        if (nic->failed || !nic->fresh || channel_usable(gn, fam, nic, freq, center, &why)) continue;
+        fprintf(stderr, "wfb_supervisor: interface %s: channel %d at %d MHz is not usable (%s, regulatory region %s), leaving it\n",
+                nic->name, g_cfg.wifi_channel, g_cfg.wifi_bandwidth, why, g_cfg.wifi_region);
+        nic->failed = 1;
+    }
+    uint32_t chan[3] = { (uint32_t)freq, (uint32_t)width, (uint32_t)center };
+    op.arg = chan;
+    nic_step(gn, "set channel", add_set_channel, &op, NULL, 0);
+    uint32_t mbm = (uint32_t)g_cfg.wifi_txpower;
+    op.arg = &mbm;
+    nic_step(gn, "set txpower", add_set_txpower, &op, NULL, 0);
+
+    close(rt);
+    close(gn);
+    g_iface_active = 1;
+
+    for (int i = 0; i < g_nic_count; i++) {
+        if (!g_nics[i].fresh) continue;
+        g_nics[i].fresh = 0;
+        if (g_nics[i].failed) continue;
+        fprintf(stderr, "wfb_supervisor: interface %s: monitor mode on channel %d (%d MHz, %d MHz wide), txpower %d mBm\n",
+                g_nics[i].name, g_cfg.wifi_channel, freq, g_cfg.wifi_bandwidth, g_cfg.wifi_txpower);
+    }
+    fprintf(stderr, "wfb_supervisor: interface setup finished in %llu ms\n", (unsigned long long)(now_ms() - start));
+    trace_span(trace_start, "iface setup", "%d NICs, channel %d", g_nic_count, g_cfg.wifi_channel);
+}
+
+static void iface_setup(void) {
+    collect_nics();
+    if (g_nic_count == 0) {
+        fprintf(stderr, "wfb_supervisor: interface setup: no rx_nics/tx_nics present\n");
+        return;
+    }
+    iface_configure();
+}
+
+/* The NIC of a templated instance joins the set on first use, and again when it returns with a new ifindex. */
+static void iface_attach(const char *name) {
+    unsigned idx = if_nametoindex(name);
+    if (idx == 0) return;
+    nic_t *nic = NULL;
+    for (int i = 0; i < g_nic_count; i++) {
+        if (strcmp(g_nics[i].name, name) == 0) nic = &g_nics[i];
+    }
+    if (nic && nic->ifindex == (int)idx) return;
+    if (!nic) {
+        if (g_nic_count >= MAX_NICS) {
+            fprintf(stderr, "wfb_supervisor: interface %s: too many NICs (max %d), leaving it unconfigured\n", name, MAX_NICS);
+            return;
+        }
+        nic = &g_nics[g_nic_count++];
+    }
+    memset(nic, 0, sizeof(*nic));
+    snprintf(nic->name, sizeof(nic->name), "%s", name);
+    nic->ifindex = (int)idx;
+    nic->fresh = 1;
+    iface_configure();
+}
+
+/* An unplugged NIC has nothing left to restore, and its ifindex may be reused. */
+static void iface_detach(const char *name) {
+    for (int i = 0; i < g_nic_count; i++) {
+        if (strcmp(g_nics[i].name, name) != 0) continue;
+        g_nics[i] = g_nics[--g_nic_count];
+        return;
+    }
+}
+
+/* Put every NIC back into the type, link state and regulatory domain captured by iface_setup(). */
+static void iface_restore(void) {
+    if (!g_iface_active) return;
+    g_iface_active = 0;
+
+    int rt = nl_open(NETLINK_ROUTE, 0);
+    int gn = nl_open(NETLINK_GENERIC, 0);
+    int fam = gn >= 0 ? genl_family_id(gn, "nl80211") : -1;
+    if (rt < 0 || fam < 0) {
+        fprintf(stderr, "wfb_supervisor: interface restore: netlink unavailable\n");
+        if (rt >= 0) close(rt);
+        if (gn >= 0) close(gn);
+        return;
+    }
+
+    int up = 0;
+    nic_op_ctx_t op = { fam, &up };
+    nic_step(rt, "link down", add_link_flags, &op, NULL, 1);
+    op.arg = NULL;
+    nic_step(gn, "restore type", add_set_iftype, &op, NULL, 1);
+    nic_step(gn, "restore txpower", add_set_txpower, &op, NULL, 1);
+    nic_step(rt, "restore link", add_link_restore, &op, NULL, 1);
+    if (g_saved_alpha2[0] && strcasecmp(g_saved_alpha2, g_cfg.wifi_region) != 0) {
+        int rc = set_regdomain(gn, fam, g_saved_alpha2);
+        if (rc) fprintf(stderr, "wfb_supervisor: failed to restore regulatory region %s: %s\n", g_saved_alpha2, strerror(-rc));
+    }
+    fprintf(stderr, "wfb_supervisor: interfaces restored\n");
+
+    close(rt);
+    close(gn);
+}
+
+/* Traffic shaper (native replacement for shaper.sh) */
+
+#define SHAPER_ROOT      TC_H_MAKE(0x10000U, 0)
+#define SHAPER_CLASS(m)  TC_H_MAKE(0x10000U, (m))
+#define SHAPER_MIN_KBIT  1000
+#define SHAPER_MTU       1600
+
+/* Leaf classes under 1:99; minors, prios, fwmarks and pfifo handles match shaper.sh. */
+static const struct {
+    const char *name;
+    uint32_t minor;
+    uint32_t prio;
+    uint32_t leaf;
+    uint32_t marks[2];
+    int min_kbit;
+} k_shaper_classes[] = {
+    { "video",     0x1,  2, 101, { 1, 2 },   1000 },
+    { "telemetry", 0x10, 1, 102, { 10, 11 }, 128 },
+    { "tunnel",    0x20, 3, 103, { 20, 21 }, 128 },
+};
+#define SHAPER_CLASS_COUNT ((int)(sizeof(k_shaper_classes) / sizeof(k_shaper_classes[0])))
+
+typedef struct {
+    char name[IFNAMSIZ];
+    int  ifindex;
+} shaped_nic_t;
+
+static shaped_nic_t g_shaped[MAX_NICS];
+static int g_shaped_count = 0;
+static int g_shaper_rate_kbit = 0;
+
+/*
+ * PHY rate in kbit/s. With nss == 0, mcs is an HT index 0-31 (8 per spatial stream);
+ * otherwise it is a per-stream VHT index 0-9. Scales by data subcarriers for the width
+ * (52/108/234/468 at 20/40/80/160 MHz; 5/10 MHz are quarter/half clocked) and by 10/9
+ * for the short guard interval.
+ */
+static long phy_rate_kbit(int mcs, int nss, int bw, int sgi) {
+    static const long base20[10] = { 6500, 13000, 19500, 26000, 39000, 52000, 58500, 65000, 78000, 86667 };
+    if (nss == 0) {
+        if (mcs < 0 || mcs > 31) return -1;
+        nss = mcs / 8 + 1;
+        mcs %= 8;
+    } else if (mcs < 0 || mcs > 9 || nss > 8) {
+        return -1;
+    }
+
+    long sc;
+    switch (bw) {
+    case 5:   sc = 13; break;
+    case 10:  sc = 26; break;
+    case 20:  sc = 52; break;
+    case 40:  sc = 108; break;
+    case 80:  sc = 234; break;
+    case 160: sc = 468; break;
+    default:  return -1;
+    }
+    long rate = base20[mcs] * sc / 52 * nss;
+    if (sgi) rate = rate * 10 / 9;
+    return rate;
+}
+
+static void shaper_collect_nics(void) {
+    const char *list = get_param_value("tx_nics");
+    g_shaped_count = 0;
+    if (!list) return;
+    char *copy = strdup(list);
+    if (!copy) die("out of memory");
+    char *save = NULL;
+    for (char *tok = strtok_r(copy, " \t,", &save); tok; tok = strtok_r(NULL, " \t,", &save)) {
+        if (g_shaped_count >= MAX_NICS) die("shaper: too many tx_nics (max %d)", MAX_NICS);
+        int idx = nl_ifindex(tok);
+        if (idx == 0) {
+            fprintf(stderr, "wfb_supervisor: shaper: interface %s not found, skipping\n", tok);
+            continue;
+        }
+        shaped_nic_t *nic = &g_shaped[g_shaped_count++];
+        snprintf(nic->name, sizeof(nic->name), "%s", tok);
+        nic->ifindex = idx;
+    }
+    free(copy);
+}
+
+static struct nlmsghdr *add_tc(nl_batch_t *b, uint16_t type, uint16_t flags, int ifindex,
+                               uint32_t handle, uint32_t parent, uint32_t info, const char *kind) {
+    struct tcmsg tcm;
+    memset(&tcm, 0, sizeof(tcm));
+    tcm.tcm_family = AF_UNSPEC;
+    tcm.tcm_ifindex = ifindex;
+    tcm.tcm_handle = handle;
+    tcm.tcm_parent = parent;
+    tcm.tcm_info = info;
+    struct nlmsghdr *nlh = nl_batch_add(b, type, flags, &tcm, sizeof(tcm));
+    if (kind) nla_put(b, nlh, TCA_KIND, kind, strlen(kind) + 1);
+    return nlh;
+}
+
+static void fill_ratespec(struct tc_ratespec *r, long kbit) {
+    memset(r, 0, sizeof(*r));
+    r->linklayer = TC_LINKLAYER_ETHERNET;  // kernel computes the rate table itself
+    r->rate = (uint32_t)(kbit * 1000 / 8);
+}
+
+/* RTM_NEWTCLASS for one HTB class; flags 0 gives "tc class change" semantics. */
+static void add_htb_class(nl_batch_t *b, uint16_t flags, int ifindex, uint32_t classid, uint32_t parent,
+                          long rate_kbit, long ceil_kbit, uint32_t prio, uint32_t quantum) {
+    struct tc_htb_opt opt;
+    memset(&opt, 0, sizeof(opt));
+    fill_ratespec(&opt.rate, rate_kbit);
+    fill_ratespec(&opt.ceil, ceil_kbit);
+    // Burst like tc's default (one jiffy at HZ=1000 plus an MTU), expressed in 64 ns psched ticks.
+    uint64_t rate_bps = opt.rate.rate ? opt.rate.rate : 1;
+    uint64_t ceil_bps = opt.ceil.rate ? opt.ceil.rate : 1;
+    opt.buffer = (uint32_t)((rate_bps / 1000 + SHAPER_MTU) * 1000000000ull / rate_bps / 64);
+    opt.cbuffer = (uint32_t)((ceil_bps / 1000 + SHAPER_MTU) * 1000000000ull / ceil_bps / 64);
+    opt.quantum = quantum;
+    opt.prio = prio;
+
+    struct nlmsghdr *nlh = add_tc(b, RTM_NEWTCLASS, flags, ifindex, classid, parent, 0, "htb");
+    struct nlattr *nest = nla_put(b, nlh, TCA_OPTIONS | NLA_F_NESTED, NULL, 0);
+    nla_put(b, nlh, TCA_HTB_PARMS, &opt, sizeof(opt));
+    nla_nest_end(nlh, nest);
+}
+
+static uint32_t class_quantum(long kbit) {
+    long q = kbit * 1000 / 8 / 10;
+    if (q < SHAPER_MTU) q = SHAPER_MTU;
+    if (q > 200000) q = 200000;
+    return (uint32_t)q;
+}
+
+/* Append the class updates for rate_kbit; used both to build and to retune in place. */
+static void add_shaper_classes(nl_batch_t *b, uint16_t flags, int ifindex, long root_kbit) {
+    add_htb_class(b, flags, ifindex, SHAPER_CLASS(0x99), SHAPER_ROOT, root_kbit, root_kbit, 0, class_quantum(root_kbit));
+    add_htb_class(b, flags, ifindex, SHAPER_CLASS(0x100), SHAPER_CLASS(0x99), 1, root_kbit, 100, 1000);
+    for (int c = 0; c < SHAPER_CLASS_COUNT; c++) {
+        long kbit = root_kbit * g_cfg.shaper_share[c] / 100;
+        if (kbit < k_shaper_classes[c].min_kbit) kbit = k_shaper_classes[c].min_kbit;
+        add_htb_class(b, flags, ifindex, SHAPER_CLASS(k_shaper_classes[c].minor), SHAPER_CLASS(0x99),
+                      kbit, root_kbit, k_shaper_classes[c].prio, class_quantum(kbit));
+    }
+}
+
+static void add_mark_filter(nl_batch_t *b, int ifindex, uint32_t mark, uint32_t flowid) {
+    struct nlmsghdr *nlh = add_tc(b, RTM_NEWTFILTER, NLM_F_CREATE | NLM_F_EXCL, ifindex, 0, SHAPER_ROOT,
+                                  TC_H_MAKE(1U << 16, htons(ETH_P_IP)), "u32");
+    struct nlattr *nest = nla_put(b, nlh, TCA_OPTIONS | NLA_F_NESTED, NULL, 0);
+    nla_put_u32(b, nlh, TCA_U32_CLASSID, flowid);
+    struct tc_u32_sel sel;
+    memset(&sel, 0, sizeof(sel));
+    sel.flags = TC_U32_TERMINAL;
+    nla_put(b, nlh, TCA_U32_SEL, &sel, sizeof(sel));
+    struct tc_u32_mark m = { .val = mark, .mask = 0xffffffffU, .success = 0 };
+    nla_put(b, nlh, TCA_U32_MARK, &m, sizeof(m));
+    nla_nest_end(nlh, nest);
+}
+
+static void on_root_qdisc(const struct nlmsghdr *nlh, void *ctx) {
+    if (nlh->nlmsg_type != RTM_NEWQDISC) return;
+    const struct tcmsg *tcm = NLMSG_DATA(nlh);
+    const struct nlattr *tb[TCA_MAX + 1];
+    nla_parse((const char *)tcm + NLMSG_ALIGN(sizeof(*tcm)), nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*tcm)), tb, TCA_MAX);
+    int *found = ctx;
+    if (tcm->tcm_ifindex == found[0] && tcm->tcm_parent == TC_H_ROOT && tcm->tcm_handle == SHAPER_ROOT &&
+        tb[TCA_KIND] && strcmp(NLA_DATA(tb[TCA_KIND]), "htb") == 0) {
+        found[1] = 1;
+    }
+}
+
+static int has_htb_root(int fd, int ifindex) {
+    nl_batch_t b;
+    int err;
+    int found[2] = { ifindex, 0 };
+    nl_batch_init(&b);
+    add_tc(&b, RTM_GETQDISC, NLM_F_DUMP, ifindex, 0, 0, 0, NULL);
+
+    if (nl_exchange(fd, &b, &err, on_root_qdisc, found) != 0) return 0;
+    return found[1];
+}
+
+/* Whole HTB tree in one batch: drop any old root, then root/classes/leaf qdiscs/filters. */
+static int shaper_build(int fd, const shaped_nic_t *nic, long root_kbit) {
+    nl_batch_t b;
+    int errs[NL_BATCH_MAX];
+    nl_batch_init(&b);
+    add_tc(&b, RTM_DELQDISC, 0, nic->ifindex, 0, TC_H_ROOT, 0, NULL);
+
+    struct tc_htb_glob glob = { .version = 3, .rate2quantum = 10, .defcls = 0x100 };
+    struct nlmsghdr *nlh = add_tc(&b, RTM_NEWQDISC, NLM_F_CREATE | NLM_F_EXCL, nic->ifindex, SHAPER_ROOT, TC_H_ROOT, 0, "htb");
+    struct nlattr *nest = nla_put(&b, nlh, TCA_OPTIONS | NLA_F_NESTED, NULL, 0);
+    nla_put(&b, nlh, TCA_HTB_INIT, &glob, sizeof(glob));
+    nla_nest_end(nlh, nest);
+
+    add_shaper_classes(&b, NLM_F_CREATE | NLM_F_EXCL, nic->ifindex, root_kbit);
+    add_tc(&b, RTM_NEWQDISC, NLM_F_CREATE | NLM_F_EXCL, nic->ifindex, TC_H_MAKE(100U << 16, 0), SHAPER_CLASS(0x100), 0, "pfifo");
+    for (int c = 0; c < SHAPER_CLASS_COUNT; c++) {
+        uint32_t flowid = SHAPER_CLASS(k_shaper_classes[c].minor);
+        add_mark_filter(&b, nic->ifindex, k_shaper_classes[c].marks[0], flowid);
+        add_mark_filter(&b, nic->ifindex, k_shaper_classes[c].marks[1], flowid);
+        add_tc(&b, RTM_NEWQDISC, NLM_F_CREATE | NLM_F_EXCL, nic->ifindex,
+               TC_H_MAKE(k_shaper_classes[c].leaf << 16, 0), flowid, 0, "pfifo");
+    }
+
+    int rc = nl_exchange(fd, &b, errs, NULL, NULL);
+    if (rc) return rc;
+    // errs[0] is the delete of a root that may not exist.
+    for (int k = 1; k < b.count; k++) {
+        if (errs[k]) return errs[k];
+    }
+    return 0;
+}
+
+static int shaper_retune(int fd, const shaped_nic_t *nic, long root_kbit) {
+    nl_batch_t b;
+    int errs[NL_BATCH_MAX];
+    nl_batch_init(&b);
+    add_shaper_classes(&b, 0, nic->ifindex, root_kbit);
+    int rc = nl_exchange(fd, &b, errs, NULL, NULL);
+    if (rc) return rc;
+    for (int k = 0; k < b.count; k++) {
+        if (errs[k]) return errs[k];
+    }
+    return 0;
+}
+
+static long shaper_target_kbit(void) {
+    long phy = phy_rate_kbit(g_cfg.shaper_mcs, g_cfg.shaper_nss, g_cfg.wifi_bandwidth, g_cfg.shaper_sgi);
+    long kbit = phy * g_cfg.shaper_efficiency / 100;
+    return kbit < SHAPER_MIN_KBIT ? SHAPER_MIN_KBIT : kbit;
+}
+
+/*
+ * Bring every tx NIC to the configured shaping rate. An existing 1:0 HTB root (ours, or
+ * one built by shaper.sh) is retuned with class changes only, so queued packets survive;
+ * anything else is replaced by a freshly built tree.
+ */
+static void shaper_apply(void) {
+    uint64_t trace_start = trace_now();
+    long root_kbit = shaper_target_kbit();
+    shaper_collect_nics();
+    int fd = nl_open(NETLINK_ROUTE, 0);
+    if (fd < 0) die("shaper: netlink socket failed: %s", strerror(errno));
+
+    for (int i = 0; i < g_shaped_count; i++) {
+        const shaped_nic_t *nic = &g_shaped[i];
+        const char *how = "retuned";
+        int rc = -ENOENT;
+        if (has_htb_root(fd, nic->ifindex)) rc = shaper_retune(fd, nic, root_kbit);
+        if (rc) {
+            how = "built";
+            rc = shaper_build(fd, nic, root_kbit);
+        }
+        if (rc) {
+            fprintf(stderr, "wfb_supervisor: shaper: %s: %s\n", nic->name, strerror(-rc));
+            continue;
+        }
+        fprintf(stderr, "wfb_supervisor: shaper: %s %s at %ld kbit/s (MCS %d, %d MHz%s; video %d%%, telemetry %d%%, tunnel %d%%)\n",
+                how, nic->name, root_kbit, g_cfg.shaper_mcs, g_cfg.wifi_bandwidth, g_cfg.shaper_sgi ? ", short GI" : "",
+                g_cfg.shaper_share[0], g_cfg.shaper_share[1], g_cfg.shaper_share[2]);
+    }
+    close(fd);
+    g_shaper_rate_kbit = (int)root_kbit;
+    trace_span(trace_start, "shaper", "%d NICs at %ld kbit/s", g_shaped_count, root_kbit);
+}
+
+/*
+ * The adaptive controller retunes from an event-loop callback, so it only sends the class
+ * changes; the ACKs come back through g_shaper_watch. A failed retune (say, the root was
+ * deleted underneath) leaves a full shaper_apply() to the top of the loop.
+ */
+static ev_watch_t g_shaper_watch = { .fd = -1 };
+static struct {
+    uint32_t first_seq;
+    int      count;
+} g_shaper_sent[MAX_NICS];        // the latest retune request of each g_shaped NIC
+static int g_shaper_rebuild = 0;
+
+static void on_shaper_ack(ev_watch_t *w, uint32_t events) {
+    (void)events;
+    char rbuf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+    ssize_t n;
+    while ((n = recv(w->fd, rbuf, sizeof(rbuf), MSG_DONTWAIT)) > 0) {
+        size_t len = (size_t)n;
+        for (struct nlmsghdr *nlh = (struct nlmsghdr *)rbuf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+            if (nlh->nlmsg_type != NLMSG_ERROR) continue;
+            int err = *(const int *)NLMSG_DATA(nlh);
+            if (err == 0) continue;
+            const char *name = "an interface";
+            for (int i = 0; i < g_shaped_count; i++) {
+                if (nlh->nlmsg_seq - g_shaper_sent[i].first_seq < (uint32_t)g_shaper_sent[i].count) name = g_shaped[i].name;
+            }
+            if (!g_shaper_rebuild) fprintf(stderr, "wfb_supervisor: shaper: retune of %s failed: %s, rebuilding\n", name, strerror(-err));
+            g_shaper_rebuild = 1;
+        }
+    }
+}
+
+static void shaper_retune_async(void) {
+    if (g_shaper_rate_kbit == 0) {
+        g_shaper_rebuild = 1;
+        return;
+    }
+    if (g_shaper_watch.fd < 0) {
+        g_shaper_watch.fd = nl_open(NETLINK_ROUTE, 0);
+        if (g_shaper_watch.fd < 0) {
+            g_shaper_rebuild = 1;
+            return;
+        }
+        g_shaper_watch.cb = on_shaper_ack;
+        ev_add(&g_shaper_watch, EPOLLIN);
+    }
+    long root_kbit = shaper_target_kbit();
+    for (int i = 0; i < g_shaped_count; i++) {
+        nl_batch_t b;
+        nl_batch_init(&b);
+        add_shaper_classes(&b, 0, g_shaped[i].ifindex, root_kbit);
+        g_shaper_sent[i].first_seq = b.first_seq;
+        g_shaper_sent[i].count = b.count;
+        if (send(g_shaper_watch.fd, b.buf, b.len, MSG_DONTWAIT) < 0) {
+            fprintf(stderr, "wfb_supervisor: shaper: retune of %s not sent: %s, rebuilding\n", g_shaped[i].name, strerror(errno));
+            g_shaper_rebuild = 1;
+        }
+    }
+    g_shaper_rate_kbit = (int)root_kbit;
+    fprintf(stderr, "wfb_supervisor: shaper: retuning %d interface%s to %ld kbit/s (MCS %d)\n", g_shaped_count,
+            g_shaped_count == 1 ? "" : "s", root_kbit, g_cfg.shaper_mcs);
+}
+
+static void shaper_remove(void) {
+    ev_close(&g_shaper_watch);
+    g_shaper_rebuild = 0;
+    if (g_shaper_rate_kbit == 0) return;
+    g_shaper_rate_kbit = 0;
+    int fd = nl_open(NETLINK_ROUTE, 0);
+    if (fd < 0) return;
+    nl_batch_t b;
+    int errs[NL_BATCH_MAX];
+    nl_batch_init(&b);
+    for (int i = 0; i < g_shaped_count; i++) {
+        add_tc(&b, RTM_DELQDISC, 0, g_shaped[i].ifindex, 0, TC_H_ROOT, 0, NULL);
+    }
+    if (b.count > 0 && nl_exchange(fd, &b, errs, NULL, NULL) == 0) {
+        fprintf(stderr, "wfb_supervisor: shaper: removed from %d interface%s\n", b.count, b.count == 1 ? "" : "s");
+    }
+    close(fd);
+}
+
+/* cgroup v2 */
+
+#define CG_REAP_MS     10    // retry interval for leaves whose killed members are still being released
+#define CG_REAP_TRIES  100
+
+static int  g_cg_root_fd = -1;   // cgroup_root, holding one leaf per instance
+static char g_cg_root_path[PATH_MAX];
+static char **g_cg_gone;         // leaves waiting for rmdir, retried from g_cg_reap_timer
+static int  g_cg_gone_count = 0;
+static int  g_cg_gone_cap = 0;
+static int  g_cg_reap_tries = 0;
+static ev_watch_t g_cg_reap_timer = { .fd = -1 };
+
+static int cg_write(int dirfd, const char *file, const char *val) {
+    int fd = openat(dirfd, file, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return -errno;
+    int rc = write(fd, val, strlen(val)) < 0 ? -errno : 0;
+    close(fd);
+    return rc;
+}
+
+static int cg_read(int dirfd, const char *file, char *buf, size_t len) {
+    int fd = openat(dirfd, file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = read(fd, buf, len - 1);
+    close(fd);
+    if (n < 0) return -1;
+    buf[n] = '\0';
+    return 0;
+}
+
+/* A single-value file (memory.peak), or the "key value" line of a flat-keyed one (cpu.stat); -1 if absent. */
+static long long cg_value(int dirfd, const char *file, const char *key) {
+    char buf[1024];
+    if (cg_read(dirfd, file, buf, sizeof(buf)) != 0) return -1;
+    if (!key) return strtoll(buf, NULL, 10);
+    size_t klen = strlen(key);
+    for (char *line = buf; *line; ) {
+        if (strncmp(line, key, klen) == 0 && line[klen] == ' ') return strtoll(line + klen + 1, NULL, 10);
+        char *nl = strchr(line, '\n');
+        if (!nl) break;
+        line = nl + 1;
+    }
+    return -1;
+}
+
+static int cg_populated(const instance_t *inst) {
+    return inst->cg_dir >= 0 && cg_value(inst->cg_dir, "cgroup.events", "populated") == 1;
+}
+
+/* SIGKILLs every process in the leaf at once (Linux 5.14+); -errno when unavailable. */
+static int cg_kill(const instance_t *inst) {
+    if (inst->cg_dir < 0) return -ENOENT;
+    return cg_write(inst->cg_dir, "cgroup.kill", "1");
+}
+
+static const char *cg_mount(void) {
+    static const char *const k_mounts[] = { "/sys/fs/cgroup", "/sys/fs/cgroup/unified" };
+    struct statfs sf;
+    for (size_t i = 0; i < sizeof(k_mounts) / sizeof(k_mounts[0]); i++) {
+        if (statfs(k_mounts[i], &sf) == 0 && sf.f_type == CGROUP2_MAGIC) return k_mounts[i];
+    }
+    return NULL;
+}
+
+static void cg_limit(const instance_t *inst, const char *file, const char *val) {
+    int rc = cg_write(inst->cg_dir, file, val);
+    if (rc) {
+        fprintf(stderr, "wfb_supervisor: cgroup: %s=%s for '%s' not applied: %s\n", file, val, inst->name,
+                rc == -ENOENT ? "controller not available" : strerror(-rc));
+    }
+}
+
+/* 1 once the leaf is gone (or cannot be removed for another reason than members still leaving). */
+static int cg_rmdir_leaf(const char *name) {
+    return unlinkat(g_cg_root_fd, name, AT_REMOVEDIR) == 0 || errno != EBUSY;
+}
+
+static void cg_gone_drop(int i) {
+    free(g_cg_gone[i]);
+    g_cg_gone[i] = g_cg_gone[--g_cg_gone_count];
+}
+
+static int cg_gone_cancel(const char *name) {
+    for (int i = 0; i < g_cg_gone_count; i++) {
+        if (strcmp(g_cg_gone[i], name) != 0) continue;
+        cg_gone_drop(i);
+        return 1;
+    }
+    return 0;
+}
+
+static void cg_reap(void) {
+    for (int i = g_cg_gone_count - 1; i >= 0; i--) {
+        if (cg_rmdir_leaf(g_cg_gone[i])) cg_gone_drop(i);
+    }
+}
+
+static void on_cg_reap(ev_watch_t *w, uint32_t events) {
+    (void)events;
+    timer_drain(w->fd);
+    cg_reap();
+    if (g_cg_gone_count == 0) return;
+    if (++g_cg_reap_tries < CG_REAP_TRIES) {
+        timer_arm_ms(w->fd, CG_REAP_MS);
+        return;
+    }
+    while (g_cg_gone_count > 0) {
+        fprintf(stderr, "wfb_supervisor: cgroup: %s/%s still busy, leaving it behind\n", g_cg_root_path, g_cg_gone[0]);
+        cg_gone_drop(0);
+    }
+}
+
+/* Killed members take a moment to be released and rmdir reports EBUSY until then; the event loop retries it. */
+static void cg_gone_add(const char *name) {
+    if (g_cg_gone_count == g_cg_gone_cap) {
+        int cap = g_cg_gone_cap ? g_cg_gone_cap * 2 : 8;
+        char **grown = realloc(g_cg_gone, (size_t)cap * sizeof(*grown));
+        if (!grown) die("out of memory");
+        g_cg_gone = grown;
+        g_cg_gone_cap = cap;
+    }
+    if (!(g_cg_gone[g_cg_gone_count++] = strdup(name))) die("out of memory");
+    if (g_cg_reap_timer.fd < 0) {
+        g_cg_reap_timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (g_cg_reap_timer.fd < 0) die("timerfd_create failed: %s", strerror(errno));
+        g_cg_reap_timer.cb = on_cg_reap;
+        ev_add(&g_cg_reap_timer, EPOLLIN);
+    }
+    g_cg_reap_tries = 0;
+    timer_arm_ms(g_cg_reap_timer.fd, CG_REAP_MS);
+}
+
+static void cg_leaf_setup(instance_t *inst) {
+    if (strchr(inst->name, '/') || inst->name[0] == '.') {
+        fprintf(stderr, "wfb_supervisor: cgroup: instance name '%s' is not a valid cgroup name, not confining it\n", inst->name);
+        return;
+    }
+    if (mkdirat(g_cg_root_fd, inst->name, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "wfb_supervisor: cgroup: cannot create %s/%s: %s\n", g_cg_root_path, inst->name, strerror(errno));
+        return;
+    }
+    inst->cg_dir = openat(g_cg_root_fd, inst->name, O_DIRECTORY | O_RDONLY | O_CLOEXEC);
+    if (inst->cg_dir < 0) return;
+    // Leftovers of a supervisor that died without tearing down.
+    if (cg_populated(inst)) cg_kill(inst);
+    // A leaf of the same name still draining is taken over; its old limits go back to the defaults.
+    if (cg_gone_cancel(inst->name)) {
+        static const char *const k_defaults[][2] = {
+            { "cpu.weight", "100" }, { "cpu.max", "max" }, { "memory.high", "max" }, { "memory.max", "max" }, { "cpuset.cpus", "" },
+        };
+        for (size_t i = 0; i < sizeof(k_defaults) / sizeof(k_defaults[0]); i++) cg_write(inst->cg_dir, k_defaults[i][0], k_defaults[i][1]);
+    }
+
+    char v[16];
+    if (inst->cpu_weight) {
+        snprintf(v, sizeof(v), "%d", inst->cpu_weight);
+        cg_limit(inst, "cpu.weight", v);
+    }
+    if (inst->cpu_max[0]) cg_limit(inst, "cpu.max", inst->cpu_max);
+    if (inst->memory_high[0]) cg_limit(inst, "memory.high", inst->memory_high);
+    if (inst->memory_max[0]) cg_limit(inst, "memory.max", inst->memory_max);
+    if (inst->cpuset[0]) cg_limit(inst, "cpuset.cpus", inst->cpuset);
+}
+
+/*
+ * Create cgroup_root (default <cgroup2 mount>/wfb_supervisor) with one leaf per instance.
+ * The supervisor itself stays in the cgroup it was started in.
+ */
+static void cg_setup(void) {
+    if (!g_cfg.cgroup) return;
+    const char *mnt = cg_mount();
+    if (!mnt) {
+        fprintf(stderr, "wfb_supervisor: cgroup: no cgroup v2 hierarchy mounted, running without per-instance cgroups\n");
+        return;
+    }
+    if (g_cfg.cgroup_root[0]) snprintf(g_cg_root_path, sizeof(g_cg_root_path), "%s", g_cfg.cgroup_root);
+    else snprintf(g_cg_root_path, sizeof(g_cg_root_path), "%s/wfb_supervisor", mnt);
+    if (mkdir(g_cg_root_path, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "wfb_supervisor: cgroup: cannot create %s: %s\n", g_cg_root_path, strerror(errno));
+        return;
+    }
+    g_cg_root_fd = open(g_cg_root_path, O_DIRECTORY | O_RDONLY | O_CLOEXEC);
+    if (g_cg_root_fd < 0) return;
+
+    // Controllers bound to a v1 hierarchy fail here; their limits are reported per instance.
+    int parent = openat(g_cg_root_fd, "..", O_DIRECTORY | O_RDONLY | O_CLOEXEC);
+    static const char *const k_controllers[] = { "+cpu", "+memory", "+cpuset" };
+    for (size_t i = 0; i < sizeof(k_controllers) / sizeof(k_controllers[0]); i++) {
+        if (parent >= 0) cg_write(parent, "cgroup.subtree_control", k_controllers[i]);
+        cg_write(g_cg_root_fd, "cgroup.subtree_control", k_controllers[i]);
+    }
+    if (parent >= 0) close(parent);
+
+    for (int i = 0; i < g_instance_count; i++) cg_leaf_setup(&g_instances[i]);
+    fprintf(stderr, "wfb_supervisor: cgroup: instances confined under %s\n", g_cg_root_path);
+}
+
+static const char *cg_describe(const instance_t *inst, char *buf, size_t len) {
+    int dir = inst->cg_dir;
+    long long usage = cg_value(dir, "cpu.stat", "usage_usec");
+    long long throttled = cg_value(dir, "cpu.stat", "throttled_usec");
+    long long peak = cg_value(dir, "memory.peak", NULL);
+    long long current = cg_value(dir, "memory.current", NULL);
+    size_t off = (size_t)snprintf(buf, len, "cgroup: cpu %.2f s", usage > 0 ? usage / 1e6 : 0.0);
+    if (throttled > 0 && off < len) off += (size_t)snprintf(buf + off, len - off, " (throttled %.2f s)", throttled / 1e6);
+    if (peak >= 0 && off < len) off += (size_t)snprintf(buf + off, len - off, ", memory peak %.1f MiB", peak / 1048576.0);
+    else if (current >= 0 && off < len) off += (size_t)snprintf(buf + off, len - off, ", memory %.1f MiB", current / 1048576.0);
+    static const char *const k_events[] = { "high", "max", "oom", "oom_kill" };
+    for (size_t i = 0; i < sizeof(k_events) / sizeof(k_events[0]) && off < len; i++) {
+        long long n = cg_value(dir, "memory.events", k_events[i]);
+        if (n > 0) off += (size_t)snprintf(buf + off, len - off, ", %s %lld", k_events[i], n);
+    }
+    return buf;
+}
+
+static void cg_leaf_remove(instance_t *inst) {
+    if (inst->cg_dir < 0) return;
+    if (cg_populated(inst)) cg_kill(inst);
+    close(inst->cg_dir);
+    inst->cg_dir = -1;
+    if (!cg_rmdir_leaf(inst->name)) cg_gone_add(inst->name);
+}
+
+static void cg_teardown(void) {
+    if (g_cg_root_fd < 0) return;
+    for (int i = 0; i < g_instance_count; i++) cg_leaf_remove(&g_instances[i]);
+    // The root goes too, so wait here for the leaves, bounded once for all of them rather than per leaf.
+    while (g_cg_gone_count > 0 && g_cg_reap_timer.fd >= 0) ev_run_once(-1);
+    close(g_cg_root_fd);
+    g_cg_root_fd = -1;
+    rmdir(g_cg_root_path);  // fails harmlessly if something else lives there
+}
+
+/* Placement */
+
+#define MAX_STEERED 64
+
+/* Sysfs/procfs values rewritten by irq_affinity=, restored in reverse order on cleanup. */
+static struct {
+    char path[128];
+    char orig[128];
+} g_steered[MAX_STEERED];
+static int g_steered_count = 0;
+
+static int steer_write(const char *path, const char *val) {
+    for (int i = 0; i < g_steered_count; i++) {
+        if (strcmp(g_steered[i].path, path) == 0) return cg_write(AT_FDCWD, path, val);
+    }
+    if (g_steered_count >= MAX_STEERED) return -ENOSPC;
+    char orig[128];
+    if (cg_read(AT_FDCWD, path, orig, sizeof(orig)) != 0) return -errno;
+    int rc = cg_write(AT_FDCWD, path, val);
+    if (rc) return rc;
+    orig[strcspn(orig, "\n")] = '\0';
+    snprintf(g_steered[g_steered_count].path, sizeof(g_steered[0].path), "%s", path);
+    snprintf(g_steered[g_steered_count].orig, sizeof(g_steered[0].orig), "%s", orig);
+    g_steered_count++;
+    return 0;
+}
+
+/* Hex cpumask in the comma-separated 32-bit word format of rps_cpus/xps_cpus. */
+static void cpu_mask_hex(const cpu_set_t *set, char *buf, size_t len) {
+    int top = 0;
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (CPU_ISSET(c, set)) top = c;
+    }
+    size_t off = 0;
+    for (int w = top / 32; w >= 0 && off < len; w--) {
+        uint32_t word = 0;
+        for (int b = 0; b < 32; b++) {
+            if (CPU_ISSET(w * 32 + b, set)) word |= 1u << b;
+        }
+        off += (size_t)snprintf(buf + off, len - off, w == top / 32 ? "%x" : ",%08x", word);
+    }
+}
+
+/* IRQs of a NIC's device, or of the closest parent that has them (the host controller of a USB adapter). */
+static int nic_irqs(const char *nic, int *irqs, int max) {
+    char link[PATH_MAX], dir[PATH_MAX];
+    snprintf(link, sizeof(link), "/sys/class/net/%s/device", nic);
+    if (!realpath(link, dir)) return 0;
+    while (strlen(dir) > strlen("/sys/devices")) {
+        char path[PATH_MAX + 16];
+        int n = 0;
+        snprintf(path, sizeof(path), "%s/msi_irqs", dir);
+        DIR *d = opendir(path);
+        if (d) {
+            struct dirent *de;
+            while ((de = readdir(d)) && n < max) {
+                if (isdigit((unsigned char)de->d_name[0])) irqs[n++] = atoi(de->d_name);
+            }
+            closedir(d);
+        }
+        if (n == 0) {
+            char val[32];
+            snprintf(path, sizeof(path), "%s/irq", dir);
+            int fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (fd >= 0) {
+                ssize_t r = read(fd, val, sizeof(val) - 1);
+                close(fd);
+                if (r > 0) {
+                    val[r] = '\0';
+                    if (atoi(val) > 0) irqs[n++] = atoi(val);
+                }
+            }
+        }
+        if (n > 0) return n;
+        char *slash = strrchr(dir, '/');
+        if (!slash) break;
+        *slash = '\0';
+    }
+    return 0;
+}
+
+/* Is word a whitespace-delimited token of s? */
+static int has_word(const char *s, const char *word) {
+    size_t len = strlen(word);
+    for (const char *p = strstr(s, word); p; p = strstr(p + 1, word)) {
+        if ((p == s || isspace((unsigned char)p[-1])) && (p[len] == '\0' || isspace((unsigned char)p[len]))) return 1;
+    }
+    return 0;
+}
+
+static void steer_nic(const instance_t *inst, const char *nic) {
+    char path[PATH_MAX], mask[80];
+    int irqs[16];
+    int n = nic_irqs(nic, irqs, 16);
+    int steered_irqs = 0, queues = 0;
+    for (int i = 0; i < n; i++) {
+        snprintf(path, sizeof(path), "/proc/irq/%d/smp_affinity_list", irqs[i]);
+        int rc = steer_write(path, inst->cpu_list);
+        if (rc == 0) steered_irqs++;
+        else fprintf(stderr, "wfb_supervisor: irq: IRQ %d of %s: %s\n", irqs[i], nic, strerror(-rc));
+    }
+
+    cpu_mask_hex(&inst->cpus, mask, sizeof(mask));
+    snprintf(path, sizeof(path), "/sys/class/net/%s/queues", nic);
+    DIR *d = opendir(path);
+    struct dirent *de;
+    while (d && (de = readdir(d))) {
+        const char *file = strncmp(de->d_name, "rx-", 3) == 0 ? "rps_cpus" :
+                           strncmp(de->d_name, "tx-", 3) == 0 ? "xps_cpus" : NULL;
+        if (!file) continue;
+        snprintf(path, sizeof(path), "/sys/class/net/%s/queues/%s/%s", nic, de->d_name, file);
+        if (steer_write(path, mask) == 0) queues++;  // xps_cpus is absent on single-queue drivers
+    }
+    if (d) closedir(d);
+    fprintf(stderr, "wfb_supervisor: irq: %s: %d IRQ%s and %d queue%s steered to CPU %s for '%s'\n", nic,
+            steered_irqs, steered_irqs == 1 ? "" : "s", queues, queues == 1 ? "" : "s", inst->cpu_list, inst->name);
+}
+
+/* Move NIC interrupts and RPS/XPS work onto the CPUs of the instance consuming that NIC. */
+static void irq_steer_setup(void) {
+    const char *lists[2] = { get_param_value("rx_nics"), get_param_value("tx_nics") };
+    static strbuf_t cmd_sb, done;
+    for (int i = 0; i < g_instance_count; i++) {
+        const instance_t *inst = &g_instances[i];
+        if (!inst->irq_affinity) continue;
+        const char *cmd = tmpl_expand(&inst->cmd_tmpl, &cmd_sb);
+        sb_reset(&done);
+        sb_puts(&done, " ");
+        for (int l = 0; l < 3; l++) {
+            // An explicit irq_affinity=<nics> list, or the rx_nics/tx_nics named in the command.
+            const char *list = inst->irq_nics[0] ? (l == 0 ? inst->irq_nics : NULL) : (l < 2 ? lists[l] : NULL);
+            if (!list) continue;
+            char *copy = strdup(list);
+            if (!copy) die("out of memory");
+            char *save = NULL;
+            for (char *tok = strtok_r(copy, " \t,", &save); tok; tok = strtok_r(NULL, " \t,", &save)) {
+                if (!inst->irq_nics[0] && !has_word(cmd, tok)) continue;
+                if (has_word(done.buf, tok)) continue;
+                sb_printf(&done, "%s ", tok);
+                steer_nic(inst, tok);
+            }
+            free(copy);
+        }
+    }
+}
+
+static void irq_steer_restore(void) {
+    for (int i = g_steered_count - 1; i >= 0; i--) {
+        int rc = cg_write(AT_FDCWD, g_steered[i].path, g_steered[i].orig);
+        if (rc) fprintf(stderr, "wfb_supervisor: irq: restoring %s: %s\n", g_steered[i].path, strerror(-rc));
+    }
+    if (g_steered_count > 0) {
+        fprintf(stderr, "wfb_supervisor: irq: restored %d interrupt/queue mask%s\n", g_steered_count, g_steered_count == 1 ? "" : "s");
+    }
+    g_steered_count = 0;
+}
+
+/* Build commands */
+
+/*
+ * Split cmd into words once at load time using sh-like quoting ('...', "...", backslash) and
+ * compile each word. A word with no quoting at all is field-split after expansion, so
+ * "$rx_nics" holding several NICs still becomes several arguments. Shell syntax (pipes,
+ * redirection, $(...)) requires an explicit shell=yes.
+ */
+static void tokenize_command(instance_t *inst) {
+    inst->argv_count = 0;
+    if (inst->shell) return;
+
+    const char *p = inst->cmd;
+    char *words = arena_alloc(&g_cfg.arena, strlen(p) + 1);  // unquoting never grows a word
+    int cap = 0, split_cap = 0;
+    size_t out = 0;
+    while (*p) {
+        while (*p && isspace((unsigned char)*p)) p++;
+        if (!*p) break;
+
+        char *word = words + out;
+        int quoted = 0;
+        while (*p && !isspace((unsigned char)*p)) {
+            char c = *p++;
+            if (c == '\'') {
+                quoted = 1;
+                while (*p && *p != '\'') words[out++] = *p++;
+                if (!*p) die("instance '%s': unterminated single quote in cmd", inst->name);
+                p++;
+            } else if (c == '"') {
+                quoted = 1;
+                while (*p && *p != '"') {
+                    if (*p == '\\' && p[1] && strchr("\\\"$`", p[1])) p++;
+                    else if (*p == '`' || (*p == '$' && p[1] == '(')) goto needs_shell;
+                    words[out++] = *p++;
+                }
+                if (!*p) die("instance '%s': unterminated double quote in cmd", inst->name);
+                p++;
+            } else if (c == '\\') {
+                quoted = 1;
+                if (*p) words[out++] = *p++;
+            } else if (c == '$' && *p == '{') {
+                const char *close = strchr(p, '}');
+                if (!close) die("instance '%s': unterminated ${ in cmd", inst->name);
+                words[out++] = c;
+                while (p <= close) words[out++] = *p++;
+            } else if (strchr("|&;<>()`*?[]{}~", c) || (c == '$' && *p == '(')) {
+                goto needs_shell;
+            } else {
+                words[out++] = c;
+            }
+        }
+        words[out++] = '\0';
+        if (inst->argv_count == 0 && !quoted && strcmp(word, "exec") == 0) continue;
+
+        inst->argv_tmpl = arena_grow(&g_cfg.arena, inst->argv_tmpl, inst->argv_count, &cap, sizeof(tmpl_t));
+        inst->argv_split = arena_grow(&g_cfg.arena, inst->argv_split, inst->argv_count, &split_cap, 1);
+        tmpl_compile(&inst->argv_tmpl[inst->argv_count], word);
+        inst->argv_split[inst->argv_count++] = (unsigned char)!quoted;
+    }
+    if (inst->argv_count == 0) die("instance '%s': cmd is empty", inst->name);
+    return;
+
+needs_shell:
+    die("instance '%s': cmd uses shell syntax; set shell=yes to run it via /bin/sh", inst->name);
+}
+
+static void compile_instance(instance_t *inst) {
+    tmpl_compile(&inst->cmd_tmpl, inst->cmd);
+    tokenize_command(inst);
+}
+
+/* Hooks and instance commands, once the parameter table is final. */
+static void compile_commands(void) {
+    for (int i = 0; i < g_cfg.init_cmd_count; i++) tmpl_compile(&g_cfg.init_cmds[i].tmpl, g_cfg.init_cmds[i].cmd);
+    for (int i = 0; i < g_cfg.cleanup_cmd_count; i++) tmpl_compile(&g_cfg.cleanup_cmds[i].tmpl, g_cfg.cleanup_cmds[i].cmd);
+    for (int i = 0; i < g_instance_count; i++) compile_instance(&g_instances[i]);
+    // Templates too, so --check reports their errors before any NIC shows up.
+    for (int i = 0; i < g_cfg.template_count; i++) compile_instance(&g_cfg.templates[i]);
+}
+
+/* A rendered command line: the words live in buf, argv points into it (NULL-terminated). */
+typedef struct {
+    strbuf_t buf;
+    char   **argv;
+    size_t  *off;
+    int      argc;
+    int      cap;
+} cmdline_t;
+
+static void cmdline_add(cmdline_t *cl, size_t off) {
+    if (cl->argc + 1 >= cl->cap) {
+        int cap = cl->cap ? cl->cap * 2 : 32;
+        char **argv = realloc(cl->argv, (size_t)cap * sizeof(*argv));
+        size_t *offs = realloc(cl->off, (size_t)cap * sizeof(*offs));
+        if (!argv || !offs) die("out of memory");
+        cl->argv = argv;
+        cl->off = offs;
+        cl->cap = cap;
+    }
+    cl->off[cl->argc++] = off;
+}
+
+/* Render the compiled words in one pass, splitting the unquoted ones on whitespace. */
+static void render_argv(const instance_t *inst, cmdline_t *cl) {
+    sb_reset(&cl->buf);
+    cl->argc = 0;
+    for (int t = 0; t < inst->argv_count; t++) {
+        size_t start = cl->buf.len;
+        tmpl_render(&inst->argv_tmpl[t], &cl->buf);
+        sb_append(&cl->buf, "", 1);
+        if (!inst->argv_split[t]) {
+            cmdline_add(cl, start);
+            continue;
+        }
+        char *word = cl->buf.buf;
+        size_t q = start;
+        while (word[q]) {
+            while (word[q] && isspace((unsigned char)word[q])) word[q++] = '\0';
+            if (!word[q]) break;
+            cmdline_add(cl, q);
+            while (word[q] && !isspace((unsigned char)word[q])) q++;
+        }
+    }
+    if (cl->argc == 0) die("instance '%s': cmd expands to nothing", inst->name);
+}
+
+static void build_command(const instance_t *inst, cmdline_t *cl) {
+    if (!inst->shell) {
+        render_argv(inst, cl);
+    } else {
+        static strbuf_t expanded;
+        wrap_exec(tmpl_expand(&inst->cmd_tmpl, &expanded), &cl->buf);
+        cl->argc = 0;
+        cmdline_add(cl, 0);
+    }
+    for (int k = 0; k < cl->argc; k++) cl->argv[k] = cl->buf.buf + cl->off[k];
+    if (inst->shell) {
+        cl->argv[2] = cl->argv[0];
+        cl->argv[0] = "/bin/sh";
+        cl->argv[1] = "-c";
+        cl->argc = 3;
+    }
+    cl->argv[cl->argc] = NULL;
+}
+
+/* System tuning ([tuning]) */
+
+#define MAX_TUNED 128
+
+/* Values rewritten by [tuning], restored in reverse order on cleanup. */
+static struct {
+    char path[128];          // sysfs/procfs file, or the NIC name for wifi_powersave
+    char orig[128];
+    int  ifindex;            // > 0: nl80211 power save of this interface, orig "0"/"1"
+} g_tuned[MAX_TUNED];
+static int g_tuned_count = 0;
+
+static int tune_find(const char *path, int ifindex) {
+    for (int i = 0; i < g_tuned_count; i++) {
+        if (g_tuned[i].ifindex == ifindex && strcmp(g_tuned[i].path, path) == 0) return i;
+    }
+    return -1;
+}
+
+/* Current value of a sysfs/procfs file; for THP the [selected] choice out of "always [madvise] never". */
+static int tune_read(const char *path, char *buf, size_t len) {
+    if (cg_read(AT_FDCWD, path, buf, len) != 0) return -errno;
+    char *open = strchr(buf, '['), *close = open ? strchr(open, ']') : NULL;
+    if (open && close) {
+        memmove(buf, open + 1, (size_t)(close - open - 1));
+        buf[close - open - 1] = '\0';
+    }
+    buf[strcspn(buf, "\n")] = '\0';
+    for (char *p = buf; *p; p++) {
+        if (*p == '\t') *p = ' ';
+    }
+    return 0;
+}
+
+static void tune_file(const char *what, const char *path, const char *val) {
+    char cur[128];
+    int rc = tune_read(path, cur, sizeof(cur));
+    if (rc == 0 && strcmp(cur, val) == 0) return;
+    if (rc == 0) rc = cg_write(AT_FDCWD, path, val);
+    if (rc) {
+        fprintf(stderr, "wfb_supervisor: tuning: %s=%s: %s\n", what, val, strerror(-rc));
+        return;
+    }
+    if (tune_find(path, 0) < 0) {
+        if (g_tuned_count >= MAX_TUNED) {
+            fprintf(stderr, "wfb_supervisor: tuning: too many settings (max %d), %s will not be restored\n", MAX_TUNED, path);
+            return;
+        }
+        snprintf(g_tuned[g_tuned_count].path, sizeof(g_tuned[0].path), "%s", path);
+        snprintf(g_tuned[g_tuned_count].orig, sizeof(g_tuned[0].orig), "%s", cur);
+        g_tuned[g_tuned_count++].ifindex = 0;
+    }
+    fprintf(stderr, "wfb_supervisor: tuning: %s %s -> %s\n", what, cur, val);
+}
+
+/* The same cpufreq file of every CPU; "max" for cpu_min_freq takes each CPU's cpuinfo_max_freq. */
+static void tune_cpus(const char *what, const char *file, const char *val) {
+    DIR *d = opendir("/sys/devices/system/cpu");
+    if (!d) {
+        fprintf(stderr, "wfb_supervisor: tuning: %s: %s\n", what, strerror(errno));
+        return;
+    }
+    int cpus = 0;
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        if (strncmp(de->d_name, "cpu", 3) != 0 || !isdigit((unsigned char)de->d_name[3])) continue;
+        char path[PATH_MAX], max[32], label[NAME_MAX + 32];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/%s/cpufreq/cpuinfo_max_freq", de->d_name);
+        const char *want = val;
+        if (strcasecmp(val, "max") == 0) {
+            if (tune_read(path, max, sizeof(max)) != 0) continue;
+            want = max;
+        }
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/%s/cpufreq/%s", de->d_name, file);
+        if (access(path, F_OK) != 0) continue;  // offline, or no cpufreq driver
+        snprintf(label, sizeof(label), "%s %s", de->d_name, what);
+        tune_file(label, path, want);
+        cpus++;
+    }
+    closedir(d);
+    if (cpus == 0) fprintf(stderr, "wfb_supervisor: tuning: %s: no cpufreq policies found\n", what);
+}
+
+static void on_power_save(const struct nlmsghdr *nlh, void *ctx) {
+    const struct nlattr *tb[NL80211_ATTR_MAX + 1];
+    nla_parse((const char *)NLMSG_DATA(nlh) + GENL_HDRLEN, nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN), tb, NL80211_ATTR_MAX);
+    if (tb[NL80211_ATTR_PS_STATE]) *(int *)ctx = nla_get_u32(tb[NL80211_ATTR_PS_STATE]) == NL80211_PS_ENABLED;
+}
+
+static int set_power_save(int fd, int fam, int ifindex, int on) {
+    nl_batch_t b;
+    int err;
+    nic_t nic = { .ifindex = ifindex };
+    nl_batch_init(&b);
+    struct nlmsghdr *nlh = add_nl80211(&b, fam, NL80211_CMD_SET_POWER_SAVE, &nic);
+    nla_put_u32(&b, nlh, NL80211_ATTR_PS_STATE, on ? NL80211_PS_ENABLED : NL80211_PS_DISABLED);
+    int rc = nl_exchange(fd, &b, &err, NULL, NULL);
+    return rc ? rc : err;
+}
+
+/* Power save of every rx_nics/tx_nics NIC, one GET and SET per NIC. */
+static void tune_power_save(int on) {
+    const char *lists[2] = { get_param_value("rx_nics"), get_param_value("tx_nics") };
+    int gn = nl_open(NETLINK_GENERIC, 0);
+    int fam = gn >= 0 ? genl_family_id(gn, "nl80211") : -1;
+    if (fam < 0) {
+        fprintf(stderr, "wfb_supervisor: tuning: wifi_powersave: nl80211 unavailable\n");
+        if (gn >= 0) close(gn);
+        return;
+    }
+    for (int l = 0; l < 2; l++) {
+        if (!lists[l]) continue;
+        char *copy = strdup(lists[l]);
+        if (!copy) die("out of memory");
+        char *save = NULL;
+        for (char *tok = strtok_r(copy, " \t,", &save); tok; tok = strtok_r(NULL, " \t,", &save)) {
+            int idx = (int)if_nametoindex(tok);
+            if (idx == 0 || tune_find(tok, idx) >= 0) continue;
+            nl_batch_t b;
+            int err, cur = -1;
+            nic_t nic = { .ifindex = idx };
+            nl_batch_init(&b);
+            add_nl80211(&b, fam, NL80211_CMD_GET_POWER_SAVE, &nic);
+            int rc = nl_exchange(gn, &b, &err, on_power_save, &cur);
+            if (rc == 0) rc = err;
+            if (rc == 0 && cur == on) continue;
+            if (rc == 0) rc = set_power_save(gn, fam, idx, on);
+            if (rc) {
+                fprintf(stderr, "wfb_supervisor: tuning: %s: wifi_powersave=%s: %s\n", tok, on ? "on" : "off", strerror(-rc));
+                continue;
+            }
+            if (g_tuned_count >= MAX_TUNED) continue;
+            snprintf(g_tuned[g_tuned_count].path, sizeof(g_tuned[0].path), "%s", tok);
+            snprintf(g_tuned[g_tuned_count].orig, sizeof(g_tuned[0].orig), "%d", cur);
+            g_tuned[g_tuned_count++].ifindex = idx;
+            fprintf(stderr, "wfb_supervisor: tuning: %s power save %s\n", tok, on ? "on" : "off");
+        }
+        free(copy);
+    }
+    close(gn);
+}
+
+/* Apply [tuning] in file order, remembering every value that actually changed. */
+static void tuning_apply(void) {
+    if (g_cfg.tuning_count == 0) return;
+    uint64_t trace_start = trace_now();
+    for (int i = 0; i < g_cfg.tuning_count; i++) {
+        const tuning_t *t = &g_cfg.tuning[i];
+        char path[160];
+        switch (t->kind) {
+        case TUNE_SYSCTL:
+            snprintf(path, sizeof(path), "/proc/sys/%s", t->key);
+            for (char *p = path + strlen("/proc/sys/"); *p; p++) {
+                if (*p == '.') *p = '/';
+            }
+            tune_file(t->key, path, t->val);
+            break;
+        case TUNE_GOVERNOR:
+            tune_cpus("governor", "scaling_governor", t->val);
+            break;
+        case TUNE_MIN_FREQ:
+            tune_cpus("min freq", "scaling_min_freq", t->val);
+            break;
+        case TUNE_WIFI_PS: {
+            int on = 0;
+            parse_bool(t->val, &on);
+            tune_power_save(on);
+            break;
+        }
+        case TUNE_THP:
+            tune_file("thp", "/sys/kernel/mm/transparent_hugepage/enabled", t->val);
+            break;
+        case TUNE_THP_DEFRAG:
+            tune_file("thp_defrag", "/sys/kernel/mm/transparent_hugepage/defrag", t->val);
+            break;
+        }
+    }
+    trace_span(trace_start, "tuning", "%d settings changed", g_tuned_count);
+}
+
+static void tuning_restore(void) {
+    int gn = -1, fam = -1;
+    for (int i = g_tuned_count - 1; i >= 0; i--) {
+        int rc;
+        if (g_tuned[i].ifindex > 0) {
+            if (gn < 0) {
+                gn = nl_open(NETLINK_GENERIC, 0);
+                fam = gn >= 0 ? genl_family_id(gn, "nl80211") : -1;
+            }
+            // An unplugged NIC has nothing left to restore.
+            if (fam < 0 || (int)if_nametoindex(g_tuned[i].path) != g_tuned[i].ifindex) continue;
+            rc = set_power_save(gn, fam, g_tuned[i].ifindex, atoi(g_tuned[i].orig));
+        } else {
+            rc = cg_write(AT_FDCWD, g_tuned[i].path, g_tuned[i].orig);
+        }
+        if (rc) fprintf(stderr, "wfb_supervisor: tuning: restoring %s: %s\n", g_tuned[i].path, strerror(-rc));
+    }
+    if (gn >= 0) close(gn);
+    if (g_tuned_count > 0) {
+        fprintf(stderr, "wfb_supervisor: tuning: restored %d setting%s\n", g_tuned_count, g_tuned_count == 1 ? "" : "s");
+    }
+    g_tuned_count = 0;
+}
+
+static long long sysctl_value(const char *path) {
+    char buf[64];
+    if (cg_read(AT_FDCWD, path, buf, sizeof(buf)) != 0) return -1;
+    return atoll(buf);
+}
+
+/*
+ * The kernel silently clamps SO_RCVBUF/SO_SNDBUF to rmem_max/wmem_max, so check the -R/-s
+ * sizes the wfb_* commands ask for. Returns -1 when a clamp is found and socket_buffers=fail.
+ */
+static int tuning_check_buffers(void) {
+    if (g_cfg.socket_buffers == 0) return 0;
+    static const struct { const char *opt; const char *sysctl; const char *path; } k_opts[] = {
+        { "-R", "net.core.rmem_max", "/proc/sys/net/core/rmem_max" },
+        { "-s", "net.core.wmem_max", "/proc/sys/net/core/wmem_max" },
+    };
+    static cmdline_t cl;
+    int clamped = 0;
+    for (int i = 0; i < g_instance_count; i++) {
+        const instance_t *inst = &g_instances[i];
+        if (inst->shell) continue;
+        build_command(inst, &cl);
+        const char *base = strrchr(cl.argv[0], '/');
+        if (strncmp(base ? base + 1 : cl.argv[0], "wfb_", 4) != 0) continue;
+        for (int k = 1; k < cl.argc; k++) {
+            for (size_t o = 0; o < sizeof(k_opts) / sizeof(k_opts[0]); o++) {
+                size_t len = strlen(k_opts[o].opt);
+                if (strncmp(cl.argv[k], k_opts[o].opt, len) != 0) continue;
+                const char *arg = cl.argv[k][len] ? cl.argv[k] + len : k + 1 < cl.argc ? cl.argv[k + 1] : NULL;
+                char *end;
+                long long want = arg ? strtoll(arg, &end, 10) : 0;
+                if (!arg || *end || want <= 0) continue;
+                long long max = sysctl_value(k_opts[o].path);
+                if (max < 0 || want <= max) continue;
+                fprintf(stderr, "wfb_supervisor: %s: '%s' asks for %s %lld but %s is %lld; the kernel will clamp it\n",
+                        g_cfg.socket_buffers == 2 ? "error" : "warning", inst->name, k_opts[o].opt, want,
+                        k_opts[o].sysctl, max);
+                clamped++;
+            }
+        }
+    }
+    return clamped && g_cfg.socket_buffers == 2 ? -1 : 0;
+}
+
+/* Event loop */
+
+static void ev_add(ev_watch_t *w, uint32_t events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = w;
+    if (epoll_ctl(g_epfd, EPOLL_CTL_ADD, w->fd, &ev) != 0) {
+        die("epoll_ctl add failed: %s", strerror(errno));
+    }
+}
+
+static void ev_close(ev_watch_t *w) {
+    if (w->fd < 0) return;
+    epoll_ctl(g_epfd, EPOLL_CTL_DEL, w->fd, NULL);
+    close(w->fd);
+    w->fd = -1;
+}
+
+static void ev_modify(ev_watch_t *w, uint32_t events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = w;
+    if (epoll_ctl(g_epfd, EPOLL_CTL_MOD, w->fd, &ev) != 0) die("epoll_ctl mod failed: %s", strerror(errno));
+}
+
+/* Point a registered watch at its new home after the owning struct was copied. */
+static void ev_rebind(ev_watch_t *w, void *ctx) {
+    if (w->fd < 0) return;
+    w->ctx = ctx;
+    ev_modify(w, EPOLLIN);
+}
+
+/* Wait up to timeout_ms (-1 = forever) and dispatch whatever became ready. */
+static void ev_run_once(int timeout_ms) {
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(g_epfd, events, MAX_EVENTS, timeout_ms);
+    if (n < 0) {
+        if (errno == EINTR) return;
+        die("epoll_wait failed: %s", strerror(errno));
+    }
+    for (int i = 0; i < n; i++) {
+        ev_watch_t *w = events[i].data.ptr;
+        if (w->fd >= 0) w->cb(w, events[i].events);
+    }
+}
+
+static void timer_arm_ms(int fd, int ms) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = ms / 1000;
+    its.it_value.tv_nsec = (long)(ms % 1000) * 1000000L;
+    if (ms == 0) its.it_value.tv_nsec = 1;
+    timerfd_settime(fd, 0, &its, NULL);
+}
+
+static void timer_drain(int fd) {
+    uint64_t expirations;
+    while (read(fd, &expirations, sizeof(expirations)) > 0) {}
+}
+
+/* Link statistics */
+
+static void adapt_on_sample(const stats_sample_t *s);
+
+/* Parse "a:b:c" into vals; returns the field count, or -1 on anything that is not a number. */
+static int stats_fields(const char *s, long *vals, int max) {
+    int n = 0;
+    while (*s) {
+        char *end;
+        errno = 0;
+        long v = strtol(s, &end, 10);
+        if (end == s || errno != 0 || (*end && *end != ':')) return -1;
+        if (n < max) vals[n] = v;
+        n++;
+        s = *end ? end + 1 : end;
+    }
+    return n;
+}
+
+static uint32_t stats_u32(long v) {
+    return v < 0 ? 0 : (uint32_t)v;
+}
+
+static void stats_commit(instance_t *inst, uint64_t wfb_ts) {
+    stats_t *st = &inst->stats;
+    stats_sample_t *s = &st->pending;
+    s->ts_ms = now_ms();
+    s->interval_ms = 0;
+    if (st->last_wfb_ts && wfb_ts > st->last_wfb_ts && wfb_ts - st->last_wfb_ts < 60000) {
+        s->interval_ms = (uint32_t)(wfb_ts - st->last_wfb_ts);
+    }
+    st->last_wfb_ts = wfb_ts;
+    st->ring[st->head] = *s;
+    st->head = (st->head + 1) % STATS_RING;
+    if (st->count < STATS_RING) st->count++;
+    memset(s, 0, sizeof(*s));
+    if (inst->adapt_source) adapt_on_sample(&st->ring[(st->head + STATS_RING - 1) % STATS_RING]);
+}
+
+/*
+ * wfb-ng log lines are "<ts>\t<TYPE>\t...": RX_ANT/TX_ANT lines for each antenna, then
+ * one PKT line closing the interval. Both the current and the pre-23 PKT layouts are
+ * recognised by field count. Returns 0 for lines that are not stats output.
+ */
+static int stats_parse_line(instance_t *inst, char *line) {
+    stats_t *st = &inst->stats;
+    char *p = line;
+    while (isdigit((unsigned char)*p)) p++;
+    if (p == line || *p != '\t') return 0;
+    uint64_t wfb_ts = strtoull(line, NULL, 10);
+
+    char *field[4];
+    int nf = 0;
+    for (char *q = p + 1; nf < 4; ) {
+        field[nf++] = q;
+        q = strchr(q, '\t');
+        if (!q) break;
+        *q++ = '\0';
+    }
+    if (nf < 2) return 1;
+
+    const char *type = field[0];
+    const char *data = field[nf - 1];
+    long v[16];
+    int n = stats_fields(data, v, 16);
+    if (n < 0) return 1;
+
+    stats_sample_t *s = &st->pending;
+    if (strcmp(type, "PKT") == 0) {
+        if (inst->stats_kind == STATS_WFB_RX && n >= 11) {
+            // all:b_all:dec_err:session:data:uniq:fec_rec:lost:bad:out:b_out
+            s->packets = stats_u32(v[0]);
+            s->bad = stats_u32(v[2]) + stats_u32(v[8]);
+            s->fec_recovered = stats_u32(v[6]);
+            s->lost = stats_u32(v[7]);
+            s->delivered = stats_u32(v[9]);
+            s->bytes = stats_u32(v[10]);
+        } else if (inst->stats_kind == STATS_WFB_RX && n >= 8) {
+            // all:dec_err:dec_ok:fec_rec:lost:bad:out:b_out
+            s->packets = stats_u32(v[0]);
+            s->bad = stats_u32(v[1]) + stats_u32(v[5]);
+            s->fec_recovered = stats_u32(v[3]);
+            s->lost = stats_u32(v[4]);
+            s->delivered = stats_u32(v[6]);
+            s->bytes = stats_u32(v[7]);
+        } else if (inst->stats_kind == STATS_WFB_TX && n >= 5) {
+            // fec_timeouts:incoming:b_incoming:injected:b_injected[:dropped[:truncated]]
+            s->packets = stats_u32(v[1]);
+            s->delivered = stats_u32(v[3]);
+            s->bytes = stats_u32(v[4]);
+            s->dropped = (n > 5 ? stats_u32(v[5]) : 0) + (n > 6 ? stats_u32(v[6]) : 0);
+        } else {
+            return 1;
+        }
+        stats_commit(inst, wfb_ts);
+    } else if (strcmp(type, "RX_ANT") == 0 && n >= 3) {
+        // count:rssi_min:rssi_avg[:rssi_max[:snr...]]
+        if (!s->antennas || v[2] > s->rssi) s->rssi = (int16_t)v[2];
+        s->antennas++;
+    } else if (strcmp(type, "TX_ANT") == 0 && n >= 3) {
+        // injected:latency_min:latency_avg:latency_max
+        if (stats_u32(v[2]) > s->latency_us) s->latency_us = stats_u32(v[2]);
+        s->antennas++;
+    } else if (strcmp(type, "SESSION") == 0 && n >= 3) {
+        // epoch[:fec_type]:k:n
+        st->fec_k = (int)v[n - 2];
+        st->fec_n = (int)v[n - 1];
+    } else if (strcmp(type, "PROBE") == 0 && inst->stats_kind == STATS_PROBE && n >= 11) {
+        // sent:received:lost:late:reordered:duplicate:p50:p90:p99:max:jitter, latencies in us
+        s->packets = stats_u32(v[0]);
+        s->delivered = stats_u32(v[1]);
+        s->lost = stats_u32(v[2]);
+        s->latency_us = stats_u32(v[8]);
+        s->antennas = s->delivered > 0;  // no latency without an arrival
+        st->probe.sent += s->packets;
+        st->probe.received += s->delivered;
+        st->probe.lost += s->lost;
+        // Declared lost in an earlier window, then turned up after all.
+        st->probe.lost -= stats_u32(v[3]) < st->probe.lost ? stats_u32(v[3]) : st->probe.lost;
+        st->probe.reordered += stats_u32(v[4]);
+        st->probe.duplicate += stats_u32(v[5]);
+        st->probe.p50_us = stats_u32(v[6]);
+        st->probe.p90_us = stats_u32(v[7]);
+        st->probe.p99_us = stats_u32(v[8]);
+        st->probe.max_us = stats_u32(v[9]);
+        st->probe.jitter_us = stats_u32(v[10]);
+        stats_commit(inst, wfb_ts);
+    }
+    return 1;
+}
+
+enum {
+    // counters, queried as per-second rates
+    STAT_PACKETS, STAT_DELIVERED, STAT_BYTES, STAT_FEC, STAT_LOST, STAT_BAD, STAT_DROPPED,
+    // per-interval gauges, queried as percentiles
+    STAT_LOSS_PCT, STAT_FEC_PCT, STAT_RSSI, STAT_LATENCY,
+};
+
+/* Returns 0 when the sample has no value for the metric. */
+static int stats_value(const stats_sample_t *s, int metric, double *out) {
+    double base;
+    switch (metric) {
+    case STAT_PACKETS:   *out = s->packets; return 1;
+    case STAT_DELIVERED: *out = s->delivered; return 1;
+    case STAT_BYTES:     *out = s->bytes; return 1;
+    case STAT_FEC:       *out = s->fec_recovered; return 1;
+    case STAT_LOST:      *out = s->lost; return 1;
+    case STAT_BAD:       *out = s->bad; return 1;
+    case STAT_DROPPED:   *out = s->dropped; return 1;
+    case STAT_LOSS_PCT:
+        // rx: lost after FEC per expected packet; tx: dropped per incoming packet
+        base = s->lost ? (double)s->delivered + s->lost : s->packets;
+        if (base <= 0) return 0;
+        *out = 100.0 * (s->lost + s->dropped) / base;
+        return 1;
+    case STAT_FEC_PCT:
+        base = (double)s->delivered + s->lost;
+        if (base <= 0) return 0;
+        *out = 100.0 * s->fec_recovered / base;
+        return 1;
+    case STAT_RSSI:
+        if (!s->antennas) return 0;
+        *out = s->rssi;
+        return 1;
+    case STAT_LATENCY:
+        if (!s->antennas) return 0;
+        *out = s->latency_us;
+        return 1;
+    }
+    return 0;
+}
+
+/* Per-second rate of a counter over the last window_ms (0 = whole ring); -1 when unknown. */
+static double stats_rate(const stats_t *st, int metric, uint64_t window_ms) {
+    uint64_t now = now_ms();
+    double sum = 0, ms = 0, v;
+    for (unsigned i = 0; i < st->count; i++) {
+        const stats_sample_t *s = &st->ring[(st->head + STATS_RING - 1 - i) % STATS_RING];
+        if (window_ms && now - s->ts_ms > window_ms) break;
+        if (!s->interval_ms || !stats_value(s, metric, &v)) continue;
+        sum += v;
+        ms += s->interval_ms;
+    }
+    return ms > 0 ? sum * 1000.0 / ms : -1;
+}
+
+/* Nearest-rank percentile of a per-interval metric over the last window_ms (0 = whole ring). */
+static int stats_percentile(const stats_t *st, int metric, int pct, uint64_t window_ms, double *out) {
+    double vals[STATS_RING];
+    int n = 0;
+    uint64_t now = now_ms();
+    for (unsigned i = 0; i < st->count; i++) {
+        const stats_sample_t *s = &st->ring[(st->head + STATS_RING - 1 - i) % STATS_RING];
+        if (window_ms && now - s->ts_ms > window_ms) break;
+        double v;
+        if (!stats_value(s, metric, &v)) continue;
+        int j = n++;
+        while (j > 0 && vals[j - 1] > v) {
+            vals[j] = vals[j - 1];
+            j--;
+        }
+        vals[j] = v;
+    }
+    if (n == 0) return -1;
+    int rank = (pct * n + 99) / 100;
+    if (rank < 1) rank = 1;
+    *out = vals[rank - 1];
+    return 0;
+}
+
+static const char *stats_describe(const instance_t *inst, char *buf, size_t len) {
+    const stats_t *st = &inst->stats;
+    double pkt = stats_rate(st, STAT_PACKETS, 0);
+    double bytes = stats_rate(st, STAT_BYTES, 0);
+    double p50, p95, fec, rssi50, rssi5, lat;
+    if (st->count == 0 || pkt < 0) {
+        snprintf(buf, len, "no stats yet");
+        return buf;
+    }
+    size_t off = 0;
+    if (inst->stats_kind == STATS_PROBE) {
+        const probe_stats_t *pr = &st->probe;
+        uint64_t expected = pr->received + pr->lost;
+        snprintf(buf, len, "probe %.0f pkt/s, loss %.2f%%, latency p50 %.2f p90 %.2f p99 %.2f max %.2f ms, "
+                 "jitter %.2f ms, %llu reordered, %llu duplicate", pkt,
+                 expected ? 100.0 * (double)pr->lost / (double)expected : 0.0, pr->p50_us / 1e3, pr->p90_us / 1e3,
+                 pr->p99_us / 1e3, pr->max_us / 1e3, pr->jitter_us / 1e3,
+                 (unsigned long long)pr->reordered, (unsigned long long)pr->duplicate);
+        return buf;
+    }
+    if (inst->stats_kind == STATS_WFB_RX) {
+        off += (size_t)snprintf(buf, len, "rx %.0f pkt/s %.2f Mbit/s", pkt, bytes * 8 / 1e6);
+        if (stats_percentile(st, STAT_LOSS_PCT, 50, 0, &p50) == 0 &&
+            stats_percentile(st, STAT_LOSS_PCT, 95, 0, &p95) == 0 && off < len) {
+            off += (size_t)snprintf(buf + off, len - off, ", loss p50 %.1f%% p95 %.1f%%", p50, p95);
+        }
+        if (stats_percentile(st, STAT_FEC_PCT, 95, 0, &fec) == 0 && off < len) {
+            off += (size_t)snprintf(buf + off, len - off, ", fec p95 %.1f%%", fec);
+        }
+        if (stats_percentile(st, STAT_RSSI, 50, 0, &rssi50) == 0 &&
+            stats_percentile(st, STAT_RSSI, 5, 0, &rssi5) == 0 && off < len) {
+            off += (size_t)snprintf(buf + off, len - off, ", rssi p50 %.0f p5 %.0f dBm", rssi50, rssi5);
+        }
+    } else {
+        off += (size_t)snprintf(buf, len, "tx %.0f pkt/s %.2f Mbit/s", stats_rate(st, STAT_DELIVERED, 0), bytes * 8 / 1e6);
+        if (stats_percentile(st, STAT_LOSS_PCT, 95, 0, &p95) == 0 && off < len) {
+            off += (size_t)snprintf(buf + off, len - off, ", drop p95 %.1f%%", p95);
+        }
+        if (stats_percentile(st, STAT_LATENCY, 95, 0, &lat) == 0 && off < len) {
+            off += (size_t)snprintf(buf + off, len - off, ", latency p95 %.0f us", lat);
+        }
+    }
+    if (st->fec_n > 0 && off < len) snprintf(buf + off, len - off, ", fec %d/%d", st->fec_k, st->fec_n);
+    return buf;
+}
+
+/* Instance output */
+
+/*
+ * Every instance writes stdout/stderr into a non-blocking pipe, so a slow console or a
+ * stalled log reader costs the child dropped lines rather than a blocked write(). Lines
+ * are recorded with a wall-clock stamp in a fixed byte ring per instance, then printed
+ * subject to log_rate. Records are an 8-byte ms stamp, a 2-byte length and the text,
+ * wrapping freely at the end of the ring; the oldest ones are evicted to make room.
+ */
+
+#define LOG_REC_HDR 10
+
+// rings are allocated on first use and recycled; they outlive reloads with their instances
+static char **g_log_pool;
+static unsigned char *g_log_pool_used;
+static int g_log_pool_count;
+static int g_log_fd = -1;          // log_file, -1 = stderr
+static char *g_log_path;
+
+static void log_attach(instance_t *inst) {
+    if (inst->log.ring >= 0) return;
+    int i = 0;
+    while (i < g_log_pool_count && g_log_pool_used[i]) i++;
+    if (i == g_log_pool_count) {
+        int n = g_log_pool_count ? g_log_pool_count * 2 : 16;
+        char **pool = realloc(g_log_pool, (size_t)n * sizeof(*pool));
+        unsigned char *used = realloc(g_log_pool_used, (size_t)n);
+        if (pool) g_log_pool = pool;
+        if (used) g_log_pool_used = used;
+        if (!pool || !used) die("out of memory");
+        memset(g_log_pool + g_log_pool_count, 0, (size_t)(n - g_log_pool_count) * sizeof(*pool));
+        memset(g_log_pool_used + g_log_pool_count, 0, (size_t)(n - g_log_pool_count));
+        g_log_pool_count = n;
+    }
+    if (!g_log_pool[i] && !(g_log_pool[i] = malloc(LOG_RING_SIZE))) die("out of memory");
+    g_log_pool_used[i] = 1;
+    inst->log.ring = i;
+    inst->log.head = inst->log.tail = 0;
+}
+
+static void log_release(instance_t *inst) {
+    if (inst->log.ring < 0) return;
+    g_log_pool_used[inst->log.ring] = 0;
+    inst->log.ring = -1;
+}
+
+static void ring_put(char *ring, uint64_t off, const void *src, size_t len) {
+    size_t at = (size_t)(off % LOG_RING_SIZE);
+    size_t first = len < LOG_RING_SIZE - at ? len : LOG_RING_SIZE - at;
+    memcpy(ring + at, src, first);
+    memcpy(ring, (const char *)src + first, len - first);
+}
+
+static void ring_get(const char *ring, uint64_t off, void *dst, size_t len) {
+    size_t at = (size_t)(off % LOG_RING_SIZE);
+    size_t first = len < LOG_RING_SIZE - at ? len : LOG_RING_SIZE - at;
+    memcpy(dst, ring + at, first);
+    memcpy((char *)dst + first, ring, len - first);
+}
+
+static uint64_t wall_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+static void log_record(instance_t *inst, uint64_t ms, const char *line, size_t len) {
+    log_t *lg = &inst->log;
+    if (lg->ring < 0) return;
+    char *ring = g_log_pool[lg->ring];
+    uint16_t n = (uint16_t)len;
+    while (lg->head + LOG_REC_HDR + n - lg->tail > LOG_RING_SIZE) {
+        uint16_t old;
+        ring_get(ring, lg->tail + 8, &old, sizeof(old));
+        lg->tail += LOG_REC_HDR + old;
+    }
+    ring_put(ring, lg->head, &ms, 8);
+    ring_put(ring, lg->head + 8, &n, 2);
+    ring_put(ring, lg->head + LOG_REC_HDR, line, n);
+    lg->head += LOG_REC_HDR + n;
+}
+
+static size_t format_wall(uint64_t ms, char *buf, size_t len) {
+    time_t sec = (time_t)(ms / 1000);
+    struct tm tm;
+    localtime_r(&sec, &tm);
+    size_t off = strftime(buf, len, "%Y-%m-%d %H:%M:%S", &tm);
+    return off + (size_t)snprintf(buf + off, len - off, ".%03u", (unsigned)(ms % 1000));
+}
+
+static void log_emit(const instance_t *inst, uint64_t ms, const char *line, size_t len) {
+    if (g_log_fd < 0) {
+        fprintf(stderr, "[%s] %.*s\n", inst->name, (int)len, line);
+        return;
+    }
+    char out[LOG_LINE_MAX + MAX_NAME_LEN + 40];
+    size_t off = format_wall(ms, out, sizeof(out));
+    off += (size_t)snprintf(out + off, sizeof(out) - off, " [%s] %.*s\n", inst->name, (int)len, line);
+    if (off >= sizeof(out)) off = sizeof(out) - 1;
+    if (write(g_log_fd, out, off) < 0) {
+        // Nothing better to do than fall back to stderr for this line.
+        fprintf(stderr, "[%s] %.*s\n", inst->name, (int)len, line);
+    }
+}
+
+static void log_flush_suppressed(instance_t *inst) {
+    if (!inst->log.suppressed) return;
+    char note[64];
+    int n = snprintf(note, sizeof(note), "(%u line%s over log_rate not printed)", inst->log.suppressed,
+                     inst->log.suppressed == 1 ? "" : "s");
+    log_emit(inst, wall_ms(), note, (size_t)n);
+    inst->log.suppressed = 0;
+}
+
+/* Print a recorded line unless quiet or over the instance's share of log_rate. */
+static void log_print(instance_t *inst, uint64_t ms, const char *line, size_t len) {
+    if (inst->quiet) return;
+    log_t *lg = &inst->log;
+    if (g_cfg.log_rate > 0) {
+        uint64_t now = now_ms();
+        lg->tokens += (double)(now - lg->refill_ms) * g_cfg.log_rate / 1000.0;
+        if (lg->tokens > g_cfg.log_rate) lg->tokens = g_cfg.log_rate;  // a burst of up to one second
+        lg->refill_ms = now;
+        if (lg->tokens < 1.0) {
+            lg->suppressed++;
+            return;
+        }
+        lg->tokens -= 1.0;
+    }
+    log_flush_suppressed(inst);
+    log_emit(inst, ms, line, len);
+}
+
+static void instance_ready(instance_t *inst);
+
+static void output_feed(instance_t *inst, const char *buf, size_t len) {
+    log_t *lg = &inst->log;
+    while (len > 0) {
+        const char *nl = memchr(buf, '\n', len);
+        size_t take = nl ? (size_t)(nl - buf) : len;
+        size_t room = sizeof(lg->line) - 1 - lg->line_len;
+        if (take > room) {
+            take = room;
+            lg->line_overflow = 1;
+        }
+        memcpy(lg->line + lg->line_len, buf, take);
+        lg->line_len += take;
+        if (!nl) return;
+
+        lg->line[lg->line_len] = '\0';
+        uint64_t ms = wall_ms();
+        log_record(inst, ms, lg->line, lg->line_len);
+        // Stats reports stay in the ring for post-mortems; they are summarized rather than printed.
+        if (!inst->stats_kind || lg->line_overflow || !stats_parse_line(inst, lg->line)) {
+            log_print(inst, ms, lg->line, lg->line_len);
+        }
+        if (inst->ready_re_set && inst->running && regexec(&inst->ready_re, lg->line, 0, NULL, 0) == 0) instance_ready(inst);
+        lg->line_len = 0;
+        lg->line_overflow = 0;
+        len -= (size_t)(nl - buf) + 1;
+        buf = nl + 1;
+    }
+}
+
+/* Read what is buffered; at most a few chunks per wakeup so a chatty child cannot starve the loop. */
+static int output_drain(instance_t *inst) {
+    char chunk[4096];
+    for (int i = 0; i < 16; i++) {
+        ssize_t n = read(inst->out_watch.fd, chunk, sizeof(chunk));
+        if (n > 0) {
+            output_feed(inst, chunk, (size_t)n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) return 0;
+        return -1;  // EOF: every writer is gone
+    }
+    return 0;
+}
+
+static void on_output_pipe(ev_watch_t *w, uint32_t events) {
+    (void)events;
+    if (output_drain(w->ctx) != 0) ev_close(w);
+}
+
+static void log_open(void) {
+    if (g_log_path && strcmp(g_log_path, g_cfg.log_file) == 0) return;
+    if (g_log_fd >= 0) close(g_log_fd);
+    g_log_fd = -1;
+    free(g_log_path);
+    if (!(g_log_path = strdup(g_cfg.log_file))) die("out of memory");
+    if (!g_log_path[0]) return;
+    // O_NONBLOCK only matters for a FIFO reader that stalls; a regular file ignores it.
+    g_log_fd = open(g_log_path, O_WRONLY | O_CREAT | O_APPEND | O_NONBLOCK | O_CLOEXEC, 0644);
+    if (g_log_fd < 0) {
+        fprintf(stderr, "wfb_supervisor: log: cannot open %s: %s, instance output goes to stderr\n", g_log_path, strerror(errno));
+    }
+}
+
+/* Flight recorder */
+
+/*
+ * On a failure teardown, write the last flight_window of every instance's ring to
+ * flight_recorder through a shared mapping, then trim the file to the text written.
+ */
+static void flight_dump(int failed_idx, int failed_status) {
+    const char *path = g_cfg.flight_recorder;
+    if (!path[0]) return;
+    // rendered text is at most twice the raw ring bytes (timestamps) plus the headers
+    const size_t size = (size_t)g_instance_count * (LOG_RING_SIZE * 2 + 256) + 4096;
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    char *out = MAP_FAILED;
+    if (fd >= 0 && ftruncate(fd, (off_t)size) == 0) {
+        out = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (out == MAP_FAILED) {
+        fprintf(stderr, "wfb_supervisor: flight recorder %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return;
+    }
+
+    size_t len = size;
+    size_t off = 0;
+    char when[40];
+    char desc[32];
+    uint64_t now = wall_ms();
+    uint64_t since = now - (uint64_t)g_cfg.flight_window_ms;
+    const instance_t *failed = &g_instances[failed_idx];
+    format_wall(now, when, sizeof(when));
+    off += (size_t)snprintf(out + off, len - off, "wfb_supervisor flight record %s\nfailed: %s (pid %d) %s\n", when,
+                            failed->name, failed->pid, describe_status(failed_status, desc, sizeof(desc)));
+    for (int i = 0; i < g_instance_count && off < len; i++) {
+        const instance_t *inst = &g_instances[i];
+        const log_t *lg = &inst->log;
+        off += (size_t)snprintf(out + off, len - off, "\n== %s: %s, %d restart%s ==\n", inst->name,
+                                inst->running ? "running" : describe_status(inst->exit_status, desc, sizeof(desc)),
+                                inst->restart_count, inst->restart_count == 1 ? "" : "s");
+        if (lg->ring < 0) continue;
+        const char *ring = g_log_pool[lg->ring];
+        for (uint64_t at = lg->tail; at < lg->head && off < len; ) {
+            uint64_t ms;
+            uint16_t n;
+            char text[LOG_LINE_MAX];
+            ring_get(ring, at, &ms, 8);
+            ring_get(ring, at + 8, &n, 2);
+            ring_get(ring, at + LOG_REC_HDR, text, n);
+            at += LOG_REC_HDR + n;
+            if (ms < since) continue;
+            format_wall(ms, when, sizeof(when));
+            off += (size_t)snprintf(out + off, len - off, "%s %.*s\n", when + 11, (int)n, text);  // time of day only
+        }
+    }
+    if (off > len) off = len;
+    msync(out, off, MS_SYNC);
+    munmap(out, size);
+    if (ftruncate(fd, (off_t)off) != 0) {
+        fprintf(stderr, "wfb_supervisor: flight recorder %s: %s\n", path, strerror(errno));
+    }
+    close(fd);
+    fprintf(stderr, "wfb_supervisor: last %d ms of instance output written to %s\n", g_cfg.flight_window_ms, path);
+}
+
+/* Metrics */
+
+/*
+ * Counters and fixed-bucket latency histograms, per instance name and for the whole
+ * supervisor, kept across reloads and full restarts. They are rendered in the Prometheus
+ * text format into metrics_file (replaced atomically every metrics_interval) and served
+ * on metrics_listen.
+ */
+
+#define METRICS_MAX_CLIENTS 4
+#define DEFAULT_METRICS_FILE "/run/wfb_supervisor.prom"
+#define DEFAULT_METRICS_INTERVAL_MS 10000
+
+// Bucket upper bounds in microseconds; one more bucket counts everything above.
+static const uint32_t k_histo_bounds_us[] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000,
+};
+#define HISTO_BUCKETS ((int)(sizeof(k_histo_bounds_us) / sizeof(k_histo_bounds_us[0])))
+
+typedef struct {
+    uint64_t counts[HISTO_BUCKETS + 1];
+    uint64_t sum_us;
+    uint64_t count;
+} histo_t;
+
+typedef struct {
+    char     name[MAX_NAME_LEN]; // "" = free slot
+    histo_t  spawn;          // fork-to-exec
+    histo_t  detect;         // child exit to reap
+    histo_t  stop;           // stop signal to reap
+    uint64_t starts;
+    uint64_t restarts;
+    uint64_t exits;
+    uint64_t failures;       // exits nobody asked for, other than status 0
+    uint64_t kills;          // SIGKILL/cgroup.kill escalations
+    uint64_t health;         // stops ordered by a failed liveness probe
+} metrics_t;
+
+static metrics_t *g_metrics;            // grows with the set of names ever configured
+static int       g_metrics_count = 0;
+static metrics_t g_metrics_all;          // the supervisor as a whole
+static histo_t   g_hook_histo[2];        // init, cleanup
+static uint64_t  g_full_restarts = 0;
+static uint64_t  g_reloads = 0;
+static uint64_t  g_started_ms = 0;
+
+static void histo_add(histo_t *h, uint64_t us) {
+    int b = 0;
+    while (b < HISTO_BUCKETS && us > k_histo_bounds_us[b]) b++;
+    h->counts[b]++;
+    h->sum_us += us;
+    h->count++;
+}
+
+static int instance_configured(const char *name) {
+    for (int i = 0; i < g_instance_count; i++) {
+        if (strcasecmp(g_instances[i].name, name) == 0) return 1;
+    }
+    return 0;
+}
+
+/*
+ * Series of an instance, created on first use. The slot is cached in the instance; a new
+ * name recycles the series of one no longer configured before the table grows.
+ */
+static metrics_t *metrics_of(instance_t *inst) {
+    if (inst->mx_slot > 0 && strcasecmp(g_metrics[inst->mx_slot - 1].name, inst->name) == 0) return &g_metrics[inst->mx_slot - 1];
+    int slot = -1;
+    for (int i = 0; i < g_metrics_count; i++) {
+        if (strcasecmp(g_metrics[i].name, inst->name) == 0) {
+            inst->mx_slot = i + 1;
+            return &g_metrics[i];
+        }
+        if (slot < 0 && (!g_metrics[i].name[0] || !instance_configured(g_metrics[i].name))) slot = i;
+    }
+    if (slot < 0) {
+        int n = g_metrics_count ? g_metrics_count * 2 : 16;
+        metrics_t *grown = realloc(g_metrics, (size_t)n * sizeof(*grown));
+        if (!grown) die("out of memory");
+        memset(grown + g_metrics_count, 0, (size_t)(n - g_metrics_count) * sizeof(*grown));
+        g_metrics = grown;
+        slot = g_metrics_count;
+        g_metrics_count = n;
+    }
+    metrics_t *m = &g_metrics[slot];
+    memset(m, 0, sizeof(*m));
+    snprintf(m->name, sizeof(m->name), "%s", inst->name);
+    inst->mx_slot = slot + 1;
+    return m;
+}
+
+static void metrics_hook(const char *phase, uint64_t us) {
+    histo_add(&g_hook_histo[strcmp(phase, "init") == 0 ? 0 : 1], us);
+}
+
+enum { MX_SPAWN, MX_DETECT, MX_STOP, MX_START, MX_RESTART, MX_EXIT, MX_FAILURE, MX_KILL, MX_HEALTH };
+
+/* Count an event for inst and for the supervisor total; us is the latency for histogram events. */
+static void metrics_note(instance_t *inst, int what, uint64_t us) {
+    metrics_t *targets[2] = { &g_metrics_all, metrics_of(inst) };
+    for (int i = 0; i < 2; i++) {
+        metrics_t *m = targets[i];
+        if (!m) continue;
+        switch (what) {
+        case MX_SPAWN:   histo_add(&m->spawn, us); break;
+        case MX_DETECT:  histo_add(&m->detect, us); break;
+        case MX_STOP:    histo_add(&m->stop, us); break;
+        case MX_START:   m->starts++; break;
+        case MX_RESTART: m->restarts++; break;
+        case MX_EXIT:    m->exits++; break;
+        case MX_FAILURE: m->failures++; break;
+        case MX_KILL:    m->kills++; break;
+        case MX_HEALTH:  m->health++; break;
+        }
+    }
+}
+
+/* Exit times from taskstats */
+
+/*
+ * The kernel reports every task exit on a taskstats listener before the parent is woken,
+ * with the time elapsed since the task started. Added to the spawn time that gives the
+ * exit time, so the reap can tell how long the exit took to notice. Needs CAP_NET_ADMIN;
+ * without it the detection histogram simply stays empty.
+ */
+
+static ev_watch_t g_taskstats_watch = { .fd = -1 };
+
+static void on_taskstats_msg(const struct nlmsghdr *nlh, void *ctx) {
+    (void)ctx;
+    const struct nlattr *tb[TASKSTATS_TYPE_MAX + 1];
+    const struct nlattr *agg[TASKSTATS_TYPE_MAX + 1];
+    nla_parse((const char *)NLMSG_DATA(nlh) + GENL_HDRLEN, nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN), tb, TASKSTATS_TYPE_MAX);
+    if (!tb[TASKSTATS_TYPE_AGGR_PID]) return;
+    nla_parse(NLA_DATA(tb[TASKSTATS_TYPE_AGGR_PID]), tb[TASKSTATS_TYPE_AGGR_PID]->nla_len - NLA_HDRLEN, agg, TASKSTATS_TYPE_MAX);
+    if (!agg[TASKSTATS_TYPE_STATS] || agg[TASKSTATS_TYPE_STATS]->nla_len < NLA_HDRLEN + offsetof(struct taskstats, ac_btime)) return;
+    struct taskstats ts;
+    memset(&ts, 0, sizeof(ts));
+    size_t len = agg[TASKSTATS_TYPE_STATS]->nla_len - NLA_HDRLEN;
+    memcpy(&ts, NLA_DATA(agg[TASKSTATS_TYPE_STATS]), len < sizeof(ts) ? len : sizeof(ts));
+    // Only the main thread's elapsed time is relative to the spawn, and only its exit as the
+    // last thread is the exit the pidfd reports.
+    if (!(ts.ac_flag & AGROUP)) return;
+    for (int i = 0; i < g_instance_count; i++) {
+        instance_t *inst = &g_instances[i];
+        if (inst->running && (uint32_t)inst->pid == ts.ac_pid) inst->exit_us = inst->spawn_at_us + ts.ac_etime;
+    }
+}
+
+static void taskstats_drain(void) {
+    if (g_taskstats_watch.fd < 0) return;
+    char buf[16384] __attribute__((aligned(NLMSG_ALIGNTO)));
+    ssize_t n;
+    while ((n = recv(g_taskstats_watch.fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0 || (n < 0 && errno == ENOBUFS)) {
+        if (n < 0) continue;  // a burst of unrelated exits overflowed the socket; keep going
+        size_t left = (size_t)n;
+        for (struct nlmsghdr *nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, left); nlh = NLMSG_NEXT(nlh, left)) {
+            if (nlh->nlmsg_type >= NLMSG_MIN_TYPE) on_taskstats_msg(nlh, NULL);
+        }
+    }
+}
+
+static void on_taskstats(ev_watch_t *w, uint32_t events) {
+    (void)w;
+    (void)events;
+    taskstats_drain();
+}
+
+static void taskstats_setup(void) {
+    int fd = nl_open(NETLINK_GENERIC, 0);
+    int fam = fd >= 0 ? genl_family_id(fd, TASKSTATS_GENL_NAME) : -1;
+    int err = -1;
+    if (fam >= 0) {
+        char cpus[32];
+        snprintf(cpus, sizeof(cpus), "0-%ld", sysconf(_SC_NPROCESSORS_CONF) - 1);
+        nl_batch_t b;
+        nl_batch_init(&b);
+        struct genlmsghdr g = { .cmd = TASKSTATS_CMD_GET, .version = TASKSTATS_GENL_VERSION };
+        struct nlmsghdr *nlh = nl_batch_add(&b, (uint16_t)fam, 0, &g, sizeof(g));
+        nla_put(&b, nlh, TASKSTATS_CMD_ATTR_REGISTER_CPUMASK, cpus, strlen(cpus) + 1);
+        if (nl_exchange(fd, &b, &err, NULL, NULL) != 0) err = -1;
+    }
+    if (err != 0) {
+        fprintf(stderr, "wfb_supervisor: metrics: taskstats unavailable (%s), exit detection latency not measured\n",
+                err < 0 && err != -1 ? strerror(-err) : "no taskstats family");
+        if (fd >= 0) close(fd);
+        return;
+    }
+    int rcvbuf = 1 << 20;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    g_taskstats_watch.fd = fd;
+    g_taskstats_watch.cb = on_taskstats;
+    ev_add(&g_taskstats_watch, EPOLLIN);
+}
+
+/* Exposition */
+
+static void mx_histo(strbuf_t *o, const char *name, const char *label, const histo_t *h) {
+    uint64_t cum = 0;
+    for (int b = 0; b <= HISTO_BUCKETS; b++) {
+        cum += h->counts[b];
+        if (b < HISTO_BUCKETS) sb_printf(o, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, label, *label ? "," : "", k_histo_bounds_us[b] / 1e6, (unsigned long long)cum);
+        else sb_printf(o, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, label, *label ? "," : "", (unsigned long long)cum);
+    }
+    sb_printf(o, "%s_sum%s%s%s %.6f\n", name, *label ? "{" : "", label, *label ? "}" : "", h->sum_us / 1e6);
+    sb_printf(o, "%s_count%s%s%s %llu\n", name, *label ? "{" : "", label, *label ? "}" : "", (unsigned long long)h->count);
+}
+
+/* Supervisor totals as wfb_supervisor_*, configured instances as wfb_instance_*{instance="..."}. */
+static void metrics_render(strbuf_t *o) {
+    static const struct {
+        const char *name;
+        const char *help;
+        size_t      field;
+    } k_histos[] = {
+        { "spawn_seconds", "Fork-to-exec latency of a spawn.", offsetof(metrics_t, spawn) },
+        { "exit_detect_seconds", "Time from a child's exit until the supervisor reaped it.", offsetof(metrics_t, detect) },
+        { "stop_seconds", "Time from the stop signal until the child was reaped.", offsetof(metrics_t, stop) },
+    };
+    static const struct {
+        const char *name;
+        const char *help;
+        size_t      field;
+    } k_counters[] = {
+        { "starts_total", "Processes spawned.", offsetof(metrics_t, starts) },
+        { "restarts_total", "Respawns after an exit or on request.", offsetof(metrics_t, restarts) },
+        { "exits_total", "Processes that exited.", offsetof(metrics_t, exits) },
+        { "failures_total", "Unrequested exits with a nonzero status or a signal.", offsetof(metrics_t, failures) },
+        { "kill_escalations_total", "Stops that needed SIGKILL or cgroup.kill after stop_timeout.", offsetof(metrics_t, kills) },
+        { "health_failures_total", "Instances stopped by a failed liveness probe.", offsetof(metrics_t, health) },
+    };
+    sb_reset(o);
+    uint64_t now = now_ms();
+    char label[MAX_NAME_LEN + 16];
+
+    sb_printf(o, "# HELP wfb_supervisor_uptime_seconds Time since the supervisor started.\n");
+    sb_printf(o, "# TYPE wfb_supervisor_uptime_seconds gauge\nwfb_supervisor_uptime_seconds %.3f\n", (now - g_started_ms) / 1e3);
+    sb_printf(o, "# HELP wfb_supervisor_full_restarts_total Teardowns followed by a relaunch of everything.\n");
+    sb_printf(o, "# TYPE wfb_supervisor_full_restarts_total counter\nwfb_supervisor_full_restarts_total %llu\n", (unsigned long long)g_full_restarts);
+    sb_printf(o, "# HELP wfb_supervisor_reloads_total Hot reloads applied.\n");
+    sb_printf(o, "# TYPE wfb_supervisor_reloads_total counter\nwfb_supervisor_reloads_total %llu\n", (unsigned long long)g_reloads);
+    sb_printf(o, "# HELP wfb_supervisor_hook_seconds Duration of init and cleanup hooks.\n# TYPE wfb_supervisor_hook_seconds histogram\n");
+    mx_histo(o, "wfb_supervisor_hook_seconds", "phase=\"init\"", &g_hook_histo[0]);
+    mx_histo(o, "wfb_supervisor_hook_seconds", "phase=\"cleanup\"", &g_hook_histo[1]);
+
+    for (int scope = 0; scope < 2; scope++) {
+        const char *prefix = scope == 0 ? "wfb_supervisor" : "wfb_instance";
+        char name[64];
+        for (size_t k = 0; k < sizeof(k_histos) / sizeof(k_histos[0]); k++) {
+            snprintf(name, sizeof(name), "%s_%s", prefix, k_histos[k].name);
+            sb_printf(o, "# HELP %s %s\n# TYPE %s histogram\n", name, k_histos[k].help, name);
+            if (scope == 0) mx_histo(o, name, "", (const histo_t *)((const char *)&g_metrics_all + k_histos[k].field));
+            for (int i = 0; scope == 1 && i < g_instance_count; i++) {
+                const metrics_t *m = metrics_of(&g_instances[i]);
+                snprintf(label, sizeof(label), "instance=\"%.*s\"", MAX_NAME_LEN - 1, g_instances[i].name);
+                mx_histo(o, name, label, (const histo_t *)((const char *)m + k_histos[k].field));
+            }
+        }
+        for (size_t k = 0; k < sizeof(k_counters) / sizeof(k_counters[0]); k++) {
+            snprintf(name, sizeof(name), "%s_%s", prefix, k_counters[k].name);
+            sb_printf(o, "# HELP %s %s\n# TYPE %s counter\n", name, k_counters[k].help, name);
+            if (scope == 0) sb_printf(o, "%s %llu\n", name, (unsigned long long)*(const uint64_t *)((const char *)&g_metrics_all + k_counters[k].field));
+            for (int i = 0; scope == 1 && i < g_instance_count; i++) {
+                const metrics_t *m = metrics_of(&g_instances[i]);
+                sb_printf(o, "%s{instance=\"%s\"} %llu\n", name, g_instances[i].name, (unsigned long long)*(const uint64_t *)((const char *)m + k_counters[k].field));
+            }
+        }
+    }
+    sb_printf(o, "# HELP wfb_instance_up Whether the instance's process is running.\n# TYPE wfb_instance_up gauge\n");
+    for (int i = 0; i < g_instance_count; i++) sb_printf(o, "wfb_instance_up{instance=\"%s\"} %d\n", g_instances[i].name, g_instances[i].running);
+    sb_printf(o, "# HELP wfb_instance_uptime_seconds Time since the running process was spawned.\n# TYPE wfb_instance_uptime_seconds gauge\n");
+    for (int i = 0; i < g_instance_count; i++) {
+        const instance_t *inst = &g_instances[i];
+        sb_printf(o, "wfb_instance_uptime_seconds{instance=\"%s\"} %.3f\n", inst->name, inst->running ? (now - inst->start_ms) / 1e3 : 0.0);
+    }
+
+    static const struct {
+        const char *name;
+        const char *help;
+        size_t      field;
+    } k_probe[] = {
+        { "sent", "Link probe packets injected.", offsetof(probe_stats_t, sent) },
+        { "received", "Link probe packets that came back out of the link.", offsetof(probe_stats_t, received) },
+        { "lost", "Link probe packets that never came back.", offsetof(probe_stats_t, lost) },
+        { "reordered", "Link probe packets that arrived after a later one.", offsetof(probe_stats_t, reordered) },
+        { "duplicate", "Link probe packets that arrived more than once.", offsetof(probe_stats_t, duplicate) },
+    };
+    int probes = 0;
+    for (int i = 0; i < g_instance_count; i++) probes += g_instances[i].stats_kind == STATS_PROBE;
+    if (probes == 0) return;
+    for (size_t k = 0; k < sizeof(k_probe) / sizeof(k_probe[0]); k++) {
+        sb_printf(o, "# HELP wfb_instance_probe_%s_total %s\n# TYPE wfb_instance_probe_%s_total counter\n",
+                  k_probe[k].name, k_probe[k].help, k_probe[k].name);
+        for (int i = 0; i < g_instance_count; i++) {
+            if (g_instances[i].stats_kind != STATS_PROBE) continue;
+            sb_printf(o, "wfb_instance_probe_%s_total{instance=\"%s\"} %llu\n", k_probe[k].name, g_instances[i].name,
+                      (unsigned long long)*(const uint64_t *)((const char *)&g_instances[i].stats.probe + k_probe[k].field));
+        }
+    }
+    sb_printf(o, "# HELP wfb_instance_probe_latency_seconds Link probe latency over the last report window.\n"
+                 "# TYPE wfb_instance_probe_latency_seconds gauge\n");
+    for (int i = 0; i < g_instance_count; i++) {
+        const probe_stats_t *pr = &g_instances[i].stats.probe;
+        if (g_instances[i].stats_kind != STATS_PROBE) continue;
+        const char *q[] = { "0.5", "0.9", "0.99", "1" };
+        uint32_t v[] = { pr->p50_us, pr->p90_us, pr->p99_us, pr->max_us };
+        for (int k = 0; k < 4; k++) {
+            sb_printf(o, "wfb_instance_probe_latency_seconds{instance=\"%s\",quantile=\"%s\"} %.6f\n", g_instances[i].name, q[k], v[k] / 1e6);
+        }
+    }
+    sb_printf(o, "# HELP wfb_instance_probe_jitter_seconds Link probe interarrival jitter (RFC 3550).\n"
+                 "# TYPE wfb_instance_probe_jitter_seconds gauge\n");
+    for (int i = 0; i < g_instance_count; i++) {
+        if (g_instances[i].stats_kind != STATS_PROBE) continue;
+        sb_printf(o, "wfb_instance_probe_jitter_seconds{instance=\"%s\"} %.6f\n", g_instances[i].name, g_instances[i].stats.probe.jitter_us / 1e6);
+    }
+}
+
+static char *g_metrics_file;              // NULL = off
+static ev_watch_t g_metrics_timer = { .fd = -1 };
+
+/* Write to a temporary next to metrics_file and rename it over, so readers never see half a file. */
+static void metrics_write_file(void) {
+    if (!g_metrics_file) return;
+    static strbuf_t text, tmp;
+    metrics_render(&text);
+    sb_reset(&tmp);
+    sb_printf(&tmp, "%s.tmp", g_metrics_file);
+    int fd = open(tmp.buf, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || write(fd, text.buf, text.len) != (ssize_t)text.len || close(fd) != 0 || rename(tmp.buf, g_metrics_file) != 0) {
+        static int warned = 0;
+        if (!warned++) fprintf(stderr, "wfb_supervisor: metrics: cannot write %s: %s\n", g_metrics_file, strerror(errno));
+        if (fd >= 0) unlink(tmp.buf);
+    }
+}
+
+static void on_metrics_timer(ev_watch_t *w, uint32_t events) {
+    (void)events;
+    timer_drain(w->fd);
+    metrics_write_file();
+}
+
+/* Scrapes: one request per connection, answered with HTTP when it looks like HTTP, raw text otherwise. */
+
+typedef struct {
+    ev_watch_t w;
+    char   hdr[160];
+    size_t hdr_len;
+    size_t off;          // bytes of hdr + snapshot sent
+    int    sending;
+} mx_client_t;
+
+static ev_watch_t g_mx_listen = { .fd = -1 };
+static mx_client_t g_mx_clients[METRICS_MAX_CLIENTS];
+static strbuf_t g_mx_snap;                 // shared by every client sending at the same time
+static int g_mx_senders = 0;
+static char g_mx_path[108];                // UNIX socket to unlink at exit
+
+static void mx_client_close(mx_client_t *c) {
+    if (c->sending) g_mx_senders--;
+    c->sending = 0;
+    ev_close(&c->w);
+}
+
+static void on_mx_client(ev_watch_t *w, uint32_t events) {
+    mx_client_t *c = w->ctx;
+    if (!c->sending) {
+        char req[1024];
+        ssize_t n = read(w->fd, req, sizeof(req) - 1);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+        if (n <= 0) {
+            mx_client_close(c);
+            return;
+        }
+        req[n] = '\0';
+        if (g_mx_senders == 0) metrics_render(&g_mx_snap);  // never reallocated under a sender
+        c->hdr_len = 0;
+        if (strncmp(req, "GET ", 4) == 0) {
+            c->hdr_len = (size_t)snprintf(c->hdr, sizeof(c->hdr), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                          "Content-Length: %zu\r\nConnection: close\r\n\r\n", g_mx_snap.len);
+        }
+        c->off = 0;
+        c->sending = 1;
+        g_mx_senders++;
+        ev_modify(w, EPOLLOUT);
+        return;
+    }
+    if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) return;
+    while (c->off < c->hdr_len + g_mx_snap.len) {
+        const char *p = c->off < c->hdr_len ? c->hdr + c->off : g_mx_snap.buf + (c->off - c->hdr_len);
+        size_t left = c->off < c->hdr_len ? c->hdr_len - c->off : g_mx_snap.len - (c->off - c->hdr_len);
+        ssize_t n = send(w->fd, p, left, MSG_NOSIGNAL);
+        if (n < 0 && errno == EAGAIN) return;
+        if (n <= 0) break;
+        c->off += (size_t)n;
+    }
+    shutdown(w->fd, SHUT_WR);
+    mx_client_close(c);
+}
+
+static void on_mx_accept(ev_watch_t *w, uint32_t events) {
+    (void)events;
+    int fd = accept4(w->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) return;
+    for (int i = 0; i < METRICS_MAX_CLIENTS; i++) {
+        mx_client_t *c = &g_mx_clients[i];
+        if (c->w.fd >= 0) continue;
+        c->w.fd = fd;
+        c->w.cb = on_mx_client;
+        c->w.ctx = c;
+        c->sending = 0;
+        ev_add(&c->w, EPOLLIN);
+        return;
+    }
+    close(fd);  // all slots busy
+}
+
+/* metrics_listen=/path (UNIX) or [addr:]port (TCP, default address 127.0.0.1). */
+static int mx_listen(const char *spec) {
+    int fd;
+    if (spec[0] == '/') {
+        struct sockaddr_un sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        if (strlen(spec) >= sizeof(sa.sun_path)) die("metrics_listen path too long: %s", spec);
+        snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", spec);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        unlink(spec);
+        if (fd < 0 || bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) goto fail;
+        snprintf(g_mx_path, sizeof(g_mx_path), "%s", spec);
+    } else {
+        char host[64] = "127.0.0.1";
+        const char *colon = strrchr(spec, ':');
+        int port = 0;
+        if (colon) snprintf(host, sizeof(host), "%.*s", (int)(colon - spec), spec);
+        if (parse_int(colon ? colon + 1 : spec, &port) || port <= 0 || port > 65535) die("config: invalid metrics_listen '%s'", spec);
+        struct sockaddr_in sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sin_family = AF_INET;
+        sa.sin_port = htons((uint16_t)port);
+        if (inet_pton(AF_INET, host, &sa.sin_addr) != 1) die("config: invalid metrics_listen address '%s'", host);
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int one = 1;
+        if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (fd < 0 || bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) goto fail;
+    }
+    if (listen(fd, METRICS_MAX_CLIENTS) != 0) goto fail;
+    return fd;
+fail:
+    fprintf(stderr, "wfb_supervisor: metrics: cannot listen on %s: %s\n", spec, strerror(errno));
+    if (fd >= 0) close(fd);
+    return -1;
+}
+
+/* Read once at startup, like control_socket. */
+static void metrics_setup(void) {
+    g_started_ms = now_ms();
+    const char *file = get_param_value("metrics_file");
+    int on = 1;
+    if (file && parse_bool(file, &on) == 0) file = NULL;  // yes/no rather than a path
+    if (on && !(g_metrics_file = strdup(file ? file : DEFAULT_METRICS_FILE))) die("out of memory");
+    int interval_ms = DEFAULT_METRICS_INTERVAL_MS;
+    const char *interval = get_param_value("metrics_interval");
+    if (interval && (parse_duration_ms(interval, &interval_ms) || interval_ms <= 0)) die("config: invalid metrics_interval '%s'", interval);
+    for (int i = 0; i < METRICS_MAX_CLIENTS; i++) g_mx_clients[i].w.fd = -1;
+
+    taskstats_setup();
+    if (g_metrics_file) {
+        g_metrics_timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (g_metrics_timer.fd >= 0) {
+            struct itimerspec its;
+            its.it_value.tv_sec = its.it_interval.tv_sec = interval_ms / 1000;
+            its.it_value.tv_nsec = its.it_interval.tv_nsec = (long)(interval_ms % 1000) * 1000000L;
+            timerfd_settime(g_metrics_timer.fd, 0, &its, NULL);
+            g_metrics_timer.cb = on_metrics_timer;
+            ev_add(&g_metrics_timer, EPOLLIN);
+        }
+    }
+    const char *listen_spec = get_param_value("metrics_listen");
+    if (listen_spec && parse_bool(listen_spec, &on) != 0) {
+        g_mx_listen.fd = mx_listen(listen_spec);
+        if (g_mx_listen.fd >= 0) {
+            g_mx_listen.cb = on_mx_accept;
+            ev_add(&g_mx_listen, EPOLLIN);
+            fprintf(stderr, "wfb_supervisor: metrics: serving on %s\n", listen_spec);
+        }
+    }
+}
+
+static void metrics_close(void) {
+    metrics_write_file();
+    ev_close(&g_metrics_timer);
+    ev_close(&g_taskstats_watch);
+    for (int i = 0; i < METRICS_MAX_CLIENTS; i++) mx_client_close(&g_mx_clients[i]);
+    if (g_mx_listen.fd >= 0) {
+        ev_close(&g_mx_listen);
+        if (g_mx_path[0]) unlink(g_mx_path);
+    }
+}
+
+/* Adaptive link control */
+
+typedef struct {
+    int step;                 // current rung of g_cfg.adapt_steps
+    int good_ms;              // consecutive intervals with headroom for the next rung
+    int bad_ms;               // consecutive intervals over the loss target
+    int hold_ms;              // remaining settle time after a change
+    int since_change_ms;
+    int last_up;              // the last change was a step up
+    int seen_traffic;
+    int probe_fail[MAX_ADAPT_STEPS]; // failed step-ups into a rung; each doubles its up wait
+    int changes;
+    int replay;               // offline: report decisions without applying them
+    uint64_t clock_ms;        // wfb time covered by the samples seen so far
+    uint64_t time_at[MAX_ADAPT_STEPS];
+} adapt_state_t;
+
+static adapt_state_t g_adapt;
+
+static void instance_recycle(instance_t *inst);
+
+static int adapt_param_uses(const instance_t *inst) {
+    static const char *const keys[] = { "mcs", "fec_k", "fec_n" };
+    for (int k = 0; k < 3; k++) {
+        int idx = param_find(keys[k], strlen(keys[k]));
+        if (idx >= 0 && tmpl_uses(&inst->cmd_tmpl, idx)) return 1;
+    }
+    return 0;
+}
+
+static void adapt_store_params(const adapt_step_t *st) {
+    char v[16];
+    snprintf(v, sizeof(v), "%d", st->mcs);
+    store_param_kv("mcs", v);
+    snprintf(v, sizeof(v), "%d", st->fec_k);
+    store_param_kv("fec_k", v);
+    snprintf(v, sizeof(v), "%d", st->fec_n);
+    store_param_kv("fec_n", v);
+}
+
+/* Parses the adapt_* parameters once the instances are known. */
+static void load_adapt_settings(void) {
+    memset(&g_adapt, 0, sizeof(g_adapt));
+    g_cfg.adapt = get_param_bool("adapt", 0);
+    if (!g_cfg.adapt) return;
+
+    const char *ladder = get_param_value("adapt_ladder");
+    if (!ladder) die("config: adapt=yes needs adapt_ladder=<mcs:k:n[:rssi]>,...");
+    char *buf = arena_strdup(&g_cfg.arena, ladder);
+    g_cfg.adapt_step_count = 0;
+    for (char *save = NULL, *tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (g_cfg.adapt_step_count >= MAX_ADAPT_STEPS) die("config: adapt_ladder has too many steps (max %d)", MAX_ADAPT_STEPS);
+        adapt_step_t *st = &g_cfg.adapt_steps[g_cfg.adapt_step_count++];
+        long v[4];
+        int n = stats_fields(trim(tok), v, 4);
+        if (n < 3 || n > 4 || v[0] < 0 || v[1] < 1 || v[2] < v[1] || v[2] > 255) {
+            die("config: invalid adapt_ladder step '%s' (expected mcs:k:n[:rssi])", tok);
+        }
+        st->mcs = (int)v[0];
+        st->fec_k = (int)v[1];
+        st->fec_n = (int)v[2];
+        st->rssi_min = n > 3 ? (int)v[3] : 0;
+        if (g_cfg.shaper_setup && phy_rate_kbit(st->mcs, g_cfg.shaper_nss, g_cfg.wifi_bandwidth, g_cfg.shaper_sgi) < 0) {
+            die("config: adapt_ladder mcs %d is not supported by the shaper", st->mcs);
+        }
+    }
+    if (g_cfg.adapt_step_count < 2) die("config: adapt_ladder needs at least two steps");
+
+    const char *v;
+    char *end;
+    g_cfg.adapt_loss_target = 1.0;
+    if ((v = get_param_value("adapt_loss_target"))) {
+        g_cfg.adapt_loss_target = strtod(v, &end);
+        if (end == v || *end || g_cfg.adapt_loss_target <= 0) die("config: invalid adapt_loss_target '%s'", v);
+    }
+    g_cfg.adapt_fec_max = 20.0;
+    if ((v = get_param_value("adapt_fec_max"))) {
+        g_cfg.adapt_fec_max = strtod(v, &end);
+        if (end == v || *end || g_cfg.adapt_fec_max < 0) die("config: invalid adapt_fec_max '%s'", v);
+    }
+    g_cfg.adapt_down_ms = 2000;
+    g_cfg.adapt_up_ms = 10000;
+    g_cfg.adapt_hold_ms = 3000;
+    if ((v = get_param_value("adapt_down")) && parse_duration_ms(v, &g_cfg.adapt_down_ms)) die("config: invalid adapt_down '%s'", v);
+    if ((v = get_param_value("adapt_up")) && parse_duration_ms(v, &g_cfg.adapt_up_ms)) die("config: invalid adapt_up '%s'", v);
+    if ((v = get_param_value("adapt_hold")) && parse_duration_ms(v, &g_cfg.adapt_hold_ms)) die("config: invalid adapt_hold '%s'", v);
+
+    instance_t *source = NULL;
+    const char *name = get_param_value("adapt_source");
+    for (int i = 0; i < g_instance_count; i++) {
+        instance_t *inst = &g_instances[i];
+        if (name ? strcasecmp(inst->name, name) == 0 : inst->stats_kind == STATS_WFB_RX) {
+            source = inst;
+            break;
+        }
+    }
+    if (!source) die("config: adapt_source %s%s%s not found", name ? "'" : "", name ? name : "(an rx instance with stats=wfb)", name ? "'" : "");
+    if (source->stats_kind != STATS_WFB_RX) die("config: adapt_source '%s' needs stats=wfb on a wfb_rx command", source->name);
+    snprintf(g_cfg.adapt_source, sizeof(g_cfg.adapt_source), "%s", source->name);
+    source->adapt_source = 1;
+
+    // Start from the rung matching the configured mcs (and fec_k/fec_n when given).
+    int mcs = get_param_int("mcs", -1);
+    int k = get_param_int("fec_k", -1);
+    int n = get_param_int("fec_n", -1);
+    int found = mcs < 0;
+    for (int i = 0; i < g_cfg.adapt_step_count && !found; i++) {
+        const adapt_step_t *st = &g_cfg.adapt_steps[i];
+        if (st->mcs == mcs && (k < 0 || st->fec_k == k) && (n < 0 || st->fec_n == n)) {
+            g_adapt.step = i;
+            found = 1;
+        }
+    }
+    if (!found) die("config: mcs %d%s matches no adapt_ladder step", mcs, k >= 0 || n >= 0 ? " with the given fec_k/fec_n" : "");
+    adapt_store_params(&g_cfg.adapt_steps[g_adapt.step]);
+    g_cfg.shaper_mcs = g_cfg.adapt_steps[g_adapt.step].mcs;
+}
+
+/* The instances recycled on a change; needs the compiled commands. */
+static void adapt_pick_targets(void) {
+    if (!g_cfg.adapt) return;
+    const char *targets = get_param_value("adapt_targets");
+    if (targets) {
+        char *buf = arena_strdup(&g_cfg.arena, targets);
+        for (char *save = NULL, *tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+            tok = trim(tok);
+            for (int i = 0; i < g_instance_count + g_cfg.template_count; i++) {
+                instance_t *inst = i < g_instance_count ? &g_instances[i] : &g_cfg.templates[i - g_instance_count];
+                if (strcasecmp(tok, inst->name) == 0) inst->adapt_target = 1;
+            }
+        }
+    }
+    // Instances of a template inherit its flag; hotplugged ones are compiled with it set.
+    int target_count = 0;
+    for (int i = 0; i < g_instance_count + g_cfg.template_count; i++) {
+        instance_t *inst = i < g_instance_count ? &g_instances[i] : &g_cfg.templates[i - g_instance_count];
+        if (!targets) inst->adapt_target = !inst->adapt_source && adapt_param_uses(inst);
+        target_count += inst->adapt_target;
+    }
+    if (target_count == 0 && !g_cfg.shaper_setup) {
+        die("config: adapt=yes but no instance uses $mcs/$fec_k/$fec_n and shaper_setup is off");
+    }
+}
+
+static void adapt_change(int to, const char *why, double loss) {
+    const adapt_step_t *from = &g_cfg.adapt_steps[g_adapt.step];
+    const adapt_step_t *st = &g_cfg.adapt_steps[to];
+    // Falling back soon after a step up marks that rung as unproven for a while.
+    if (to < g_adapt.step && g_adapt.last_up &&
+        g_adapt.since_change_ms <= g_cfg.adapt_hold_ms + 2 * g_cfg.adapt_down_ms + g_cfg.adapt_up_ms &&
+        g_adapt.probe_fail[g_adapt.step] < 4) {
+        g_adapt.probe_fail[g_adapt.step]++;
+    }
+    if (g_adapt.replay) {
+        printf("%9.1f s  %-4s mcs %d fec %d/%d -> mcs %d fec %d/%d (loss %.2f%%)\n",
+               g_adapt.clock_ms / 1000.0, why, from->mcs, from->fec_k, from->fec_n,
+               st->mcs, st->fec_k, st->fec_n, loss);
+    } else {
+        fprintf(stderr, "wfb_supervisor: adapt: %s, loss %.2f%%: mcs %d fec %d/%d -> mcs %d fec %d/%d\n",
+                why, loss, from->mcs, from->fec_k, from->fec_n, st->mcs, st->fec_k, st->fec_n);
+    }
+
+    g_adapt.last_up = to > g_adapt.step;
+    g_adapt.step = to;
+    g_adapt.good_ms = 0;
+    g_adapt.bad_ms = 0;
+    g_adapt.hold_ms = g_cfg.adapt_hold_ms;
+    g_adapt.since_change_ms = 0;
+    g_adapt.changes++;
+    if (g_adapt.replay) return;
+
+    adapt_store_params(st);
+    if (g_cfg.shaper_setup) {
+        g_cfg.shaper_mcs = st->mcs;
+        shaper_retune_async();
+    }
+    for (int i = 0; i < g_instance_count; i++) {
+        if (g_instances[i].adapt_target) instance_recycle(&g_instances[i]);
+    }
+}
+
+/* Fed with every report of the adapt_source instance; decides on wfb time, so replays are exact. */
+static void adapt_on_sample(const stats_sample_t *s) {
+    if (!s->interval_ms) return;
+    int iv = (int)s->interval_ms;
+    g_adapt.clock_ms += (uint64_t)iv;
+    g_adapt.time_at[g_adapt.step] += (uint64_t)iv;
+    g_adapt.since_change_ms += iv;
+    if (s->packets) g_adapt.seen_traffic = 1;
+    if (g_adapt.hold_ms > 0) {
+        g_adapt.hold_ms -= iv;
+        return;
+    }
+
+    double expected = (double)s->delivered + s->lost;
+    double loss = expected > 0 ? 100.0 * s->lost / expected : 0;
+    double fec = expected > 0 ? 100.0 * s->fec_recovered / expected : 0;
+    // A silent receiver after traffic was seen is a lost link, the worst case of loss.
+    if ((g_adapt.seen_traffic && s->packets == 0) || loss > g_cfg.adapt_loss_target) {
+        if (s->packets == 0) loss = 100.0;
+        g_adapt.good_ms = 0;
+        g_adapt.bad_ms += iv;
+        if (g_adapt.bad_ms >= g_cfg.adapt_down_ms && g_adapt.step > 0) adapt_change(g_adapt.step - 1, "down", loss);
+        return;
+    }
+    g_adapt.bad_ms = 0;
+
+    int next = g_adapt.step + 1;
+    if (next >= g_cfg.adapt_step_count) return;
+    const adapt_step_t *st = &g_cfg.adapt_steps[next];
+    int headroom = s->packets > 0 && loss <= g_cfg.adapt_loss_target / 2 && fec <= g_cfg.adapt_fec_max &&
+                   (!st->rssi_min || (s->antennas && s->rssi >= st->rssi_min));
+    if (!headroom) {
+        g_adapt.good_ms = 0;
+        return;
+    }
+    g_adapt.good_ms += iv;
+    if (g_adapt.good_ms >= g_cfg.adapt_up_ms) g_adapt.probe_fail[g_adapt.step] = 0;
+    if (g_adapt.good_ms >= g_cfg.adapt_up_ms << g_adapt.probe_fail[next]) adapt_change(next, "up", loss);
+}
+
+/* Runs the controller over a recorded wfb_rx log instead of live output; nothing is started. */
+static int adapt_replay(const char *path) {
+    if (!g_cfg.adapt) die("--replay needs adapt=yes in the config");
+    instance_t *source = NULL;
+    for (int i = 0; i < g_instance_count; i++) {
+        if (g_instances[i].adapt_source) source = &g_instances[i];
+    }
+    FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!f) die("cannot open replay log '%s': %s", path, strerror(errno));
+
+    g_adapt.replay = 1;
+    source->quiet = 1;
+    const adapt_step_t *st = &g_cfg.adapt_steps[g_adapt.step];
+    printf("replaying %s through '%s', starting at mcs %d fec %d/%d\n", path, source->name, st->mcs, st->fec_k, st->fec_n);
+    char chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) output_feed(source, chunk, n);
+    if (f != stdin) fclose(f);
+
+    printf("%d change%s over %.1f s of reports\n", g_adapt.changes, g_adapt.changes == 1 ? "" : "s", g_adapt.clock_ms / 1000.0);
+    for (int i = 0; i < g_cfg.adapt_step_count; i++) {
+        st = &g_cfg.adapt_steps[i];
+        printf("  mcs %d fec %d/%d: %.1f s (%.0f%%)\n", st->mcs, st->fec_k, st->fec_n, g_adapt.time_at[i] / 1000.0,
+               g_adapt.clock_ms ? 100.0 * g_adapt.time_at[i] / g_adapt.clock_ms : 0);
+    }
+    return 0;
+}
+
+/* Supervision */
+
+static const char *describe_status(int status, char *buf, size_t len) {
+    if (WIFEXITED(status)) {
+        snprintf(buf, len, "exit(%d)", WEXITSTATUS(status));
+    } else if (WIFSIGNALED(status)) {
+        snprintf(buf, len, "signal(%d)", WTERMSIG(status));
+    } else {
+        snprintf(buf, len, "status(%d)", status);
+    }
+    return buf;
+}
+
+static void instance_signal(instance_t *inst, int sig) {
+    if (inst->pidfd >= 0) {
+        if (syscall(SYS_pidfd_send_signal, inst->pidfd, sig, NULL, 0) == 0) return;
+        if (errno != ENOSYS) return;
+    }
+    kill(inst->pid, sig);
+}
+
+static int spawn_instance(instance_t *inst);
+static void instance_exited(instance_t *inst);
+static void health_stop(instance_t *inst);
+static void ready_stop(instance_t *inst);
+static void deps_lost(const instance_t *inst);
+static void deps_release(void);
+static int instance_launch(instance_t *inst);
+
+static void mark_failed(instance_t *inst, int status) {
+    if (g_failed_idx >= 0) return;
+    g_failed_idx = (int)(inst - g_instances);
+    g_failed_status = status;
+}
+
+static void instance_reap(instance_t *inst) {
+    if (!inst->running) return;
+
+    int status;
+    pid_t pid = waitpid(inst->pid, &status, WNOHANG);
+    if (pid == 0) return;
+    if (pid < 0) {
+        if (errno == EINTR) return;
+        status = (127 << 8);
+    }
+    uint64_t reaped_us = now_us();
+    taskstats_drain();  // the exit report is queued before the pidfd fires
+    if (g_trace) {
+        char desc[32];
+        describe_status(status, desc, sizeof(desc));
+        trace_add('X', inst->pid, inst->spawn_at_us, "running", "%s", desc);
+        trace_instant("reap", "%s: pid %d, %s", inst->name, inst->pid, desc);
+    }
+
+    inst->exit_status = status;
+    inst->running = 0;
+    if (inst->out_watch.fd >= 0) {
+        // Pick up the last words before the pipe goes away.
+        output_drain(inst);
+        ev_close(&inst->out_watch);
+    }
+    if (inst->log.line_len > 0) output_feed(inst, "\n", 1);
+    log_flush_suppressed(inst);
+    ev_close(&inst->pid_watch);
+    ev_close(&inst->kill_timer);
+    health_stop(inst);
+    ready_stop(inst);
+    inst->ready = 0;
+    inst->pidfd = -1;
+    if (cg_populated(inst)) {
+        fprintf(stderr, "wfb_supervisor: instance '%s' left processes behind, killing its cgroup\n", inst->name);
+        cg_kill(inst);
+    }
+
+    metrics_note(inst, MX_EXIT, 0);
+    if (inst->exit_us) metrics_note(inst, MX_DETECT, reaped_us > inst->exit_us ? reaped_us - inst->exit_us : 0);
+    if (inst->stopping) {
+        metrics_note(inst, MX_STOP, reaped_us - inst->stop_us);
+        fprintf(stderr, "wfb_supervisor: instance '%s' (pid %d) stopped after %llu ms%s\n",
+                inst->name, inst->pid, (unsigned long long)(reaped_us - inst->stop_us) / 1000,
+                inst->killed ? " (SIGKILL)" : "");
+    }
+    if (inst->health.failed || (!inst->stopping && (!WIFEXITED(status) || WEXITSTATUS(status) != 0))) {
+        metrics_note(inst, MX_FAILURE, 0);
+    }
+    if (g_session_active) deps_lost(inst);
+    instance_exited(inst);
+    // An after= instance that is down for good no longer holds anyone back.
+    if (g_session_active) deps_release();
+}
+
+static void on_pidfd(ev_watch_t *w, uint32_t events) {
+    (void)events;
+    instance_reap(w->ctx);
+}
+
+static void on_kill_timer(ev_watch_t *w, uint32_t events) {
+    (void)events;
+    instance_t *inst = w->ctx;
+    timer_drain(w->fd);
+    if (!inst->running || inst->killed) return;
+    // cgroup.kill also takes down whatever the instance forked, in one step.
+    int cg = cg_kill(inst) == 0;
+    fprintf(stderr, "wfb_supervisor: instance '%s' (pid %d) still running after %d ms, escalating with %s\n",
+            inst->name, inst->pid, inst->stop_timeout_ms, cg ? "cgroup.kill" : "SIGKILL");
+    if (!cg) instance_signal(inst, SIGKILL);
+    inst->killed = 1;
+    metrics_note(inst, MX_KILL, 0);
+    trace_instant("kill", "%s: pid %d, %s", inst->name, inst->pid, cg ? "cgroup.kill" : "SIGKILL");
+}
+
+static void instance_stop(instance_t *inst) {
+    if (!inst->running || inst->stopping) return;
+    inst->stopping = 1;
+    inst->stop_us = now_us();
+    instance_signal(inst, inst->stop_signal);
+    trace_instant("stop", "%s: pid %d, signal %d", inst->name, inst->pid, inst->stop_signal);
+
+    inst->kill_timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (inst->kill_timer.fd < 0) {
+        fprintf(stderr, "wfb_supervisor: timerfd for '%s' failed: %s; sending SIGKILL now\n",
+                inst->name, strerror(errno));
+        instance_signal(inst, SIGKILL);
+        inst->killed = 1;
+        metrics_note(inst, MX_KILL, 0);
+        return;
+    }
+    inst->kill_timer.cb = on_kill_timer;
+    inst->kill_timer.ctx = inst;
+    ev_add(&inst->kill_timer, EPOLLIN);
+    timer_arm_ms(inst->kill_timer.fd, inst->stop_timeout_ms);
+}
+
+static void on_restart_timer(ev_watch_t *w, uint32_t events) {
+    (void)events;
+    instance_t *inst = w->ctx;
+    ev_close(&inst->restart_timer);
+    if (!inst->restart_pending) return;
+    inst->restart_pending = 0;
+    inst->restart_count++;
+    metrics_note(inst, MX_RESTART, 0);
+    if (instance_launch(inst) != 0) instance_exited(inst);
+}
+
+static void cancel_restart(instance_t *inst) {
+    inst->restart_pending = 0;
+    inst->recycle = 0;
+    ev_close(&inst->restart_timer);
+}
+
+static int same_group(const instance_t *a, const instance_t *b) {
+    return a->group[0] && strcasecmp(a->group, b->group) == 0;
+}
+
+/* Arm respawn timers once no member of inst's failure domain is still running. */
+static void schedule_pending_restarts(instance_t *inst) {
+    for (int i = 0; i < g_instance_count; i++) {
+        instance_t *m = &g_instances[i];
+        if ((m == inst || same_group(m, inst)) && m->running) return;
+    }
+    for (int i = 0; i < g_instance_count; i++) {
+        instance_t *m = &g_instances[i];
+        if (!(m == inst || same_group(m, inst)) || !m->restart_pending || m->restart_timer.fd >= 0) continue;
+        m->restart_timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (m->restart_timer.fd < 0) {
+            fprintf(stderr, "wfb_supervisor: timerfd for '%s' failed: %s\n", m->name, strerror(errno));
+            cancel_restart(m);
+            mark_failed(m, m->exit_status);
+            continue;
+        }
+        m->restart_timer.cb = on_restart_timer;
+        m->restart_timer.ctx = m;
+        ev_add(&m->restart_timer, EPOLLIN);
+        timer_arm_ms(m->restart_timer.fd, m->pending_delay_ms);
+    }
+}
+
+/* Consumes one unit of the crash-loop budget; returns -1 once it is exhausted. */
+static int take_restart_budget(instance_t *inst, uint64_t now) {
+    if (inst->restart_burst == 0) return 0;
+    if (now - inst->budget_start_ms >= (uint64_t)inst->restart_interval_ms || inst->budget_used == 0) {
+        inst->budget_start_ms = now;
+        inst->budget_used = 0;
+    }
+    if (inst->budget_used >= inst->restart_burst) return -1;
+    inst->budget_used++;
+    return 0;
+}
+
+static void instance_exited(instance_t *inst) {
+    char desc[96];
+    describe_status(inst->exit_status, desc, sizeof(desc));
+    if (inst->health.failed) snprintf(desc, sizeof(desc), "unhealthy (%s)", inst->health.reason);
+
+    // An unplugged NIC is not a failure: wait for it instead of restarting or tearing down.
+    if (!inst->absent && inst->nic[0] && if_nametoindex(inst->nic) == 0) {
+        fprintf(stderr, "wfb_supervisor: instance '%s' (pid %d) %s, interface %s gone, parking it\n",
+                inst->name, inst->pid, desc, inst->nic);
+        inst->absent = 1;
+    }
+    if (inst->absent) {
+        int pending = inst->restart_pending;
+        cancel_restart(inst);
+        if (pending) schedule_pending_restarts(inst);
+        return;
+    }
+
+    if (inst->stopping && !inst->health.failed) {
+        // Stopped on purpose: shutdown, recycled alongside a failed group member, or
+        // recycled alone to pick up new parameters.
+        if (inst->recycle) {
+            inst->recycle = 0;
+            inst->restart_count++;
+            metrics_note(inst, MX_RESTART, 0);
+            if (spawn_instance(inst) != 0) instance_exited(inst);
+            return;
+        }
+        // A peer that stays down may be the last one the rest of its group waits for.
+        if (inst->restart_pending || inst->group[0]) schedule_pending_restarts(inst);
+        return;
+    }
+
+    int failed = inst->health.failed || !WIFEXITED(inst->exit_status) || WEXITSTATUS(inst->exit_status) != 0;
+    int respawn = inst->restart_policy == RESTART_ALWAYS ||
+                  (inst->restart_policy == RESTART_ON_FAILURE && failed);
+
+    if (inst->restart_policy == RESTART_TEARDOWN) {
+        mark_failed(inst, inst->exit_status);
+        return;
+    }
+    if (!respawn) {
+        fprintf(stderr, "wfb_supervisor: instance '%s' (pid %d) %s, not restarting\n",
+                inst->name, inst->pid, desc);
+        return;
+    }
+
+    uint64_t now = now_ms();
+    if (take_restart_budget(inst, now) != 0) {
+        fprintf(stderr, "wfb_supervisor: instance '%s' crash-looping (%d restarts within %d ms), shutting down all\n",
+                inst->name, inst->budget_used, inst->restart_interval_ms);
+        mark_failed(inst, inst->exit_status);
+        return;
+    }
+
+    // A run that outlived the backoff cap counts as healthy and resets the backoff.
+    if (now - inst->start_ms >= (uint64_t)inst->backoff_max_ms) inst->backoff_step = 0;
+    long delay = inst->backoff_ms;
+    for (int i = 0; i < inst->backoff_step && delay < inst->backoff_max_ms; i++) delay *= 2;
+    if (delay > inst->backoff_max_ms) delay = inst->backoff_max_ms;
+    else inst->backoff_step++;
+
+    fprintf(stderr, "wfb_supervisor: instance '%s' (pid %d) %s, restarting %s%s in %ld ms (restart #%d)\n",
+            inst->name, inst->pid, desc, inst->group[0] ? "group " : "",
+            inst->group[0] ? inst->group : "alone", delay, inst->restart_count + 1);
+
+    inst->restart_pending = 1;
+    inst->pending_delay_ms = (int)delay;
+    for (int i = 0; i < g_instance_count; i++) {
+        instance_t *m = &g_instances[i];
+        if (m == inst || !same_group(m, inst)) continue;
+        // The whole domain goes down, but a restart=never peer stays down.
+        if (m->restart_policy == RESTART_NEVER) {
+            if (m->running) fprintf(stderr, "wfb_supervisor: stopping '%s' with group %s, not restarting it (restart=never)\n", m->name, m->group);
+            cancel_restart(m);
+        } else {
+            m->restart_pending = 1;
+            m->pending_delay_ms = (int)delay;
+        }
+        instance_stop(m);
+    }
+    schedule_pending_restarts(inst);
+}
+
+/* Liveness probes */
+
+/*
+ * Counts IPv4 UDP packets to addr:port in either direction, once each: loopback traffic is
+ * taken on the way out only. Accepted packets are cut to one byte and never read, so once
+ * the tiny receive queue is full the kernel only bumps the drop counter, which
+ * PACKET_STATISTICS reports (and resets) together with the queued ones.
+ */
+static int health_udp_open(uint32_t addr, int port) {
+    unsigned lo = if_nametoindex("lo");
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_AD_OFF + SKF_AD_PROTOCOL)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, 13),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_AD_OFF + SKF_AD_PKTTYPE)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING, 2, 0),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_AD_OFF + SKF_AD_IFINDEX)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, lo, 9, 0),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9),                       // IP protocol
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 7),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 6),                       // fragment offset
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 5, 0),
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),                      // IP header length
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 2),                       // UDP destination port
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)port, 0, 2),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 16),                      // IP destination
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohl(addr), 1, addr ? 0 : 1),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+        BPF_STMT(BPF_RET | BPF_K, 1),
+    };
+    struct sock_fprog prog = { .len = sizeof(code) / sizeof(code[0]), .filter = code };
+    // Protocol 0 receives nothing until the filter is in place and the socket is bound.
+    int fd = socket(AF_PACKET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    int rcvbuf = 1;  // rounded up to the kernel minimum
+    struct sockaddr_ll sll = { .sll_family = AF_PACKET, .sll_protocol = htons(ETH_P_ALL) };
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) != 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) != 0 ||
+        bind(fd, (struct sockaddr *)&sll, sizeof(sll)) != 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+static uint64_t health_udp_take(int fd) {
+    struct tpacket_stats st;
+    socklen_t len = sizeof(st);
+    if (getsockopt(fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) != 0) return 0;
+    return st.tp_packets;  // includes tp_drops
+}
+
+/* health_udp=auto: the -c host -u port a wfb_rx sends to, or the -u port a wfb_tx listens on. */
+static int health_udp_target(const cmdline_t *cl, uint32_t *addr, int *port) {
+    *addr = 0;
+    *port = 0;
+    for (int k = 1; k + 1 < cl->argc; k++) {
+        if (strcmp(cl->argv[k], "-u") == 0 && parse_int(cl->argv[k + 1], port) != 0) *port = 0;
+        if (strcmp(cl->argv[k], "-c") == 0 && inet_pton(AF_INET, cl->argv[k + 1], addr) != 1) *addr = 0;
+    }
+    return *port > 0 && *port < 65536 ? 0 : -1;
+}
+
+static uint64_t stats_last_ms(const stats_t *st) {
+    return st->count ? st->ring[(st->head + STATS_RING - 1) % STATS_RING].ts_ms : 0;
+}
+
+static void health_stop(instance_t *inst) {
+    ev_close(&inst->health_timer);
+    if (inst->health.udp_fd >= 0) close(inst->health.udp_fd);
+    inst->health.udp_fd = -1;
+}
+
+/* A failed probe stops the instance; its exit then takes the same path as a crash. */
+static void health_fail(instance_t *inst, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void health_fail(instance_t *inst, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(inst->health.reason, sizeof(inst->health.reason), fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "wfb_supervisor: instance '%s' (pid %d) unhealthy: %s\n", inst->name, inst->pid, inst->health.reason);
+    inst->health.failed = 1;
+    health_stop(inst);
+    metrics_note(inst, MX_HEALTH, 0);
+    instance_stop(inst);
+}
+
+static void on_health_timer(ev_watch_t *w, uint32_t events) {
+    (void)events;
+    instance_t *inst = w->ctx;
+    health_t *h = &inst->health;
+    timer_drain(w->fd);
+    if (!inst->running || inst->stopping) return;
+    uint64_t now = now_ms();
+    uint64_t armed = inst->start_ms + (uint64_t)inst->health_grace_ms;
+    if (h->udp_fd >= 0) {
+        uint64_t n = health_udp_take(h->udp_fd);
+        if (now < armed) {
+            h->window_start_ms = now;
+            h->window_packets = 0;
+        } else {
+            h->window_packets += n;
+            uint64_t span = now - h->window_start_ms;
+            if (span >= (uint64_t)inst->health_timeout_ms) {
+                h->last_pps = (uint32_t)(h->window_packets * 1000u / span);
+                if (h->window_packets * 1000u < (uint64_t)inst->health_min_pps * span) {
+                    health_fail(inst, "%llu UDP packets in %llu ms (health_min_pps=%d)",
+                                (unsigned long long)h->window_packets, (unsigned long long)span, inst->health_min_pps);
+                    return;
+                }
+                h->window_start_ms = now;
+                h->window_packets = 0;
+            }
+        }
+    }
+    if (inst->health_stats_ms && now >= armed) {
+        uint64_t last = stats_last_ms(&inst->stats);
+        if (last < armed) last = armed;  // reports from a previous run do not count
+        if (now - last >= (uint64_t)inst->health_stats_ms) {
+            health_fail(inst, "no wfb report for %llu ms", (unsigned long long)(now - last));
+        }
+    }
+}
+
+/* Called after every successful spawn; probes start counting once health_grace has passed. */
+static void health_start(instance_t *inst, const cmdline_t *cl) {
+    health_t *h = &inst->health;
+    h->failed = 0;
+    h->reason[0] = '\0';
+    h->last_pps = 0;
+    h->window_start_ms = now_ms();
+    h->window_packets = 0;
+    if (!inst->health_udp && !inst->health_stats_ms) return;
+    if (inst->health_udp) {
+        uint32_t addr = inst->health_addr;
+        int port = inst->health_port;
+        if (inst->health_udp == 2 && health_udp_target(cl, &addr, &port) != 0) {
+            fprintf(stderr, "wfb_supervisor: instance '%s': health_udp=auto found no -u <port> in cmd, UDP probe off\n", inst->name);
+        } else if ((h->udp_fd = health_udp_open(addr, port)) < 0) {
+            fprintf(stderr, "wfb_supervisor: instance '%s': UDP probe on port %d failed: %s\n", inst->name, port, strerror(errno));
+        }
+    }
+    inst->health_timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (inst->health_timer.fd < 0) {
+        fprintf(stderr, "wfb_supervisor: timerfd for '%s' failed: %s; liveness probes off\n", inst->name, strerror(errno));
+        health_stop(inst);
+        return;
+    }
+    struct itimerspec its;
+    its.it_value.tv_sec = its.it_interval.tv_sec = 0;
+    its.it_value.tv_nsec = its.it_interval.tv_nsec = HEALTH_TICK_MS * 1000000L;
+    timerfd_settime(inst->health_timer.fd, 0, &its, NULL);
+    inst->health_timer.cb = on_health_timer;
+    inst->health_timer.ctx = inst;
+    ev_add(&inst->health_timer, EPOLLIN);
+}
+
+static const char *health_describe(const instance_t *inst, char *buf, size_t len) {
+    const health_t *h = &inst->health;
+    size_t off = (size_t)snprintf(buf, len, "health %s", h->failed ? "failed" : inst->health_timer.fd >= 0 ? "ok" : "off");
+    if (h->udp_fd >= 0 && off < len) off += (size_t)snprintf(buf + off, len - off, " udp=%upps", h->last_pps);
+    if (inst->health_stats_ms && inst->running && off < len) {
+        uint64_t last = stats_last_ms(&inst->stats);
+        if (last >= inst->start_ms) off += (size_t)snprintf(buf + off, len - off, " report=%llums ago", (unsigned long long)(now_ms() - last));
+    }
+    if (h->reason[0] && off < len) snprintf(buf + off, len - off, " (%s)", h->reason);
+    return buf;
+}
+
+/* Automatic placement (cpu=auto) */
+
+#define AUTO_MAX_CORES 64
+#define DEFAULT_CPU_AUTO_INTERVAL_MS 5000
+#define AUTO_HYSTERESIS 100   // permille of a CPU a new layout must take off the busiest core before anything moves
+
+static cpu_set_t  g_auto_allowed;                 // CPUs the supervisor was started on
+static cpu_set_t  g_auto_cores[AUTO_MAX_CORES];   // SMT siblings of one core; the first is never dedicated
+static int        g_auto_core_count = 0;          // 0 = topology not read yet
+static cpu_set_t  g_auto_shared;                  // the supervisor, its hooks and the other instances
+static ev_watch_t g_auto_timer = { .fd = -1 };
+
+/* "0-1,3" back from a set; the inverse of parse_cpu_list(). */
+static void cpu_list_format(const cpu_set_t *set, char *buf, size_t len) {
+    size_t off = 0;
+    buf[0] = '\0';
+    for (int c = 0; c < CPU_SETSIZE && off < len; c++) {
+        if (!CPU_ISSET(c, set)) continue;
+        int hi = c;
+        while (hi + 1 < CPU_SETSIZE && CPU_ISSET(hi + 1, set)) hi++;
+        if (hi == c) off += (size_t)snprintf(buf + off, len - off, "%s%d", off ? "," : "", c);
+        else off += (size_t)snprintf(buf + off, len - off, "%s%d-%d", off ? "," : "", c, hi);
+        c = hi;
+    }
+}
+
+/* pid's threads, by tid; the number visited. */
+static int auto_each_task(pid_t pid, void (*fn)(pid_t, void *), void *ctx) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task", (int)pid);
+    DIR *d = opendir(path);
+    if (!d) return 0;
+    int n = 0;
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        if (de->d_name[0] == '.') continue;
+        fn((pid_t)atoi(de->d_name), ctx);
+        n++;
+    }
+    closedir(d);
+    return n;
+}
+
+static void auto_swap(pid_t *pids, pid_t *ppids, int a, int b) {
+    pid_t t = pids[a];
+    pids[a] = pids[b];
+    pids[b] = t;
+    t = ppids[a];
+    ppids[a] = ppids[b];
+    ppids[b] = t;
+}
+
+/*
+ * Every thread of the instance, not only of the process it spawned: with shell=yes the
+ * workload is a child of the shell. The leaf's cgroup.threads lists them all; without
+ * cgroups the descendants of pid are found through the parent pids in /proc. The number
+ * visited, 0 once the instance is gone.
+ */
+static int auto_each_thread(const instance_t *inst, void (*fn)(pid_t, void *), void *ctx) {
+    int n = 0;
+    if (inst->cg_dir >= 0) {
+        int fd = openat(inst->cg_dir, "cgroup.threads", O_RDONLY | O_CLOEXEC);
+        FILE *fp = fd >= 0 ? fdopen(fd, "re") : NULL;
+        if (fp) {
+            int tid;
+            while (fscanf(fp, "%d", &tid) == 1) {
+                fn((pid_t)tid, ctx);
+                n++;
+            }
+            fclose(fp);
+            return n;
+        }
+        if (fd >= 0) close(fd);
+    }
+    static pid_t *pids, *ppids;
+    static int cap;
+    int count = 0;
+    DIR *d = opendir("/proc");
+    if (!d) return auto_each_task(inst->pid, fn, ctx);
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        if (de->d_name[0] < '1' || de->d_name[0] > '9') continue;
+        char path[64], buf[512];
+        pid_t pid = (pid_t)atoi(de->d_name);
+        snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+        if (cg_read(AT_FDCWD, path, buf, sizeof(buf)) != 0) continue;
+        const char *paren = strrchr(buf, ')');  // comm may hold spaces and parentheses
+        int ppid;
+        if (!paren || sscanf(paren + 1, " %*c %d", &ppid) != 1) continue;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 256;
+            pids = realloc(pids, (size_t)cap * sizeof(*pids));
+            ppids = realloc(ppids, (size_t)cap * sizeof(*ppids));
+            if (!pids || !ppids) die("out of memory");
+        }
+        pids[count] = pid;
+        ppids[count++] = (pid_t)ppid;
+    }
+    closedir(d);
+    // Descendants are moved to the front of the list in breadth-first order; [0, found) is the tree.
+    int found = 0;
+    for (int i = 0; i < count; i++) {
+        if (pids[i] != inst->pid) continue;
+        auto_swap(pids, ppids, found, i);
+        found = 1;
+        break;
+    }
+    if (!found) return 0;
+    for (int at = 0; at < found; at++) {
+        for (int i = found; i < count; i++) {
+            if (ppids[i] != pids[at]) continue;
+            auto_swap(pids, ppids, found++, i);
+        }
+    }
+    for (int i = 0; i < found; i++) n += auto_each_task(pids[i], fn, ctx);
+    return n;
+}
+
+typedef struct {
+    uint64_t run_ns;
+    uint64_t wait_ns;
+} auto_sched_t;
+
+static void auto_sched_add(pid_t tid, void *ctx) {
+    auto_sched_t *s = ctx;
+    char file[64], buf[128];
+    unsigned long long run, wait;
+    snprintf(file, sizeof(file), "/proc/%d/schedstat", (int)tid);
+    if (cg_read(AT_FDCWD, file, buf, sizeof(buf)) == 0 && sscanf(buf, "%llu %llu", &run, &wait) == 2) {
+        s->run_ns += run;
+        s->wait_ns += wait;
+    }
+}
+
+/* CPU time and run-queue wait summed over the threads of the instance; -1 once it is gone. */
+static int auto_schedstat(const instance_t *inst, uint64_t *run_ns, uint64_t *wait_ns) {
+    auto_sched_t s = { 0, 0 };
+    if (auto_each_thread(inst, auto_sched_add, &s) == 0) return -1;
+    *run_ns = s.run_ns;
+    *wait_ns = s.wait_ns;
+    return 0;
+}
+
+typedef struct {
+    const instance_t *inst;
+    const cpu_set_t  *cpus;
+} auto_move_t;
+
+static void auto_move_thread(pid_t tid, void *ctx) {
+    const auto_move_t *m = ctx;
+    if (sched_setaffinity(tid, sizeof(*m->cpus), m->cpus) != 0 && errno != ESRCH) {
+        fprintf(stderr, "wfb_supervisor: placement: cannot move '%s' thread %d: %s\n", m->inst->name, (int)tid, strerror(errno));
+    }
+}
+
+/* Affinity is per thread, so every thread the instance has by now is moved. */
+static void auto_apply(const instance_t *inst, const cpu_set_t *cpus) {
+    auto_move_t m = { inst, cpus };
+    auto_each_thread(inst, auto_move_thread, &m);
+}
+
+static void on_auto_timer(ev_watch_t *w, uint32_t events);
+
+/* Cores are read once, from the CPUs the supervisor may use; hyperthreads of one core stay together. */
+static void auto_init(void) {
+    char buf[256], path[96];
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(g_auto_allowed), &g_auto_allowed) != 0) CPU_ZERO(&g_auto_allowed);
+    if (cg_read(AT_FDCWD, "/sys/devices/system/cpu/online", buf, sizeof(buf)) == 0) {
+        buf[strcspn(buf, "\n")] = '\0';
+        if (parse_cpu_list(buf, &set) == 0) CPU_AND(&g_auto_allowed, &g_auto_allowed, &set);
+    }
+    if (CPU_COUNT(&g_auto_allowed) == 0) CPU_SET(0, &g_auto_allowed);
+    cpu_set_t seen;
+    CPU_ZERO(&seen);
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (!CPU_ISSET(c, &g_auto_allowed) || CPU_ISSET(c, &seen)) continue;
+        cpu_set_t core;
+        CPU_ZERO(&core);
+        CPU_SET(c, &core);
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", c);
+        if (cg_read(AT_FDCWD, path, buf, sizeof(buf)) == 0) {
+            buf[strcspn(buf, "\n")] = '\0';
+            if (parse_cpu_list(buf, &set) == 0) CPU_OR(&core, &core, &set);
+        }
+        CPU_AND(&core, &core, &g_auto_allowed);
+        CPU_OR(&seen, &seen, &core);
+        if (g_auto_core_count < AUTO_MAX_CORES) g_auto_cores[g_auto_core_count++] = core;
+        else CPU_OR(&g_auto_cores[0], &g_auto_cores[0], &core);  // beyond that they only widen the shared core
+    }
+    g_auto_shared = g_auto_allowed;
+    cpu_list_format(&g_auto_cores[0], buf, sizeof(buf));
+    fprintf(stderr, "wfb_supervisor: placement: %d CPU%s in %d core%s, CPU %s kept for the supervisor and hooks\n",
+            CPU_COUNT(&g_auto_allowed), CPU_COUNT(&g_auto_allowed) == 1 ? "" : "s", g_auto_core_count,
+            g_auto_core_count == 1 ? "" : "s", buf);
+
+    int interval_ms = DEFAULT_CPU_AUTO_INTERVAL_MS;
+    const char *interval = get_param_value("cpu_auto_interval");
+    if (interval && (parse_duration_ms(interval, &interval_ms) || interval_ms <= 0)) die("config: invalid cpu_auto_interval '%s'", interval);
+    g_auto_timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (g_auto_timer.fd < 0) die("placement: timerfd failed: %s", strerror(errno));
+    struct itimerspec its;
+    its.it_value.tv_sec = its.it_interval.tv_sec = interval_ms / 1000;
+    its.it_value.tv_nsec = its.it_interval.tv_nsec = (long)(interval_ms % 1000) * 1000000L;
+    timerfd_settime(g_auto_timer.fd, 0, &its, NULL);
+    g_auto_timer.cb = on_auto_timer;
+    ev_add(&g_auto_timer, EPOLLIN);
+}
+
+static int auto_max_load(instance_t **crit, int n, const int *core) {
+    int load[AUTO_MAX_CORES] = { 0 };
+    int max = 0;
+    for (int i = 0; i < n; i++) {
+        load[core[i]] += crit[i]->auto_measured ? crit[i]->auto_load : 0;
+        if (load[core[i]] > max) max = load[core[i]];
+    }
+    return max;
+}
+
+/*
+ * Critical instances get cores of their own, heaviest first onto the least loaded one, as
+ * long as cores last beyond the supervisor's; when they do not, they share those cores and
+ * only move when that takes AUTO_HYSTERESIS off the busiest one. Everything else, the
+ * supervisor and its hooks included, runs on the remaining CPUs. spawning joins the layout
+ * before it runs.
+ */
+static void auto_layout(instance_t *spawning) {
+    if (!g_auto_core_count) auto_init();
+    int dedicable[AUTO_MAX_CORES] = { 0 };
+    for (int k = 1; k < g_auto_core_count; k++) {
+        dedicable[k] = 1;
+        for (int i = 0; i < g_instance_count && dedicable[k]; i++) {
+            const instance_t *inst = &g_instances[i];
+            cpu_set_t both;
+            CPU_AND(&both, &inst->cpus, &g_auto_cores[k]);
+            if (!inst->cpu_auto && inst->cpu_list[0] && CPU_COUNT(&both)) dedicable[k] = 0;  // a fixed cpu= lives there
+        }
+    }
+    static instance_t **crit;
+    static int *cur, *next;
+    static int crit_cap;
+    if (crit_cap < g_instance_count) {
+        free(crit);
+        free(cur);
+        free(next);
+        crit = malloc((size_t)g_instance_count * sizeof(*crit));
+        cur = malloc((size_t)g_instance_count * sizeof(*cur));
+        next = malloc((size_t)g_instance_count * sizeof(*next));
+        if (!crit || !cur || !next) die("out of memory");
+        crit_cap = g_instance_count;
+    }
+    int ncrit = 0;
+    for (int i = 0; i < g_instance_count; i++) {
+        instance_t *inst = &g_instances[i];
+        if (!inst->cpu_auto) continue;
+        if (!inst->running && inst != spawning) inst->auto_core = 0;  // its core is free for the others
+        else if (inst->latency_critical) crit[ncrit++] = inst;
+    }
+    for (int i = 1; i < ncrit; i++) {
+        instance_t *c = crit[i];
+        int j = i;
+        for (; j > 0 && (crit[j - 1]->auto_measured ? crit[j - 1]->auto_load : 0) < (c->auto_measured ? c->auto_load : 0); j--) crit[j] = crit[j - 1];
+        crit[j] = c;
+    }
+
+    // The cores to dedicate: those already held first, then the lowest free ones.
+    int ncand = 0, ndedicated = 0;
+    for (int k = 0; k < g_auto_core_count; k++) ncand += dedicable[k];
+    int want = ncrit < ncand ? ncrit : ncand;
+    int chosen[AUTO_MAX_CORES] = { 0 };
+    for (int i = 0; i < ncrit && ndedicated < want; i++) {
+        int k = crit[i]->auto_core - 1;
+        if (k > 0 && dedicable[k] && !chosen[k]) chosen[k] = 1, ndedicated++;
+    }
+    for (int k = 1; k < g_auto_core_count && ndedicated < want; k++) {
+        if (dedicable[k] && !chosen[k]) chosen[k] = 1, ndedicated++;
+    }
+
+    int keep = ndedicated > 0;
+    for (int i = 0; i < ncrit; i++) {
+        cur[i] = crit[i]->auto_core - 1;
+        if (cur[i] < 0 || !chosen[cur[i]]) keep = 0;
+    }
+    if (ndedicated > 0) {
+        int load[AUTO_MAX_CORES] = { 0 };
+        for (int i = 0; i < ncrit; i++) {
+            int best = -1;
+            for (int k = 1; k < g_auto_core_count; k++) {
+                if (!chosen[k]) continue;
+                if (best < 0 || load[k] < load[best] || (load[k] == load[best] && k == cur[i])) best = k;
+            }
+            next[i] = best;
+            load[best] += crit[i]->auto_measured ? crit[i]->auto_load : 0;
+            if (ncrit <= ndedicated) load[best] += 1000000;  // one each: a taken core is never the least loaded
+        }
+        // The held layout stays while it is one core each, or not clearly worse than the new one.
+        for (int i = 0; i < ncrit && keep && ncrit <= ndedicated; i++) {
+            for (int j = 0; j < i; j++) if (cur[j] == cur[i]) keep = 0;
+        }
+        if (keep && (ncrit <= ndedicated || auto_max_load(crit, ncrit, next) + AUTO_HYSTERESIS >= auto_max_load(crit, ncrit, cur))) {
+            memcpy(next, cur, sizeof(*next) * (size_t)ncrit);
+        }
+    }
+
+    char buf[128];
+    cpu_set_t shared = g_auto_allowed;
+    for (int k = 1; k < g_auto_core_count; k++) {
+        if (chosen[k]) CPU_XOR(&shared, &shared, &g_auto_cores[k]);
+    }
+    if (!CPU_EQUAL(&shared, &g_auto_shared)) {
+        g_auto_shared = shared;
+        if (sched_setaffinity(0, sizeof(shared), &shared) != 0) {
+            fprintf(stderr, "wfb_supervisor: placement: cannot narrow the supervisor's CPUs: %s\n", strerror(errno));
+        }
+        cpu_list_format(&shared, buf, sizeof(buf));
+        fprintf(stderr, "wfb_supervisor: placement: supervisor, hooks and other instances on CPU %s\n", buf);
+        // Instances without cpu= took the supervisor's CPUs when they started; they follow them.
+        for (int i = 0; i < g_instance_count; i++) {
+            const instance_t *inst = &g_instances[i];
+            if (!inst->cpu_auto && !inst->cpu_list[0] && inst->running) auto_apply(inst, &shared);
+        }
+    }
+
+    for (int i = 0; i < g_instance_count; i++) {
+        instance_t *inst = &g_instances[i];
+        if (!inst->cpu_auto || (!inst->running && inst != spawning)) continue;
+        int core = 0;
+        for (int j = 0; j < ncrit; j++) {
+            if (crit[j] == inst && ndedicated > 0) core = next[j] + 1;
+        }
+        const cpu_set_t *set = core ? &g_auto_cores[core - 1] : &shared;
+        if (core == inst->auto_core && CPU_EQUAL(set, &inst->auto_cpus) && inst != spawning) continue;
+        inst->auto_core = core;
+        inst->auto_cpus = *set;
+        cpu_list_format(set, buf, sizeof(buf));
+        if (inst == spawning) {
+            fprintf(stderr, "wfb_supervisor: placement: '%s'%s on CPU %s\n", inst->name,
+                    inst->latency_critical ? (core ? " (critical)" : " (critical, no spare core)") : "", buf);
+            continue;
+        }
+        fprintf(stderr, "wfb_supervisor: placement: moving '%s'%s to CPU %s", inst->name,
+                inst->latency_critical ? (core ? " (critical)" : " (critical, no spare core)") : "", buf);
+        if (inst->auto_measured) {
+            fprintf(stderr, ", load %.1f%%, run-queue wait %.2f ms/s", inst->auto_load / 10.0, inst->auto_wait / 1000.0);
+            inst->auto_moved = 1;
+            inst->auto_wait_moved = inst->auto_wait;
+        }
+        fprintf(stderr, "\n");
+        auto_apply(inst, &inst->auto_cpus);
+    }
+}
+
+static void on_auto_timer(ev_watch_t *w, uint32_t events) {
+    (void)events;
+    timer_drain(w->fd);
+    uint64_t now = now_us();
+    for (int i = 0; i < g_instance_count; i++) {
+        instance_t *inst = &g_instances[i];
+        uint64_t run, wait;
+        if (!inst->cpu_auto || !inst->running || auto_schedstat(inst, &run, &wait) != 0) continue;
+        // Counters of threads that exited leave the sum; such an interval counts as idle, not negative.
+        if (inst->auto_pid == inst->pid && now > inst->auto_sample_us) {
+            uint64_t dt = now - inst->auto_sample_us;
+            inst->auto_load = run > inst->auto_run_ns ? (int)((run - inst->auto_run_ns) / dt) : 0;
+            inst->auto_wait = wait > inst->auto_wait_ns ? (int)((wait - inst->auto_wait_ns) * 1000 / dt) : 0;
+            inst->auto_measured = 1;
+            if (inst->auto_moved) {
+                fprintf(stderr, "wfb_supervisor: placement: '%s' run-queue wait %.2f -> %.2f ms/s since the move\n", inst->name,
+                        inst->auto_wait_moved / 1000.0, inst->auto_wait / 1000.0);
+                inst->auto_moved = 0;
+            }
+        }
+        inst->auto_pid = inst->pid;
+        inst->auto_run_ns = run;
+        inst->auto_wait_ns = wait;
+        inst->auto_sample_us = now;
+    }
+    auto_layout(NULL);
+}
+
+static const char *auto_describe(const instance_t *inst, char *buf, size_t len) {
+    char cpus[128];
+    cpu_list_format(&inst->auto_cpus, cpus, sizeof(cpus));
+    size_t off = (size_t)snprintf(buf, len, "placement: CPU %s (%s)", cpus, inst->auto_core ? "critical core" : "shared");
+    if (inst->auto_measured && off < len) {
+        snprintf(buf + off, len - off, ", load %.1f%%, run-queue wait %.2f ms/s", inst->auto_load / 10.0, inst->auto_wait / 1000.0);
+    }
+    return buf;
+}
+
+/* Startup order */
+
+/* Is a local port in use per /proc/net: a UDP socket bound to it, or a TCP socket listening on it. */
+static int port_bound(int tcp, int port) {
+    const char *files[2] = { tcp ? "/proc/net/tcp" : "/proc/net/udp", tcp ? "/proc/net/tcp6" : "/proc/net/udp6" };
+    char line[256];
+    for (int f = 0; f < 2; f++) {
+        FILE *fp = fopen(files[f], "re");
+        if (!fp) continue;
+        while (fgets(line, sizeof(line), fp)) {
+            unsigned lport, st;
+            if (sscanf(line, " %*d: %*[0-9A-Fa-f]:%x %*[0-9A-Fa-f]:%*x %x", &lport, &st) != 2) continue;
+            if ((int)lport == port && (!tcp || st == 0x0A)) {
+                fclose(fp);
+                return 1;
+            }
+        }
+        fclose(fp);
+    }
+    return 0;
+}
+
+static void ready_stop(instance_t *inst) {
+    ev_close(&inst->ready_timer);
+    if (inst->ready_re_set) regfree(&inst->ready_re);
+    inst->ready_re_set = 0;
+}
+
+static void deps_release(void);
+
+static void instance_ready(instance_t *inst) {
+    inst->ready = 1;
+    trace_add('X', inst->pid, inst->spawn_at_us, "starting", "until ready");
+    ready_stop(inst);
+    if (inst->ready_kind) {
+        fprintf(stderr, "wfb_supervisor: instance '%s' ready after %llu ms\n", inst->name, (unsigned long long)(now_ms() - inst->start_ms));
+    }
+    deps_release();
+}
+
+static void on_ready_timer(ev_watch_t *w, uint32_t events) {
+    (void)events;
+    instance_t *inst = w->ctx;
+    timer_drain(w->fd);
+    int ok = 0;
+    switch (inst->ready_kind) {
+    case READY_UDP:   ok = port_bound(0, inst->ready_port); break;
+    case READY_TCP:   ok = port_bound(1, inst->ready_port); break;
+    case READY_IFACE: ok = if_nametoindex(inst->ready_arg) != 0; break;
+    case READY_FILE:  ok = access(inst->ready_arg, F_OK) == 0; break;
+    default:          break;  // READY_LOG is matched as the output arrives
+    }
+    if (ok) {
+        instance_ready(inst);
+    } else if (now_ms() - inst->start_ms >= (uint64_t)inst->ready_timeout_ms) {
+        ready_stop(inst);
+        health_fail(inst, "not ready within %d ms", inst->ready_timeout_ms);
+    }
+}
+
+/* Last step of a spawn: without ready= the instance is ready now, otherwise poll for it. */
+static void ready_start(instance_t *inst) {
+    if (!inst->ready_kind) {
+        instance_ready(inst);
+        return;
+    }
+    if (inst->ready_kind == READY_LOG) inst->ready_re_set = regcomp(&inst->ready_re, inst->ready_arg, REG_EXTENDED | REG_NOSUB) == 0;
+    inst->ready_timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (inst->ready_timer.fd < 0) {
+        fprintf(stderr, "wfb_supervisor: timerfd for '%s' failed: %s; treating it as ready\n", inst->name, strerror(errno));
+        instance_ready(inst);
+        return;
+    }
+    struct itimerspec its;
+    its.it_value.tv_sec = its.it_interval.tv_sec = 0;
+    its.it_value.tv_nsec = its.it_interval.tv_nsec = READY_POLL_MS * 1000000L;
+    timerfd_settime(inst->ready_timer.fd, 0, &its, NULL);
+    inst->ready_timer.cb = on_ready_timer;
+    inst->ready_timer.ctx = inst;
+    ev_add(&inst->ready_timer, EPOLLIN);
+}
+
+/* Are the after=/requires= instances of inst ready? after= stops waiting for one that is down for good. */
+static int deps_met(const instance_t *inst) {
+    if (!inst->after[0] && !inst->requires[0]) return 1;
+    for (int i = 0; i < g_instance_count; i++) {
+        const instance_t *m = &g_instances[i];
+        if (m == inst) continue;
+        int req = deps_name(inst->requires, m);
+        if (!req && !deps_name(inst->after, m)) continue;
+        if (m->running && m->ready) continue;
+        if (!req && !m->running && !m->restart_pending && !m->waiting) continue;
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Start every waiting instance whose prerequisites are now ready. A spawn can make an instance
+ * ready and call back in here; that only asks the running pass for another round.
+ */
+static void deps_release(void) {
+    static int busy, again;
+    if (busy) {
+        again = 1;
+        return;
+    }
+    busy = 1;
+    do {
+        again = 0;
+        for (int i = 0; i < g_instance_count && g_failed_idx < 0; i++) {
+            instance_t *m = &g_instances[i];
+            if (!m->waiting || !deps_met(m)) continue;
+            m->waiting = 0;
+            if (m->running) m->recycle = 1;  // still on its way down from losing a requirement
+            else if (spawn_instance(m) != 0) instance_exited(m);
+        }
+    } while (again && g_failed_idx < 0);
+    busy = 0;
+}
+
+/* inst went down: whatever requires= it goes down too and waits for it to be ready again. */
+static void deps_lost(const instance_t *inst) {
+    for (int i = 0; i < g_instance_count; i++) {
+        instance_t *m = &g_instances[i];
+        if (m == inst || m->waiting || !deps_name(m->requires, inst)) continue;
+        if (!m->running && !m->restart_pending) continue;
+        fprintf(stderr, "wfb_supervisor: instance '%s' requires '%s', stopping it until that is ready again\n", m->name, inst->name);
+        cancel_restart(m);
+        m->waiting = 1;
+        instance_stop(m);
+    }
+}
+
+/* Spawn inst now, or leave it to deps_release() once its after=/requires= instances are ready. */
+static int instance_launch(instance_t *inst) {
+    if (!deps_met(inst)) {
+        inst->waiting = 1;
+        return 0;
+    }
+    return spawn_instance(inst);
+}
+
+static void cluster_dump(void);
+
+static void dump_status(void) {
+    fprintf(stderr, "wfb_supervisor: status:\n");
+    for (int i = 0; i < g_instance_count; i++) {
+        instance_t *inst = &g_instances[i];
+        char desc[32];
+        char stats[256];
+        if (inst->running) {
+            fprintf(stderr, "  %s: running (pid %d) for %llu s, %d restart%s\n", inst->name, inst->pid,
+                    (unsigned long long)((now_ms() - inst->start_ms) / 1000),
+                    inst->restart_count, inst->restart_count == 1 ? "" : "s");
+        } else {
+            fprintf(stderr, "  %s: %s%s, %d restart%s\n", inst->name,
+                    describe_status(inst->exit_status, desc, sizeof(desc)),
+                    inst->absent ? ", interface absent" : inst->waiting ? ", waiting for after=/requires=" :
+                    inst->restart_pending ? ", restart pending" : "",
+                    inst->restart_count, inst->restart_count == 1 ? "" : "s");
+        }
+        if (inst->stats_kind) fprintf(stderr, "    %s\n", stats_describe(inst, stats, sizeof(stats)));
+        if (inst->cg_dir >= 0) fprintf(stderr, "    %s\n", cg_describe(inst, stats, sizeof(stats)));
+        if (inst->health_udp || inst->health_stats_ms) fprintf(stderr, "    %s\n", health_describe(inst, stats, sizeof(stats)));
+        if (inst->cpu_auto && inst->running) fprintf(stderr, "    %s\n", auto_describe(inst, stats, sizeof(stats)));
+    }
+    cluster_dump();
+}
+
+/* Restart one instance with freshly rendered parameters; its group peers keep running. */
+static void instance_recycle(instance_t *inst) {
+    if (!inst->running || inst->stopping) return;  // a pending respawn renders the new values anyway
+    inst->recycle = 1;
+    instance_stop(inst);
+}
+
+static void on_signalfd(ev_watch_t *w, uint32_t events) {
+    (void)events;
+    struct signalfd_siginfo si;
+    while (read(w->fd, &si, sizeof(si)) == (ssize_t)sizeof(si)) {
+        switch (si.ssi_signo) {
+        case SIGINT:
+        case SIGTERM:
+            g_stop_requested = 1;
+            break;
+        case SIGHUP:
+            fprintf(stderr, "wfb_supervisor: SIGHUP received, reloading config\n");
+            g_reload_requested = 1;
+            break;
+        case SIGUSR1:
+            dump_status();
+            break;
+        case SIGUSR2:
+            trace_flush();
+            break;
+        case SIGCHLD:
+            // Covers kernels without pidfd support; pidfds normally win the race.
+            for (int i = 0; i < g_instance_count; i++) instance_reap(&g_instances[i]);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+static void setup_event_loop(void) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGUSR2);
+    sigaddset(&mask, SIGCHLD);
+    // Blocked rather than ignored: children get g_orig_sigmask back, an ignore would survive their exec.
+    sigaddset(&mask, SIGPIPE);
+    if (sigprocmask(SIG_BLOCK, &mask, &g_orig_sigmask) != 0) die("sigprocmask failed: %s", strerror(errno));
+
+    g_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (g_epfd < 0) die("epoll_create1 failed: %s", strerror(errno));
+
+    g_signal_watch.fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (g_signal_watch.fd < 0) die("signalfd failed: %s", strerror(errno));
+    g_signal_watch.cb = on_signalfd;
+    ev_add(&g_signal_watch, EPOLLIN);
+}
+
+static int count_running(void) {
+    int running = 0;
+    for (int i = 0; i < g_instance_count; i++) {
+        if (g_instances[i].running) running++;
+    }
+    return running;
+}
+
+static int count_active(void) {
+    int active = 0;
+    for (int i = 0; i < g_instance_count; i++) {
+        // Waiting instances are not counted: only an active one can release them.
+        if (g_instances[i].running || g_instances[i].restart_pending || g_instances[i].absent) active++;
+    }
+    return active;
+}
+
+static void shutdown_all(int failed_idx, int failed_status) {
+    if (failed_idx >= 0) {
+        instance_t *inst = &g_instances[failed_idx];
+        if (WIFEXITED(failed_status)) {
+            fprintf(stderr, "wfb_supervisor: instance '%s' (pid %d) exited with status %d, shutting down all\n",
+                    inst->name, inst->pid, WEXITSTATUS(failed_status));
+        } else if (WIFSIGNALED(failed_status)) {
+            fprintf(stderr, "wfb_supervisor: instance '%s' (pid %d) terminated by signal %d, shutting down all\n",
+                    inst->name, inst->pid, WTERMSIG(failed_status));
+        } else {
+            fprintf(stderr, "wfb_supervisor: instance '%s' (pid %d) exited, shutting down all\n",
+                    inst->name, inst->pid);
+        }
+    } else {
+        fprintf(stderr, "wfb_supervisor: shutdown requested, terminating all children\n");
+    }
+
+    uint64_t start = now_ms();
+    uint64_t trace_start = trace_now();
+    for (int i = 0; i < g_instance_count; i++) {
+        g_instances[i].waiting = 0;
+        cancel_restart(&g_instances[i]);
+        instance_stop(&g_instances[i]);
+    }
+    trace_span(trace_start, "stop all", "%d running", count_running());
+
+    // Each instance carries its own SIGKILL deadline, so this always terminates.
+    uint64_t trace_wait = trace_now();
+    while (count_running() > 0) {
+        ev_run_once(-1);
+    }
+    trace_span(trace_wait, "reap all", "");
+
+    fprintf(stderr, "wfb_supervisor: teardown finished in %llu ms\n", (unsigned long long)(now_ms() - start));
+    fprintf(stderr, "wfb_supervisor: summary:\n");
+    for (int i = 0; i < g_instance_count; i++) {
+        instance_t *inst = &g_instances[i];
+        char desc[32];
+        char stats[256];
+        fprintf(stderr, "  %s: %s, %d restart%s\n", inst->name,
+                describe_status(inst->exit_status, desc, sizeof(desc)),
+                inst->restart_count, inst->restart_count == 1 ? "" : "s");
+        if (inst->stats_kind) fprintf(stderr, "    %s\n", stats_describe(inst, stats, sizeof(stats)));
+        if (inst->cg_dir >= 0) fprintf(stderr, "    %s\n", cg_describe(inst, stats, sizeof(stats)));
+    }
+    if (failed_idx >= 0) flight_dump(failed_idx, failed_status);
+    for (int i = 0; i < g_instance_count; i++) log_release(&g_instances[i]);
+    cg_teardown();
+    irq_steer_restore();
+    trace_span(trace_start, "teardown", "%s", failed_idx >= 0 ? g_instances[failed_idx].name : "shutdown requested");
+}
+
+/* clone3() arguments up to .cgroup (CLONE_ARGS_SIZE_VER2); linux/sched.h clashes with glibc's. */
+typedef struct {
+    uint64_t flags;
+    uint64_t pidfd;
+    uint64_t child_tid;
+    uint64_t parent_tid;
+    uint64_t exit_signal;
+    uint64_t stack;
+    uint64_t stack_size;
+    uint64_t tls;
+    uint64_t set_tid;
+    uint64_t set_tid_size;
+    uint64_t cgroup;
+} clone_args_t;
+
+static int g_clone_into_cgroup = 1;  // cleared once the kernel turns CLONE_INTO_CGROUP down (pre-5.7)
+
+/*
+ * Runs in the child between fork and exec. The instance's placement, scheduling and output
+ * are set up here rather than on the supervisor, which could not always undo them (an
+ * unprivileged process cannot lower its nice value again). A failed exec or scheduler
+ * change is reported through err_fd; the others are logged and the instance still starts.
+ * join_cgroup: born outside the leaf, the child moves itself in, before its affinity since
+ * joining a cpuset resets the mask.
+ */
+static void __attribute__((noreturn)) spawn_exec(const instance_t *inst, char **argv, int out_fd, int err_fd, int join_cgroup) {
+    int err = 0;
+    int rc = join_cgroup ? cg_write(inst->cg_dir, "cgroup.procs", "0") : 0;
+    if (rc) fprintf(stderr, "wfb_supervisor: cgroup: cannot enter %s/%s: %s\n", g_cg_root_path, inst->name, strerror(-rc));
+    if (inst->cpu_list[0]) {
+        const cpu_set_t *cpus = inst->cpu_auto ? &inst->auto_cpus : &inst->cpus;
+        if (sched_setaffinity(0, sizeof(*cpus), cpus) != 0) {
+            fprintf(stderr, "wfb_supervisor: failed to set CPU %s affinity for '%s': %s\n", inst->cpu_list, inst->name, strerror(errno));
+        }
+    }
+    if (inst->nice_set && setpriority(PRIO_PROCESS, 0, inst->nice) != 0) {
+        fprintf(stderr, "wfb_supervisor: failed to set nice %d for '%s': %s\n", inst->nice, inst->name, strerror(errno));
+    }
+    if (inst->ioprio >= 0 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, inst->ioprio) != 0) {
+        fprintf(stderr, "wfb_supervisor: failed to set ioprio for '%s': %s\n", inst->name, strerror(errno));
+    }
+    if (inst->sched_policy >= 0) {
+        struct sched_param sp = { .sched_priority = inst->sched_priority };
+        if (sched_setscheduler(0, inst->sched_policy, &sp) != 0) err = errno;
+    }
+    if (!err) {
+        int null_fd = out_fd < 0 && inst->quiet ? open("/dev/null", O_WRONLY) : -1;
+        int fd = out_fd >= 0 ? out_fd : null_fd;
+        if (fd >= 0) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+        }
+        if (null_fd > STDERR_FILENO) close(null_fd);
+        sigprocmask(SIG_SETMASK, &g_orig_sigmask, NULL);
+        execvp(argv[0], argv);
+        err = errno;
+    }
+    while (write(err_fd, &err, sizeof(err)) < 0 && errno == EINTR) {}
+    _exit(127);
+}
+
+/*
+ * Fork and exec argv for inst; returns 0 with *pid set once the child has exec'd, else the
+ * errno of the failure. The parent blocks on a close-on-exec pipe that the exec closes, so
+ * the time spent here is fork to exec, as with posix_spawn. With a cgroup leaf the child is
+ * born in it through clone3(CLONE_INTO_CGROUP), so the supervisor never joins an instance's
+ * leaf (its limits, or a cgroup.kill of it); older kernels fork and the child moves itself.
+ */
+static int spawn_child(const instance_t *inst, char **argv, int out_fd, pid_t *pid) {
+    int err_pipe[2];
+    *pid = -1;
+    if (pipe2(err_pipe, O_CLOEXEC) != 0) return errno;
+    int join_cgroup = inst->cg_dir >= 0;
+    if (join_cgroup && g_clone_into_cgroup) {
+        clone_args_t args = { .flags = CLONE_INTO_CGROUP, .exit_signal = SIGCHLD, .cgroup = (uint64_t)inst->cg_dir };
+        *pid = (pid_t)syscall(SYS_clone3, &args, sizeof(args));
+        if (*pid >= 0) {
+            join_cgroup = 0;
+        } else if (errno == ENOSYS || errno == EINVAL || errno == E2BIG) {
+            fprintf(stderr, "wfb_supervisor: cgroup: clone3 into a cgroup not available (%s), children join their leaf after fork\n", strerror(errno));
+            g_clone_into_cgroup = 0;
+        } else {
+            fprintf(stderr, "wfb_supervisor: cgroup: cannot start '%s' in %s/%s: %s\n", inst->name, g_cg_root_path, inst->name, strerror(errno));
+            join_cgroup = 0;
+        }
+    }
+    if (*pid < 0) *pid = fork();
+    if (*pid == 0) {
+        close(err_pipe[0]);
+        spawn_exec(inst, argv, out_fd, err_pipe[1], join_cgroup);
+    }
+    int err = *pid < 0 ? errno : 0;
+    close(err_pipe[1]);
+    if (*pid > 0) {
+        ssize_t n;
+        while ((n = read(err_pipe[0], &err, sizeof(err))) < 0 && errno == EINTR) {}
+        if (n == (ssize_t)sizeof(err)) waitpid(*pid, NULL, 0);  // it never exec'd
+        else err = 0;
+    }
+    close(err_pipe[0]);
+    return err;
+}
+
+static int spawn_instance(instance_t *inst) {
+    static cmdline_t cl;
+    inst->stopping = 0;
+    inst->killed = 0;
+    inst->waiting = 0;
+    inst->ready = 0;
+    if (inst->nic[0] && g_cfg.monitor_setup) iface_attach(inst->nic);
+    uint64_t trace_start = trace_now();
+    build_command(inst, &cl);
+    trace_span(trace_start, "build_command", "%s", inst->name);
+    char **argv = cl.argv;
+    int argc = cl.argc;
+
+    fprintf(stderr, "wfb_supervisor: starting instance '%s':", inst->name);
+    for (int k = 0; k < argc; k++) {
+        fprintf(stderr, " %s", argv[k]);
+    }
+    fprintf(stderr, "\n");
+
+    // Children write into a non-blocking pipe: a stalled supervisor or console drops
+    // lines instead of blocking the data path.
+    int out_pipe[2] = { -1, -1 };
+    if (pipe2(out_pipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+        fprintf(stderr, "wfb_supervisor: output pipe for '%s' failed: %s\n", inst->name, strerror(errno));
+        out_pipe[0] = out_pipe[1] = -1;
+    }
+
+    if (inst->cpu_auto) auto_layout(inst);
+    else if (inst->cpu_list[0]) fprintf(stderr, "wfb_supervisor: pinning '%s' to CPU %s\n", inst->name, inst->cpu_list);
+
+    struct timespec t0, t1;
+    pid_t pid;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int rc = spawn_child(inst, argv, out_pipe[1], &pid);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if (out_pipe[1] >= 0) close(out_pipe[1]);
+
+    if (rc != 0) {
+        if (out_pipe[0] >= 0) close(out_pipe[0]);
+        fprintf(stderr, "wfb_supervisor: spawn failed for instance '%s' (%s): %s\n", inst->name, argv[0], strerror(rc));
+        inst->pid = 0;
+        inst->exit_status = (127 << 8);
+        inst->running = 0;
+        metrics_note(inst, MX_FAILURE, 0);
+        return -1;
+    }
+
+    inst->spawn_us = (uint64_t)(t1.tv_sec - t0.tv_sec) * 1000000u + (uint64_t)((t1.tv_nsec - t0.tv_nsec) / 1000);
+    inst->spawn_at_us = (uint64_t)t0.tv_sec * 1000000u + (uint64_t)t0.tv_nsec / 1000u;
+    trace_span(inst->spawn_at_us, "spawn", "%s: pid %d, %s", inst->name, (int)pid, argv[0]);
+    trace_add('M', pid, 0, inst->name, "");
+    inst->exit_us = 0;
+    metrics_note(inst, MX_START, 0);
+    metrics_note(inst, MX_SPAWN, inst->spawn_us);
+    fprintf(stderr, "wfb_supervisor: instance '%s' (pid %d) exec'd in %llu.%03llu ms\n", inst->name, pid,
+            (unsigned long long)(inst->spawn_us / 1000), (unsigned long long)(inst->spawn_us % 1000));
+
+    inst->pid = pid;
+    inst->running = 1;
+    inst->start_ms = now_ms();
+    inst->pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    if (inst->pidfd >= 0) {
+        inst->pid_watch.fd = inst->pidfd;
+        inst->pid_watch.cb = on_pidfd;
+        inst->pid_watch.ctx = inst;
+        ev_add(&inst->pid_watch, EPOLLIN);
+    }
+    if (out_pipe[0] >= 0) {
+        ev_close(&inst->out_watch);
+        log_attach(inst);
+        inst->log.line_len = 0;
+        inst->log.line_overflow = 0;
+        inst->stats.last_wfb_ts = 0;
+        memset(&inst->stats.pending, 0, sizeof(inst->stats.pending));
+        inst->out_watch.fd = out_pipe[0];
+        inst->out_watch.cb = on_output_pipe;
+        inst->out_watch.ctx = inst;
+        ev_add(&inst->out_watch, EPOLLIN);
+    }
+    health_start(inst, &cl);
+    ready_start(inst);  // may start dependents, so it comes last
+    return 0;
+}
+
+static int start_children(int *failed_idx, int *failed_status) {
+    if (failed_idx) *failed_idx = -1;
+    if (failed_status) *failed_status = 0;
+
+    // Everything waits for its after=/requires= instances; those without start right away,
+    // in file order, and each ready instance releases its dependents. Instances with a
+    // restart policy retry a failed exec like any other exit.
+    for (int i = 0; i < g_instance_count; i++) g_instances[i].waiting = 1;
+    deps_release();
+    if (g_failed_idx >= 0) {
+        if (failed_idx) *failed_idx = g_failed_idx;
+        if (failed_status) *failed_status = g_failed_status;
+        return -1;
+    }
+    return 0;
+}
+
+/* NIC hotplug */
+
+#define HOTPLUG_SETTLE_MS 250   // a USB adapter shows up and gets renamed in a burst of link events
+
+static ev_watch_t g_hotplug_watch = { .fd = -1 };
+static ev_watch_t g_hotplug_timer = { .fd = -1 };
+static int g_hotplug_pending = 0;  // links changed; hotplug_apply() runs at the top of the loop
+
+static void on_hotplug_timer(ev_watch_t *w, uint32_t events) {
+    (void)events;
+    ev_close(w);
+    g_hotplug_pending = 1;
+}
+
+/* Any link appearing, leaving or being renamed (re)starts the settle timer. */
+static void on_hotplug(ev_watch_t *w, uint32_t events) {
+    (void)events;
+    char rbuf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+    int changed = 0;
+    ssize_t n;
+    while ((n = recv(w->fd, rbuf, sizeof(rbuf), MSG_DONTWAIT)) > 0) {
+        size_t len = (size_t)n;
+        for (struct nlmsghdr *nlh = (struct nlmsghdr *)rbuf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+            if (nlh->nlmsg_type == RTM_NEWLINK || nlh->nlmsg_type == RTM_DELLINK) changed = 1;
+        }
+    }
+    // ENOBUFS means events were lost: look anyway.
+    if (n < 0 && errno == ENOBUFS) changed = 1;
+    if (!changed) return;
+    if (g_hotplug_timer.fd < 0) {
+        g_hotplug_timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (g_hotplug_timer.fd < 0) {
+            g_hotplug_pending = 1;
+            return;
+        }
+        g_hotplug_timer.cb = on_hotplug_timer;
+        ev_add(&g_hotplug_timer, EPOLLIN);
+    }
+    timer_arm_ms(g_hotplug_timer.fd, HOTPLUG_SETTLE_MS);
+}
+
+/* Listens for link changes while the config has templates. */
+static void hotplug_setup(void) {
+    if (g_cfg.template_count == 0 || g_hotplug_watch.fd >= 0) return;
+    g_hotplug_watch.fd = nl_open(NETLINK_ROUTE, RTMGRP_LINK);
+    if (g_hotplug_watch.fd < 0) {
+        fprintf(stderr, "wfb_supervisor: hotplug: netlink socket failed: %s; templates expand at start only\n", strerror(errno));
+        return;
+    }
+    fcntl(g_hotplug_watch.fd, F_SETFL, O_NONBLOCK);
+    g_hotplug_watch.cb = on_hotplug;
+    ev_add(&g_hotplug_watch, EPOLLIN);
+}
+
+static void hotplug_close(void) {
+    ev_close(&g_hotplug_watch);
+    ev_close(&g_hotplug_timer);
+    g_hotplug_pending = 0;
+}
+
+/* The table moved: point every watch back at its instance. */
+static void instances_rebind(void) {
+    for (int j = 0; j < g_instance_count; j++) {
+        instance_t *inst = &g_instances[j];
+        ev_rebind(&inst->pid_watch, inst);
+        ev_rebind(&inst->kill_timer, inst);
+        ev_rebind(&inst->restart_timer, inst);
+        ev_rebind(&inst->out_watch, inst);
+        ev_rebind(&inst->health_timer, inst);
+        ev_rebind(&inst->ready_timer, inst);
+    }
+}
+
+static int nic_present(const instance_t *inst) {
+    return !inst->nic[0] || if_nametoindex(inst->nic) != 0;
+}
+
+/*
+ * Park the instances whose NIC went away, start the parked ones whose NIC is back, and
+ * instantiate the templates for new NICs. Runs outside any callback since the table may move.
+ */
+static void hotplug_apply(void) {
+    g_hotplug_pending = 0;
+    for (int i = 0; i < g_instance_count; i++) {
+        instance_t *inst = &g_instances[i];
+        if (inst->absent || nic_present(inst)) continue;
+        fprintf(stderr, "wfb_supervisor: hotplug: interface %s gone, parking instance '%s'\n", inst->nic, inst->name);
+        inst->absent = 1;
+        cancel_restart(inst);
+        instance_stop(inst);
+        if (g_cfg.monitor_setup) iface_detach(inst->nic);
+    }
+    for (int i = 0; i < g_instance_count; i++) {
+        instance_t *inst = &g_instances[i];
+        if (!inst->absent || !nic_present(inst)) continue;
+        fprintf(stderr, "wfb_supervisor: hotplug: interface %s back, starting instance '%s'\n", inst->nic, inst->name);
+        inst->absent = 0;
+        if (inst->running) inst->recycle = 1;  // still on its way down from the unplug
+        else inst->waiting = 1;
+    }
+    int first = g_instance_count;
+    if (templates_expand() > 0) instances_rebind();
+    for (int j = first; j < g_instance_count; j++) {
+        instance_t *inst = &g_instances[j];
+        fprintf(stderr, "wfb_supervisor: hotplug: interface %s appeared, instance '%s' added\n", inst->nic, inst->name);
+        if (g_cg_root_fd >= 0) cg_leaf_setup(inst);
+        inst->waiting = 1;
+    }
+    deps_release();
+}
+
+/* Hot reload */
+
+/* A parsed config waiting to replace the live one, or the live one while the new one is inspected. */
+static general_config_t g_shadow_cfg;
+static instance_t *g_shadow_instances;     // lives in g_shadow_cfg.arena
+static int g_shadow_count = 0;
+static int g_shadow_cap = 0;
+static adapt_state_t g_shadow_adapt;
+
+/* The instance table belongs to its config's arena, so both travel together. */
+static void swap_shadow(void) {
+    general_config_t cfg = g_cfg;
+    instance_t *instances = g_instances;
+    int count = g_instance_count;
+    int cap = g_instance_cap;
+    adapt_state_t adapt = g_adapt;
+    g_cfg = g_shadow_cfg;
+    g_instances = g_shadow_instances;
+    g_instance_count = g_shadow_count;
+    g_instance_cap = g_shadow_cap;
+    g_adapt = g_shadow_adapt;
+    g_shadow_cfg = cfg;
+    g_shadow_instances = instances;
+    g_shadow_count = count;
+    g_shadow_cap = cap;
+    g_shadow_adapt = adapt;
+}
+
+/* Everything about an instance that only takes effect when its process is (re)started. */
+static void instance_spec(const instance_t *inst, strbuf_t *out) {
+    static cmdline_t cl;
+    build_command(inst, &cl);
+    sb_reset(out);
+    for (int k = 0; k < cl.argc; k++) {
+        sb_puts(out, cl.argv[k]);
+        sb_append(out, "\x1f", 1);
+    }
+    sb_printf(out, "cpu=%s:%d quiet=%d stats=%d sched=%d:%d nice=%d:%d ioprio=%d irq=%d:%s cg=%d|%s|%s|%s|%s",
+             inst->cpu_list, inst->latency_critical, inst->quiet, inst->stats_kind, inst->sched_policy, inst->sched_priority,
+             inst->nice_set, inst->nice, inst->ioprio, inst->irq_affinity, inst->irq_nics, inst->cpu_weight,
+             inst->cpu_max, inst->memory_max, inst->memory_high, inst->cpuset);
+    sb_printf(out, " health=%d:%08x:%d:%d:%d:%d:%d", inst->health_udp, inst->health_addr, inst->health_port,
+              inst->health_min_pps, inst->health_timeout_ms, inst->health_stats_ms, inst->health_grace_ms);
+    sb_printf(out, " deps=%s|%s ready=%d:%s:%d", inst->after, inst->requires, inst->ready_kind, inst->ready_arg, inst->ready_timeout_ms);
+}
+
+/* What a hot reload cannot change under running instances: hooks, native NIC setup, the cgroup root. */
+static uint64_t stage_fingerprint(void) {
+    uint64_t h = 1469598103934665603ull;
+    static strbuf_t buf;
+    for (int i = 0; i < g_cfg.init_cmd_count; i++) {
+        h = fnv1a(h, tmpl_expand(&g_cfg.init_cmds[i].tmpl, &buf));
+        h = fnv1a(h, g_cfg.init_cmds[i].persist ? "persist" : "");
+    }
+    for (int i = 0; i < g_cfg.cleanup_cmd_count; i++) h = fnv1a(h, tmpl_expand(&g_cfg.cleanup_cmds[i].tmpl, &buf));
+    for (int i = 0; i < g_cfg.tuning_count; i++) {
+        h = fnv1a(h, g_cfg.tuning[i].key);
+        h = fnv1a(h, g_cfg.tuning[i].val);
+    }
+    const char *rx = get_param_value("rx_nics");
+    const char *tx = get_param_value("tx_nics");
+    sb_reset(&buf);
+    sb_printf(&buf, "%d|%s|%d|%d|%d|%d|%d|%s|%s|%s", g_cfg.monitor_setup, g_cfg.wifi_region,
+              g_cfg.wifi_channel, g_cfg.wifi_bandwidth, g_cfg.wifi_txpower, g_cfg.shaper_setup, g_cfg.cgroup,
+              g_cfg.cgroup_root, rx ? rx : "", tx ? tx : "");
+    return fnv1a(h, buf.buf);
+}
+
+static int shaper_equal(const general_config_t *a, const general_config_t *b) {
+    return a->shaper_mcs == b->shaper_mcs && a->shaper_nss == b->shaper_nss && a->shaper_sgi == b->shaper_sgi &&
+           a->shaper_efficiency == b->shaper_efficiency &&
+           memcmp(a->shaper_share, b->shaper_share, sizeof(a->shaper_share)) == 0;
+}
+
+/*
+ * load_config() plus rendering every command, with config errors returned instead of fatal:
+ * -1 leaves a partial table in the live slots and the reason in g_die_msg. Callers parse into
+ * the shadow slots and swap the running config back on failure.
+ */
+static int config_try(const char *path) {
+    static strbuf_t spec;
+    jmp_buf jb;
+    if (setjmp(jb)) {
+        g_die_jmp = NULL;
+        return -1;
+    }
+    g_die_jmp = &jb;
+    load_config(path);
+    for (int i = 0; i < g_instance_count; i++) instance_spec(&g_instances[i], &spec);
+    g_die_jmp = NULL;
+    return 0;
+}
+
+/* Read once at startup; a reload only says that the new value is waiting for a supervisor restart. */
+static const char *const k_startup_params[] = {
+    "control_socket", "metrics_file", "metrics_listen", "metrics_interval", "cluster_report",
+    "cluster_listen", "cluster_node", "cluster_interval", "cluster_stale", "cpu_auto_interval",
+};
+#define STARTUP_PARAM_COUNT (sizeof(k_startup_params) / sizeof(k_startup_params[0]))
+
+static int hot_reload_apply(const int *old_of, const int *keep, int keep_adapt, int restage, char *msg, size_t len);
+
+/*
+ * Bring the running set in line with the config file: instances whose spec is unchanged keep
+ * their process, the others are stopped, started or restarted on their own. Changed hooks or
+ * link setup fall back to the full restart path. Only called from the top of the event loop,
+ * never from a callback, since it re-lays the instance table. Writes a one-line outcome to msg
+ * and returns -1 when the running set was left alone.
+ */
+static int hot_reload(char *msg, size_t len) {
+    fprintf(stderr, "wfb_supervisor: reloading %s\n", g_config_path);
+    // The old values stay valid after the swap: they live in what becomes the shadow arena.
+    const char *old_startup[STARTUP_PARAM_COUNT];
+    for (size_t k = 0; k < STARTUP_PARAM_COUNT; k++) old_startup[k] = get_param_value(k_startup_params[k]);
+
+    // Parse into the shadow slots, then look at the result through the live names.
+    swap_shadow();
+    if (config_try(g_config_path) != 0) {
+        swap_shadow();
+        snprintf(msg, len, "config rejected (%.72s), keeping the running set", g_die_msg);
+        fprintf(stderr, "wfb_supervisor: reload: %s\n", msg);
+        return -1;
+    }
+    for (size_t k = 0; k < STARTUP_PARAM_COUNT; k++) {
+        const char *val = get_param_value(k_startup_params[k]);
+        if (strcmp(val ? val : "", old_startup[k] ? old_startup[k] : "") == 0) continue;
+        fprintf(stderr, "wfb_supervisor: reload: %s changed, takes effect after a supervisor restart\n", k_startup_params[k]);
+    }
+    swap_shadow();
+
+    strbuf_t *old_spec = calloc((size_t)g_instance_count + 1, sizeof(*old_spec));
+    if (!old_spec) die("out of memory");
+    int old_count = g_instance_count;
+    for (int i = 0; i < g_instance_count; i++) instance_spec(&g_instances[i], &old_spec[i]);
+    uint64_t old_stage = stage_fingerprint();
+
+    swap_shadow();
+    // An unchanged ladder keeps the rung the controller is on instead of restarting from the configured one.
+    int keep_adapt = g_cfg.adapt && g_shadow_cfg.adapt && g_cfg.adapt_step_count == g_shadow_cfg.adapt_step_count &&
+                     memcmp(g_cfg.adapt_steps, g_shadow_cfg.adapt_steps, sizeof(g_cfg.adapt_steps)) == 0;
+    if (keep_adapt) {
+        adapt_store_params(&g_cfg.adapt_steps[g_shadow_adapt.step]);
+        g_cfg.shaper_mcs = g_cfg.adapt_steps[g_shadow_adapt.step].mcs;
+    }
+    uint64_t new_stage = stage_fingerprint();
+    strbuf_t spec = { 0 };
+    int *old_of = calloc((size_t)g_instance_count + 1, sizeof(*old_of));
+    int *keep = calloc((size_t)old_count + 1, sizeof(*keep));
+    if (!old_of || !keep) die("out of memory");
+    for (int j = 0; j < g_instance_count; j++) {
+        old_of[j] = -1;
+        instance_spec(&g_instances[j], &spec);
+        for (int i = 0; i < g_shadow_count; i++) {
+            if (strcasecmp(g_shadow_instances[i].name, g_instances[j].name) != 0) continue;
+            old_of[j] = i;
+            keep[i] = strcmp(old_spec[i].buf, spec.buf) == 0;
+        }
+    }
+    sb_free(&spec);
+    for (int i = 0; i < old_count; i++) sb_free(&old_spec[i]);
+    free(old_spec);
+    swap_shadow();
+    int rc = hot_reload_apply(old_of, keep, keep_adapt, new_stage != old_stage, msg, len);
+    free(old_of);
+    free(keep);
+    return rc;
+}
+
+/* Second half of hot_reload(): old_of maps each new instance to its old index, keep marks old ones left running. */
+static int hot_reload_apply(const int *old_of, const int *keep, int keep_adapt, int restage, char *msg, size_t len) {
+    if (restage) {
+        snprintf(msg, len, "hooks or link setup changed, full restart");
+        fprintf(stderr, "wfb_supervisor: reload: %s\n", msg);
+        g_restart_requested = 1;
+        return 0;
+    }
+
+    // Stop what goes away or changes while the old table is still live.
+    int removed = 0;
+    for (int i = 0; i < g_instance_count; i++) {
+        if (keep[i]) continue;
+        int gone = 1;
+        for (int j = 0; j < g_shadow_count; j++) gone &= old_of[j] != i;
+        if (gone) fprintf(stderr, "wfb_supervisor: reload: instance '%s' removed\n", g_instances[i].name);
+        removed += gone;
+        cancel_restart(&g_instances[i]);
+        instance_stop(&g_instances[i]);
+    }
+    for (;;) {
+        int left = 0;
+        for (int i = 0; i < g_instance_count; i++) left += !keep[i] && g_instances[i].running;
+        if (!left) break;
+        ev_run_once(-1);
+        // A teardown-policy instance failing now takes everything down through the old table.
+        if (g_stop_requested || g_failed_idx >= 0) {
+            snprintf(msg, len, "aborted, shutting down");
+            return -1;
+        }
+    }
+    for (int i = 0; i < g_instance_count; i++) {
+        if (keep[i]) continue;
+        cg_leaf_remove(&g_instances[i]);
+        log_release(&g_instances[i]);
+    }
+
+    // Kept instances bring their process, timers, stats and cgroup leaf along.
+    size_t rt = offsetof(instance_t, pid);
+    for (int j = 0; j < g_shadow_count; j++) {
+        if (old_of[j] < 0 || !keep[old_of[j]]) continue;
+        memcpy((char *)&g_shadow_instances[j] + rt, (char *)&g_instances[old_of[j]] + rt, sizeof(instance_t) - rt);
+    }
+    int shaper_changed = !shaper_equal(&g_cfg, &g_shadow_cfg);
+    swap_shadow();
+    if (keep_adapt) g_adapt = g_shadow_adapt;
+    instances_rebind();
+    hotplug_setup();
+    if (g_cfg.shaper_setup && shaper_changed) shaper_apply();
+
+    int kept = 0, changed = 0, added = 0;
+    for (int j = 0; j < g_instance_count; j++) kept += old_of[j] >= 0 && keep[old_of[j]];
+    if (kept < g_instance_count || removed) {
+        irq_steer_restore();
+        irq_steer_setup();
+    }
+    for (int j = 0; j < g_instance_count; j++) {
+        instance_t *inst = &g_instances[j];
+        if (old_of[j] >= 0 && keep[old_of[j]]) continue;
+        fprintf(stderr, "wfb_supervisor: reload: instance '%s' %s\n", inst->name, old_of[j] >= 0 ? "changed" : "added");
+        if (g_cg_root_fd >= 0) cg_leaf_setup(inst);
+        if (old_of[j] >= 0) changed++;
+        else added++;
+        inst->waiting = 1;
+    }
+    deps_release();
+    g_fingerprint = hook_fingerprint();
+    g_reloads++;
+    snprintf(msg, len, "%d unchanged, %d restarted, %d added, %d removed", kept, changed, added, removed);
+    fprintf(stderr, "wfb_supervisor: reload: %s\n", msg);
+    return 0;
+}
+
+/* Cluster heartbeat */
+
+#define CLUSTER_MAX_NODES  64
+#define CLUSTER_MAX_INST   8      // instances kept per node; the rest are only counted
+#define CLUSTER_PKT_MAX    1400
+#define CLUSTER_RESP_PER_NODE 640 // "cluster" reply lines of one node
+#define DEFAULT_CLUSTER_INTERVAL_MS 1000
+#define CLUSTER_STALE_BEATS 3     // heartbeats missed before a node counts as stale
+
+/*
+ * One datagram per heartbeat, plain text so it can be read with tcpdump or faked with nc:
+ * "WFBHB 1 <node> <boot> <seq> <interval_ms> <up> <count>\n" then per instance
+ * "<name> <R|S|W|P|A> <restarts> <pkt/s or -1>\n". boot tells supervisor runs apart.
+ */
+typedef struct {
+    char     name[MAX_NAME_LEN];
+    char     state;
+    uint32_t restarts;
+    int32_t  pps;
+} cluster_inst_t;
+
+typedef struct {
+    char     node[64];
+    char     addr[INET_ADDRSTRLEN + 6];
+    uint64_t boot;
+    uint32_t seq;
+    uint32_t interval_ms;
+    uint64_t seen_ms;        // 0 = free slot
+    uint64_t beats;
+    uint64_t missed;         // sequence gaps
+    int      up;             // 0 after the node said goodbye
+    int      stale;
+    int      inst_count;     // as reported; at most CLUSTER_MAX_INST are kept
+    cluster_inst_t inst[CLUSTER_MAX_INST];
+} cluster_node_t;
+
+static ev_watch_t g_cluster_rx = { .fd = -1 };     // cluster_listen: the aggregator's single socket
+static ev_watch_t g_cluster_timer = { .fd = -1 };
+static int        g_cluster_tx_fd = -1;            // cluster_report: connected to the aggregator
+static char       g_cluster_node[64];
+static uint64_t   g_cluster_boot;
+static uint32_t   g_cluster_seq = 0;
+static int        g_cluster_interval_ms = DEFAULT_CLUSTER_INTERVAL_MS;
+static int        g_cluster_stale_ms = 0;          // 0 = CLUSTER_STALE_BEATS of the node's interval
+static cluster_node_t g_cluster[CLUSTER_MAX_NODES];
+static uint64_t   g_cluster_rejected = 0;          // table full or malformed
+
+static int fanout_resolve(const char *host, const char *port, struct sockaddr_in *sa);
+
+static char instance_state_char(const instance_t *inst) {
+    return inst->running ? 'R' : inst->absent ? 'A' : inst->waiting ? 'W' : inst->restart_pending ? 'P' : 'S';
+}
+
+static const char *cluster_state_name(char c) {
+    switch (c) {
+    case 'R': return "running";
+    case 'A': return "absent";
+    case 'W': return "waiting";
+    case 'P': return "pending";
+    default:  return "stopped";
+    }
+}
+
+static void cluster_send(int up) {
+    if (g_cluster_tx_fd < 0) return;
+    char pkt[CLUSTER_PKT_MAX];
+    int off = snprintf(pkt, sizeof(pkt), "WFBHB 1 %s %llu %u %d %d %d\n", g_cluster_node, (unsigned long long)g_cluster_boot,
+                       ++g_cluster_seq, g_cluster_interval_ms, up, g_instance_count);
+    for (int i = 0; i < g_instance_count; i++) {
+        const instance_t *inst = &g_instances[i];
+        double pps = inst->stats_kind && inst->running ? stats_rate(&inst->stats, STAT_PACKETS, 5000) : -1;
+        char line[MAX_NAME_LEN + 48];
+        int n = snprintf(line, sizeof(line), "%s %c %d %d\n", inst->name, up ? instance_state_char(inst) : 'S',
+                         inst->restart_count, pps < 0 ? -1 : (int)(pps + 0.5));
+        if (off + n >= (int)sizeof(pkt)) break;  // the count still tells the aggregator there were more
+        memcpy(pkt + off, line, (size_t)n + 1);
+        off += n;
+    }
+    // ECONNREFUSED only means the aggregator is not up yet; the next beat tries again.
+    send(g_cluster_tx_fd, pkt, (size_t)off, MSG_DONTWAIT);
 }
 
-static int get_param_int(const char *key, int default_val) {
-    const char *val = get_param_value(key);
-    if (!val) return default_val;
+static cluster_node_t *cluster_slot(const char *node) {
+    cluster_node_t *free_slot = NULL, *oldest = NULL;
+    for (int i = 0; i < CLUSTER_MAX_NODES; i++) {
+        cluster_node_t *n = &g_cluster[i];
+        if (!n->seen_ms) {
+            if (!free_slot) free_slot = n;
+            continue;
+        }
+        if (strcmp(n->node, node) == 0) return n;
+        if ((n->stale || !n->up) && (!oldest || n->seen_ms < oldest->seen_ms)) oldest = n;
+    }
+    // A full table gives up the longest-silent node that is already stale or gone, never a live one.
+    cluster_node_t *n = free_slot ? free_slot : oldest;
+    if (!n) return NULL;
+    if (n == oldest) fprintf(stderr, "wfb_supervisor: cluster: table full, forgetting node %s\n", n->node);
+    memset(n, 0, sizeof(*n));
+    snprintf(n->node, sizeof(n->node), "%s", node);
+    return n;
+}
 
-    int parsed = 0;
-    if (parse_int(val, &parsed)) {
-        die("config: invalid integer value '%s' for %s", val, key);
+static void cluster_receive(const char *pkt, const struct sockaddr_in *from) {
+    char node[64];
+    unsigned long long boot;
+    unsigned seq, interval;
+    int up, count, used;
+    if (sscanf(pkt, "WFBHB 1 %63s %llu %u %u %d %d\n%n", node, &boot, &seq, &interval, &up, &count, &used) != 6 || interval == 0) {
+        g_cluster_rejected++;
+        return;
     }
-    return parsed;
+    cluster_node_t *n = cluster_slot(node);
+    if (!n) {
+        g_cluster_rejected++;
+        return;
+    }
+    char addr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &from->sin_addr, addr, sizeof(addr));
+    if (!n->seen_ms) {
+        fprintf(stderr, "wfb_supervisor: cluster: node %s joined from %s\n", node, addr);
+    } else if (n->boot != boot) {
+        fprintf(stderr, "wfb_supervisor: cluster: node %s restarted its supervisor\n", node);
+        n->seq = 0;
+    } else if (seq <= n->seq) {
+        return;  // duplicate or reordered beat
+    } else {
+        n->missed += seq - n->seq - 1;
+        if (n->stale) fprintf(stderr, "wfb_supervisor: cluster: node %s is back\n", node);
+    }
+    if (!up && n->up) fprintf(stderr, "wfb_supervisor: cluster: node %s shut down\n", node);
+    snprintf(n->addr, sizeof(n->addr), "%s:%u", addr, ntohs(from->sin_port));
+    n->boot = boot;
+    n->seq = seq;
+    n->interval_ms = interval;
+    n->seen_ms = now_ms();
+    n->beats++;
+    n->up = up;
+    n->stale = 0;
+    n->inst_count = count;
+
+    int kept = 0;
+    for (const char *p = pkt + used; *p && kept < CLUSTER_MAX_INST; ) {
+        cluster_inst_t *ci = &n->inst[kept];
+        if (sscanf(p, "%63s %c %u %d", ci->name, &ci->state, &ci->restarts, &ci->pps) != 4) break;
+        kept++;
+        p = strchr(p, '\n');
+        if (!p) break;
+        p++;
+    }
+    if (kept < n->inst_count && kept < CLUSTER_MAX_INST) n->inst_count = kept;  // truncated datagram
 }
 
-static void apply_runtime_settings(void) {
-    g_cfg.restart_enabled = get_param_bool("restart", DEFAULT_RESTART_ENABLED);
-    g_cfg.restart_delay = get_param_int("restart_delay", DEFAULT_RESTART_DELAY);
-    if (g_cfg.restart_delay < 0) {
-        die("config: restart_delay must be non-negative (got %d)", g_cfg.restart_delay);
+static void on_cluster_rx(ev_watch_t *w, uint32_t events) {
+    (void)events;
+    char pkt[CLUSTER_PKT_MAX + 1];
+    for (;;) {
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        ssize_t n = recvfrom(w->fd, pkt, CLUSTER_PKT_MAX, MSG_DONTWAIT, (struct sockaddr *)&from, &from_len);
+        if (n < 0) return;
+        pkt[n] = '\0';
+        cluster_receive(pkt, &from);
     }
 }
 
-static const char *wrap_exec(const char *cmd, char *buf, size_t buf_len) {
-    if (strncmp(cmd, "exec ", 5) == 0) return cmd;
+static uint64_t cluster_stale_after(const cluster_node_t *n) {
+    return g_cluster_stale_ms ? (uint64_t)g_cluster_stale_ms : (uint64_t)n->interval_ms * CLUSTER_STALE_BEATS;
+}
 
-    int n = snprintf(buf, buf_len, "exec %s", cmd);
-    if (n < 0 || (size_t)n >= buf_len) die("expanded command too long");
-    return buf;
+static void on_cluster_timer(ev_watch_t *w, uint32_t events) {
+    (void)events;
+    timer_drain(w->fd);
+    cluster_send(1);
+    uint64_t now = now_ms();
+    for (int i = 0; i < CLUSTER_MAX_NODES; i++) {
+        cluster_node_t *n = &g_cluster[i];
+        if (!n->seen_ms || !n->up || n->stale || now - n->seen_ms < cluster_stale_after(n)) continue;
+        n->stale = 1;
+        fprintf(stderr, "wfb_supervisor: cluster: node %s is stale, no heartbeat for %llu ms\n", n->node,
+                (unsigned long long)(now - n->seen_ms));
+    }
 }
 
-static void run_commands(char cmds[][MAX_VALUE_LEN], int count, const char *phase) {
-    for (int i = 0; i < count; i++) {
-        char expanded[MAX_CMD_LEN];
-        char exec_wrapped[MAX_CMD_LEN];
-        expand_placeholders(cmds[i], expanded, sizeof(expanded));
-        const char *cmd = wrap_exec(expanded, exec_wrapped, sizeof(exec_wrapped));
-        fprintf(stderr, "wfb_supervisor: running %s command: %s\n", phase, cmd);
-        pid_t pid = fork();
-        if (pid < 0) die("%s command fork failed: %s", phase, strerror(errno));
-        if (pid == 0) {
-            execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
-            fprintf(stderr, "wfb_supervisor: exec failed for %s command '%s': %s\n", phase, cmd, strerror(errno));
-            _exit(127);
+/* One summary line per node; with detail, one more per instance it reported. */
+static size_t cluster_describe(char *out, size_t len, int detail) {
+    size_t off = 0;
+    uint64_t now = now_ms();
+    for (int i = 0; i < CLUSTER_MAX_NODES && off < len; i++) {
+        const cluster_node_t *n = &g_cluster[i];
+        if (!n->seen_ms) continue;
+        int running = 0, restarts = 0, rate = -1;
+        for (int k = 0; k < n->inst_count && k < CLUSTER_MAX_INST; k++) {
+            running += n->inst[k].state == 'R';
+            restarts += (int)n->inst[k].restarts;
+            if (n->inst[k].pps >= 0) rate = (rate < 0 ? 0 : rate) + n->inst[k].pps;
         }
-        int status;
-        if (waitpid(pid, &status, 0) < 0) die("%s command waitpid failed: %s", phase, strerror(errno));
-        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
-            die("%s command '%s' failed (status %d)", phase, expanded,
-                WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+        off += (size_t)snprintf(out + off, len - off, "cluster %s %s addr=%s age=%llums running=%d/%d restarts=%d",
+                                n->node, !n->up ? "down" : n->stale ? "stale" : "ok", n->addr,
+                                (unsigned long long)(now - n->seen_ms), running, n->inst_count, restarts);
+        if (rate >= 0 && off < len) off += (size_t)snprintf(out + off, len - off, " pkt/s=%d", rate);
+        if (off < len) off += (size_t)snprintf(out + off, len - off, " beats=%llu missed=%llu\n",
+                                               (unsigned long long)n->beats, (unsigned long long)n->missed);
+        for (int k = 0; detail && k < n->inst_count && k < CLUSTER_MAX_INST && off < len; k++) {
+            const cluster_inst_t *ci = &n->inst[k];
+            off += (size_t)snprintf(out + off, len - off, "cluster %s %s %s restarts=%u", n->node, ci->name,
+                                    cluster_state_name(ci->state), ci->restarts);
+            if (ci->pps >= 0 && off < len) off += (size_t)snprintf(out + off, len - off, " pkt/s=%d", ci->pps);
+            if (off < len) off += (size_t)snprintf(out + off, len - off, "\n");
         }
     }
+    return off < len ? off : len - 1;
 }
 
-/* Build commands */
+static void cluster_dump(void) {
+    char buf[CLUSTER_MAX_NODES * 160];
+    if (g_cluster_rx.fd < 0) return;
+    size_t len = cluster_describe(buf, sizeof(buf), 0);
+    fprintf(stderr, "wfb_supervisor: cluster:%s\n", len ? "" : " no nodes heard yet");
+    for (char *line = strtok(buf, "\n"); len && line; line = strtok(NULL, "\n")) fprintf(stderr, "  %s\n", line + 8);
+}
+
+/* Read once at startup, like control_socket: cluster_report= on a forwarder, cluster_listen= on the aggregator. */
+static void cluster_setup(void) {
+    const char *report = get_param_value("cluster_report");
+    const char *listen_spec = get_param_value("cluster_listen");
+    const char *node = get_param_value("cluster_node");
+    const char *interval = get_param_value("cluster_interval");
+    const char *stale = get_param_value("cluster_stale");
+    if (!report && !listen_spec) return;
+    if (interval && (parse_duration_ms(interval, &g_cluster_interval_ms) || g_cluster_interval_ms <= 0)) {
+        die("config: invalid cluster_interval '%s'", interval);
+    }
+    if (stale && (parse_duration_ms(stale, &g_cluster_stale_ms) || g_cluster_stale_ms <= 0)) die("config: invalid cluster_stale '%s'", stale);
+    if (node) snprintf(g_cluster_node, sizeof(g_cluster_node), "%s", node);
+    else if (gethostname(g_cluster_node, sizeof(g_cluster_node) - 1) != 0) snprintf(g_cluster_node, sizeof(g_cluster_node), "node");
+    if (strpbrk(g_cluster_node, " \t\n")) die("config: cluster_node '%s' must be one word", g_cluster_node);
+    g_cluster_boot = wall_ms();
+
+    char host[128];
+    struct sockaddr_in sa;
+    if (report) {
+        const char *colon = strrchr(report, ':');
+        if (!colon) die("config: invalid cluster_report '%s' (expected host:port)", report);
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - report), report);
+        if (fanout_resolve(host, colon + 1, &sa) != 0) die("config: cannot resolve cluster_report '%s'", report);
+        g_cluster_tx_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (g_cluster_tx_fd < 0 || connect(g_cluster_tx_fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+            die("cluster: socket for %s failed: %s", report, strerror(errno));
+        }
+        fprintf(stderr, "wfb_supervisor: cluster: reporting to %s as %s every %d ms\n", report, g_cluster_node, g_cluster_interval_ms);
+    }
+    if (listen_spec) {
+        const char *colon = strrchr(listen_spec, ':');
+        snprintf(host, sizeof(host), "%.*s", colon ? (int)(colon - listen_spec) : 0, listen_spec);
+        if (fanout_resolve(colon ? host : "0.0.0.0", colon ? colon + 1 : listen_spec, &sa) != 0) {
+            die("config: invalid cluster_listen '%s' (expected <port> or <ipv4>:<port>)", listen_spec);
+        }
+        int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) die("cluster: cannot listen on %s: %s", listen_spec, strerror(errno));
+        g_cluster_rx.fd = fd;
+        g_cluster_rx.cb = on_cluster_rx;
+        ev_add(&g_cluster_rx, EPOLLIN);
+        fprintf(stderr, "wfb_supervisor: cluster: aggregating heartbeats on %s\n", listen_spec);
+    }
 
-static void build_command(const instance_t *inst, char **argv, int *argc, char *exec_path, size_t exec_len) {
-    char expanded_cmd[MAX_CMD_LEN];
-    char exec_wrapped[MAX_CMD_LEN];
-    expand_placeholders(inst->cmd, expanded_cmd, sizeof(expanded_cmd));
-    const char *cmd = wrap_exec(expanded_cmd, exec_wrapped, sizeof(exec_wrapped));
+    g_cluster_timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (g_cluster_timer.fd < 0) die("cluster: timerfd failed: %s", strerror(errno));
+    struct itimerspec its;
+    its.it_value.tv_sec = its.it_interval.tv_sec = g_cluster_interval_ms / 1000;
+    its.it_value.tv_nsec = its.it_interval.tv_nsec = (long)(g_cluster_interval_ms % 1000) * 1000000L;
+    timerfd_settime(g_cluster_timer.fd, 0, &its, NULL);
+    g_cluster_timer.cb = on_cluster_timer;
+    ev_add(&g_cluster_timer, EPOLLIN);
+}
 
-    snprintf(exec_path, exec_len, "%s", "/bin/sh");
-    *argc = 0;
-    argv[(*argc)++] = exec_path;
-    argv[(*argc)++] = "-c";
-    argv[(*argc)++] = (char *)cmd;
-    argv[*argc] = NULL;
+/* A last beat with up=0 tells the aggregator this node went away on purpose. */
+static void cluster_close(void) {
+    cluster_send(0);
+    if (g_cluster_tx_fd >= 0) close(g_cluster_tx_fd);
+    g_cluster_tx_fd = -1;
+    ev_close(&g_cluster_rx);
+    ev_close(&g_cluster_timer);
 }
 
-/* Supervision */
+/* Control socket */
 
-static void shutdown_all(int failed_idx, int failed_status) {
-    if (failed_idx >= 0) {
-        instance_t *inst = &g_instances[failed_idx];
-        if (WIFEXITED(failed_status)) {
-            fprintf(stderr, "wfb_supervisor: instance '%s' (pid %d) exited with status %d, shutting down all\n",
-                    inst->name, inst->pid, WEXITSTATUS(failed_status));
-        } else if (WIFSIGNALED(failed_status)) {
-            fprintf(stderr, "wfb_supervisor: instance '%s' (pid %d) terminated by signal %d, shutting down all\n",
-                    inst->name, inst->pid, WTERMSIG(failed_status));
+#define CTL_MAX_CLIENTS 4
+#define CTL_REQ_MAX     512
+#define CTL_RESP_MAX    8192
+#define CTL_RESP_PER_INSTANCE 768   // status lines of one instance
+#define CTL_IDLE_MS     2000        // a client that has not sent its request line by then is dropped
+#define DEFAULT_CONTROL_SOCKET "/run/wfb_supervisor.sock"
+
+typedef struct {
+    ev_watch_t w;
+    ev_watch_t idle;       // timerfd: CTL_IDLE_MS from accept
+    char   buf[CTL_REQ_MAX];
+    size_t len;
+} ctl_client_t;
+
+static ev_watch_t g_ctl_watch = { .fd = -1 };
+static ctl_client_t g_ctl_clients[CTL_MAX_CLIENTS];
+static char g_ctl_path[108];
+static int g_ctl_reload_fd = -1;   // client waiting for the outcome of apply/reload
+
+static instance_t *find_instance(const char *name) {
+    for (int i = 0; i < g_instance_count; i++) {
+        if (strcasecmp(g_instances[i].name, name) == 0) return &g_instances[i];
+    }
+    return NULL;
+}
+
+/* Overrides outlive every config generation, so they live on the heap rather than in an arena. */
+static void set_override(const char *key, const char *val) {
+    int idx = 0;
+    while (idx < g_override_count && strcasecmp(g_overrides[idx].key, key) != 0) idx++;
+    if (idx == g_override_count) {
+        if (g_override_count == g_override_cap) {
+            int cap = g_override_cap ? g_override_cap * 2 : 8;
+            param_t *grown = realloc(g_overrides, (size_t)cap * sizeof(*grown));
+            if (!grown) die("out of memory");
+            g_overrides = grown;
+            g_override_cap = cap;
+        }
+        g_override_count++;
+        g_overrides[idx].key = strdup(key);
+        g_overrides[idx].val = NULL;
+        if (!g_overrides[idx].key) die("out of memory");
+    }
+    free(g_overrides[idx].val);
+    if (!(g_overrides[idx].val = strdup(val))) die("out of memory");
+}
+
+static int unset_override(const char *key) {
+    for (int i = 0; i < g_override_count; i++) {
+        if (strcasecmp(g_overrides[i].key, key) != 0) continue;
+        free(g_overrides[i].key);
+        free(g_overrides[i].val);
+        g_overrides[i] = g_overrides[--g_override_count];
+        return 0;
+    }
+    return -1;
+}
+
+/* Stage key=val only if the config still loads with it, so no later reload or relaunch trips over it. */
+static int stage_override(const char *key, const char *val) {
+    const char *prev = NULL;
+    for (int i = 0; i < g_override_count; i++) {
+        if (strcasecmp(g_overrides[i].key, key) == 0) prev = g_overrides[i].val;
+    }
+    char *saved = prev ? strdup(prev) : NULL;
+    if (prev && !saved) die("out of memory");
+    set_override(key, val);
+    swap_shadow();
+    int rc = config_try(g_config_path);
+    swap_shadow();
+    if (rc != 0) {
+        if (saved) set_override(key, saved);
+        else unset_override(key);
+    }
+    free(saved);
+    return rc;
+}
+
+static size_t ctl_status(char *out, size_t len) {
+    size_t off = (size_t)snprintf(out, len, "ok\n");
+    for (int i = 0; i < g_instance_count && off < len; i++) {
+        instance_t *inst = &g_instances[i];
+        char desc[32];
+        char extra[256];
+        if (inst->running) {
+            off += (size_t)snprintf(out + off, len - off, "%s running pid=%d up=%llu restarts=%d\n", inst->name, inst->pid,
+                                    (unsigned long long)((now_ms() - inst->start_ms) / 1000), inst->restart_count);
         } else {
-            fprintf(stderr, "wfb_supervisor: instance '%s' (pid %d) exited, shutting down all\n",
-                    inst->name, inst->pid);
+            off += (size_t)snprintf(out + off, len - off, "%s %s status=%s restarts=%d\n", inst->name,
+                                    inst->absent ? "absent" : inst->waiting ? "waiting" : inst->restart_pending ? "pending" : "stopped",
+                                    describe_status(inst->exit_status, desc, sizeof(desc)), inst->restart_count);
         }
+        if (inst->stats_kind && off < len) {
+            off += (size_t)snprintf(out + off, len - off, "%s %s\n", inst->name, stats_describe(inst, extra, sizeof(extra)));
+        }
+        if (inst->cg_dir >= 0 && off < len) {
+            off += (size_t)snprintf(out + off, len - off, "%s %s\n", inst->name, cg_describe(inst, extra, sizeof(extra)));
+        }
+        if ((inst->health_udp || inst->health_stats_ms) && off < len) {
+            off += (size_t)snprintf(out + off, len - off, "%s %s\n", inst->name, health_describe(inst, extra, sizeof(extra)));
+        }
+        if (inst->cpu_auto && inst->running && off < len) {
+            off += (size_t)snprintf(out + off, len - off, "%s %s\n", inst->name, auto_describe(inst, extra, sizeof(extra)));
+        }
+    }
+    if (off < len) off += cluster_describe(out + off, len - off, 0);
+    return off < len ? off : len - 1;
+}
+
+/* One request line in, "ok[ detail]" or "err <reason>" out; 0 when the reply is deferred to the reload. */
+static size_t ctl_handle(int fd, char *req, char *out, size_t len) {
+    char *save = NULL;
+    char *verb = strtok_r(req, " \t\r", &save);
+    char *arg = strtok_r(NULL, " \t\r", &save);
+    char *rest = save ? trim(save) : NULL;
+
+    if (!verb) return (size_t)snprintf(out, len, "err empty request\n");
+    if (strcasecmp(verb, "help") == 0) {
+        return (size_t)snprintf(out, len, "ok\nstatus\nstart|stop|restart <instance>\nget <param>\n"
+                                "set <param> <value>\nunset <param>\napply (alias: reload)\ncluster\n");
+    }
+    if (strcasecmp(verb, "status") == 0) return ctl_status(out, len);
+    if (strcasecmp(verb, "cluster") == 0) {
+        if (g_cluster_rx.fd < 0) return (size_t)snprintf(out, len, "err cluster_listen is not set\n");
+        size_t off = (size_t)snprintf(out, len, "ok\n");
+        return off + cluster_describe(out + off, len - off, 1);
+    }
+    if (strcasecmp(verb, "get") == 0) {
+        const char *val = arg ? get_param_value(arg) : NULL;
+        if (!val) return (size_t)snprintf(out, len, "err unknown parameter\n");
+        return (size_t)snprintf(out, len, "ok %s\n", val);
+    }
+    if (strcasecmp(verb, "set") == 0) {
+        if (!arg || !rest || !*rest) return (size_t)snprintf(out, len, "err usage: set <param> <value>\n");
+        if (stage_override(arg, rest) != 0) return (size_t)snprintf(out, len, "err %s\n", g_die_msg);
+        return (size_t)snprintf(out, len, "ok staged until apply\n");
+    }
+    if (strcasecmp(verb, "unset") == 0) {
+        if (!arg) return (size_t)snprintf(out, len, "err usage: unset <param>\n");
+        if (unset_override(arg) != 0) return (size_t)snprintf(out, len, "err no override for %s\n", arg);
+        return (size_t)snprintf(out, len, "ok staged until apply\n");
+    }
+    if (!g_session_active || g_ctl_reload_fd >= 0) return (size_t)snprintf(out, len, "err busy\n");
+    if (strcasecmp(verb, "apply") == 0 || strcasecmp(verb, "reload") == 0) {
+        g_ctl_reload_fd = fd;
+        g_reload_requested = 1;
+        return 0;
+    }
+
+    instance_t *inst = arg ? find_instance(arg) : NULL;
+    if (strcasecmp(verb, "start") != 0 && strcasecmp(verb, "stop") != 0 && strcasecmp(verb, "restart") != 0) {
+        return (size_t)snprintf(out, len, "err unknown command '%s'\n", verb);
+    }
+    if (!inst) return (size_t)snprintf(out, len, "err unknown instance\n");
+    if (strcasecmp(verb, "stop") == 0) {
+        cancel_restart(inst);
+        instance_stop(inst);
+    } else if (inst->running) {
+        if (strcasecmp(verb, "start") == 0) return (size_t)snprintf(out, len, "err already running\n");
+        instance_recycle(inst);
     } else {
-        fprintf(stderr, "wfb_supervisor: shutdown requested, terminating all children\n");
+        cancel_restart(inst);
+        if (spawn_instance(inst) != 0) instance_exited(inst);
     }
+    return (size_t)snprintf(out, len, "ok\n");
+}
 
-    for (int i = 0; i < g_instance_count; i++) {
-        if (g_instances[i].running && g_instances[i].pid > 0) {
-            kill(g_instances[i].pid, SIGTERM);
-        }
+/* MSG_NOSIGNAL: a client that hung up must not take the supervisor down with SIGPIPE. */
+static void ctl_reply(int fd, const char *resp, size_t len) {
+    if (send(fd, resp, len, MSG_NOSIGNAL) < 0) fprintf(stderr, "wfb_supervisor: control: reply failed: %s\n", strerror(errno));
+    close(fd);
+}
+
+/* Answer the client that asked for the reload that just ran (or was cut short). */
+static void ctl_reload_done(const char *status, const char *msg) {
+    if (g_ctl_reload_fd < 0) return;
+    char resp[256];
+    int n = snprintf(resp, sizeof(resp), "%s %s\n", status, msg);
+    ctl_reply(g_ctl_reload_fd, resp, (size_t)n < sizeof(resp) ? (size_t)n : sizeof(resp) - 1);
+    g_ctl_reload_fd = -1;
+}
+
+static void on_ctl_client(ev_watch_t *w, uint32_t events) {
+    (void)events;
+    ctl_client_t *c = w->ctx;
+    ssize_t n = read(w->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+    if (n > 0) c->len += (size_t)n;
+    c->buf[c->len] = '\0';
+    char *nl = strchr(c->buf, '\n');
+    if (!nl && n > 0 && c->len < sizeof(c->buf) - 1) return;  // rest of the line still to come
+    if (nl) *nl = '\0';
+
+    // One request per connection: the fd leaves the poll set and is closed once answered.
+    int fd = w->fd;
+    epoll_ctl(g_epfd, EPOLL_CTL_DEL, fd, NULL);
+    w->fd = -1;
+    ev_close(&c->idle);
+    static char *resp;
+    static size_t resp_size;
+    size_t want = CTL_RESP_MAX + (size_t)g_instance_count * CTL_RESP_PER_INSTANCE
+                  + (g_cluster_rx.fd >= 0 ? (size_t)CLUSTER_MAX_NODES * CLUSTER_RESP_PER_NODE : 0);
+    if (resp_size < want) {
+        free(resp);
+        if (!(resp = malloc(want))) die("out of memory");
+        resp_size = want;
     }
+    size_t len;
+    if (!nl && c->len >= sizeof(c->buf) - 1) len = (size_t)snprintf(resp, resp_size, "err request too long\n");
+    else len = ctl_handle(fd, c->buf, resp, resp_size);
+    if (len > 0) ctl_reply(fd, resp, len);
+}
 
-    int escalated = 0;
-    time_t start = time(NULL);
+/* A client that connected but never finished its request gives its slot back. */
+static void on_ctl_idle(ev_watch_t *w, uint32_t events) {
+    (void)events;
+    ctl_client_t *c = w->ctx;
+    ev_close(&c->w);
+    ev_close(&c->idle);
+}
 
-    while (1) {
-        int running = 0;
-        int status;
-        pid_t pid = waitpid(-1, &status, WNOHANG);
-        if (pid > 0) {
-            for (int i = 0; i < g_instance_count; i++) {
-                if (g_instances[i].pid == pid) {
-                    g_instances[i].exit_status = status;
-                    g_instances[i].running = 0;
-                    break;
-                }
-            }
-            continue;
+static void on_ctl_accept(ev_watch_t *w, uint32_t events) {
+    (void)events;
+    int fd = accept4(w->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) return;
+    for (int i = 0; i < CTL_MAX_CLIENTS; i++) {
+        ctl_client_t *c = &g_ctl_clients[i];
+        if (c->w.fd >= 0) continue;
+        c->len = 0;
+        c->w.fd = fd;
+        c->w.cb = on_ctl_client;
+        c->w.ctx = c;
+        ev_add(&c->w, EPOLLIN);
+        c->idle.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (c->idle.fd >= 0) {
+            c->idle.cb = on_ctl_idle;
+            c->idle.ctx = c;
+            timer_arm_ms(c->idle.fd, CTL_IDLE_MS);
+            ev_add(&c->idle, EPOLLIN);
         }
+        return;
+    }
+    close(fd);  // all slots busy
+}
 
-        for (int i = 0; i < g_instance_count; i++) {
-            if (g_instances[i].running) running++;
-        }
-        if (running == 0) break;
+static void ctl_setup(void) {
+    const char *path = get_param_value("control_socket");
+    int on = 1;
+    if (path && parse_bool(path, &on) == 0) path = NULL;  // yes/no rather than a path
+    if (!on) return;
+    if (!path) path = DEFAULT_CONTROL_SOCKET;
+    for (int i = 0; i < CTL_MAX_CLIENTS; i++) g_ctl_clients[i].w.fd = g_ctl_clients[i].idle.fd = -1;
 
-        if (!escalated && difftime(time(NULL), start) >= 5) {
-            fprintf(stderr, "wfb_supervisor: escalating shutdown with SIGKILL for %d remaining children\n", running);
-            for (int i = 0; i < g_instance_count; i++) {
-                if (g_instances[i].running && g_instances[i].pid > 0) {
-                    kill(g_instances[i].pid, SIGKILL);
-                }
-            }
-            escalated = 1;
-        }
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sa.sun_path)) die("control_socket path too long: %s", path);
+    snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", path);
 
-        if (pid < 0 && errno != EINTR) break;
-        sleep(1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return;
+    // A socket that still answers belongs to another supervisor; anything else is stale.
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe >= 0 && connect(probe, (struct sockaddr *)&sa, sizeof(sa)) == 0) {
+        fprintf(stderr, "wfb_supervisor: control: %s is in use by another process, not listening\n", path);
+        close(probe);
+        close(fd);
+        return;
+    }
+    if (probe >= 0) close(probe);
+    unlink(path);
+    mode_t old_mask = umask(077);
+    int rc = bind(fd, (struct sockaddr *)&sa, sizeof(sa));
+    umask(old_mask);
+    if (rc != 0 || listen(fd, CTL_MAX_CLIENTS) != 0) {
+        fprintf(stderr, "wfb_supervisor: control: cannot listen on %s: %s\n", path, strerror(errno));
+        close(fd);
+        return;
     }
+    snprintf(g_ctl_path, sizeof(g_ctl_path), "%s", path);
+    g_ctl_watch.fd = fd;
+    g_ctl_watch.cb = on_ctl_accept;
+    ev_add(&g_ctl_watch, EPOLLIN);
+    fprintf(stderr, "wfb_supervisor: control: listening on %s\n", path);
+}
 
-    fprintf(stderr, "wfb_supervisor: summary:\n");
-    for (int i = 0; i < g_instance_count; i++) {
-        instance_t *inst = &g_instances[i];
-        if (WIFEXITED(inst->exit_status)) {
-            fprintf(stderr, "  %s: exit(%d)\n", inst->name, WEXITSTATUS(inst->exit_status));
-        } else if (WIFSIGNALED(inst->exit_status)) {
-            fprintf(stderr, "  %s: signal(%d)\n", inst->name, WTERMSIG(inst->exit_status));
-        } else {
-            fprintf(stderr, "  %s: status(%d)\n", inst->name, inst->exit_status);
+static void ctl_close(void) {
+    if (g_ctl_watch.fd < 0) return;
+    ev_close(&g_ctl_watch);
+    unlink(g_ctl_path);
+}
+
+/* --ctl: send one request to a running supervisor and print the reply. */
+static int ctl_client(const char *path, const char *req) {
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) die("cannot connect to %s: %s", path, strerror(errno));
+    char line[CTL_REQ_MAX];
+    int n = snprintf(line, sizeof(line), "%s\n", req);
+    if (n < 0 || (size_t)n >= sizeof(line) || write(fd, line, (size_t)n) != n) die("request too long or write failed");
+    char buf[4096];
+    ssize_t r;
+    int ok = -1;
+    while ((r = read(fd, buf, sizeof(buf))) > 0) {
+        if (ok < 0) ok = strncmp(buf, "ok", 2) == 0;
+        fwrite(buf, 1, (size_t)r, stdout);
+    }
+    close(fd);
+    return ok == 1 ? 0 : 1;
+}
+
+static int supervise_once(void) {
+    int failed_idx = -1;
+    int failed_status = 0;
+
+    g_failed_idx = -1;
+    g_failed_status = 0;
+
+    log_open();
+    cg_setup();
+    irq_steer_setup();
+    if (start_children(&failed_idx, &failed_status) != 0) {
+        shutdown_all(failed_idx, failed_status);
+        return 1;
+    }
+
+    g_session_active = 1;
+    hotplug_setup();
+    // With templates, the session also waits for NICs that are not plugged in yet.
+    while (!g_stop_requested && !g_restart_requested && g_failed_idx < 0 && (count_active() > 0 || g_cfg.template_count > 0)) {
+        ev_run_once(g_reload_requested ? 0 : -1);  // one asked for since the config was read is handled first
+        if (g_hotplug_pending && !g_stop_requested && g_failed_idx < 0) hotplug_apply();
+        if (g_shaper_rebuild && !g_stop_requested && g_failed_idx < 0) {
+            g_shaper_rebuild = 0;
+            shaper_apply();
+        }
+        if (g_reload_requested && !g_stop_requested && g_failed_idx < 0) {
+            char msg[128];
+            g_reload_requested = 0;
+            int rc = hot_reload(msg, sizeof(msg));
+            ctl_reload_done(rc ? "err" : "ok", msg);
         }
     }
+    g_session_active = 0;
+    hotplug_close();
+    ctl_reload_done("err", "supervisor is shutting down or restarting");
+    if (g_failed_idx < 0 && !g_stop_requested && !g_restart_requested) {
+        fprintf(stderr, "wfb_supervisor: all instances have finished\n");
+    }
+
+    failed_idx = g_failed_idx;
+    failed_status = g_failed_status;
+    shutdown_all(failed_idx, failed_status);
+
+    return (failed_idx >= 0) ? 2 : 0;
+}
+
+/* Sleep for delay_ms while still servicing signals; returns early on stop. */
+static void wait_interruptible(int delay_ms) {
+    uint64_t deadline = now_ms() + (uint64_t)delay_ms;
+    while (!g_stop_requested) {
+        uint64_t now = now_ms();
+        if (now >= deadline) break;
+        ev_run_once((int)(deadline - now));
+    }
 }
 
-static void signal_handler(int sig) {
+/* UDP fan-out (type=udp_fanout) */
+
+#define FANOUT_BATCH    32
+#define FANOUT_SLOT     65536      // one GRO train is at most 64 KiB
+#define FANOUT_SOCKBUF  (8 << 20)
+#define FANOUT_MAX_DEST 16
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+typedef struct {
+    char     name[80];
+    int      fd;
+    uint64_t sent;      // datagrams (GSO segments) handed to the kernel
+    uint64_t dropped;   // send buffer full: the consumer's path is backed up
+    uint64_t refused;   // ICMP port unreachable: nobody listening yet
+} fanout_dest_t;
+
+static volatile sig_atomic_t g_fanout_stop = 0;
+
+static void fanout_on_term(int sig) {
     (void)sig;
-    g_stop_requested = 1;
+    g_fanout_stop = 1;
 }
 
-static int start_children(int *failed_idx, int *failed_status) {
-    if (failed_idx) *failed_idx = -1;
-    if (failed_status) *failed_status = 0;
+/* The FORCE variant passes net.core.[rw]mem_max when we have CAP_NET_ADMIN. */
+static void fanout_sockbuf(int fd, int force_opt, int opt) {
+    int size = FANOUT_SOCKBUF;
+    if (setsockopt(fd, SOL_SOCKET, force_opt, &size, sizeof(size)) != 0) setsockopt(fd, SOL_SOCKET, opt, &size, sizeof(size));
+}
 
-    for (int i = 0; i < g_instance_count; i++) {
-        instance_t *inst = &g_instances[i];
-        char exec_path[MAX_VALUE_LEN];
-        char *argv[MAX_ARGS];
-        int argc = 0;
+static int fanout_resolve(const char *host, const char *port, struct sockaddr_in *sa) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0) return -1;
+    memcpy(sa, res->ai_addr, sizeof(*sa));
+    freeaddrinfo(res);
+    return 0;
+}
 
-        build_command(inst, argv, &argc, exec_path, sizeof(exec_path));
+static void fanout_report(const fanout_dest_t *dest, int count, uint64_t received) {
+    printf("fanout: received %llu", (unsigned long long)received);
+    for (int d = 0; d < count; d++) {
+        printf(", %s sent %llu dropped %llu refused %llu", dest[d].name, (unsigned long long)dest[d].sent,
+               (unsigned long long)dest[d].dropped, (unsigned long long)dest[d].refused);
+    }
+    printf("\n");
+    fflush(stdout);
+}
 
-        fprintf(stderr, "wfb_supervisor: starting instance '%s':", inst->name);
-        for (int k = 0; k < argc; k++) {
-            fprintf(stderr, " %s", argv[k]);
-        }
-        fprintf(stderr, "\n");
-        if (inst->cpu_core >= 0) {
-            fprintf(stderr, "wfb_supervisor: pinning '%s' to CPU %d\n", inst->name, inst->cpu_core);
+/*
+ * Child side of type=udp_fanout: "[-c addr] -u port [--report=ms] [--gso] host:port[,...]...".
+ * Batches arrive with recvmmsg and leave with one sendmmsg per destination straight from the
+ * receive buffers. Destinations are written without blocking, so a slow or absent consumer
+ * only loses its own packets (counted) and never holds up the source or the other consumers.
+ * With --gso, UDP_GRO coalesces arriving datagrams and UDP_SEGMENT splits them again on send.
+ */
+static int fanout_main(int argc, char **argv) {
+    static char bufs[FANOUT_BATCH][FANOUT_SLOT];
+    static fanout_dest_t dest[FANOUT_MAX_DEST];
+    const char *host = NULL, *port = NULL;
+    int report_ms = DEFAULT_FANOUT_REPORT_MS, gso = 0, count = 0;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            host = argv[++i];
+        } else if (strcmp(argv[i], "-u") == 0 && i + 1 < argc) {
+            port = argv[++i];
+        } else if (strncmp(argv[i], "--report=", 9) == 0) {
+            if (parse_int(argv[i] + 9, &report_ms)) die("udp_fanout: invalid %s", argv[i]);
+        } else if (strcmp(argv[i], "--gso") == 0) {
+            gso = 1;
+        } else {
+            char *save = NULL;
+            for (char *tok = strtok_r(argv[i], ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+                if (count >= FANOUT_MAX_DEST) die("udp_fanout: too many destinations (max %d)", FANOUT_MAX_DEST);
+                fanout_dest_t *d = &dest[count++];
+                char *colon = strrchr(tok, ':');
+                struct sockaddr_in sa;
+                if (!colon) die("udp_fanout: invalid destination '%s' (expected host:port)", tok);
+                *colon = '\0';
+                if (fanout_resolve(tok, colon + 1, &sa) != 0) die("udp_fanout: cannot resolve '%s'", tok);
+                *colon = ':';
+                snprintf(d->name, sizeof(d->name), "%s", tok);
+                // Connected, so an ICMP refusal shows up as ECONNREFUSED on the next send.
+                d->fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+                if (d->fd < 0 || connect(d->fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+                    die("udp_fanout: socket for %s failed: %s", tok, strerror(errno));
+                }
+                fanout_sockbuf(d->fd, SO_SNDBUFFORCE, SO_SNDBUF);
+            }
         }
+    }
+    if (!port || count == 0) die("udp_fanout: usage: --udp-fanout [-c addr] -u port [--report=ms] [--gso] host:port[,...]");
 
-        pid_t pid = fork();
-        if (pid < 0) {
-            fprintf(stderr, "wfb_supervisor: fork failed for instance '%s': %s\n", inst->name, strerror(errno));
-            if (failed_idx) *failed_idx = i;
-            if (failed_status) *failed_status = (127 << 8);
-            inst->exit_status = failed_status ? *failed_status : 0;
-            inst->running = 0;
-            return -1;
-        } else if (pid == 0) {
-            if (inst->cpu_core >= 0) {
-                cpu_set_t set;
-                CPU_ZERO(&set);
-                CPU_SET(inst->cpu_core, &set);
-                if (sched_setaffinity(0, sizeof(set), &set) != 0) {
-                    fprintf(stderr, "wfb_supervisor: failed to set CPU %d affinity for '%s': %s\n",
-                            inst->cpu_core, inst->name, strerror(errno));
-                }
+    struct sockaddr_in sa;
+    if (fanout_resolve(host ? host : "0.0.0.0", port, &sa) != 0) die("udp_fanout: invalid listen address");
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    int one = 1;
+    if (fd < 0) die("udp_fanout: socket failed: %s", strerror(errno));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) die("udp_fanout: bind to port %s failed: %s", port, strerror(errno));
+    fanout_sockbuf(fd, SO_RCVBUFFORCE, SO_RCVBUF);
+    if (gso && setsockopt(fd, SOL_UDP, UDP_GRO, &one, sizeof(one)) != 0) {
+        fprintf(stderr, "udp_fanout: UDP_GRO unavailable (%s), relaying datagram by datagram\n", strerror(errno));
+        gso = 0;
+    }
+    if (report_ms > 0) {
+        struct timeval tv = { report_ms / 1000, (report_ms % 1000) * 1000 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = fanout_on_term;  // no SA_RESTART: recvmmsg returns EINTR
+    sigaction(SIGTERM, &act, NULL);
+    sigaction(SIGINT, &act, NULL);
+
+    struct mmsghdr in[FANOUT_BATCH], out[FANOUT_BATCH];
+    struct iovec iov[FANOUT_BATCH], out_iov[FANOUT_BATCH];
+    union { char buf[CMSG_SPACE(sizeof(int))]; struct cmsghdr align; } in_ctl[FANOUT_BATCH];
+    union { char buf[CMSG_SPACE(sizeof(uint16_t))]; struct cmsghdr align; } out_ctl[FANOUT_BATCH];
+    uint32_t segs[FANOUT_BATCH];
+    uint64_t received = 0, reported = 0;
+    uint64_t next_report = now_ms() + (uint64_t)report_ms;
+    fprintf(stderr, "udp_fanout: relaying %s:%s to %d destination%s%s\n", host ? host : "*", port, count,
+            count == 1 ? "" : "s", gso ? " (GRO/GSO)" : "");
+
+    while (!g_fanout_stop) {
+        for (int k = 0; k < FANOUT_BATCH; k++) {
+            iov[k].iov_base = bufs[k];
+            iov[k].iov_len = FANOUT_SLOT;
+            memset(&in[k].msg_hdr, 0, sizeof(in[k].msg_hdr));
+            in[k].msg_hdr.msg_iov = &iov[k];
+            in[k].msg_hdr.msg_iovlen = 1;
+            in[k].msg_hdr.msg_control = gso ? in_ctl[k].buf : NULL;
+            in[k].msg_hdr.msg_controllen = gso ? sizeof(in_ctl[k].buf) : 0;
+        }
+        int n = recvmmsg(fd, in, FANOUT_BATCH, MSG_WAITFORONE, NULL);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) die("udp_fanout: recvmmsg failed: %s", strerror(errno));
+        for (int k = 0; k < n; k++) {
+            uint32_t len = in[k].msg_len;
+            int seg = 0;
+            for (struct cmsghdr *c = gso ? CMSG_FIRSTHDR(&in[k].msg_hdr) : NULL; c; c = CMSG_NXTHDR(&in[k].msg_hdr, c)) {
+                if (c->cmsg_level == SOL_UDP && c->cmsg_type == UDP_GRO) memcpy(&seg, CMSG_DATA(c), sizeof(seg));
+            }
+            out_iov[k].iov_base = bufs[k];
+            out_iov[k].iov_len = len;
+            memset(&out[k].msg_hdr, 0, sizeof(out[k].msg_hdr));
+            out[k].msg_hdr.msg_iov = &out_iov[k];
+            out[k].msg_hdr.msg_iovlen = 1;
+            segs[k] = 1;
+            if (seg > 0 && len > (uint32_t)seg) {
+                // A coalesced train goes out as one send, cut back into seg-sized datagrams.
+                uint16_t gso_size = (uint16_t)seg;
+                out[k].msg_hdr.msg_control = out_ctl[k].buf;
+                out[k].msg_hdr.msg_controllen = sizeof(out_ctl[k].buf);
+                struct cmsghdr *c = CMSG_FIRSTHDR(&out[k].msg_hdr);
+                c->cmsg_level = SOL_UDP;
+                c->cmsg_type = UDP_SEGMENT;
+                c->cmsg_len = CMSG_LEN(sizeof(gso_size));
+                memcpy(CMSG_DATA(c), &gso_size, sizeof(gso_size));
+                segs[k] = (len + (uint32_t)seg - 1) / (uint32_t)seg;
             }
-            if (inst->quiet) {
-                int nullfd = open("/dev/null", O_RDWR);
-                if (nullfd >= 0) {
-                    dup2(nullfd, STDOUT_FILENO);
-                    dup2(nullfd, STDERR_FILENO);
-                    if (nullfd > 2) close(nullfd);
+            received += segs[k];
+        }
+        for (int d = 0; d < count && n > 0; d++) {
+            for (int sent = 0; sent < n; ) {
+                int r = sendmmsg(dest[d].fd, out + sent, (unsigned)(n - sent), MSG_DONTWAIT);
+                if (r > 0) {
+                    for (int k = sent; k < sent + r; k++) dest[d].sent += segs[k];
+                    sent += r;
+                } else if (r < 0 && errno == ECONNREFUSED) {
+                    dest[d].refused += segs[sent++];
+                } else if (r < 0 && errno == EINTR) {
+                    continue;
+                } else {
+                    for (int k = sent; k < n; k++) dest[d].dropped += segs[k];
+                    break;
                 }
             }
-            execvp(exec_path, argv);
-            fprintf(stderr, "wfb_supervisor: execvp failed for '%s': %s\n", exec_path, strerror(errno));
-            _exit(127);
-        } else {
-            inst->pid = pid;
-            inst->running = 1;
+        }
+        if (report_ms > 0 && now_ms() >= next_report) {
+            if (received != reported) fanout_report(dest, count, received);  // quiet while the source is
+            reported = received;
+            next_report = now_ms() + (uint64_t)report_ms;
         }
     }
+    fanout_report(dest, count, received);
+    return 0;
+}
+
+/* Link probe (type=link_probe) */
+
+#define PROBE_WINDOW   4096      // packets in flight tracked for loss; > rate x PROBE_LOSS_MS
+#define PROBE_LOSS_MS  2000      // a packet not back by then counts as lost
+#define PROBE_BUCKETS  240       // log-linear latency histogram, 8 buckets per power of two
+
+typedef struct {
+    char     magic[4];           // "WFBP"
+    uint32_t run;                // random per probe process: stale packets of an earlier run are ignored
+    uint32_t seq;
+    uint32_t pad;
+    uint64_t sent_us;            // CLOCK_MONOTONIC of the measuring probe
+} probe_pkt_t;
 
+/* Bucket of a latency: exact below 8 us, then 8 steps per octave (12.5% resolution). */
+static int probe_bucket(uint32_t us) {
+    if (us < 8) return (int)us;
+    int e = 31 - __builtin_clz(us);
+    return (e - 2) * 8 + (int)((us >> (e - 3)) & 7);
+}
+
+static uint32_t probe_bucket_us(int b) {
+    if (b < 8) return (uint32_t)b;
+    int e = b / 8 + 2;
+    uint32_t lo = (uint32_t)(8 + b % 8) << (e - 3);
+    return lo + ((1u << (e - 3)) >> 1);  // middle of the bucket
+}
+
+static uint32_t probe_percentile(const uint32_t *hist, uint32_t count, int pct, uint32_t max_us) {
+    uint32_t rank = (uint32_t)(((uint64_t)count * (uint64_t)pct + 99) / 100), seen = 0;
+    if (rank < 1) rank = 1;
+    for (int b = 0; b < PROBE_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen >= rank) return probe_bucket_us(b) < max_us ? probe_bucket_us(b) : max_us;
+    }
     return 0;
 }
 
-static int supervise_once(void) {
-    int failed_idx = -1;
-    int failed_status = 0;
+/* Reflect every probe packet arriving at fd back to dest (or to its sender), untouched. */
+static int probe_echo(int fd, const struct sockaddr_in *dest) {
+    char buf[2048];
+    fprintf(stderr, "link_probe: echoing probe packets%s\n", dest ? "" : " back to their sender");
+    while (!g_fanout_stop) {
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        ssize_t n = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *)&from, &from_len);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+        if (n < 0) die("link_probe: recvfrom failed: %s", strerror(errno));
+        if ((size_t)n < sizeof(probe_pkt_t) || memcmp(buf, "WFBP", 4) != 0) continue;
+        sendto(fd, buf, (size_t)n, MSG_DONTWAIT, (const struct sockaddr *)(dest ? dest : &from), sizeof(from));
+    }
+    return 0;
+}
 
-    if (start_children(&failed_idx, &failed_status) != 0) {
-        shutdown_all(failed_idx, failed_status);
-        run_commands(g_cfg.cleanup_cmds, g_cfg.cleanup_cmd_count, "cleanup");
-        return 1;
+/*
+ * Child side of type=link_probe: "[-c addr] -u port [--report=ms] [--rate=pps] [--size=bytes]
+ * [--echo] [host:port]". Sends rate sequence-numbered, timestamped datagrams a second to
+ * host:port and matches what arrives at the listen port against them. A path that leads back
+ * to the same host (wfb_tx -> air -> wfb_rx on one ground station, or a loopback stand-in)
+ * gives one-way latency; an --echo probe at the far end turns it into a round trip. Every
+ * report period prints one wfb-style "<ms>\tPROBE\t..." line with the window's counts, latency
+ * percentiles and jitter.
+ */
+static int probe_main(int argc, char **argv) {
+    const char *host = NULL, *port = NULL, *dest_arg = NULL;
+    int report_ms = DEFAULT_FANOUT_REPORT_MS, rate = DEFAULT_PROBE_RATE, size = DEFAULT_PROBE_SIZE, echo = 0;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) host = argv[++i];
+        else if (strcmp(argv[i], "-u") == 0 && i + 1 < argc) port = argv[++i];
+        else if (strncmp(argv[i], "--report=", 9) == 0 && parse_int(argv[i] + 9, &report_ms) == 0) continue;
+        else if (strncmp(argv[i], "--rate=", 7) == 0 && parse_int(argv[i] + 7, &rate) == 0 && rate > 0) continue;
+        else if (strncmp(argv[i], "--size=", 7) == 0 && parse_int(argv[i] + 7, &size) == 0) continue;
+        else if (strcmp(argv[i], "--echo") == 0) echo = 1;
+        else if (argv[i][0] != '-' && !dest_arg) dest_arg = argv[i];
+        else die("link_probe: invalid argument '%s'", argv[i]);
     }
+    if (!port || (!dest_arg && !echo)) die("link_probe: usage: --link-probe [-c addr] -u port [--report=ms] [--rate=pps] [--size=bytes] [--echo] host:port");
+    if (size < (int)sizeof(probe_pkt_t)) size = (int)sizeof(probe_pkt_t);
+    if (size > 2048) size = 2048;
 
-    int running = g_instance_count;
-    int shutdown_initiated = 0;
-    failed_idx = -1;
-    failed_status = 0;
+    struct sockaddr_in sa, dest;
+    if (fanout_resolve(host ? host : "0.0.0.0", port, &sa) != 0) die("link_probe: invalid listen address");
+    if (dest_arg) {
+        char tmp[128];
+        snprintf(tmp, sizeof(tmp), "%s", dest_arg);
+        char *colon = strrchr(tmp, ':');
+        if (!colon) die("link_probe: invalid destination '%s' (expected host:port)", dest_arg);
+        *colon = '\0';
+        if (fanout_resolve(tmp, colon + 1, &dest) != 0) die("link_probe: cannot resolve '%s'", tmp);
+    }
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    int one = 1;
+    if (fd < 0) die("link_probe: socket failed: %s", strerror(errno));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) die("link_probe: bind to port %s failed: %s", port, strerror(errno));
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = fanout_on_term;  // no SA_RESTART: poll and recvfrom return EINTR
+    sigaction(SIGTERM, &act, NULL);
+    sigaction(SIGINT, &act, NULL);
+    if (echo) return probe_echo(fd, dest_arg ? &dest : NULL);
 
-    while (running > 0) {
-        if (g_stop_requested && !shutdown_initiated) {
-            shutdown_initiated = 1;
-            failed_idx = -1;
-            failed_status = 0;
-            break;
-        }
+    // The send side is its own socket, so what the link delivers to the listen port is all we read.
+    int out = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (out < 0 || connect(out, (struct sockaddr *)&dest, sizeof(dest)) != 0) die("link_probe: socket for %s failed: %s", dest_arg, strerror(errno));
 
-        int status;
-        pid_t pid = waitpid(-1, &status, 0);
-        if (pid < 0) {
-            if (errno == EINTR) continue;
-            break;
+    static uint64_t slot_sent[PROBE_WINDOW];   // 0 = nothing outstanding in the slot
+    static uint32_t slot_seq[PROBE_WINDOW];
+    static uint8_t  slot_state[PROBE_WINDOW];  // 0 in flight, 1 arrived, 2 declared lost
+    static uint32_t hist[PROBE_BUCKETS];
+    char buf[2048];
+    memset(buf, 0, sizeof(buf));
+    probe_pkt_t pkt;
+    memcpy(pkt.magic, "WFBP", 4);
+    pkt.run = (uint32_t)getpid() ^ (uint32_t)now_us();
+    pkt.pad = 0;
+
+    uint32_t next_seq = 0, sweep_seq = 0, highest = 0, got_any = 0, hist_count = 0, max_us = 0;
+    uint32_t sent = 0, received = 0, lost = 0, late = 0, reordered = 0, duplicate = 0;
+    double jitter = 0, last_latency = -1;
+    uint64_t interval_us = 1000000u / (uint64_t)rate;
+    uint64_t next_send = now_us(), next_report = now_us() + (uint64_t)report_ms * 1000u;
+    fprintf(stderr, "link_probe: %d packets/s of %d bytes to %s, matching at %s:%s\n", rate, size, dest_arg, host ? host : "*", port);
+
+    while (!g_fanout_stop) {
+        uint64_t now = now_us();
+        uint64_t wake = next_send < next_report ? next_send : next_report;
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        if (wake > now && poll(&pfd, 1, (int)((wake - now + 999) / 1000)) < 0 && errno != EINTR) die("link_probe: poll failed: %s", strerror(errno));
+        now = now_us();
+
+        ssize_t n;
+        while ((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) >= (ssize_t)sizeof(probe_pkt_t)) {
+            probe_pkt_t in;
+            memcpy(&in, buf, sizeof(in));
+            if (memcmp(in.magic, "WFBP", 4) != 0 || in.run != pkt.run || in.seq >= next_seq) continue;
+            unsigned slot = in.seq % PROBE_WINDOW;
+            if (slot_seq[slot] != in.seq || slot_sent[slot] == 0) continue;  // older than the window
+            if (slot_state[slot] == 1) {
+                duplicate++;
+                continue;
+            }
+            if (slot_state[slot] == 2) late++;
+            slot_state[slot] = 1;
+            received++;
+            if (got_any && in.seq < highest) reordered++;
+            if (!got_any || in.seq > highest) highest = in.seq;
+            got_any = 1;
+            uint32_t us = now > in.sent_us ? (uint32_t)(now - in.sent_us) : 0;
+            hist[probe_bucket(us)]++;
+            hist_count++;
+            if (us > max_us) max_us = us;
+            // RFC 3550 interarrival jitter over consecutive arrivals
+            double d = us - last_latency;
+            if (last_latency >= 0) jitter += ((d < 0 ? -d : d) - jitter) / 16.0;
+            last_latency = us;
         }
 
-        int idx = -1;
-        for (int i = 0; i < g_instance_count; i++) {
-            if (g_instances[i].pid == pid) {
-                idx = i;
-                break;
+        // Whatever has not come back within PROBE_LOSS_MS is lost (and counted as late if it still does).
+        while (sweep_seq < next_seq && slot_sent[sweep_seq % PROBE_WINDOW] + PROBE_LOSS_MS * 1000u <= now) {
+            unsigned slot = sweep_seq % PROBE_WINDOW;
+            if (slot_state[slot] == 0) {
+                slot_state[slot] = 2;
+                lost++;
             }
+            sweep_seq++;
         }
-        if (idx < 0) continue;
 
-        g_instances[idx].exit_status = status;
-        g_instances[idx].running = 0;
-        running--;
+        if (now >= next_send) {
+            if (next_seq - sweep_seq < PROBE_WINDOW) {
+                unsigned slot = next_seq % PROBE_WINDOW;
+                pkt.seq = next_seq;
+                pkt.sent_us = now;
+                memcpy(buf, &pkt, sizeof(pkt));
+                slot_seq[slot] = next_seq;
+                slot_sent[slot] = now;
+                slot_state[slot] = 0;
+                next_seq++;
+                // Unreachable or a full queue is loss like any other, found by the sweep.
+                send(out, buf, (size_t)size, MSG_DONTWAIT);
+                sent++;
+            }
+            next_send += interval_us;
+            if (next_send < now) next_send = now + interval_us;  // no catch-up burst after a stall
+        }
 
-        if (!shutdown_initiated) {
-            shutdown_initiated = 1;
-            failed_idx = idx;
-            failed_status = status;
-            break;
+        if (report_ms > 0 && now >= next_report) {
+            printf("%llu\tPROBE\t%u:%u:%u:%u:%u:%u:%u:%u:%u:%u:%u\n", (unsigned long long)(now / 1000), sent, received, lost,
+                   late, reordered, duplicate, probe_percentile(hist, hist_count, 50, max_us),
+                   probe_percentile(hist, hist_count, 90, max_us), probe_percentile(hist, hist_count, 99, max_us), max_us,
+                   (unsigned)jitter);
+            fflush(stdout);
+            memset(hist, 0, sizeof(hist));
+            hist_count = max_us = 0;
+            sent = received = lost = late = reordered = duplicate = 0;
+            next_report = now + (uint64_t)report_ms * 1000u;
         }
     }
+    return 0;
+}
 
-    shutdown_all(failed_idx, failed_status);
-    run_commands(g_cfg.cleanup_cmds, g_cfg.cleanup_cmd_count, "cleanup");
+/* --check / --dump-expanded: parse and render everything once, without running anything. */
+static void dump_word(FILE *f, const char *w) {
+    if (*w && !w[strcspn(w, " \t\n'\"\\$`;&|<>()*?[]#~")]) {
+        fputs(w, f);
+        return;
+    }
+    fputc('\'', f);
+    for (; *w; w++) {
+        if (*w == '\'') fputs("'\\''", f);
+        else fputc(*w, f);
+    }
+    fputc('\'', f);
+}
 
-    return (failed_idx >= 0) ? 2 : 0;
+static int check_config(const char *path, int dump) {
+    static cmdline_t cl;
+    static strbuf_t sb;
+    load_config(path);
+    if (dump) {
+        printf("[parameters]\n");
+        for (int i = 0; i < g_cfg.param_count; i++) printf("%s=%s\n", g_cfg.params[i].key, g_cfg.params[i].val);
+        printf("\n[general]\n");
+        for (int i = 0; i < g_cfg.init_cmd_count; i++) printf("init_cmd=%s\n", tmpl_expand(&g_cfg.init_cmds[i].tmpl, &sb));
+        for (int i = 0; i < g_cfg.cleanup_cmd_count; i++) printf("cleanup_cmd=%s\n", tmpl_expand(&g_cfg.cleanup_cmds[i].tmpl, &sb));
+    }
+    for (int i = 0; i < g_instance_count; i++) {
+        build_command(&g_instances[i], &cl);
+        if (!dump) continue;
+        printf("\n[instance %s]\ncmd=", g_instances[i].name);
+        for (int k = 0; k < cl.argc; k++) {
+            if (k) putchar(' ');
+            dump_word(stdout, cl.argv[k]);
+        }
+        putchar('\n');
+    }
+    for (int i = 0; dump && i < g_cfg.template_count; i++) {
+        const instance_t *tpl = &g_cfg.templates[i];
+        printf("\n[instance %s]\ncmd=%s\nnics=%s\n", tpl->name, tpl->cmd, tpl->nics ? tpl->nics : "(wireless)");
+    }
+    fprintf(stderr, "wfb_supervisor: %s: %d instance%s, %d template%s, %d parameter%s, %d init and %d cleanup hook%s\n", path,
+            g_instance_count, g_instance_count == 1 ? "" : "s", g_cfg.template_count, g_cfg.template_count == 1 ? "" : "s",
+            g_cfg.param_count, g_cfg.param_count == 1 ? "" : "s",
+            g_cfg.init_cmd_count, g_cfg.cleanup_cmd_count, g_cfg.cleanup_cmd_count == 1 ? "" : "s");
+    return 0;
+}
+
+/* --dry-run-netlink: interface setup, shaper and their teardown against the netlink mock. */
+static int netlink_dry_run(const char *path) {
+    load_config(path);
+    if (!g_cfg.monitor_setup && !g_cfg.shaper_setup) die("--dry-run-netlink needs monitor_setup=yes or shaper_setup=yes");
+    g_nl_mock = 1;
+    if (g_cfg.monitor_setup) iface_setup();
+    if (g_cfg.shaper_setup) shaper_apply();
+    shaper_remove();
+    iface_restore();
+    return 0;
 }
 
 int main(int argc, char **argv) {
-    const char *config_path = "/etc/wfb.conf";
+    if (argc > 1 && strcmp(argv[1], "--udp-fanout") == 0) return fanout_main(argc - 2, argv + 2);
+    if (argc > 1 && strcmp(argv[1], "--link-probe") == 0) return probe_main(argc - 2, argv + 2);
+    const char *config_path = g_config_path;
     int restart = -1;
     int restart_delay = -1;
     int restart_delay_set = 0;
+    const char *replay_path = NULL;
+    const char *trace_path = NULL;
+    int nl_dry_run = 0;
+    const char *ctl_path = DEFAULT_CONTROL_SOCKET;
+    int check = 0;
 
     for (int i = 1; i < argc; i++) {
         const char *arg = argv[i];
-        if (strcmp(arg, "--restart") == 0) {
+        if (strcmp(arg, "--ctl") == 0) {
+            // Everything after --ctl is the request.
+            char req[CTL_REQ_MAX] = "";
+            for (int k = i + 1; k < argc; k++) {
+                size_t off = strlen(req);
+                snprintf(req + off, sizeof(req) - off, "%s%s", off ? " " : "", argv[k]);
+            }
+            return ctl_client(ctl_path, req[0] ? req : "status");
+        } else if (strncmp(arg, "--ctl-socket=", 13) == 0) {
+            ctl_path = arg + 13;
+        } else if (strcmp(arg, "--restart") == 0) {
             restart = 1;
         } else if (strcmp(arg, "--restart-delay") == 0) {
             if (i + 1 >= argc) die("missing value for --restart-delay");
@@ -631,6 +8110,22 @@ int main(int argc, char **argv) {
         } else if (strncmp(arg, "--restart-delay=", 17) == 0) {
             if (parse_int(arg + 17, &restart_delay)) die("invalid restart delay '%s'", arg + 17);
             restart_delay_set = 1;
+        } else if (strcmp(arg, "--check") == 0) {
+            check = 1;
+        } else if (strcmp(arg, "--dump-expanded") == 0) {
+            check = 2;
+        } else if (strcmp(arg, "--dry-run-netlink") == 0) {
+            nl_dry_run = 1;
+        } else if (strcmp(arg, "--replay") == 0) {
+            if (i + 1 >= argc) die("missing value for --replay");
+            replay_path = argv[++i];
+        } else if (strncmp(arg, "--replay=", 9) == 0) {
+            replay_path = arg + 9;
+        } else if (strcmp(arg, "--trace") == 0) {
+            if (i + 1 >= argc) die("missing value for --trace");
+            trace_path = argv[++i];
+        } else if (strncmp(arg, "--trace=", 8) == 0) {
+            trace_path = arg + 8;
         } else if (arg[0] == '-') {
             die("unknown option '%s'", arg);
         } else {
@@ -640,28 +8135,124 @@ int main(int argc, char **argv) {
 
     if (restart_delay_set && restart_delay < 0) die("restart delay must be non-negative");
 
-    struct sigaction sa;
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = signal_handler;
-    sigaction(SIGINT, &sa, NULL);
-    sigaction(SIGTERM, &sa, NULL);
+    if (check) return check_config(config_path, check == 2);
+    if (nl_dry_run) return netlink_dry_run(config_path);
+    if (replay_path) {
+        load_config(config_path);
+        return adapt_replay(replay_path);
+    }
+
+    if (trace_path) trace_setup(trace_path);
+    setup_event_loop();
 
     int exit_code = 0;
+    int attempts = 0;
 
-    do {
-        if (g_stop_requested) break;
-        g_stop_requested = 0;
-        reload_config_and_init(config_path);
+    g_config_path = config_path;
+    g_reload_requested = 0;
+    load_config(config_path);
+    ctl_setup();
+    metrics_setup();
+    cluster_setup();
+    run_commands(g_cfg.init_cmds, g_cfg.init_cmd_count, "init", 0);
+    // A shutdown during the init hooks skips the rest of the setup; cleanup still runs.
+    if (!g_stop_requested) {
+        if (g_cfg.monitor_setup) iface_setup();
+        tuning_apply();
+        if (g_cfg.shaper_setup) shaper_apply();
+    }
+    g_fingerprint = hook_fingerprint();
+    int hooks_active = 1;
+    if (!g_stop_requested && tuning_check_buffers() != 0) {
+        exit_code = 1;
+        g_stop_requested = 1;
+    }
+
+    while (!g_stop_requested) {
+        g_restart_requested = 0;
+        uint64_t session_start = now_ms();
+        uint64_t trace_start = trace_now();
         exit_code = supervise_once();
+        trace_span(trace_start, "session", "exit code %d", exit_code);
+        if (g_stop_requested) break;
+
+        int effective_delay = 0;
+        int first_attempt = 1;
+        if (!g_restart_requested) {
+            int restart_enabled = (restart >= 0) ? restart : g_cfg.restart_enabled;
+            effective_delay = restart_delay_set ? restart_delay : g_cfg.restart_delay;
+            int delay_max = g_cfg.restart_delay_max > effective_delay ? g_cfg.restart_delay_max : effective_delay;
+            if (!restart_enabled) break;
+
+            // A session that stayed up past the backoff cap (and at least a minute) resets the attempt counter.
+            uint64_t stable_ms = (uint64_t)delay_max * 1000u;
+            if (stable_ms < DEFAULT_RESTART_INTERVAL_MS) stable_ms = DEFAULT_RESTART_INTERVAL_MS;
+            if (now_ms() - session_start >= stable_ms) attempts = 0;
+            if (g_cfg.restart_max > 0 && attempts >= g_cfg.restart_max) {
+                fprintf(stderr, "wfb_supervisor: giving up after %d consecutive restarts\n", attempts);
+                break;
+            }
+            for (int k = 0; k < attempts && effective_delay < delay_max; k++) effective_delay *= 2;
+            if (effective_delay > delay_max) effective_delay = delay_max;
+            first_attempt = (attempts == 0);
+            attempts++;
+        }
+
+        g_full_restarts++;
+        if (reload_config(config_path, &g_fingerprint)) {
+            // Only the first relaunch is immediate; a crash loop still backs off.
+            int delay_ms = first_attempt ? g_cfg.warm_restart_delay_ms : effective_delay * 1000;
+            fprintf(stderr, "wfb_supervisor: hooks unchanged (fingerprint %016llx), warm restart in %d ms\n",
+                    (unsigned long long)g_fingerprint, delay_ms);
+            trace_start = trace_now();
+            wait_interruptible(delay_ms);
+            trace_span(trace_start, "restart sleep", "warm, %d ms", delay_ms);
+            if (g_stop_requested) break;
+            run_commands(g_cfg.init_cmds, g_cfg.init_cmd_count, "init", 1);
+            if (g_stop_requested) break;
+            // The controller starts over from the configured rung; bring the shaper back to it.
+            if (g_cfg.adapt && g_cfg.shaper_setup) shaper_apply();
+            continue;
+        }
+
+        trace_start = trace_now();
+        tuning_restore();
+        iface_restore();
+        trace_span(trace_start, "restore", "tuning, interfaces");
+        run_prev_cleanup();
+        hooks_active = 0;
+        if (effective_delay > 0) {
+            fprintf(stderr, "wfb_supervisor: restart requested, sleeping %d seconds before relaunch\n", effective_delay);
+        }
+        trace_start = trace_now();
+        wait_interruptible(effective_delay * 1000);
+        trace_span(trace_start, "restart sleep", "cold, %d s", effective_delay);
         if (g_stop_requested) break;
-        int restart_enabled = (restart >= 0) ? restart : g_cfg.restart_enabled;
-        int effective_delay = restart_delay_set ? restart_delay : g_cfg.restart_delay;
-        if (!restart_enabled) break;
-        fprintf(stderr, "wfb_supervisor: restart requested, sleeping %d seconds before relaunch\n", effective_delay);
-        for (int slept = 0; slept < effective_delay && !g_stop_requested; slept++) {
-            sleep(1);
-        }
-    } while (1);
+        hooks_active = 1;
+        run_commands(g_cfg.init_cmds, g_cfg.init_cmd_count, "init", 0);
+        if (g_stop_requested) break;
+        if (g_cfg.monitor_setup) iface_setup();
+        tuning_apply();
+        // An existing tree is retuned in place rather than torn down with the other hooks.
+        if (g_cfg.shaper_setup) shaper_apply();
+        else shaper_remove();
+        if (tuning_check_buffers() != 0) {
+            exit_code = 1;
+            break;
+        }
+    }
+
+    if (hooks_active) {
+        uint64_t trace_start = trace_now();
+        shaper_remove();
+        tuning_restore();
+        iface_restore();
+        trace_span(trace_start, "restore", "shaper, tuning, interfaces");
+        if (run_commands(g_cfg.cleanup_cmds, g_cfg.cleanup_cmd_count, "cleanup", 0)) exit_code = 1;
+    }
+    cluster_close();
+    ctl_close();
+    metrics_close();
 
     return exit_code;
 }